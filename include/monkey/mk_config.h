@@ -37,6 +37,12 @@
 #define MK_DEFAULT_LISTEN_ADDR              "0.0.0.0"
 #define MK_DEFAULT_LISTEN_PORT              "2001"
 #define MK_WORKERS_DEFAULT                  1
+#define MK_DEFAULT_STAT_CACHE_TTL           10
+#define MK_DEFAULT_COMPRESSION_LEVEL        6
+#define MK_DEFAULT_COMPRESSION_MAX_SIZE     1024
+#define MK_DEFAULT_READAHEAD_WINDOW         1024
+#define MK_DEFAULT_PREWARM_BUDGET           262144
+#define MK_DEFAULT_WRITE_BUDGET             256
 
 #define VALUE_ON "on"
 #define VALUE_OFF "off"
@@ -72,14 +78,27 @@ struct mk_config_entry
     struct mk_list _head;
 };
 
+/* Socket buffers of client connections in bytes, zero keeps the default */
+struct mk_config_sock
+{
+    long send_lowat;              /* TCP_NOTSENT_LOWAT */
+    long send_buffer;             /* SO_SNDBUF */
+    long recv_buffer;             /* SO_RCVBUF */
+};
+
 struct mk_config_listener
 {
     char *address;
     char *port;
 
+    /* overrides the server wide socket tuning */
+    struct mk_config_sock sock;
+
     struct mk_list _head;
 };
 
+struct mk_vhost_index;
+
 /* Base struct of server */
 struct mk_server_config
 {
@@ -91,6 +110,28 @@ struct mk_server_config
     short int manual_tcp_cork;    /* If enabled it will handle TCP_CORK */
 
     int8_t fdt;                   /* is FDT enabled ? */
+    int fdt_limit;                /* max descriptors kept by FDT */
+    long mmap_cache;              /* bytes of files kept mapped */
+    int stat_cache;               /* stat cache entries per worker */
+    int stat_cache_ttl;           /* stat cache entries TTL (seconds) */
+    long small_file_size;         /* max file size served from memory */
+    long small_file_memory;       /* memory for small files per worker */
+    int8_t precompressed;         /* serve .br/.gz siblings of files */
+    int8_t compression;           /* on-the-fly compression enabled ? */
+    int compression_level;        /* zlib level (1-9) */
+    long compression_min_size;    /* smaller files are sent as is */
+    long compression_max_size;    /* bigger files are sent as is */
+    long compression_cache;       /* compressed variants per worker */
+    long compression_budget;      /* input bytes per second per worker */
+    struct mk_list *compression_types;
+    int readahead_threads;        /* readahead pool size, 0 disables it */
+    long readahead_window;        /* bytes read ahead for a cold file */
+    long prewarm_budget;          /* bytes prewarmed per virtual host */
+    long write_budget;            /* bytes written per connection event */
+    struct mk_config_sock sock;   /* client socket buffers */
+    long send_lowat_max;          /* adaptive watermark ceiling */
+    long zerocopy;                /* MSG_ZEROCOPY bodies from this size */
+    int8_t prewarm_wait;          /* accept once the prewarm is done */
     int8_t is_daemon;
     int8_t is_seteuid;
     int8_t scheduler_mode;        /* Scheduler balancing mode */
@@ -139,6 +180,9 @@ struct mk_server_config
     int nhosts;
     struct mk_list hosts;
 
+    /* lookup index of the host names, replaced as a whole */
+    struct mk_vhost_index *vhost_index;
+
     mode_t open_flags;
     struct mk_list *plugins;
 
@@ -170,6 +214,7 @@ struct mk_server_config
 
     /* Direct map to Stage plugins */
     struct mk_list stage10_handler;
+    struct mk_list stage15_handler;
     struct mk_list stage20_handler;
     struct mk_list stage30_handler;
     struct mk_list stage40_handler;
@@ -197,6 +242,8 @@ struct mk_config_section *mk_config_section_add(struct mk_config *conf,
 void *mk_config_section_getval(struct mk_config_section *section, char *key, int mode);
 
 struct mk_config_listener *mk_config_listener_add(char *address, char *port);
+void mk_config_sock_read(struct mk_config_section *section,
+                         struct mk_config_sock *sock);
 
 int mk_config_listen_check_busy();
 void mk_config_listeners_free();
@@ -22,6 +22,7 @@
 
 int mk_conn_read(int socket);
 int mk_conn_write(int socket);
+int mk_conn_zerocopy(int socket);
 int mk_conn_close(int socket, int event);
 
 #endif
@@ -0,0 +1,130 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef MK_DEFLATE_H
+#define MK_DEFLATE_H
+
+#include <time.h>
+#include <sys/types.h>
+
+#include "mk_list.h"
+#include "mk_file.h"
+#include "mk_memory.h"
+#include "mk_stream.h"
+
+/*
+ * On-the-fly compression of static content (zlib). Every worker owns its
+ * compression streams and a cache of compressed variants bounded by size
+ * (CompressionCache), entries are keyed by the path and the encoding and
+ * validated against the inode, size and modification time of the file.
+ * Chunked bodies of unknown length are compressed on their channel.
+ */
+
+#define MK_DEFLATE_GZIP       0
+#define MK_DEFLATE_DEFLATE    1
+#define MK_DEFLATE_ENCODINGS  2
+
+#define MK_DEFLATE_BUCKETS    256
+
+/* Chunked bodies: output round of a channel and idle deflaters kept */
+#define MK_DEFLATE_CHANNEL_BUF  16384
+#define MK_DEFLATE_CHANNEL_IDLE 8
+
+/* Flush modes of a channel deflater */
+#define MK_DEFLATE_NO_FLUSH   0
+#define MK_DEFLATE_SYNC       1
+#define MK_DEFLATE_FINISH     2
+
+struct mk_deflate_stats {
+    unsigned long long hits;
+    unsigned long long misses;          /* responses compressed          */
+    unsigned long long skipped;         /* identity sent, budget reached */
+    unsigned long long streamed;        /* chunked bodies compressed     */
+    unsigned long long evictions;
+    unsigned long long bytes_in;        /* compressed input              */
+    unsigned long long bytes_out;       /* compressed output             */
+    unsigned long long usec;            /* CPU time spent compressing    */
+    unsigned long long bytes;           /* cache memory in use           */
+};
+
+
+struct mk_deflate_entry {
+    int encoding;
+    int len;
+    unsigned int hash;
+    char *path;
+
+    ino_t inode;
+    off_t size;
+    time_t mtime;
+    struct mk_stream_buffer *variant;   /* compressed body, shared with
+                                           the responses sending it     */
+
+    struct mk_list _head;       /* hash table bucket */
+    struct mk_list _lru;        /* LRU, last is the most recent */
+};
+
+/*
+ * Compression of a chunked body on its channel: the streams queued after
+ * the headers are fed to the deflater when they reach the head of the
+ * channel, 'out' carries what a round produced as a single chunk in front
+ * of them.
+ */
+struct mk_deflate_channel {
+    int encoding;
+    int flush;                  /* flush mode still to complete    */
+    int finished;               /* the end of the body is in 'buf' */
+    void *zs;                   /* z_stream                        */
+    char *buf;
+    size_t len;                 /* bytes of 'buf' in use           */
+    struct mk_stream out;
+
+    struct mk_list _head;       /* idle list of the worker */
+};
+
+struct mk_deflate_cache {
+    struct mk_list table[MK_DEFLATE_BUCKETS];
+    struct mk_list lru;
+    void *streams[MK_DEFLATE_ENCODINGS];  /* z_stream, created on first use */
+
+    /* Channel deflaters not in use, per encoding */
+    struct mk_list idle[MK_DEFLATE_ENCODINGS];
+    int idle_count[MK_DEFLATE_ENCODINGS];
+
+    /* Input bytes compressed during the current second (budget) */
+    time_t budget_time;
+    long budget_used;
+
+    struct mk_deflate_stats stats;
+};
+
+void mk_deflate_init();
+struct mk_deflate_cache *mk_deflate_worker_init();
+void mk_deflate_worker_exit();
+struct mk_stream_buffer *mk_deflate_variant_get(const char *path, int len,
+                                                struct file_info *finfo,
+                                                int encoding);
+int mk_deflate_type_check(mk_ptr_t *content_type);
+struct mk_deflate_channel *mk_deflate_channel_get(int encoding);
+void mk_deflate_channel_put(struct mk_deflate_channel *dc);
+ssize_t mk_deflate_channel_input(struct mk_deflate_channel *dc,
+                                 char *data, size_t len);
+int mk_deflate_channel_flush(struct mk_deflate_channel *dc, int flush);
+
+#endif
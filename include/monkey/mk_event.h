@@ -29,6 +29,7 @@
 #define MK_EVENT_WRITE           4
 #define MK_EVENT_SLEEP           8
 #define MK_EVENT_CLOSE          (16 | 8 | 8192)
+#define MK_EVENT_ERROR           8  /* socket error or error queue data */
 
 /* The event queue size */
 #define MK_EVENT_QUEUE_SIZE    256
@@ -37,6 +38,9 @@
 #define MK_EVENT_LEVEL         256
 #define MK_EVENT_EDGE          512
 
+/* Tag: the fd is the source a sleeping channel relays from */
+#define MK_EVENT_RELAY        1024
+
 
 /* Legacy definitions: temporal
  *  ----------------------------
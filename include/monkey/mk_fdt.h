@@ -0,0 +1,86 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef MK_FDT_H
+#define MK_FDT_H
+
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "mk_list.h"
+
+/*
+ * File Descriptor Table (FDT)
+ * ===========================
+ * Process wide cache of read-only file descriptors for static content.
+ * Entries are looked up by the full path and validated against the inode,
+ * size and modification time of the request file information, so a changed
+ * or replaced file is never served from a stale descriptor.
+ *
+ * Descriptors are shared by every worker: files are opened read-only and
+ * the transports read them through positional I/O (sendfile(2) or
+ * pread(2) with an explicit offset), so the file position is never used.
+ * Idle descriptors stay open in a LRU list until the global budget
+ * (FDTLimit) requires room for a new one.
+ */
+
+#define MK_FDT_SHARDS         16
+#define MK_FDT_LIMIT_DEFAULT  1024
+
+struct mk_fdt_stats {
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long evictions;      /* idle descriptors closed by LRU */
+    unsigned long long invalidations;  /* descriptors of changed files   */
+};
+
+struct mk_fdt_entry {
+    int fd;
+    int readers;
+    int stale;                 /* unlinked from the table, close on release */
+    unsigned long len;
+    unsigned int hash;
+    char *path;
+
+    ino_t inode;
+    off_t size;
+    time_t mtime;
+
+    struct mk_fdt_shard *shard;
+    struct mk_list _head;      /* shard bucket */
+    struct mk_list _lru;       /* shard idle list, first is the oldest */
+};
+
+struct mk_fdt_shard {
+    pthread_mutex_t mutex;
+    int count;                 /* open descriptors owned by the shard */
+    struct mk_list *table;     /* allocated on first use */
+    struct mk_list lru;
+};
+
+struct mk_http_request;
+
+void mk_fdt_init();
+void mk_fdt_exit();
+int mk_fdt_open(struct mk_http_request *sr);
+int mk_fdt_close(struct mk_http_request *sr);
+void mk_fdt_warm(const char *path, int len, int fd, struct stat *st);
+
+#endif
@@ -29,6 +29,7 @@
 struct file_info
 {
     off_t size;
+    ino_t inode;
     time_t last_modification;
 
     /* Suggest flags to open this file */
@@ -24,6 +24,7 @@
 #include "mk_http_status.h"
 
 #define MK_HEADER_BREAKLINE 1
+#define MK_HEADER_IOV       32
 
 /*
  * header response: We handle this as static global data in order
@@ -71,6 +72,7 @@
 #define MK_RH_CLIENT_UNSUPPORTED_MEDIA  "HTTP/1.1 415 Unsupported Media Type\r\n"
 #define MK_RH_CLIENT_REQUESTED_RANGE_NOT_SATISF \
     "HTTP/1.1 416 Requested Range Not Satisfiable\r\n"
+#define MK_RH_CLIENT_EXPECTATION_FAILED "HTTP/1.1 417 Expectation Failed\r\n"
 
 /* Server side errors */
 #define MK_RH_SERVER_INTERNAL_ERROR "HTTP/1.1 500 Internal Server Error\r\n"
@@ -80,6 +82,22 @@
 #define MK_RH_SERVER_GATEWAY_TIMEOUT "HTTP/1.1 504 Gateway Timeout\r\n"
 #define MK_RH_SERVER_HTTP_VERSION_UNSUP "HTTP/1.1 505 HTTP Version Not Supported\r\n"
 
+/*
+ * Header block: the immutable part of a static file 200 response
+ * (Last-Modified, ETag, Content-Type, Content-Length and Accept-Ranges). It's
+ * built once per cached file and spliced on every response, it's
+ * reference counted by the cache entry and the requests using it. Small
+ * files also keep their content on the block (body).
+ */
+struct mk_header_block {
+    int refs;
+    long content_length;
+    mk_ptr_t data;
+    mk_ptr_t etag;             /* entity tag, points inside data */
+    mk_ptr_t content_type;     /* mime type header the block was built for */
+    mk_ptr_t body;
+};
+
 struct header_status_response {
     int   status;
     int   length;
@@ -97,13 +115,21 @@ extern const mk_ptr_t mk_header_conn_ka;
 extern const mk_ptr_t mk_header_conn_close;
 extern const mk_ptr_t mk_header_content_length;
 extern const mk_ptr_t mk_header_content_encoding;
+extern const mk_ptr_t mk_header_vary;
 extern const mk_ptr_t mk_header_accept_ranges;
 extern const mk_ptr_t mk_header_te_chunked;
 extern const mk_ptr_t mk_header_last_modified;
+extern const mk_ptr_t mk_header_etag;
 
 int mk_header_prepare(struct mk_http_session *cs, struct mk_http_request *sr);
 void mk_header_response_reset(struct response_headers *header);
 void mk_header_set_http_status(struct mk_http_request *sr, int status);
 void mk_header_set_content_length(struct mk_http_request *sr, long len);
 
+struct mk_header_block *mk_header_block_create(struct file_info *finfo,
+                                               mk_ptr_t *content_type,
+                                               int body_size);
+void mk_header_block_release(struct mk_header_block *block);
+int mk_header_etag_create(struct file_info *finfo, char *buf, int size);
+
 #endif
@@ -78,6 +78,15 @@
     MK_CRLF
 
 #define MK_HTTP_PROTOCOL_UNKNOWN (-1)
+/*
+ * Range requests: a request with more ranges than MK_HTTP_RANGES_MAX, or
+ * whose ranges overlap for more than the file size, gets the full content
+ * (RFC 7233 section 6.1). Ranges closer than MK_HTTP_RANGES_GAP bytes are
+ * coalesced, a part header costs about the same.
+ */
+#define MK_HTTP_RANGES_MAX  16
+#define MK_HTTP_RANGES_GAP  80
+
 #define MK_HTTP_PROTOCOL_09 (9)
 #define MK_HTTP_PROTOCOL_10 (10)
 #define MK_HTTP_PROTOCOL_11 (11)
@@ -111,11 +120,16 @@ struct mk_http_session
     int pipelined;              /* Pipelined request */
     int counter_connections;    /* Count persistent connections */
     int status;                 /* Request status */
+    int send_lowat;             /* TCP_NOTSENT_LOWAT, -1 if not known */
+    struct host *sock_host;     /* virtual host that tuned the socket */
     struct mk_channel channel;
 
     unsigned int body_size;
     unsigned int body_length;
 
+    /* offset in the body buffer where the next pipelined request starts */
+    unsigned int body_offset;
+
     /* red-black tree head */
     struct rb_node _rb_head;
 
@@ -171,10 +185,14 @@ int mk_http_protocol_check(char *protocol, int len);
 mk_ptr_t mk_http_protocol_check_str(int protocol);
 
 int mk_http_init(struct mk_http_session *cs, struct mk_http_request *sr);
+int mk_http_expect_continue(struct mk_http_session *cs,
+                            struct mk_http_request *sr);
 int mk_http_keepalive_check(struct mk_http_session *cs);
+void mk_http_sock_adapt(struct mk_http_session *cs, unsigned long long bytes);
 
 int mk_http_pending_request(struct mk_http_session *cs);
 int mk_http_send_file(struct mk_http_session *cs, struct mk_http_request *sr);
+struct mk_deflate_channel *mk_http_deflate_chunked(struct mk_http_request *sr);
 int mk_http_request_end(int socket);
 
 
@@ -186,6 +204,7 @@ struct mk_http_session *mk_http_session_create(int socket,
 
 /* event handlers */
 int mk_http_handler_read(int socket, struct mk_http_session *cs);
+int mk_http_handler_parse(int socket, struct mk_http_session *cs);
 int mk_http_handler_write(int socket, struct mk_http_session *cs);
 
 void mk_http_request_free(struct mk_http_request *sr);
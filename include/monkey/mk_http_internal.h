@@ -22,6 +22,25 @@
 
 #include <monkey/mk_stream.h>
 
+#define MK_HEADER_ETAG_SIZE  64
+
+/* A part of a multipart/byteranges response: part headers + file range */
+struct mk_http_range_part {
+    off_t offset;
+    off_t length;
+    mk_ptr_t header;
+    struct mk_stream header_stream;
+    struct mk_stream file_stream;
+};
+
+struct mk_http_multirange {
+    int count;
+    mk_ptr_t content_type;
+    mk_ptr_t tail;                 /* closing boundary */
+    struct mk_stream tail_stream;
+    struct mk_http_range_part parts[];
+};
+
 struct response_headers
 {
     int status;
@@ -47,12 +66,13 @@ struct response_headers
 
     int transfer_encoding;
 
-    int ranges[2];
+    long ranges[2];
 
     time_t last_modified;
     mk_ptr_t allow_methods;
     mk_ptr_t content_type;
     mk_ptr_t content_encoding;
+    mk_ptr_t vary;
     char *location;
 
     /*
@@ -61,6 +81,19 @@ struct response_headers
      */
     struct mk_iov *_extra_rows;
 
+    /*
+     * Headers iov owned by the request, it's only allocated when the
+     * thread cached one is still in use by a previous response.
+     */
+    struct mk_iov *iov;
+
+    /* Precomputed headers of a static file (200 OK), see mk_header.c */
+    struct mk_header_block *block;
+
+    /* Entity tag of a static file, it points to the block or etag_buf */
+    mk_ptr_t etag;
+    char etag_buf[MK_HEADER_ETAG_SIZE];
+
     /* Flag to track if the response headers were sent */
     int sent;
 
@@ -108,6 +141,7 @@ struct mk_http_request
     /*---Request headers--*/
     int content_length;
 
+    mk_ptr_t accept_encoding;
     mk_ptr_t _content_length;
     mk_ptr_t content_type;
     mk_ptr_t connection;
@@ -115,6 +149,9 @@ struct mk_http_request
     mk_ptr_t host;
     mk_ptr_t host_port;
     mk_ptr_t if_modified_since;
+    mk_ptr_t if_none_match;
+    mk_ptr_t if_match;
+    mk_ptr_t if_range;
     mk_ptr_t last_modified_since;
     mk_ptr_t range;
 
@@ -152,10 +189,17 @@ struct mk_http_request
     /* Static file information */
     struct file_info file_info;
 
-    /* Vhost */
-    int vhost_fdt_id;
-    unsigned int vhost_fdt_hash;
-    int vhost_fdt_enabled;
+    /* Shared file descriptor (FDT) */
+    struct mk_fdt_entry *fdt_entry;
+
+    /* Asset served from the virtual host pack */
+    struct mk_pack_record *pack_record;
+
+    /* Multiple ranges requested, sent as multipart/byteranges */
+    struct mk_http_multirange *multirange;
+
+    /* Compressed content being sent (on-the-fly compression) */
+    struct mk_stream_buffer *deflate_variant;
 
     struct host       *host_conf;     /* root vhost config */
     struct host_alias *host_alias;    /* specific vhost matched */
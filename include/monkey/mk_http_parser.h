@@ -38,6 +38,11 @@
 #define MK_HTTP_PARSER_CONN_CLOSE    2
 #define MK_HTTP_PARSER_CONN_UPGRADE  3
 
+/* Expect header values */
+#define MK_HTTP_PARSER_EXPECT_EMPTY     0
+#define MK_HTTP_PARSER_EXPECT_UNKNOWN  -1
+#define MK_HTTP_PARSER_EXPECT_CONTINUE  1
+
 #define MK_HEADER_EXTRA_SIZE         8
 
 /* Request levels
@@ -104,8 +109,12 @@ enum mk_request_headers {
     MK_HEADER_CONTENT_LENGTH        ,
     MK_HEADER_CONTENT_RANGE         ,
     MK_HEADER_CONTENT_TYPE          ,
+    MK_HEADER_EXPECT                ,
     MK_HEADER_HOST                  ,
+    MK_HEADER_IF_MATCH              ,
     MK_HEADER_IF_MODIFIED_SINCE     ,
+    MK_HEADER_IF_NONE_MATCH         ,
+    MK_HEADER_IF_RANGE              ,
     MK_HEADER_LAST_MODIFIED         ,
     MK_HEADER_LAST_MODIFIED_SINCE   ,
     MK_HEADER_RANGE                 ,
@@ -125,6 +134,7 @@ enum mk_request_headers {
 #define MK_CONN_KEEP_ALIVE     "keep-alive"
 #define MK_CONN_CLOSE          "close"
 #define MK_CONN_UPGRADE        "upgrade"
+#define MK_EXPECT_CONTINUE     "100-continue"
 
 struct mk_http_header {
     /* The header type/name, e.g: MK_HEADER_CONTENT_LENGTH */
@@ -164,6 +174,12 @@ struct mk_http_parser {
 
     long header_content_length;
 
+    /*
+     * Number of bytes of the buffer used by the parsed request (headers and
+     * body), anything after it belongs to the next pipelined request.
+     */
+    int request_length;
+
     /*
      * connection header value discovered: it can be set with
      * values:
@@ -175,6 +191,15 @@ struct mk_http_parser {
      */
     int header_connection;
 
+    /*
+     * expect header value discovered:
+     *
+     * MK_HTTP_PARSER_EXPECT_EMPTY   : header not set
+     * MK_HTTP_PARSER_EXPECT_UNKNOWN : unsupported expectation
+     * MK_HTTP_PARSER_EXPECT_CONTINUE: 100-continue
+     */
+    int header_expect;
+
     /* probable current header, fly parsing */
     int header_key;
     int header_sep;
@@ -61,6 +61,7 @@ int mk_iov_realloc(struct mk_iov *mk_io, int new_size);
 int mk_iov_add_separator(struct mk_iov *mk_io, mk_ptr_t sep);
 
 ssize_t mk_iov_send(int fd, struct mk_iov *mk_io);
+ssize_t mk_iov_send_more(int fd, struct mk_iov *mk_io);
 
 void mk_iov_free(struct mk_iov *mk_io);
 
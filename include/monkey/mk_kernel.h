@@ -24,6 +24,7 @@
 #define MK_KERNEL_TCP_FASTOPEN      1
 #define MK_KERNEL_SO_REUSEPORT      2
 #define MK_KERNEL_TCP_AUTOCORKING   4
+#define MK_KERNEL_MSG_ZEROCOPY      8
 
 #define MK_KERNEL_VERSION(a, b, c) (((a) << 16) + ((b) << 8) + (c))
 
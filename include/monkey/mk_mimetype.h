@@ -32,6 +32,7 @@ struct mimetype
     char *name;
     mk_ptr_t type;
     mk_ptr_t header_type;
+    int compress;               /* listed on CompressionTypes */
     struct mk_list _head;
     struct rb_node _rb_head;
 };
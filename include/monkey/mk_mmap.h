@@ -0,0 +1,81 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef MK_MMAP_H
+#define MK_MMAP_H
+
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "mk_list.h"
+
+/*
+ * Mapped files cache
+ * ==================
+ * Process wide cache of read-only mappings of static files, for the
+ * consumers that need the file content in memory instead of sending it
+ * with sendfile(2): TLS transports encrypt the records straight from the
+ * mapping and the compressor deflates it, no pread(2) into a buffer.
+ *
+ * Entries are keyed by the device and inode of an open descriptor and
+ * validated against its size and modification time on every lookup, a
+ * changed file gets a new mapping once the readers of the old one are
+ * done. Idle mappings are kept in a LRU list until the total mapped size
+ * reaches the budget (MmapCache).
+ *
+ * A file truncated while it's mapped raises SIGBUS on access to the lost
+ * pages, so the content is never dereferenced directly: mk_mmap_read()
+ * hands it to its consumer under a recovery point and reports the
+ * truncation as an error.
+ */
+
+#define MK_MMAP_BUCKETS   256
+
+struct mk_mmap_stats {
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long evictions;      /* idle mappings released by LRU */
+    unsigned long long invalidations;  /* mappings of changed files     */
+};
+
+struct mk_mmap_entry {
+    int refs;
+    int stale;                 /* unlinked from the table, unmap on release */
+
+    dev_t dev;
+    ino_t inode;
+    off_t size;
+    time_t mtime;
+
+    void *addr;
+
+    struct mk_list _head;      /* hash table bucket */
+    struct mk_list _lru;       /* idle list, first is the oldest */
+};
+
+void mk_mmap_init();
+void mk_mmap_exit();
+struct mk_mmap_entry *mk_mmap_get(int fd);
+void mk_mmap_release(struct mk_mmap_entry *entry);
+int mk_mmap_read(struct mk_mmap_entry *entry, off_t offset, size_t len,
+                 void (*func) (void *, const char *, size_t), void *data);
+void mk_mmap_fault();
+
+#endif
@@ -0,0 +1,87 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef MK_PACK_H
+#define MK_PACK_H
+
+#include <stdint.h>
+
+/*
+ * Asset packs
+ * ===========
+ * A pack is a single read-only file holding the static content of a
+ * virtual host (Pack directive), built offline by the mkpack tool:
+ *
+ *   header | content of every file | records | strings
+ *
+ * Records are sorted by request path and point to the content of the file
+ * and to its path, Content-Type header row and entity tag on the strings
+ * area. Integers are stored in the byte order of the host that built it.
+ *
+ * The server loads the records and strings at startup, indexes them on a
+ * hash table and serves every asset with sendfile(2) from one descriptor
+ * kept open for the whole life of the server: no path resolution, stat or
+ * open is done per request. A pack is never reloaded, replacing it requires
+ * a restart.
+ */
+
+#define MK_PACK_MAGIC      "MKPACK\r\n"
+#define MK_PACK_VERSION    1
+
+struct mk_pack_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;             /* number of records */
+    uint64_t records;           /* offset of the records */
+    uint64_t strings;           /* offset of the strings area */
+    uint64_t strings_size;
+};
+
+struct mk_pack_record {
+    uint64_t offset;            /* content */
+    uint64_t size;
+    int64_t  mtime;
+
+    /* Offsets on the strings area */
+    uint32_t path;              /* request path, e.g: /css/site.css */
+    uint32_t path_len;
+    uint32_t type;              /* "Content-Type: text/css\r\n"     */
+    uint32_t type_len;
+    uint32_t etag;              /* "\"...\""                        */
+    uint32_t etag_len;
+};
+
+struct mk_pack {
+    int fd;
+    char *path;
+    uint32_t count;
+    struct mk_pack_record *records;
+    char *strings;
+
+    /* Open addressing hash table, slots hold a record index plus one */
+    uint32_t size;
+    uint32_t *table;
+};
+
+struct mk_pack *mk_pack_open(const char *path);
+void mk_pack_close(struct mk_pack *pack);
+struct mk_pack_record *mk_pack_lookup(struct mk_pack *pack,
+                                      const char *path, int len);
+
+#endif
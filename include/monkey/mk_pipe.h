@@ -0,0 +1,55 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef MK_PIPE_H
+#define MK_PIPE_H
+
+#include <sys/types.h>
+
+#include "mk_list.h"
+
+/*
+ * Pipe pool
+ * =========
+ * Data relayed from a descriptor (MK_STREAM_SOCKET) is moved with
+ * splice(2): from the source into a pipe and from the pipe into the client
+ * socket, it never reaches user space. Every worker keeps a few idle pipes
+ * for it. A channel only holds a pipe while it has data buffered in it,
+ * so a handful of them serve any number of relays.
+ */
+
+#define MK_PIPE_POOL_SIZE   16   /* idle pipes kept by a worker */
+
+struct mk_pipe_stats {
+    unsigned long long created;
+    unsigned long long reused;         /* pipes taken from the pool */
+    unsigned long long bytes;          /* data relayed with splice  */
+};
+
+struct mk_pipe {
+    int fd[2];
+    size_t bytes;              /* data sitting in the pipe */
+    struct mk_list _head;
+};
+
+struct mk_pipe *mk_pipe_get();
+void mk_pipe_put(struct mk_pipe *pipe);
+void mk_pipe_worker_exit();
+
+#endif
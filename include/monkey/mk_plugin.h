@@ -31,6 +31,7 @@
 #include <monkey/mk_utils.h>
 #include <monkey/mk_string.h>
 #include <monkey/mk_list.h>
+#include <monkey/mk_mmap.h>
 #include <monkey/mk_info.h>
 
 extern __thread struct mk_list *worker_plugin_event_list;
@@ -136,6 +137,10 @@ struct plugin_api
     /* file functions */
     char *(*file_to_buffer) (const char *);
     int  (*file_get_info) (const char *, struct file_info *, int);
+    struct mk_mmap_entry *(*file_mmap_get) (int);
+    void (*file_mmap_release) (struct mk_mmap_entry *);
+    int (*file_mmap_read) (struct mk_mmap_entry *, off_t, size_t,
+                           void (*) (void *, const char *, size_t), void *);
 
     /* header */
     int  (*header_prepare) (struct mk_http_session *,
@@ -154,11 +159,16 @@ struct plugin_api
     struct mk_channel *(*channel_new) (int, int);
     int (*channel_write) (struct mk_channel *);
     void (*channel_append_stream) (struct mk_channel *, struct mk_stream *stream);
+    void (*channel_chunked_end) (struct mk_channel *);
     void (*stream_set) (struct mk_stream *, int, struct mk_channel *, void *, size_t,
                         void *,
                         void (*) (struct mk_stream *),
                         void (*) (struct mk_stream *, long),
                         void (*) (struct mk_stream *, int));
+    struct mk_stream_buffer *(*stream_buffer_new) (char *, size_t, void *,
+                                                   void (*) (struct mk_stream_buffer *));
+    void (*stream_buffer_get) (struct mk_stream_buffer *);
+    void (*stream_buffer_release) (struct mk_stream_buffer *);
 
     /* iov functions */
     struct mk_iov *(*iov_create) (int, int);
@@ -168,6 +178,7 @@ struct plugin_api
     int (*iov_add) (struct mk_iov *, void *, int, int);
     int (*iov_set_entry) (struct mk_iov *, void *, int, int, int);
     ssize_t (*iov_send) (int, struct mk_iov *);
+    ssize_t (*iov_send_more) (int, struct mk_iov *);
     void (*iov_print) (struct mk_iov *);
 
     /* plugin functions */
@@ -268,10 +279,31 @@ struct mk_plugin_network {
     int (*bind) (int, const struct sockaddr *addr, socklen_t, int);
     int (*server) (char *port, char *addr, int);
     int (*buffer_size) ();
+
+    /*
+     * Optional: write and writev telling the kernel more data follows
+     * right away (MSG_MORE), so a response made of several streams leaves
+     * in full frames without toggling TCP_CORK.
+     */
+    int (*write_more) (int, const void *, size_t);
+    int (*writev_more) (int, struct mk_iov *);
+
+    /*
+     * Optional: write referencing the buffer pages instead of copying them
+     * (MSG_ZEROCOPY), see ZeroCopy.
+     */
+    int (*write_zerocopy) (int, const void *, size_t);
+
+    /*
+     * Optional: move data buffered in a pipe to the socket with splice(2),
+     * the last argument flags that more data follows.
+     */
+    int (*write_pipe) (int, int, size_t, int);
 };
 
 struct mk_plugin_stage {
     int (*stage10) (int, struct sched_connection *);
+    int (*stage15) (struct mk_http_session *, struct mk_http_request *);
     int (*stage20) (struct mk_http_session *, struct mk_http_request *);
     int (*stage30) (struct mk_plugin *, struct mk_http_session *,
                     struct mk_http_request *);
@@ -40,6 +40,34 @@ static inline int mk_plugin_stage_run_10(int socket,
     return -1;
 }
 
+/*
+ * Stage 15 runs when the request headers have arrived but the body is
+ * still pending (Expect: 100-continue), plugins can reject the request
+ * before any byte of the body is read.
+ */
+static inline int mk_plugin_stage_run_15(struct mk_http_session *cs,
+                                         struct mk_http_request *sr)
+{
+    int ret;
+    struct mk_list *head;
+    struct mk_plugin_stage *stage;
+
+    mk_list_foreach(head, &mk_config->stage15_handler) {
+        stage = mk_list_entry(head, struct mk_plugin_stage, _head);
+        ret = stage->stage15(cs, sr);
+        switch (ret) {
+        case MK_PLUGIN_RET_NOT_ME:
+            break;
+        case MK_PLUGIN_RET_END:
+        case MK_PLUGIN_RET_CLOSE_CONX:
+            MK_TRACE("stage 15 rejected the request");
+            return ret;
+        }
+    }
+
+    return -1;
+}
+
 static inline int mk_plugin_stage_run_20(struct mk_http_session *cs,
                                          struct mk_http_request *sr)
 {
@@ -74,7 +102,9 @@ static inline int mk_plugin_stage_run_30(struct mk_http_session *cs,
         case MK_PLUGIN_RET_NOT_ME:
             break;
         case MK_PLUGIN_RET_END:
-            mk_bug(sr->headers.sent == MK_FALSE);
+            /* The response is queued, or a stream waiting to make it */
+            mk_bug(sr->headers.sent == MK_FALSE &&
+                   mk_list_is_empty(&cs->channel.streams) == 0);
             return ret;
         case MK_PLUGIN_RET_CLOSE_CONX:
         case MK_PLUGIN_RET_CONTINUE:
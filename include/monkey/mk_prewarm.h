@@ -0,0 +1,54 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef MK_PREWARM_H
+#define MK_PREWARM_H
+
+/*
+ * Cache prewarming
+ * ================
+ * A virtual host may list the files worth having hot from the first
+ * request (Prewarm directive): a directory walked recursively or a
+ * manifest with one path or glob(3) pattern per line, relative to the
+ * DocumentRoot. At startup one thread walks every list: it opens each
+ * file, hands the descriptor to the FDT and asks the kernel to read it
+ * into the page cache, until the budget (PrewarmBudget) of the virtual
+ * host is consumed.
+ *
+ * Workers accept connections meanwhile, unless PrewarmWait is set.
+ */
+
+#define MK_PREWARM_PENDING  0
+#define MK_PREWARM_RUNNING  1
+#define MK_PREWARM_DONE     2
+
+/* Progress of a virtual host, updated by the prewarm thread only */
+struct mk_prewarm {
+    char *source;              /* directory or manifest */
+    volatile int state;
+    volatile unsigned long files;
+    volatile unsigned long failed;
+    volatile unsigned long long bytes;
+    unsigned long usec;        /* time spent once done */
+};
+
+void mk_prewarm_init();
+void mk_prewarm_wait();
+
+#endif
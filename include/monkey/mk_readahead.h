@@ -0,0 +1,87 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef MK_READAHEAD_H
+#define MK_READAHEAD_H
+
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "mk_list.h"
+#include "mk_event.h"
+#include "mk_stream.h"
+
+/*
+ * Cold file readahead: before a file stream is sent, the worker checks if
+ * the next window of the file is in the page cache. If it is not, sending
+ * it would block the whole worker on disk I/O, so the window is read by a
+ * thread of the readahead pool while the connection sleeps; the pool
+ * notifies the worker through its channel and the connection is resumed.
+ */
+
+/* Buffer used by the pool threads to read a window */
+#define MK_READAHEAD_CHUNK    65536
+
+struct mk_readahead_stats {
+    unsigned long long probes;          /* windows checked            */
+    unsigned long long parked;          /* connections sent to sleep  */
+    unsigned long long resumed;
+    unsigned long long cancelled;       /* connection closed meanwhile */
+    unsigned long long bytes;           /* data read by the pool      */
+    unsigned long long usec;            /* time connections slept     */
+};
+
+struct mk_readahead_job {
+    int fd;                             /* dup() of the stream file */
+    off_t offset;
+    size_t length;
+    struct timespec start;
+
+    /* Owned by the worker, the channel is NULL once it's gone */
+    struct mk_channel *channel;
+    struct mk_stream *stream;
+    struct mk_readahead_worker *worker;
+
+    struct mk_list _head;
+};
+
+struct mk_readahead_worker {
+    int ch_r;                           /* completion channel */
+    int ch_w;
+    int probe;                          /* MK_FALSE if not supported */
+    mk_event_loop_t *loop;
+
+    /* Jobs completed by the pool, pending to be resumed */
+    pthread_mutex_t lock;
+    int pending;                        /* jobs not resumed yet       */
+    int exiting;                        /* the last job frees it      */
+    struct mk_list done;
+
+    struct mk_readahead_stats stats;
+};
+
+void mk_readahead_init();
+struct mk_readahead_worker *mk_readahead_worker_init(mk_event_loop_t *loop);
+void mk_readahead_worker_exit();
+int mk_readahead_park(struct mk_channel *channel, struct mk_stream *stream);
+void mk_readahead_cancel(struct mk_channel *channel);
+int mk_readahead_events();
+
+#endif
@@ -25,6 +25,12 @@
 #include <monkey/mk_list.h>
 #include <monkey/mk_rbtree.h>
 #include <monkey/mk_event.h>
+#include <monkey/mk_stat_cache.h>
+#include <monkey/mk_readahead.h>
+#include <monkey/mk_deflate.h>
+#include <monkey/mk_fdt.h>
+#include <monkey/mk_mmap.h>
+#include <monkey/mk_pipe.h>
 
 #ifndef MK_SCHEDULER_H
 #define MK_SCHEDULER_H
@@ -56,6 +62,20 @@ extern __thread struct mk_list *cs_incomplete;
 extern __thread struct stats *stats;
 #endif
 
+/* Socket tuning applied by a worker, see SendLowat */
+struct mk_socket_stats {
+    unsigned long long tuned;     /* virtual host buffer overrides */
+    unsigned long long raised;    /* adaptive watermark raises     */
+};
+
+/* Dynamic virtual hosts resolved by a worker, see VirtualDocumentRoot */
+struct mk_vhost_stats {
+    unsigned long long hits;
+    unsigned long long misses;    /* document roots looked up   */
+    unsigned long long negative;  /* names without document root */
+    unsigned long long evictions;
+};
+
 struct sched_connection
 {
     int socket;                  /* file descriptor            */
@@ -119,6 +139,33 @@ struct sched_list_node
      * the available and busy queue entries.
      */
     struct sched_connection *sched_array;
+
+    /* Per worker stat cache, exposes its inotify fd and counters */
+    struct mk_stat_cache *stat_cache;
+
+    /* Per worker compressed variants cache and counters */
+    struct mk_deflate_cache *deflate_cache;
+
+    /* Completion channel of the readahead pool and counters */
+    struct mk_readahead_worker *readahead;
+
+    /* Shared file descriptors (FDT) usage from this worker */
+    struct mk_fdt_stats fdt_stats;
+
+    /* Shared file mappings usage from this worker */
+    struct mk_mmap_stats mmap_stats;
+
+    /* Response data written and write budget usage */
+    struct mk_channel_stats channel_stats;
+
+    /* Socket buffers tuned by virtual hosts and watermark raises */
+    struct mk_socket_stats sock_stats;
+
+    /* Pipes of the worker pool and data relayed through them */
+    struct mk_pipe_stats pipe_stats;
+
+    /* Dynamic virtual hosts cache */
+    struct mk_vhost_stats vhost_stats;
 };
 
 extern __thread struct sched_list_node *worker_sched_node;
@@ -20,6 +20,7 @@
 #ifndef MK_SOCKET_H
 #define MK_SOCKET_H
 
+#include <stdint.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <netdb.h>
@@ -48,6 +49,21 @@
 #define TCP_FASTOPEN  23
 #endif
 
+/* TCP_NOTSENT_LOWAT: Linux >= 3.12, same case as TCP_FASTOPEN */
+#ifndef TCP_NOTSENT_LOWAT
+#define TCP_NOTSENT_LOWAT  25
+#endif
+
+/* MSG_ZEROCOPY: Linux >= 4.14 */
+#if defined(__linux__)
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY   60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY  0x4000000
+#endif
+#endif
+
 #define TCP_CORK_ON 1
 #define TCP_CORK_OFF 0
 
@@ -59,6 +75,12 @@ int mk_socket_set_tcp_nodelay(int sockfd);
 int mk_socket_set_tcp_defer_accept(int sockfd);
 int mk_socket_set_tcp_reuseport(int sockfd);
 int mk_socket_set_nonblocking(int sockfd);
+int mk_socket_set_buffers(int sockfd, int sndbuf, int rcvbuf);
+int mk_socket_set_notsent_lowat(int sockfd, int bytes);
+int mk_socket_get_notsent_lowat(int sockfd);
+int mk_socket_set_zerocopy(int sockfd);
+int mk_socket_zerocopy_read(int sockfd, uint32_t *lo, uint32_t *hi,
+                            int *copied);
 
 int mk_socket_close(int socket);
 
@@ -69,6 +91,9 @@ int mk_socket_server(char *port, char *listen_addr, int reuse_port);
 
 int mk_socket_sendv(int socket_fd, struct mk_iov *mk_io);
 int mk_socket_send(int socket_fd, const void *buf, size_t count);
+int mk_socket_sendv_more(int socket_fd, struct mk_iov *mk_io);
+int mk_socket_send_zerocopy(int socket_fd, const void *buf, size_t count);
+int mk_socket_send_pipe(int socket_fd, int pipe_fd, size_t count, int more);
 int mk_socket_read(int socket_fd, void *buf, int count);
 int mk_socket_send_file(int socket_fd, int file_fd, off_t *file_offset,
                         size_t file_count);
@@ -0,0 +1,99 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef MK_STAT_CACHE_H
+#define MK_STAT_CACHE_H
+
+#include <time.h>
+
+#include "mk_list.h"
+#include "mk_file.h"
+#include "mk_event.h"
+#include "mk_memory.h"
+
+/*
+ * The stat cache keeps per worker the result of mk_file_get_info() for
+ * the paths resolved by the static file handler. Entries are dropped when
+ * the parent directory reports a change (inotify), when the TTL expires
+ * or when the LRU needs room for a new path.
+ */
+
+#define MK_STAT_CACHE_EVENTS_SIZE  4096
+
+struct mk_stat_cache_stats {
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long expired;         /* dropped by TTL               */
+    unsigned long long invalidations;   /* dropped by a directory event */
+    unsigned long long evictions;       /* dropped by the LRU           */
+    unsigned long long syscalls_saved;  /* lstat/stat calls not issued  */
+
+    /* Small files served from memory */
+    unsigned long long mem_hits;
+    unsigned long long mem_loads;
+    unsigned long long mem_evictions;
+    unsigned long long mem_bytes;       /* content currently held */
+};
+
+/* A watched directory and the cached entries living on it */
+struct mk_stat_cache_watch {
+    int wd;
+    int len;
+    unsigned int hash;
+    char *path;
+    struct mk_list entries;
+    struct mk_list _head;
+};
+
+struct mk_stat_cache_entry {
+    int len;
+    unsigned int hash;
+    char *path;
+
+    int ret;                    /* mk_file_get_info() return value */
+    int syscalls;               /* syscalls issued to resolve it   */
+    time_t expire;
+    struct file_info info;
+    struct mk_header_block *block;  /* built on the first 200 response */
+
+    struct mk_stat_cache_watch *watch;
+    struct mk_list _head;       /* hash table bucket */
+    struct mk_list _lru;        /* LRU, last is the most recent */
+    struct mk_list _watch;      /* link to watch->entries */
+};
+
+struct mk_stat_cache {
+    int fd;                     /* inotify instance or -1 */
+    int size;                   /* number of hash table buckets */
+    int count;                  /* number of cached entries */
+    struct mk_stat_cache_entry *last;   /* entry of the last lookup */
+    struct mk_list *table;
+    struct mk_list lru;
+    struct mk_list watches;
+    struct mk_stat_cache_stats stats;
+};
+
+struct mk_stat_cache *mk_stat_cache_worker_init(mk_event_loop_t *loop);
+void mk_stat_cache_worker_exit();
+int mk_stat_cache_get_info(const char *path, int len, struct file_info *f_info);
+int mk_stat_cache_events();
+struct mk_header_block *mk_stat_cache_header_block(const char *path, int len,
+                                                   mk_ptr_t *content_type);
+
+#endif
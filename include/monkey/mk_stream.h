@@ -20,6 +20,8 @@
 #ifndef MK_STREAM_H
 #define MK_STREAM_H
 
+#include <stdint.h>
+
 #include <monkey/mk_iov.h>
 #include <monkey/mk_list.h>
 
@@ -33,6 +35,20 @@
 #define MK_STREAM_PTR     2  /* mk_ptr               */
 #define MK_STREAM_FILE    3  /* opened file          */
 #define MK_STREAM_SOCKET  4  /* socket, scared..     */
+#define MK_STREAM_BUFFER  5  /* shared mk_stream_buffer */
+#define MK_STREAM_WAIT    6  /* owner called when fd is readable */
+
+/*
+ * Size of a MK_STREAM_SOCKET stream relayed until its source is closed. On
+ * a chunked channel every read from the source goes out as a chunk of its
+ * own, otherwise the response is delimited by closing the connection.
+ */
+#define MK_STREAM_SIZE_EOF  ((size_t) -1)
+
+/* What the channel does with the data of a stream, set when it's queued */
+#define MK_STREAM_ENC_NONE     0  /* sent as is                     */
+#define MK_STREAM_ENC_DEFLATE  1  /* fed to the channel deflater    */
+#define MK_STREAM_ENC_DISCARD  2  /* body of a HEAD response, dropped */
 
 
 /* Channel return values for write event */
@@ -41,10 +57,17 @@
 #define MK_CHANNEL_FLUSH   1  /* channel flushed some data    */
 #define MK_CHANNEL_EMPTY   2  /* no streams available         */
 #define MK_CHANNEL_UNKNOWN 4  /* unhandled                    */
+#define MK_CHANNEL_BUSY    8  /* waiting for file data to read */
 
 /* Channel status */
 #define MK_CHANNEL_DISABLED 0 /* channel is sleeping */
 #define MK_CHANNEL_ENABLED  1 /* channel enabled, have some data */
+#define MK_CHANNEL_BATCH    2 /* queue streams, flush them later */
+
+/* Channel zero copy state, see ZeroCopy */
+#define MK_CHANNEL_ZEROCOPY_UNKNOWN  0  /* not tried on the socket yet  */
+#define MK_CHANNEL_ZEROCOPY_ON       1  /* SO_ZEROCOPY set              */
+#define MK_CHANNEL_ZEROCOPY_OFF      2  /* unsupported or kernel copies */
 
 /*
  * Channel types: by default the only channel supported
@@ -56,11 +79,36 @@
  * A channel represents an end-point of a stream, for short
  * where the stream data consumed is send to.
  */
-struct mk_channel {
-    int type;
-    int fd;
-    int status;
-    struct mk_list streams;
+struct mk_readahead_job;
+struct mk_channel;
+struct mk_pipe;
+struct mk_deflate_channel;
+
+/* Writes of a worker, see WriteBudget */
+struct mk_channel_stats {
+    unsigned long long writes;        /* file and buffer writes issued   */
+    unsigned long long budget_hits;   /* writes cut short by the budget  */
+    unsigned long long bytes;
+    unsigned long long zerocopy;      /* bytes sent with MSG_ZEROCOPY    */
+    unsigned long long zerocopy_copied; /* zero copy sends the kernel copied */
+};
+
+/*
+ * A read-only payload that can be queued on many channels at the same time
+ * (an error page, a cached listing, a proxied body) without copying it: every
+ * MK_STREAM_BUFFER stream holds a reference until its data has been written
+ * or its channel is cleaned. When the last reference goes away
+ * cb_release is invoked, it owns 'data'.
+ */
+struct mk_stream_buffer {
+    int refs;
+    char *data;
+    size_t size;
+
+    /* Some data the user may want to reference with the buffer (optional) */
+    void *priv;
+
+    void (*cb_release) (struct mk_stream_buffer *);
 };
 
 /*
@@ -71,11 +119,13 @@ struct mk_stream {
     int type;              /* stream type                      */
     int fd;                /* file descriptor                  */
     int preserve;          /* preserve stream? (do not unlink) */
-    int encoding;          /* some output encoding ?           */
+    int encoding;          /* MK_STREAM_ENC_*                  */
+    int until_eof;         /* size unknown, ends with the source */
 
     /* bytes info */
-    size_t bytes_total;
-    off_t  bytes_offset;
+    size_t bytes_total;    /* bytes pending                    */
+    off_t  bytes_offset;   /* position of the next byte to write */
+    off_t  resident;       /* file data known to be cached up to */
 
     /* the outgoing channel, we do this for all streams */
     struct mk_channel *channel;
@@ -95,14 +145,147 @@ struct mk_stream {
     void (*cb_bytes_consumed) (struct mk_stream *, long);
     void (*cb_exception) (struct mk_stream *, int);
 
+    /*
+     * MK_STREAM_WAIT: called when 'fd' is readable, returns MK_CHANNEL_DONE
+     * once the data the stream waits for is queued behind it, BUSY to wait
+     * some more or ERROR.
+     */
+    int (*cb_ready) (struct mk_stream *);
+
+    /* Chunk framing when queued on a chunked channel */
+    short chunk_len;       /* length of the chunk size line    */
+    short chunk_head;      /* size line bytes still to write   */
+    short chunk_tail;      /* trailing CRLF bytes to write     */
+    short chunk_relay;     /* until_eof relay, chunked as read */
+    char  chunk[18];       /* hex size + CRLF                  */
+
     /* Link to the Channel parent */
     struct mk_list _head;
 };
 
+struct mk_channel {
+    int type;
+    int fd;
+    int status;
+    struct mk_list streams;
+
+    /* Set while the channel waits for file data to be read ahead */
+    struct mk_readahead_job *job;
+
+    /*
+     * Relay of a MK_STREAM_SOCKET stream: the pipe holding data spliced
+     * from the source and not yet sent, and the source descriptor the
+     * channel sleeps on while it has nothing to read (-1 if none).
+     */
+    struct mk_pipe *pipe;
+    int relay_wait;
+
+    /*
+     * Chunked transfer encoding: every stream queued while it's on is
+     * wrapped with its chunk size line and CRLF, chunk_end carries the
+     * last chunk once the body is over.
+     */
+    int chunked;
+    struct mk_stream chunk_end;
+
+    /* Encoding of the streams queued from now on, MK_STREAM_ENC_* */
+    int encoding;
+
+    /* Set while the chunked body is compressed, see mk_deflate.h */
+    struct mk_deflate_channel *deflate;
+
+    /*
+     * MSG_ZEROCOPY sends are numbered by the kernel in the order they're
+     * made, every one pins its shared buffer until its id is reported
+     * complete on the socket error queue.
+     */
+    int zerocopy;
+    uint32_t zerocopy_id;         /* id of the next zero copy send */
+    struct mk_list zerocopy_pins;
+};
+
 /* exported functions */
+struct mk_stream_buffer *mk_stream_buffer_new(char *data, size_t size,
+                                              void *priv,
+                                              void (*cb_release) (struct mk_stream_buffer *));
+void mk_stream_buffer_release(struct mk_stream_buffer *buffer);
+
+static inline void mk_stream_buffer_get(struct mk_stream_buffer *buffer)
+{
+    __sync_fetch_and_add(&buffer->refs, 1);
+}
+
+/* Wrap the data of a stream in a chunk, an empty chunk would end the body */
+static inline void mk_stream_chunk_compose(struct mk_stream *stream)
+{
+    int i;
+    int len = 0;
+    char hex[16];
+    size_t size = stream->bytes_total;
+
+    stream->chunk_len  = 0;
+    stream->chunk_head = 0;
+    stream->chunk_tail = 0;
+
+    if (size == 0) {
+        return;
+    }
+
+    while (size > 0) {
+        hex[len++] = "0123456789abcdef"[size & 0xf];
+        size >>= 4;
+    }
+    for (i = 0; i < len; i++) {
+        stream->chunk[i] = hex[len - i - 1];
+    }
+    stream->chunk[len++] = '\r';
+    stream->chunk[len++] = '\n';
+
+    stream->chunk_len  = len;
+    stream->chunk_head = len;
+    stream->chunk_tail = 2;
+}
+
+/*
+ * Compose the chunk framing of a stream queued on a chunked channel. The
+ * streams of a compressed body are not framed, what the deflater makes of
+ * them is.
+ */
+static inline void mk_stream_chunk_frame(struct mk_stream *stream,
+                                         struct mk_channel *channel)
+{
+    stream->encoding = channel->encoding;
+    stream->chunk_relay = MK_FALSE;
+
+    /* It carries no data, the encoding left by a previous body is not its */
+    if (stream->type == MK_STREAM_WAIT) {
+        stream->encoding = MK_STREAM_ENC_NONE;
+    }
+
+    if (channel->chunked == MK_FALSE ||
+        stream->encoding != MK_STREAM_ENC_NONE) {
+        stream->chunk_len  = 0;
+        stream->chunk_head = 0;
+        stream->chunk_tail = 0;
+        return;
+    }
+
+    /* Its chunks are composed as the source is read, see mk_channel_write() */
+    if (stream->until_eof == MK_TRUE) {
+        stream->chunk_relay = MK_TRUE;
+        stream->chunk_len  = 0;
+        stream->chunk_head = 0;
+        stream->chunk_tail = 0;
+        return;
+    }
+
+    mk_stream_chunk_compose(stream);
+}
+
 static inline void mk_channel_append_stream(struct mk_channel *channel,
                                             struct mk_stream *stream)
 {
+    mk_stream_chunk_frame(stream, channel);
     mk_list_add(&stream->_head, &channel->streams);
 }
 
@@ -117,13 +300,17 @@ static inline void mk_stream_set(struct mk_stream *stream, int type,
 {
     mk_ptr_t *ptr;
     struct mk_iov *iov;
+    struct mk_stream_buffer *shared;
 
     stream->type         = type;
     stream->channel      = channel;
     stream->bytes_offset = 0;
+    stream->resident     = 0;
     stream->buffer       = buffer;
     stream->data         = data;
     stream->preserve     = MK_FALSE;
+    stream->until_eof    = (type == MK_STREAM_SOCKET &&
+                            size == MK_STREAM_SIZE_EOF);
 
     if (type == MK_STREAM_IOV) {
         iov = buffer;
@@ -133,6 +320,13 @@ static inline void mk_stream_set(struct mk_stream *stream, int type,
         ptr = buffer;
         stream->bytes_total = ptr->len;
     }
+    else if (type == MK_STREAM_BUFFER) {
+        shared = buffer;
+        stream->bytes_total = shared->size;
+        if (shared->size > 0) {
+            mk_stream_buffer_get(shared);
+        }
+    }
     else {
         stream->bytes_total = size;
     }
@@ -141,7 +335,9 @@ static inline void mk_stream_set(struct mk_stream *stream, int type,
     stream->cb_finished       = cb_finished;
     stream->cb_bytes_consumed = cb_bytes_consumed;
     stream->cb_exception      = cb_exception;
+    stream->cb_ready          = NULL;
 
+    mk_stream_chunk_frame(stream, channel);
     mk_list_add(&stream->_head, &channel->streams);
 }
 
@@ -162,12 +358,21 @@ static inline void mk_stream_bytes_consumed(struct mk_stream *stream, long bytes
     else if (stream->type == MK_STREAM_IOV) {
         fmt = "[STREAM_IOV %p] bytes consumed %lu/%lu";
     }
+    else if (stream->type == MK_STREAM_PTR) {
+        fmt = "[STREAM_PTR %p] bytes consumed %lu/%lu";
+    }
     else if (stream->type == MK_STREAM_FILE) {
         fmt = "[STREAM_FILE %p] bytes consumed %lu/%lu";
     }
     else if (stream->type == MK_STREAM_SOCKET) {
         fmt = "[STREAM_SOCK %p] bytes consumed %lu/%lu";
     }
+    else if (stream->type == MK_STREAM_BUFFER) {
+        fmt = "[STREAM_BUF %p] bytes consumed %lu/%lu";
+    }
+    else if (stream->type == MK_STREAM_WAIT) {
+        fmt = "[STREAM_WAIT %p] bytes consumed %lu/%lu";
+    }
     else {
         fmt = "[STREAM_UNKW %p] bytes consumed %lu/%lu";
     }
@@ -203,6 +408,12 @@ static inline void mk_channel_debug(struct mk_channel *channel)
         case MK_STREAM_SOCKET:
             printf("%i) [%p] STREAM SOCKET: ", i, stream);
             break;
+        case MK_STREAM_BUFFER:
+            printf("%i) [%p] STREAM BUFFER: ", i, stream);
+            break;
+        case MK_STREAM_WAIT:
+            printf("%i) [%p] STREAM WAIT  : ", i, stream);
+            break;
         }
 #if defined(__APPLE__)
         printf("bytes=%lld/%lu\n", stream->bytes_offset, stream->bytes_total);
@@ -220,5 +431,16 @@ struct mk_stream *mk_stream_new(int type, struct mk_channel *channel,
                            void (*cb_exception) (struct mk_stream *, int));
 struct mk_channel *mk_channel_new(int type, int fd);
 int mk_channel_write(struct mk_channel *channel);
+int mk_channel_flush(struct mk_channel *channel);
+void mk_channel_clean(struct mk_channel *channel);
+void mk_channel_chunked_start(struct mk_channel *channel);
+void mk_channel_chunked_end(struct mk_channel *channel);
+void mk_channel_deflate_start(struct mk_channel *channel,
+                              struct mk_deflate_channel *deflate);
+void mk_channel_head_only(struct mk_channel *channel);
+int mk_channel_zerocopy_done(struct mk_channel *channel);
+void mk_channel_orphans_check();
+void mk_channel_worker_exit();
+int mk_channel_relay_resume(int fd);
 
 #endif
@@ -41,6 +41,10 @@
 
 #define MK_GMT_CACHES 10
 
+/* mk_utils_url_decode_path() errors */
+#define MK_UTILS_URL_INVALID   -1
+#define MK_UTILS_URL_TRAVERSAL -2
+
 struct mk_gmt_cache {
     time_t time;
     char text[32];
@@ -64,12 +68,12 @@ pthread_mutex_t mutex_trace;
 #endif
 
 int    mk_utils_utime2gmt(char **data, time_t date);
-time_t mk_utils_gmt2utime(char *date);
+time_t mk_utils_gmt2utime(const char *date, int len);
 
 int mk_buffer_cat(mk_ptr_t * p, char *buf1, int len1, char *buf2, int len2);
 
 int mk_utils_set_daemon(void);
-char *mk_utils_url_decode(mk_ptr_t req_uri);
+int mk_utils_url_decode_path(mk_ptr_t uri, char *out);
 
 #ifdef TRACE
 void mk_utils_trace(const char *component, int color, const char *function,
@@ -17,9 +17,14 @@
  *  limitations under the License.
  */
 
+#include <time.h>
+
 #include "mk_list.h"
+#include "mk_limits.h"
 #include "mk_config.h"
 #include "mk_http.h"
+#include "mk_pack.h"
+#include "mk_prewarm.h"
 
 #ifndef MK_VHOST_H
 #define MK_VHOST_H
@@ -40,6 +45,23 @@ struct host
     mk_ptr_t documentroot;
     mk_ptr_t header_redirect;
 
+    /* static assets served from a pack file (optional) */
+    struct mk_pack *pack;
+
+    /* files to warm up at startup (optional) */
+    struct mk_prewarm *prewarm;
+
+    /* socket buffers of the connections it serves (optional) */
+    struct mk_config_sock sock;
+
+    /* mass hosting: document root built from the Host name (optional) */
+    char *docroot_pattern;
+    int docroot_cache;
+
+    /* dynamic host: template it was made from and requests using it */
+    struct host *origin;
+    int refs;
+
     /* source configuration */
     struct mk_config *config;
 
@@ -58,38 +80,90 @@ struct host_alias
     struct mk_list _head;
 };
 
+/*
+ * Host names index
+ * ================
+ * Request hosts are matched through a hash table of the lowercase names
+ * (without port). A name such as '*.example.com' is a wildcard: it is
+ * kept in a trie of labels read from the right (com -> example) and
+ * matches any subdomain, the longest suffix wins over shorter ones. The
+ * index is built from the hosts list when it is loaded and published
+ * with a single pointer swap, lookups never see a partial index.
+ */
+struct mk_vhost_name {
+    unsigned int hash;
+    unsigned int len;
+    char *name;                   /* normalized host name */
+    struct host *host;
+    struct host_alias *alias;
+    struct mk_vhost_name *next;   /* bucket chain */
+};
+
+struct mk_vhost_label {
+    char *name;
+    unsigned int len;
 
-#define VHOST_FDT_HASHTABLE_SIZE   64
-#define VHOST_FDT_HASHTABLE_CHAINS  8
+    /* set when a '*.' name ends at this label */
+    struct host *host;
+    struct host_alias *alias;
 
-struct vhost_fdt_hash_chain {
-    int fd;
-    int readers;
-    unsigned int hash;
+    /* sub labels, sorted by length and name */
+    unsigned int count;
+    unsigned int size;
+    struct mk_vhost_label **children;
 };
 
-struct vhost_fdt_hash_table {
-    int av_slots;
-    struct vhost_fdt_hash_chain chain[VHOST_FDT_HASHTABLE_CHAINS];
+struct mk_vhost_index {
+    unsigned int size;            /* buckets, power of two */
+    unsigned int names;
+    unsigned int wildcards;
+    struct mk_vhost_name **table;
+    struct mk_vhost_label *labels;
+    struct host *dynamic;         /* VirtualDocumentRoot template */
 };
 
-struct vhost_fdt_host {
-    struct host *host;
-    struct vhost_fdt_hash_table hash_table[VHOST_FDT_HASHTABLE_SIZE];
-    struct mk_list _head;
+/*
+ * Dynamic virtual hosts
+ * =====================
+ * A host with a VirtualDocumentRoot pattern (e.g: /srv/sites/%2/%1/htdocs)
+ * serves the names that are not configured: the document root comes from
+ * the Host name and the host entry is only created on its first request.
+ * Every worker keeps the resolved names on a LRU cache, names without a
+ * document root are cached too for MK_VHOST_NEGATIVE_TTL seconds.
+ */
+#define MK_VHOST_CACHE_SIZE     1024   /* default entries per worker */
+#define MK_VHOST_CACHE_BUCKETS  256
+#define MK_VHOST_NEGATIVE_TTL   5
+
+struct mk_vhost_entry {
+    unsigned int hash;
+    unsigned int len;
+    char name[MK_HOSTNAME_LEN];
+
+    struct host *origin;          /* template that resolved it */
+    struct host *host;            /* NULL: no document root    */
+    time_t expire;                /* negative entries          */
+
+    struct mk_list _head;         /* hash table bucket */
+    struct mk_list _lru;          /* LRU, last is the most recent */
 };
 
-//pthread_key_t mk_vhost_fdt_key;
-pthread_mutex_t mk_vhost_fdt_mutex;
+struct mk_vhost_cache {
+    int entries;
+    struct mk_list table[MK_VHOST_CACHE_BUCKETS];
+    struct mk_list lru;
+};
 
 struct host *mk_vhost_read(char *path);
 int mk_vhost_get(mk_ptr_t host, struct host **vhost, struct host_alias **alias);
 void mk_vhost_set_single(char *path);
 void mk_vhost_init(char *path);
-int mk_vhost_fdt_worker_init();
-int mk_vhost_fdt_worker_exit();
-int mk_vhost_open(struct mk_http_request *sr);
-int mk_vhost_close(struct mk_http_request *sr);
 void mk_vhost_free_all();
 
+struct mk_vhost_index *mk_vhost_index_create(struct mk_list *hosts);
+struct mk_vhost_index *mk_vhost_index_swap(struct mk_vhost_index *index);
+void mk_vhost_index_free(struct mk_vhost_index *index);
+void mk_vhost_release(struct host *host);
+void mk_vhost_worker_exit();
+
 #endif
@@ -133,10 +133,12 @@ void mk_auth_worker_init()
     pthread_setspecific(_mkp_data, (void *) user);
 }
 
-/* Object handler */
-int mk_auth_stage30(struct mk_plugin *plugin,
-                    struct mk_http_session *cs,
-                    struct mk_http_request *sr)
+/*
+ * Validate the credentials for restricted locations, if the user is not
+ * authorized a 401 response is sent and it returns MK_PLUGIN_RET_END.
+ */
+static int mk_auth_check(struct mk_http_session *cs,
+                         struct mk_http_request *sr)
 {
     int val;
     short int is_restricted = MK_FALSE;
@@ -145,14 +147,19 @@ int mk_auth_stage30(struct mk_plugin *plugin,
     struct vhost *vh_entry = NULL;
     struct location *loc_entry;
     struct mk_http_header *header;
-    (void) plugin;
+    struct host *host = sr->host_conf;
 
     PLUGIN_TRACE("[FD %i] Handler received request");
 
+    /* A dynamic host is protected by the rules of its template */
+    if (host->origin) {
+        host = host->origin;
+    }
+
     /* Match auth_vhost with global vhost */
     mk_list_foreach(vh_head, &vhosts_list) {
         vh_entry = mk_list_entry(vh_head, struct vhost, _head);
-        if (vh_entry->host == sr->host_conf) {
+        if (vh_entry->host == host) {
             PLUGIN_TRACE("[FD %i] host matched %s",
                          cs->socket,
                          mk_api->config->server_signature);
@@ -215,7 +222,25 @@ int mk_auth_stage30(struct mk_plugin *plugin,
     return MK_PLUGIN_RET_END;
 }
 
+/* Request headers arrived, the body is still pending */
+int mk_auth_stage15(struct mk_http_session *cs,
+                    struct mk_http_request *sr)
+{
+    return mk_auth_check(cs, sr);
+}
+
+/* Object handler */
+int mk_auth_stage30(struct mk_plugin *plugin,
+                    struct mk_http_session *cs,
+                    struct mk_http_request *sr)
+{
+    (void) plugin;
+
+    return mk_auth_check(cs, sr);
+}
+
 struct mk_plugin_stage mk_plugin_stage_auth = {
+    .stage15      = &mk_auth_stage15,
     .stage30      = &mk_auth_stage30
 };
 
@@ -43,18 +43,19 @@ int swrite(const int fd, const void *buf, const size_t count)
 
 static void cgi_write_post(void *p)
 {
-    const struct post_t * const in = p;
+    struct post_t *in = p;
 
+    pthread_detach(pthread_self());
     swrite(in->fd, in->buf, in->len);
     close(in->fd);
+    mk_api->mem_free(in);
 }
 
 static int do_cgi(const char *const __restrict__ file,
                   const char *const __restrict__ url,
                   struct mk_http_request *const sr,
                   struct mk_http_session *const cs,
-                  struct cgi_match_t *match,
-                  struct mk_plugin *const plugin)
+                  struct cgi_match_t *match)
 {
     int ret;
     const int socket = cs->socket;
@@ -162,12 +163,22 @@ static int do_cgi(const char *const __restrict__ file,
     /* Must be NULL-terminated */
     env[envpos] = NULL;
 
-    /* pipes, from monkey's POV */
+    /*
+     * stdin is a pipe, stdout a socket so the channel can relay it. From
+     * monkey's POV. They're not inherited by the scripts of other requests,
+     * or the end of an output would wait for them to exit.
+     */
     int writepipe[2], readpipe[2];
-    if (pipe(writepipe) || pipe(readpipe)) {
+    if (pipe2(writepipe, O_CLOEXEC)) {
         mk_err("Failed to create pipe");
         return 403;
     }
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, readpipe)) {
+        mk_err("Failed to create socket pair");
+        close(writepipe[0]);
+        close(writepipe[1]);
+        return 403;
+    }
 
     pid_t pid = vfork();
     if (pid < 0) {
@@ -234,38 +245,30 @@ static int do_cgi(const char *const __restrict__ file,
 
     /* If we have POST data to write, spawn a thread to do that */
     if (sr->data.len) {
-        struct post_t p;
-        p.fd = writepipe[1];
-        p.buf = sr->data.data;
-        p.len = sr->data.len;
+        struct post_t *p = mk_api->mem_alloc(sizeof(struct post_t) +
+                                             sr->data.len);
+        if (!p) {
+            close(writepipe[1]);
+            close(readpipe[0]);
+            return 500;
+        }
+        p->fd = writepipe[1];
+        p->len = sr->data.len;
+        memcpy(p->buf, sr->data.data, sr->data.len);
 
-        mk_api->worker_spawn(cgi_write_post, &p);
+        mk_api->worker_spawn(cgi_write_post, p);
     }
     else {
         close(writepipe[1]);
     }
 
-
     struct cgi_request *r = cgi_req_create(readpipe[0], socket, sr, cs);
-    if (!r) return 403;
-
-    if (r->sr->protocol >= MK_HTTP_PROTOCOL_11 &&
-        (r->sr->headers.status < MK_REDIR_MULTIPLE ||
-         r->sr->headers.status > MK_REDIR_USE_PROXY))
-    {
-        r->sr->headers.transfer_encoding = MK_HEADER_TE_TYPE_CHUNKED;
-        r->chunked = 1;
+    if (!r) {
+        close(readpipe[0]);
+        return 500;
     }
-
-
-    cgi_req_add(r);
-    mk_api->event_add(readpipe[0], MK_EVENT_READ, plugin, -1);
-
-    /* XXX Fixme: this needs to be atomic */
     requests_by_socket[socket] = r;
-
-    /* We have nothing to write yet */
-    mk_api->event_socket_change_mode(socket, MK_EVENT_SLEEP, -1);
+    cgi_response_wait(r);
 
     return 200;
 }
@@ -414,7 +417,6 @@ int mk_cgi_plugin_init(struct plugin_api **api, char *confdir)
 
     mk_list_init(&cgi_global_matches);
     cgi_read_config(confdir);
-    pthread_key_create(&cgi_request_list, NULL);
 
     struct rlimit lim;
     getrlimit(RLIMIT_NOFILE, &lim);
@@ -443,6 +445,7 @@ int mk_cgi_stage30(struct mk_plugin *plugin,
     char url[PATHLEN];
     struct cgi_match_t *match_rule;
     struct mk_list *head_matches;
+    (void) plugin;
 
     if (sr->uri.len + 1 > PATHLEN)
         return MK_PLUGIN_RET_NOT_ME;
@@ -495,34 +498,38 @@ int mk_cgi_stage30(struct mk_plugin *plugin,
  run_cgi:
     /* start running the CGI */
     if (cgi_req_get(cs->socket)) {
-        printf("Error, someone tried to retry\n");
-        return MK_PLUGIN_RET_CONTINUE;
+        mk_err("CGI: A script is still running for this connection");
+        mk_api->header_set_http_status(sr, MK_SERVER_INTERNAL_ERROR);
+        return MK_PLUGIN_RET_CLOSE_CONX;
     }
 
-    int status = do_cgi(file, url, sr, cs, match_rule, plugin);
-
-    /* These are just for the other plugins, such as logger; bogus data */
-    mk_api->header_set_http_status(sr, status);
-
-    if (status != 200)
+    int status = do_cgi(file, url, sr, cs, match_rule);
+    if (status != 200) {
+        mk_api->header_set_http_status(sr, status);
         return MK_PLUGIN_RET_CLOSE_CONX;
+    }
 
-    sr->headers.cgi = SH_CGI;
-
-    return MK_PLUGIN_RET_CONTINUE;
+    /* The response is on its way, the status is the one of the script */
+    return MK_PLUGIN_RET_END;
 }
 
-void mk_cgi_worker_init()
+/* The connection is gone before the script output was relayed */
+int mk_cgi_stage50(int socket)
 {
-    struct mk_list *list = mk_api->mem_alloc_z(sizeof(struct mk_list));
+    struct cgi_request *r = cgi_req_get(socket);
 
-    mk_list_init(list);
-    pthread_setspecific(cgi_request_list, (void *) list);
+    if (r) {
+        requests_by_socket[socket] = NULL;
+        cgi_req_del(r);
+    }
+
+    return MK_PLUGIN_RET_NOT_ME;
 }
 
 
 struct mk_plugin_stage mk_plugin_stage_cgi = {
-    .stage30      = &mk_cgi_stage30
+    .stage30      = &mk_cgi_stage30,
+    .stage50      = &mk_cgi_stage50
 };
 
 struct mk_plugin mk_plugin_cgi = {
@@ -538,7 +545,7 @@ struct mk_plugin mk_plugin_cgi = {
 
     /* Init Levels */
     .master_init   = NULL,
-    .worker_init   = mk_cgi_worker_init,
+    .worker_init   = NULL,
 
     /* Type */
     .stage         = &mk_plugin_stage_cgi
@@ -30,17 +30,19 @@
 
 enum {
     PATHLEN = 1024,
-    SHORTLEN = 64
+    SHORTLEN = 64,
+    HEADERSLEN = 8192       /* response headers of a script */
 };
 
 regex_t match_regex;
 
 struct cgi_request **requests_by_socket;
 
+/* POST body written to the script, it's copied as the request may end first */
 struct post_t {
     int fd;
-    void *buf;
     unsigned long len;
+    char buf[];
 };
 
 struct cgi_match_t {
@@ -59,64 +61,44 @@ struct cgi_vhost_t {
 struct cgi_vhost_t *cgi_vhosts;
 struct mk_list cgi_global_matches;
 
-
+/*
+ * A running script: its headers are read first, as they arrive, and turned
+ * into the response headers. The body is relayed by the client channel from
+ * the script stdout (a socket) until it's closed or Content-Length is met.
+ */
 struct cgi_request {
-
-    char in_buf[PATHLEN];
-
-    struct mk_list _head;
+    int fd;                 /* stdout of the CGI app */
+    int socket;
 
     struct mk_http_request *sr;
     struct mk_http_session *cs;
 
+    /* The header block, and the first body bytes read along with it */
+    char in_buf[HEADERSLEN];
     unsigned int in_len;
+    unsigned int headers_len;
 
-    int fd;			/* From the CGI app */
-    int socket;
+    /* 'HTTP/1.1 ' + the Status header value */
+    char status[SHORTLEN];
 
-    unsigned char status_done;
-    unsigned char all_headers_done;
-    unsigned char chunked;
+    struct mk_stream wait;  /* holds the channel until the headers are in */
+    struct mk_stream head;  /* body bytes read with the headers */
+    struct mk_stream body;  /* rest of the body, relayed */
 };
 
-/* Global list per worker */
-pthread_key_t cgi_request_list;
-
 extern struct cgi_request **requests_by_socket;
 
-int swrite(const int fd, const void *buf, const size_t count);
-
 struct cgi_request *cgi_req_create(int fd, int socket,
                                    struct mk_http_request *sr,
                                    struct mk_http_session *cs);
-void cgi_req_add(struct cgi_request *r);
-int cgi_req_del(struct cgi_request *r);
+void cgi_req_del(struct cgi_request *r);
 
-// Get the CGI request by the client socket
-static inline struct cgi_request *cgi_req_get(int socket)
-{
-    struct cgi_request *r = requests_by_socket[socket];
-
-    return r;
-}
+void cgi_response_wait(struct cgi_request *r);
 
-// Get the CGI request by the CGI app's fd
-static inline struct cgi_request *cgi_req_get_by_fd(int fd)
+/* Get the CGI request by the client socket */
+static inline struct cgi_request *cgi_req_get(int socket)
 {
-    struct mk_list *list, *node;
-    struct cgi_request *r;
-
-    list = pthread_getspecific(cgi_request_list);
-    if (mk_list_is_empty(list) == 0)
-        return NULL;
-
-    mk_list_foreach(node, list) {
-        r = mk_list_entry(node, struct cgi_request, _head);
-        if (r->fd == fd)
-            return r;
-    }
-
-    return NULL;
+    return requests_by_socket[socket];
 }
 
 #endif
@@ -35,18 +35,11 @@ struct cgi_request *cgi_req_create(int fd, int socket,
     return newcgi;
 }
 
-void cgi_req_add(struct cgi_request *r)
+/* Release a request, its end of the script stdout is closed */
+void cgi_req_del(struct cgi_request *r)
 {
-    struct mk_list *list = pthread_getspecific(cgi_request_list);
-    mk_list_add(&r->_head, list);
-}
-
-int cgi_req_del(struct cgi_request *r)
-{
-    if (!r) return 1;
+    if (!r) return;
 
-    mk_list_del(&r->_head);
+    close(r->fd);
     mk_api->mem_free(r);
-
-    return 0;
 }
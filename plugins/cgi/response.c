@@ -0,0 +1,311 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright (C) 2012, Lauri Kasanen
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "cgi.h"
+
+/* Get the earliest break between headers and content.
+
+   The reason for this function is that some CGI apps
+   use LFLF and some use CRLFCRLF.
+
+   If that app then sends content that has the other break
+   in the beginning, monkey can accidentally send part of the
+   content as headers.
+*/
+static char *getearliestbreak(const char buf[], const unsigned bufsize,
+				unsigned char * const advance) {
+
+    char * const crend = memmem(buf, bufsize, MK_IOV_CRLFCRLF,
+				sizeof(MK_IOV_CRLFCRLF) - 1);
+    char * const lfend = memmem(buf, bufsize, MK_IOV_LFLF,
+				sizeof(MK_IOV_LFLF) - 1);
+
+    if (!crend && !lfend)
+        return NULL;
+
+    /* If only one found, return that one */
+    if (!crend) {
+        *advance = 2;
+        return lfend;
+    }
+    if (!lfend)
+        return crend;
+
+    /* Both found, return the earlier one - the latter one is part of content */
+    if (lfend < crend) {
+        *advance = 2;
+        return lfend;
+    }
+    return crend;
+}
+
+/* The response is over or the connection went away */
+static void cgi_cb_finished(struct mk_stream *stream)
+{
+    struct cgi_request *r = stream->data;
+
+    requests_by_socket[r->socket] = NULL;
+    cgi_req_del(r);
+}
+
+/*
+ * Read what the script has written so far, up to the end of its headers.
+ * Returns 0 once they're in, 1 while more is expected or -1 on error.
+ */
+static int cgi_read_headers(struct cgi_request *r)
+{
+    char *end;
+    ssize_t bytes;
+    unsigned char advance;
+
+    while (1) {
+        advance = 4;
+        end = getearliestbreak(r->in_buf, r->in_len, &advance);
+        if (end) {
+            r->headers_len = end + advance - r->in_buf;
+            return 0;
+        }
+
+        if (r->in_len == sizeof(r->in_buf)) {
+            mk_err("CGI: Response headers too large");
+            return -1;
+        }
+
+        bytes = read(r->fd, r->in_buf + r->in_len,
+                     sizeof(r->in_buf) - r->in_len);
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        else if (bytes < 0 && errno == EAGAIN) {
+            return 1;
+        }
+        else if (bytes <= 0) {
+            return -1;
+        }
+        r->in_len += bytes;
+    }
+}
+
+/*
+ * Turn the script headers into the response ones: Status sets the status
+ * line, Content-Length the body size, the rest is sent as is. Returns the
+ * body size, -1 if it's unknown or -2 on error.
+ */
+static long cgi_parse_headers(struct cgi_request *r)
+{
+    int len;
+    int rows = 0;
+    int status = 0;
+    int location = MK_FALSE;
+    char *p;
+    char *eol;
+    char *end;
+    long length = -1;
+    struct mk_http_request *sr = r->sr;
+
+    p = r->in_buf;
+    end = r->in_buf + r->headers_len;
+
+    while (p < end && (eol = memchr(p, '\n', end - p))) {
+        len = eol - p;
+        if (len > 0 && p[len - 1] == '\r') {
+            len--;
+        }
+
+        /* The blank line ending the headers */
+        if (len == 0) {
+            break;
+        }
+
+        if (len > 7 && strncasecmp(p, "Status:", 7) == 0) {
+            status = atoi(p + 7);
+            if (status < 100 || status > 999) {
+                return -2;
+            }
+
+            /* Keep the reason phrase of the script */
+            p += 7;
+            len -= 7;
+            while (len > 0 && *p == ' ') {
+                p++;
+                len--;
+            }
+            if (len > SHORTLEN - 12) {
+                len = SHORTLEN - 12;
+            }
+            r->sr->headers.custom_status.data = r->status;
+            r->sr->headers.custom_status.len =
+                snprintf(r->status, SHORTLEN, "HTTP/1.1 %.*s\r\n", len, p);
+        }
+        else if (len > 15 && strncasecmp(p, "Content-Length:", 15) == 0) {
+            length = strtol(p + 15, NULL, 10);
+            if (length < 0) {
+                return -2;
+            }
+        }
+        else {
+            if (len > 9 && strncasecmp(p, "Location:", 9) == 0) {
+                location = MK_TRUE;
+            }
+
+            /* The last row of the extra headers is the ending CRLF */
+            if (++rows >= MK_PLUGIN_HEADER_EXTRA_ROWS) {
+                mk_err("CGI: Too many response headers");
+                return -2;
+            }
+            mk_api->header_add(sr, p, len);
+        }
+
+        p = eol + 1;
+    }
+
+    /* A redirection without status is a 302 */
+    if (status == 0) {
+        status = (location == MK_TRUE) ? MK_REDIR_MOVED_T : MK_HTTP_OK;
+    }
+    mk_api->header_set_http_status(sr, status);
+
+    return length;
+}
+
+/*
+ * The script headers are in: send the response headers and queue its
+ * body, the bytes that came with the headers first and then the rest of
+ * its stdout, relayed by the client channel. Without a Content-Length the
+ * body is chunked, or ends when the script exits along with the connection
+ * when it can't be.
+ */
+static int cgi_response(struct cgi_request *r)
+{
+    int status;
+    long length;
+    size_t pending;
+    size_t relay;
+    struct mk_http_request *sr = r->sr;
+    struct mk_http_session *cs = r->cs;
+
+    length = cgi_parse_headers(r);
+    if (length == -2) {
+        return -1;
+    }
+
+    pending = r->in_len - r->headers_len;
+    if (length >= 0) {
+        if (pending > (size_t) length) {
+            pending = length;
+        }
+        relay = length - pending;
+    }
+    else {
+        relay = MK_STREAM_SIZE_EOF;
+
+        /* Redirections are not chunked by the server */
+        status = sr->headers.status;
+        if (sr->protocol == MK_HTTP_PROTOCOL_11 &&
+            (status < MK_REDIR_MULTIPLE || status > MK_REDIR_USE_PROXY)) {
+            sr->headers.transfer_encoding = MK_HEADER_TE_TYPE_CHUNKED;
+        }
+        else {
+            sr->keep_alive = MK_FALSE;
+            sr->close_now = MK_TRUE;
+        }
+    }
+
+    sr->headers.cgi = SH_CGI;
+    sr->headers.breakline = MK_HEADER_BREAKLINE;
+    sr->headers.content_length = length;
+    mk_ptr_reset(&sr->headers.content_type);
+    mk_api->header_prepare(cs, sr);
+
+    /*
+     * The last stream queued releases the request once it's sent, the
+     * response headers point to it until then.
+     */
+    if (pending > 0 || relay == 0) {
+        mk_api->stream_set(&r->head, MK_STREAM_RAW, &cs->channel,
+                           r->in_buf + r->headers_len, pending, r,
+                           relay > 0 ? NULL : cgi_cb_finished, NULL, NULL);
+    }
+    if (relay > 0) {
+        mk_api->stream_set(&r->body, MK_STREAM_SOCKET, &cs->channel,
+                           NULL, relay, r,
+                           cgi_cb_finished, NULL, NULL);
+        r->body.fd = r->fd;
+    }
+
+    mk_api->channel_chunked_end(&cs->channel);
+    return 0;
+}
+
+/*
+ * The script output can't make a response: a 500 goes out instead, and
+ * the connection is closed as its headers may be half read.
+ */
+static void cgi_response_error(struct cgi_request *r)
+{
+    struct mk_http_request *sr = r->sr;
+
+    if (sr->headers._extra_rows) {
+        mk_api->iov_free(sr->headers._extra_rows);
+        sr->headers._extra_rows = NULL;
+    }
+    mk_ptr_reset(&sr->headers.custom_status);
+
+    sr->keep_alive = MK_FALSE;
+    sr->close_now = MK_TRUE;
+    sr->headers.content_length = 0;
+    mk_api->header_set_http_status(sr, MK_SERVER_INTERNAL_ERROR);
+    mk_api->header_prepare(r->cs, sr);
+
+    r->wait.cb_finished = cgi_cb_finished;
+}
+
+/*
+ * The client channel sleeps on the script stdout until its headers are in,
+ * it's called back every time there's something new to read.
+ */
+static int cgi_cb_ready(struct mk_stream *stream)
+{
+    int ret;
+    struct cgi_request *r = stream->data;
+
+    ret = cgi_read_headers(r);
+    if (ret > 0) {
+        return MK_CHANNEL_BUSY;
+    }
+
+    if (ret < 0 || cgi_response(r) != 0) {
+        cgi_response_error(r);
+    }
+
+    return MK_CHANNEL_DONE;
+}
+
+/* Wait for the script headers, the response is queued once they're in */
+void cgi_response_wait(struct cgi_request *r)
+{
+    struct mk_http_session *cs = r->cs;
+
+    fcntl(r->fd, F_SETFL, fcntl(r->fd, F_GETFL, 0) | O_NONBLOCK);
+
+    mk_api->stream_set(&r->wait, MK_STREAM_WAIT, &cs->channel,
+                       NULL, 0, r, NULL, NULL, NULL);
+    r->wait.fd = r->fd;
+    r->wait.cb_ready = cgi_cb_ready;
+}
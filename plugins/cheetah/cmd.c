@@ -195,6 +195,17 @@ void mk_cheetah_cmd_plugins()
         }
     }
 
+    if (mk_list_is_empty(&mk_api->config->stage15_handler)) {
+        CHEETAH_WRITE("%s[%sSTAGE_15%s]%s",
+                      ANSI_BOLD ANSI_YELLOW, ANSI_WHITE, ANSI_RESET);
+        mk_list_foreach(head, &mk_api->config->stage15_handler) {
+            s = mk_list_entry(head, struct mk_plugin_stage, _head);
+            p = s->plugin;
+            CHEETAH_WRITE("\n  [%s] %s v%s on \"%s\"",
+                          p->shortname, p->name, p->version, p->path);
+        }
+    }
+
     if (mk_list_is_empty(&mk_api->config->stage20_handler)) {
         CHEETAH_WRITE("%s[%sSTAGE_20%s]%s",
                       ANSI_BOLD ANSI_YELLOW, ANSI_WHITE, ANSI_RESET);
@@ -248,6 +259,8 @@ void mk_cheetah_cmd_vhosts()
     struct host_alias *entry_alias;
     struct mk_config_section *section;
     struct mk_config_entry *entry;
+    struct mk_prewarm *prewarm;
+    struct mk_vhost_index *index;
     struct mk_list *hosts = &mk_api->config->hosts;
     struct mk_list *aliases;
     struct mk_list *head_host;
@@ -274,6 +287,17 @@ void mk_cheetah_cmd_vhosts()
         CHEETAH_WRITE("      - Document root : %s\n", entry_host->documentroot.data);
         CHEETAH_WRITE("      - Config file   : %s\n", entry_host->file);
 
+        if (entry_host->prewarm) {
+            prewarm = entry_host->prewarm;
+            CHEETAH_WRITE("      - Prewarm       : %s, %lu files (%llu KB), "
+                          "%lu failed, %s\n",
+                          prewarm->source, prewarm->files,
+                          prewarm->bytes / 1024, prewarm->failed,
+                          prewarm->state == MK_PREWARM_DONE ? "done" :
+                          prewarm->state == MK_PREWARM_RUNNING ? "running" :
+                          "pending");
+        }
+
         if (!entry_host->config) {
             continue;
         }
@@ -290,14 +314,24 @@ void mk_cheetah_cmd_vhosts()
         }
     }
 
+    index = mk_api->config->vhost_index;
+    if (index) {
+        CHEETAH_WRITE("\nNames index: %u names, %u wildcards, %u buckets\n",
+                      index->names, index->wildcards, index->size);
+    }
+
     CHEETAH_WRITE("\n");
 }
 
 void mk_cheetah_cmd_workers()
 {
     int i;
+    unsigned long long lookups;
     unsigned long long active_connections;
     struct sched_list_node *node;
+    struct mk_stat_cache_stats *st;
+    struct mk_deflate_stats *dst;
+    struct mk_readahead_stats *rst;
 
     node = mk_api->sched_list;
     for (i=0; i < mk_api->config->workers; i++) {
@@ -306,6 +340,92 @@ void mk_cheetah_cmd_workers()
         CHEETAH_WRITE("* Worker %i\n", node[i].idx);
         CHEETAH_WRITE("      - Task ID           : %i\n", node[i].pid);
         CHEETAH_WRITE("      - Active Connections: %llu\n", active_connections);
+        CHEETAH_WRITE("      - FDT               : %llu hits, %llu misses, "
+                      "%llu evicted, %llu invalidated\n",
+                      node[i].fdt_stats.hits, node[i].fdt_stats.misses,
+                      node[i].fdt_stats.evictions,
+                      node[i].fdt_stats.invalidations);
+        CHEETAH_WRITE("      - Mapped Files      : %llu hits, %llu misses, "
+                      "%llu evicted, %llu invalidated\n",
+                      node[i].mmap_stats.hits, node[i].mmap_stats.misses,
+                      node[i].mmap_stats.evictions,
+                      node[i].mmap_stats.invalidations);
+        CHEETAH_WRITE("      - Writes            : %llu writes, %llu KB, "
+                      "%llu cut by budget\n",
+                      node[i].channel_stats.writes,
+                      node[i].channel_stats.bytes / 1024,
+                      node[i].channel_stats.budget_hits);
+        CHEETAH_WRITE("      - Pipe Relay        : %llu KB spliced, %llu pipes "
+                      "created, %llu reused\n",
+                      node[i].pipe_stats.bytes / 1024,
+                      node[i].pipe_stats.created,
+                      node[i].pipe_stats.reused);
+        if (mk_api->config->zerocopy > 0) {
+            CHEETAH_WRITE("      - Zero Copy         : %llu KB, %llu connections "
+                          "copied by the kernel\n",
+                          node[i].channel_stats.zerocopy / 1024,
+                          node[i].channel_stats.zerocopy_copied);
+        }
+        CHEETAH_WRITE("      - Socket Tuning     : %llu vhost overrides, "
+                      "%llu watermark raises\n",
+                      node[i].sock_stats.tuned, node[i].sock_stats.raised);
+        if (mk_api->config->vhost_index &&
+            mk_api->config->vhost_index->dynamic) {
+            CHEETAH_WRITE("      - Dynamic VHosts    : %llu hits, %llu misses, "
+                          "%llu without root, %llu evicted\n",
+                          node[i].vhost_stats.hits, node[i].vhost_stats.misses,
+                          node[i].vhost_stats.negative,
+                          node[i].vhost_stats.evictions);
+        }
+
+        if (node[i].deflate_cache) {
+            dst = &node[i].deflate_cache->stats;
+            CHEETAH_WRITE("      - Compression       : %llu hits, %llu compressed, "
+                          "%llu streamed, %llu skipped, %llu evicted\n",
+                          dst->hits, dst->misses, dst->streamed, dst->skipped,
+                          dst->evictions);
+            CHEETAH_WRITE("                            %llu KB in, %llu KB out "
+                          "(%.2f%% ratio), %llu KB in use\n",
+                          dst->bytes_in / 1024, dst->bytes_out / 1024,
+                          dst->bytes_in ? (dst->bytes_out * 100.0) / dst->bytes_in : 0.0,
+                          dst->bytes / 1024);
+            CHEETAH_WRITE("                            %.2f ms CPU, %.2f MB/s per core\n",
+                          dst->usec / 1000.0,
+                          dst->usec ? dst->bytes_in / (double) dst->usec : 0.0);
+        }
+
+        if (node[i].readahead) {
+            rst = &node[i].readahead->stats;
+            CHEETAH_WRITE("      - Readahead         : %llu probes, %llu parked, "
+                          "%llu resumed, %llu cancelled\n",
+                          rst->probes, rst->parked, rst->resumed, rst->cancelled);
+            CHEETAH_WRITE("                            %llu KB read, %.2f ms "
+                          "average wait\n",
+                          rst->bytes / 1024,
+                          rst->resumed ? (rst->usec / 1000.0) / rst->resumed : 0.0);
+        }
+
+        if (!node[i].stat_cache) {
+            continue;
+        }
+
+        st = &node[i].stat_cache->stats;
+        lookups = st->hits + st->misses;
+        CHEETAH_WRITE("      - Stat Cache        : %llu hits, %llu misses (%.2f%% hit ratio)\n",
+                      st->hits, st->misses,
+                      lookups ? (st->hits * 100.0) / lookups : 0.0);
+        CHEETAH_WRITE("                            %llu expired, %llu invalidated, "
+                      "%llu evicted\n",
+                      st->expired, st->invalidations, st->evictions);
+        CHEETAH_WRITE("                            %llu syscalls saved\n",
+                      st->syscalls_saved);
+
+        lookups = st->mem_hits + st->mem_loads;
+        CHEETAH_WRITE("      - Small Files       : %llu hits, %llu loads (%.2f%% hit ratio)\n",
+                      st->mem_hits, st->mem_loads,
+                      lookups ? (st->mem_hits * 100.0) / lookups : 0.0);
+        CHEETAH_WRITE("                            %llu evicted, %llu KB in use\n",
+                      st->mem_evictions, st->mem_bytes / 1024);
     }
 
     CHEETAH_WRITE("\n");
@@ -350,6 +470,13 @@ static void mk_cheetah_listen_config()
         CHEETAH_WRITE("\nListen on          : %s:%s",
                       listener->address,
                       listener->port);
+        if (listener->sock.send_lowat || listener->sock.send_buffer ||
+            listener->sock.recv_buffer) {
+            CHEETAH_WRITE(" (SendLowat=%li SendBuffer=%li RecvBuffer=%li KB)",
+                          listener->sock.send_lowat / 1024,
+                          listener->sock.send_buffer / 1024,
+                          listener->sock.recv_buffer / 1024);
+        }
     }
 }
 
@@ -417,6 +544,15 @@ void mk_cheetah_cmd_config()
     CHEETAH_WRITE("\nKeepAliveTimeout    : %i seconds", mk_api->config->keep_alive_timeout);
     CHEETAH_WRITE("\nMaxRequestSize      : %i KB",
            mk_api->config->max_request_size/1024);
+    CHEETAH_WRITE("\nSendLowat           : %li KB (max %li KB)",
+                  mk_api->config->sock.send_lowat / 1024,
+                  mk_api->config->send_lowat_max / 1024);
+    CHEETAH_WRITE("\nSendBuffer          : %li KB",
+                  mk_api->config->sock.send_buffer / 1024);
+    CHEETAH_WRITE("\nRecvBuffer          : %li KB",
+                  mk_api->config->sock.recv_buffer / 1024);
+    CHEETAH_WRITE("\nZeroCopy            : %li KB",
+                  mk_api->config->zerocopy / 1024);
     CHEETAH_WRITE("\nSymLink             : ");
     if (mk_api->config->symlink == MK_TRUE) {
         CHEETAH_WRITE("On");
@@ -664,6 +664,9 @@ void mk_dirhtml_cb_body_rows(struct mk_stream *stream)
                            mk_dirhtml_cb_complete, /* on_finish         */
                            NULL,                   /* on_bytes_consumed */
                            mk_dirhtml_cb_error);   /* on_error          */
+
+        /* End of the body, a no-op if the response is not chunked */
+        mk_api->channel_chunked_end(channel);
         return;
     }
 
@@ -713,6 +716,7 @@ int mk_dirhtml_init(struct mk_http_session *cs, struct mk_http_request *sr)
     request->state   = MK_DIRHTML_STATE_HTTP_HEADER;
     request->dir     = dir;
     request->toc_idx = 0;
+    request->toc_len = 0;
     request->cs      = cs;
     request->sr      = sr;
 
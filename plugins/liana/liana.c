@@ -77,6 +77,38 @@ int mk_liana_writev(int socket_fd, struct mk_iov *mk_io)
     return bytes_sent;
 }
 
+#if defined(MSG_MORE)
+int mk_liana_write_more(int socket_fd, const void *buf, size_t count)
+{
+    return send(socket_fd, buf, count, MSG_MORE);
+}
+
+int mk_liana_writev_more(int socket_fd, struct mk_iov *mk_io)
+{
+    return mk_api->iov_send_more(socket_fd, mk_io);
+}
+#endif
+
+#if defined(MSG_ZEROCOPY)
+int mk_liana_write_zerocopy(int socket_fd, const void *buf, size_t count)
+{
+    return send(socket_fd, buf, count, MSG_ZEROCOPY);
+}
+#endif
+
+#if defined (__linux__)
+int mk_liana_write_pipe(int socket_fd, int pipe_fd, size_t count, int more)
+{
+    unsigned int flags = SPLICE_F_MOVE | SPLICE_F_NONBLOCK;
+
+    if (more) {
+        flags |= SPLICE_F_MORE;
+    }
+
+    return splice(pipe_fd, NULL, socket_fd, NULL, count, flags);
+}
+#endif
+
 int mk_liana_close(int socket_fd)
 {
     close(socket_fd);
@@ -277,7 +309,17 @@ struct mk_plugin_network mk_plugin_network_liana = {
     .create_socket = mk_liana_create_socket,
     .bind          = mk_liana_bind,
     .server        = mk_liana_server,
-    .buffer_size   = mk_liana_buffer_size
+    .buffer_size   = mk_liana_buffer_size,
+#if defined(MSG_MORE)
+    .write_more    = mk_liana_write_more,
+    .writev_more   = mk_liana_writev_more,
+#endif
+#if defined(MSG_ZEROCOPY)
+    .write_zerocopy = mk_liana_write_zerocopy,
+#endif
+#if defined (__linux__)
+    .write_pipe    = mk_liana_write_pipe
+#endif
 };
 
 struct mk_plugin mk_plugin_liana = {
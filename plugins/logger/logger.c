@@ -499,8 +499,13 @@ int mk_logger_stage40(struct mk_http_session *cs, struct mk_http_request *sr)
     /* Set response status */
     http_status = sr->headers.status;
 
-    /* Look for target log file */
-    target = mk_logger_match_by_host(sr->host_conf);
+    /* Look for target log file, a dynamic host logs as its template */
+    if (sr->host_conf->origin) {
+        target = mk_logger_match_by_host(sr->host_conf->origin);
+    }
+    else {
+        target = mk_logger_match_by_host(sr->host_conf);
+    }
     if (!target) {
         PLUGIN_TRACE("No target found");
         return 0;
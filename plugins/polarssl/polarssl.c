@@ -723,6 +723,33 @@ int mk_polarssl_writev(int fd, struct mk_iov *mk_io)
     return handle_return(ret);
 }
 
+/* Records of a mapped file being encrypted, see polar_write_mapped() */
+struct polar_mmap_write {
+    ssl_context *ssl;
+    ssize_t sent;
+    int ret;
+};
+
+/*
+ * Encrypt straight from the mapping of the file. It runs under the SIGBUS
+ * recovery point of the mmap cache: if the file is truncated meanwhile,
+ * ssl_write() is left half way and the connection must be dropped.
+ */
+static void polar_write_mapped(void *data, const char *buf, size_t len)
+{
+    struct polar_mmap_write *w = data;
+
+    w->ret = 0;
+    while ((size_t) w->sent < len) {
+        w->ret = ssl_write(w->ssl, (const unsigned char *) buf + w->sent,
+                           len - w->sent);
+        if (w->ret <= 0) {
+            return;
+        }
+        w->sent += w->ret;
+    }
+}
+
 int mk_polarssl_send_file(int fd, int file_fd, off_t *file_offset,
         size_t file_count)
 {
@@ -730,11 +757,37 @@ int mk_polarssl_send_file(int fd, int file_fd, off_t *file_offset,
     unsigned char *buf;
     ssize_t used, remain = file_count, sent = 0;
     int ret;
+    struct mk_mmap_entry *map;
+    struct polar_mmap_write w;
 
     if (!ssl) {
         ssl = context_new(fd);
     }
 
+    map = mk_api->file_mmap_get(file_fd);
+    if (map) {
+        if (remain <= 0 || *file_offset + remain > map->size) {
+            remain = map->size - *file_offset;
+        }
+
+        w.ssl  = ssl;
+        w.sent = 0;
+        ret = mk_api->file_mmap_read(map, *file_offset, remain,
+                                     polar_write_mapped, &w);
+        mk_api->file_mmap_release(map);
+
+        if (ret == -1) {
+            mk_err("[polarssl] File truncated while it was sent");
+            return -1;
+        }
+
+        *file_offset += w.sent;
+        if (w.sent > 0) {
+            return w.sent;
+        }
+        return handle_return(w.ret);
+    }
+
     buf = mk_api->mem_alloc(SENDFILE_BUF_SIZE);
     if (buf == NULL) {
         return -1;
@@ -29,6 +29,8 @@
 #include <monkey/mk_plugin.h>
 #include <monkey/mk_macros.h>
 #include <monkey/mk_vhost.h>
+#include <monkey/mk_fdt.h>
+#include <monkey/mk_mmap.h>
 #include <monkey/mk_mimetype.h>
 
 #include <dirent.h>
@@ -48,6 +50,7 @@ struct mk_server_config *mk_config_init()
 
     config = mk_mem_malloc_z(sizeof(struct mk_server_config));
     mk_list_init(&config->stage10_handler);
+    mk_list_init(&config->stage15_handler);
     mk_list_init(&config->stage20_handler);
     mk_list_init(&config->stage30_handler);
     mk_list_init(&config->stage40_handler);
@@ -330,6 +333,8 @@ void mk_config_listeners_free()
 
 void mk_config_free_all()
 {
+    mk_fdt_exit();
+    mk_mmap_exit();
     mk_vhost_free_all();
     mk_mimetype_free_all();
 
@@ -344,6 +349,10 @@ void mk_config_free_all()
         mk_string_split_free(mk_config->index_files);
     }
 
+    if (mk_config->compression_types) {
+        mk_string_split_free(mk_config->compression_types);
+    }
+
     if (mk_config->user) mk_mem_free(mk_config->user);
     if (mk_config->transport_layer) mk_mem_free(mk_config->transport_layer);
 
@@ -457,14 +466,57 @@ int mk_config_listen_check_busy()
     return MK_FALSE;
 }
 
+/* Listen options: 'Key=Value' pairs following the address, sizes in KB */
+static void mk_config_listen_options(struct mk_config_listener *listen,
+                                     char *options)
+{
+    long val;
+    char *key;
+    char *sep;
+    char *save = NULL;
+
+    for (key = strtok_r(options, " \t", &save); key;
+         key = strtok_r(NULL, " \t", &save)) {
+        sep = strchr(key, '=');
+        if (!sep) {
+            mk_warn("[config] Listen %s:%s, invalid option '%s'",
+                    listen->address, listen->port, key);
+            continue;
+        }
+
+        *sep = '\0';
+        val = strtol(sep + 1, NULL, 10) * 1024;
+        if (val < 0) {
+            val = 0;
+        }
+
+        if (strcasecmp(key, "SendLowat") == 0) {
+            listen->sock.send_lowat = val;
+        }
+        else if (strcasecmp(key, "SendBuffer") == 0) {
+            listen->sock.send_buffer = val;
+        }
+        else if (strcasecmp(key, "RecvBuffer") == 0) {
+            listen->sock.recv_buffer = val;
+        }
+        else {
+            mk_warn("[config] Listen %s:%s, unknown option '%s'",
+                    listen->address, listen->port, key);
+        }
+    }
+}
+
 static int mk_config_listen_read(struct mk_config_section *section)
 {
     long port_num;
+    size_t len;
     char *address = NULL;
     char *port = NULL;
+    char *options;
     char *divider;
     struct mk_list *cur;
     struct mk_config_entry *entry;
+    struct mk_config_listener *listen;
 
     mk_list_foreach(cur, &section->entries) {
         entry = mk_list_entry(cur, struct mk_config_entry, _head);
@@ -472,6 +524,14 @@ static int mk_config_listen_read(struct mk_config_section *section)
             continue;
         }
 
+        /* Split the address from the options */
+        options = NULL;
+        len = strcspn(entry->val, " \t");
+        if (entry->val[len] != '\0') {
+            entry->val[len] = '\0';
+            options = entry->val + len + 1;
+        }
+
         if (entry->val[0] == '[') {
             /* IPv6 address */
             divider = strchr(entry->val, ']');
@@ -512,7 +572,10 @@ static int mk_config_listen_read(struct mk_config_section *section)
         }
 
         /* register the new listener */
-        mk_config_listener_add(address, port);
+        listen = mk_config_listener_add(address, port);
+        if (listen && options) {
+            mk_config_listen_options(listen, options);
+        }
 
 error:
         if (address) mk_mem_free(address);
@@ -689,6 +752,176 @@ static void mk_config_read_files(char *path_conf, char *file_conf)
                                                     "FDT",
                                                     MK_CONFIG_VAL_BOOL);
 
+    mk_config->fdt_limit = (size_t) mk_config_section_getval(section,
+                                                          "FDTLimit",
+                                                          MK_CONFIG_VAL_NUM);
+
+    /* Mapped files cache, size in KB */
+    mk_config->mmap_cache = (size_t) mk_config_section_getval(section,
+                                                           "MmapCache",
+                                                           MK_CONFIG_VAL_NUM);
+    if (mk_config->mmap_cache < 0) {
+        mk_config->mmap_cache = 0;
+    }
+    mk_config->mmap_cache *= 1024;
+
+    /* Stat cache */
+    mk_config->stat_cache = (size_t) mk_config_section_getval(section,
+                                                           "StatCache",
+                                                           MK_CONFIG_VAL_NUM);
+    if (mk_config->stat_cache < 0) {
+        mk_config->stat_cache = 0;
+    }
+
+    mk_config->stat_cache_ttl = (size_t) mk_config_section_getval(section,
+                                                               "StatCacheTTL",
+                                                               MK_CONFIG_VAL_NUM);
+    if (mk_config->stat_cache_ttl <= 0) {
+        mk_config->stat_cache_ttl = MK_DEFAULT_STAT_CACHE_TTL;
+    }
+
+    /* Small files kept in memory by the stat cache (KB) */
+    mk_config->small_file_size = (size_t) mk_config_section_getval(section,
+                                                                "SmallFileSize",
+                                                                MK_CONFIG_VAL_NUM);
+    mk_config->small_file_memory = (size_t) mk_config_section_getval(section,
+                                                                  "SmallFileMemory",
+                                                                  MK_CONFIG_VAL_NUM);
+    if (mk_config->small_file_size <= 0 || mk_config->small_file_memory <= 0) {
+        mk_config->small_file_size = 0;
+        mk_config->small_file_memory = 0;
+    }
+    else {
+        mk_config->small_file_size *= 1024;
+        mk_config->small_file_memory *= 1024;
+    }
+
+    /* Precompressed siblings of static files */
+    mk_config->precompressed = (size_t) mk_config_section_getval(section,
+                                                              "Precompressed",
+                                                              MK_CONFIG_VAL_BOOL);
+    if (mk_config->precompressed == MK_ERROR) {
+        mk_config_print_error_msg("Precompressed", tmp);
+    }
+
+    /* On-the-fly compression */
+    mk_config->compression = (size_t) mk_config_section_getval(section,
+                                                            "Compression",
+                                                            MK_CONFIG_VAL_BOOL);
+    if (mk_config->compression == MK_ERROR) {
+        mk_config_print_error_msg("Compression", tmp);
+    }
+
+    mk_config->compression_level = (size_t) mk_config_section_getval(section,
+                                                                  "CompressionLevel",
+                                                                  MK_CONFIG_VAL_NUM);
+    if (mk_config->compression_level < 1 || mk_config->compression_level > 9) {
+        mk_config->compression_level = MK_DEFAULT_COMPRESSION_LEVEL;
+    }
+
+    /* Sizes in KB */
+    mk_config->compression_min_size = (size_t) mk_config_section_getval(section,
+                                                                     "CompressionMinSize",
+                                                                     MK_CONFIG_VAL_NUM);
+    if (mk_config->compression_min_size < 0) {
+        mk_config->compression_min_size = 0;
+    }
+    mk_config->compression_min_size *= 1024;
+
+    mk_config->compression_max_size = (size_t) mk_config_section_getval(section,
+                                                                     "CompressionMaxSize",
+                                                                     MK_CONFIG_VAL_NUM);
+    if (mk_config->compression_max_size <= 0) {
+        mk_config->compression_max_size = MK_DEFAULT_COMPRESSION_MAX_SIZE;
+    }
+    mk_config->compression_max_size *= 1024;
+
+    mk_config->compression_cache = (size_t) mk_config_section_getval(section,
+                                                                  "CompressionCache",
+                                                                  MK_CONFIG_VAL_NUM);
+    if (mk_config->compression_cache < 0) {
+        mk_config->compression_cache = 0;
+    }
+    mk_config->compression_cache *= 1024;
+
+    mk_config->compression_budget = (size_t) mk_config_section_getval(section,
+                                                                   "CompressionBudget",
+                                                                   MK_CONFIG_VAL_NUM);
+    if (mk_config->compression_budget < 0) {
+        mk_config->compression_budget = 0;
+    }
+    mk_config->compression_budget *= 1024;
+
+    mk_config->compression_types = mk_config_section_getval(section,
+                                                            "CompressionTypes",
+                                                            MK_CONFIG_VAL_LIST);
+
+    /* Readahead of cold files */
+    mk_config->readahead_threads = (size_t) mk_config_section_getval(section,
+                                                                  "ReadaheadThreads",
+                                                                  MK_CONFIG_VAL_NUM);
+    if (mk_config->readahead_threads < 0) {
+        mk_config->readahead_threads = 0;
+    }
+
+    mk_config->readahead_window = (size_t) mk_config_section_getval(section,
+                                                                 "ReadaheadWindow",
+                                                                 MK_CONFIG_VAL_NUM);
+    if (mk_config->readahead_window <= 0) {
+        mk_config->readahead_window = MK_DEFAULT_READAHEAD_WINDOW;
+    }
+    mk_config->readahead_window *= 1024;
+
+    /* Prewarm */
+    mk_config->prewarm_budget = (size_t) mk_config_section_getval(section,
+                                                               "PrewarmBudget",
+                                                               MK_CONFIG_VAL_NUM);
+    if (mk_config->prewarm_budget < 0) {
+        mk_config->prewarm_budget = MK_DEFAULT_PREWARM_BUDGET;
+    }
+    mk_config->prewarm_budget *= 1024;
+
+    mk_config->prewarm_wait = (size_t) mk_config_section_getval(section,
+                                                             "PrewarmWait",
+                                                             MK_CONFIG_VAL_BOOL);
+    if (mk_config->prewarm_wait == MK_ERROR) {
+        mk_config_print_error_msg("PrewarmWait", tmp);
+    }
+
+    /* Write budget */
+    mk_config->write_budget = (size_t) mk_config_section_getval(section,
+                                                             "WriteBudget",
+                                                             MK_CONFIG_VAL_NUM);
+    if (mk_config->write_budget < 0) {
+        mk_config->write_budget = MK_DEFAULT_WRITE_BUDGET;
+    }
+    mk_config->write_budget *= 1024;
+
+    /* Socket buffers and send watermark */
+    mk_config_sock_read(section, &mk_config->sock);
+    mk_config->send_lowat_max = (size_t) mk_config_section_getval(section,
+                                                               "SendLowatMax",
+                                                               MK_CONFIG_VAL_NUM);
+    if (mk_config->send_lowat_max < 0) {
+        mk_config->send_lowat_max = 0;
+    }
+    mk_config->send_lowat_max *= 1024;
+
+    /* Zero copy sends */
+    mk_config->zerocopy = (size_t) mk_config_section_getval(section,
+                                                         "ZeroCopy",
+                                                         MK_CONFIG_VAL_NUM);
+    if (mk_config->zerocopy < 0) {
+        mk_config->zerocopy = 0;
+    }
+    mk_config->zerocopy *= 1024;
+
+    if (mk_config->zerocopy > 0 &&
+        !(mk_config->kernel_features & MK_KERNEL_MSG_ZEROCOPY)) {
+        mk_warn("[config] ZeroCopy requires Linux >= 4.14, disabled");
+        mk_config->zerocopy = 0;
+    }
+
     /* FIXME: Overcapacity not ready */
     mk_config->fd_limit = (size_t) mk_config_section_getval(section,
                                                            "FDLimit",
@@ -704,6 +937,9 @@ static void mk_config_read_files(char *path_conf, char *file_conf)
         mk_vhost_set_single(mk_config->one_shot);
     }
 
+    /* Index the host names matched by the requests */
+    mk_vhost_index_swap(mk_vhost_index_create(&mk_config->hosts));
+
     /* Server Signature */
     if (mk_config->hideversion == MK_FALSE) {
         snprintf(mk_config->server_signature,
@@ -748,6 +984,34 @@ void mk_config_start_configure(void)
     }
 }
 
+/* Read the socket tuning keys of a section, sizes are given in KB */
+void mk_config_sock_read(struct mk_config_section *section,
+                         struct mk_config_sock *sock)
+{
+    sock->send_lowat = (size_t) mk_config_section_getval(section,
+                                                         "SendLowat",
+                                                         MK_CONFIG_VAL_NUM);
+    sock->send_buffer = (size_t) mk_config_section_getval(section,
+                                                          "SendBuffer",
+                                                          MK_CONFIG_VAL_NUM);
+    sock->recv_buffer = (size_t) mk_config_section_getval(section,
+                                                          "RecvBuffer",
+                                                          MK_CONFIG_VAL_NUM);
+    if (sock->send_lowat < 0) {
+        sock->send_lowat = 0;
+    }
+    if (sock->send_buffer < 0) {
+        sock->send_buffer = 0;
+    }
+    if (sock->recv_buffer < 0) {
+        sock->recv_buffer = 0;
+    }
+
+    sock->send_lowat  *= 1024;
+    sock->send_buffer *= 1024;
+    sock->recv_buffer *= 1024;
+}
+
 /* Register a new listener into the main configuration */
 struct mk_config_listener *mk_config_listener_add(char *address, char *port)
 {
@@ -776,6 +1040,11 @@ struct mk_config_listener *mk_config_listener_add(char *address, char *port)
         listen->port = mk_string_dup(port);
     }
 
+    /* Use the server wide socket tuning */
+    listen->sock.send_lowat  = 0;
+    listen->sock.send_buffer = 0;
+    listen->sock.recv_buffer = 0;
+
     /* Before to add a new listener, lets make sure it's not a duplicated */
     mk_list_foreach(head, &mk_config->listeners) {
         check = mk_list_entry(head, struct mk_config_listener, _head);
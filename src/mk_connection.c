@@ -25,9 +25,7 @@
 int mk_conn_read(int socket)
 {
     int ret;
-    int status;
     struct mk_http_session *cs;
-    struct mk_http_request *sr;
     struct sched_list_node *sched;
 
     MK_TRACE("[FD %i] Connection Handler / read", socket);
@@ -73,34 +71,9 @@ int mk_conn_read(int socket)
     /* Invoke the read handler, on this case we only support HTTP (for now :) */
     ret = mk_http_handler_read(socket, cs);
     if (ret > 0) {
-        if (mk_list_is_empty(&cs->request_list) == 0) {
-            /* Add the first entry */
-            sr = &cs->sr_fixed;
-            mk_list_add(&sr->_head, &cs->request_list);
-            mk_http_request_init(cs, sr);
-        }
-        else {
-            sr = mk_list_entry_first(&cs->request_list, struct mk_http_request, _head);
-        }
-
-        status = mk_http_parser(sr, &cs->parser,
-                                cs->body, cs->body_length);
-        if (status == MK_HTTP_PARSER_OK) {
-            MK_TRACE("[FD %i] HTTP_PARSER_OK", socket);
-            mk_http_status_completed(cs);
-            mk_event_add(sched->loop, socket, MK_EVENT_WRITE, NULL);
-        }
-        else if (status == MK_HTTP_PARSER_ERROR) {
-            if (mk_list_is_empty(&cs->channel.streams) != 0) {
-                mk_channel_write(&cs->channel);
-            }
-            mk_http_session_remove(socket);
-            MK_TRACE("[FD %i] HTTP_PARSER_ERROR", socket);
+        if (mk_http_handler_parse(socket, cs) == MK_HTTP_PARSER_ERROR) {
             return -1;
         }
-        else {
-            MK_TRACE("[FD %i] HTTP_PARSER_PENDING", socket);
-        }
     }
 
     if (ret == -EAGAIN) {
@@ -110,9 +83,23 @@ int mk_conn_read(int socket)
     return ret;
 }
 
+/* Zero copy sends reported complete on the socket error queue */
+int mk_conn_zerocopy(int socket)
+{
+    struct mk_http_session *cs;
+
+    cs = mk_http_session_get(socket);
+    if (!cs) {
+        return 0;
+    }
+
+    return mk_channel_zerocopy_done(&cs->channel);
+}
+
 int mk_conn_write(int socket)
 {
     int ret = -1;
+    unsigned long long bytes;
     struct mk_http_session *cs;
     struct sched_list_node *sched;
     struct sched_connection *conx;
@@ -160,6 +147,7 @@ int mk_conn_write(int socket)
         return 0;
     }
 
+    bytes = sched->channel_stats.bytes;
     ret = mk_http_handler_write(socket, cs);
 
     /*
@@ -176,6 +164,12 @@ int mk_conn_write(int socket)
         return mk_http_request_end(socket);
     }
     else if (ret == MK_CHANNEL_FLUSH) {
+        mk_http_sock_adapt(cs, sched->channel_stats.bytes - bytes);
+        return 0;
+    }
+    else if (ret == MK_CHANNEL_BUSY) {
+        /* Sleep until the readahead pool has the file data in memory */
+        mk_event_add(sched->loop, socket, MK_EVENT_SLEEP, NULL);
         return 0;
     }
 
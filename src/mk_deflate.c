@@ -0,0 +1,672 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include <monkey/monkey.h>
+#include <monkey/mk_deflate.h>
+#include <monkey/mk_mmap.h>
+#include <monkey/mk_config.h>
+#include <monkey/mk_memory.h>
+#include <monkey/mk_mimetype.h>
+#include <monkey/mk_string.h>
+#include <monkey/mk_utils.h>
+#include <monkey/mk_clock.h>
+#include <monkey/mk_macros.h>
+
+static __thread struct mk_deflate_cache *mk_deflate_key;
+
+/* Flag the mime types listed on CompressionTypes */
+void mk_deflate_init()
+{
+    struct mk_list *head;
+    struct mk_list *m_head;
+    struct mimetype *mime;
+    struct mk_string_line *entry;
+
+    if (mk_config->compression == MK_FALSE) {
+        return;
+    }
+
+#ifndef HAVE_ZLIB
+    mk_warn("Compression: Monkey was built without zlib, disabled");
+    mk_config->compression = MK_FALSE;
+    return;
+#endif
+
+    if (!mk_config->compression_types) {
+        return;
+    }
+
+    mk_list_foreach(head, mk_config->compression_types) {
+        entry = mk_list_entry(head, struct mk_string_line, _head);
+
+        mk_list_foreach(m_head, &mimetype_list) {
+            mime = mk_list_entry(m_head, struct mimetype, _head);
+            if (strncasecmp(mime->type.data, entry->val, entry->len) == 0 &&
+                mime->type.data[entry->len] == '\r') {
+                mime->compress = MK_TRUE;
+            }
+        }
+
+        if (strncasecmp(mimetype_default->type.data,
+                        entry->val, entry->len) == 0 &&
+            mimetype_default->type.data[entry->len] == '\r') {
+            mimetype_default->compress = MK_TRUE;
+        }
+    }
+}
+
+struct mk_deflate_cache *mk_deflate_worker_init()
+{
+    int i;
+    struct mk_deflate_cache *cache;
+
+    if (mk_config->compression == MK_FALSE) {
+        return NULL;
+    }
+
+    cache = mk_mem_malloc_z(sizeof(struct mk_deflate_cache));
+    for (i = 0; i < MK_DEFLATE_BUCKETS; i++) {
+        mk_list_init(&cache->table[i]);
+    }
+    mk_list_init(&cache->lru);
+    for (i = 0; i < MK_DEFLATE_ENCODINGS; i++) {
+        mk_list_init(&cache->idle[i]);
+    }
+
+    mk_deflate_key = cache;
+    return cache;
+}
+
+static void mk_deflate_entry_free(struct mk_deflate_cache *cache,
+                                  struct mk_deflate_entry *entry)
+{
+    mk_list_del(&entry->_head);
+    mk_list_del(&entry->_lru);
+    cache->stats.bytes -= entry->variant->size;
+    mk_stream_buffer_release(entry->variant);
+    mk_mem_free(entry->path);
+    mk_mem_free(entry);
+}
+
+static void mk_deflate_channel_free(struct mk_deflate_channel *dc)
+{
+#ifdef HAVE_ZLIB
+    deflateEnd(dc->zs);
+#endif
+    mk_mem_free(dc->zs);
+    mk_mem_free(dc->buf);
+    mk_mem_free(dc);
+}
+
+void mk_deflate_worker_exit()
+{
+    int i;
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_deflate_cache *cache = mk_deflate_key;
+    struct mk_deflate_entry *entry;
+    struct mk_deflate_channel *dc;
+
+    if (!cache) {
+        return;
+    }
+
+    mk_list_foreach_safe(head, tmp, &cache->lru) {
+        entry = mk_list_entry(head, struct mk_deflate_entry, _lru);
+        mk_deflate_entry_free(cache, entry);
+    }
+
+    for (i = 0; i < MK_DEFLATE_ENCODINGS; i++) {
+        mk_list_foreach_safe(head, tmp, &cache->idle[i]) {
+            dc = mk_list_entry(head, struct mk_deflate_channel, _head);
+            mk_list_del(&dc->_head);
+            mk_deflate_channel_free(dc);
+        }
+
+        if (cache->streams[i]) {
+#ifdef HAVE_ZLIB
+            deflateEnd(cache->streams[i]);
+#endif
+            mk_mem_free(cache->streams[i]);
+        }
+    }
+
+    mk_mem_free(cache);
+    mk_deflate_key = NULL;
+}
+
+#ifdef HAVE_ZLIB
+static z_stream *mk_deflate_stream_new(int encoding)
+{
+    int bits;
+    z_stream *zs;
+
+    /* gzip wrapper for gzip, zlib wrapper for deflate (RFC 7230 4.2.2) */
+    bits = (encoding == MK_DEFLATE_GZIP) ? MAX_WBITS + 16 : MAX_WBITS;
+
+    zs = mk_mem_malloc_z(sizeof(z_stream));
+    if (deflateInit2(zs, mk_config->compression_level, Z_DEFLATED, bits,
+                     8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        mk_mem_free(zs);
+        return NULL;
+    }
+
+    return zs;
+}
+
+/* Compression stream of the worker for an encoding, ready to be used */
+static z_stream *mk_deflate_stream(struct mk_deflate_cache *cache, int encoding)
+{
+    z_stream *zs = cache->streams[encoding];
+
+    if (zs) {
+        deflateReset(zs);
+        return zs;
+    }
+
+    zs = mk_deflate_stream_new(encoding);
+    cache->streams[encoding] = zs;
+    return zs;
+}
+
+/* Open a file that must still match the metadata of the request */
+static int mk_deflate_file_open(const char *path, struct file_info *finfo)
+{
+    int fd;
+    struct stat st;
+
+    fd = open(path, finfo->flags_read_only);
+    if (fd == -1) {
+        return -1;
+    }
+
+    if (fstat(fd, &st) == -1 || st.st_ino != finfo->inode ||
+        st.st_size != finfo->size ||
+        st.st_mtime != finfo->last_modification) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static char *mk_deflate_file_read(int fd, struct file_info *finfo)
+{
+    ssize_t n;
+    size_t total = 0;
+    char *buf;
+
+    buf = mk_mem_malloc(finfo->size);
+    while (total < (size_t) finfo->size) {
+        n = read(fd, buf + total, finfo->size - total);
+        if (n <= 0) {
+            mk_mem_free(buf);
+            return NULL;
+        }
+        total += n;
+    }
+
+    return buf;
+}
+
+/* A whole file compressed in one call, see mk_deflate_run() */
+struct mk_deflate_job {
+    z_stream *zs;
+    int ret;
+};
+
+/* Deflate a whole file, it runs under the recovery point of its mapping */
+static void mk_deflate_run(void *data, const char *buf, size_t len)
+{
+    struct mk_deflate_job *job = data;
+
+    job->zs->next_in  = (Bytef *) buf;
+    job->zs->avail_in = len;
+    job->ret = deflate(job->zs, Z_FINISH);
+}
+
+/* The last reference to a compressed body is gone */
+static void mk_deflate_variant_free(struct mk_stream_buffer *variant)
+{
+    mk_mem_free(variant->data);
+}
+
+static struct mk_stream_buffer *mk_deflate_compress(struct mk_deflate_cache *cache,
+                                                    const char *path,
+                                                    struct file_info *finfo,
+                                                    int encoding)
+{
+    int fd;
+    int ret;
+    char *in;
+    char *out;
+    uLong bound;
+    z_stream *zs;
+    struct timespec t0;
+    struct timespec t1;
+    struct mk_mmap_entry *map;
+    struct mk_deflate_job job;
+    struct mk_stream_buffer *variant;
+
+    zs = mk_deflate_stream(cache, encoding);
+    if (!zs) {
+        return NULL;
+    }
+
+    fd = mk_deflate_file_open(path, finfo);
+    if (fd == -1) {
+        return NULL;
+    }
+
+    /* Compress from the shared mapping of the file if possible */
+    in  = NULL;
+    map = mk_mmap_get(fd);
+    if (map && map->size != finfo->size) {
+        mk_mmap_release(map);
+        map = NULL;
+    }
+    if (!map) {
+        in = mk_deflate_file_read(fd, finfo);
+    }
+    close(fd);
+
+    if (!map && !in) {
+        return NULL;
+    }
+
+    bound = deflateBound(zs, finfo->size);
+    out = mk_mem_malloc(bound);
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t0);
+
+    zs->next_out  = (Bytef *) out;
+    zs->avail_out = bound;
+    job.zs  = zs;
+    job.ret = Z_STREAM_ERROR;
+    if (map) {
+        ret = mk_mmap_read(map, 0, finfo->size, mk_deflate_run, &job);
+        mk_mmap_release(map);
+
+        /* Truncated meanwhile, the stream was left in the middle of it */
+        if (ret == -1) {
+            deflateEnd(zs);
+            mk_mem_free(zs);
+            cache->streams[encoding] = NULL;
+            mk_mem_free(out);
+            return NULL;
+        }
+    }
+    else {
+        mk_deflate_run(&job, in, finfo->size);
+        mk_mem_free(in);
+    }
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t1);
+
+    if (job.ret != Z_STREAM_END) {
+        mk_mem_free(out);
+        return NULL;
+    }
+
+    /* Give back the unused room of the output buffer */
+    out = mk_mem_realloc(out, zs->total_out);
+    variant = mk_stream_buffer_new(out, zs->total_out, NULL,
+                                   mk_deflate_variant_free);
+    if (!variant) {
+        mk_mem_free(out);
+        return NULL;
+    }
+
+    cache->stats.misses++;
+    cache->stats.bytes_in  += finfo->size;
+    cache->stats.bytes_out += zs->total_out;
+    cache->stats.usec += ((t1.tv_sec - t0.tv_sec) * 1000000) +
+        ((t1.tv_nsec - t0.tv_nsec) / 1000);
+
+    return variant;
+}
+#endif
+
+/*
+ * Return a reference to the compressed content of a file, the caller must
+ * release it. It returns NULL if the response must be sent as is: the
+ * compression budget of the worker for the current second is exhausted or
+ * the file could not be compressed.
+ */
+struct mk_stream_buffer *mk_deflate_variant_get(const char *path, int len,
+                                                struct file_info *finfo,
+                                                int encoding)
+{
+#ifdef HAVE_ZLIB
+    unsigned int hash;
+    struct mk_list *head;
+    struct mk_list *bucket;
+    struct mk_deflate_cache *cache = mk_deflate_key;
+    struct mk_deflate_entry *entry;
+    struct mk_stream_buffer *variant;
+
+    if (!cache) {
+        return NULL;
+    }
+
+    hash = mk_utils_gen_hash(path, len);
+    bucket = &cache->table[hash % MK_DEFLATE_BUCKETS];
+
+    mk_list_foreach(head, bucket) {
+        entry = mk_list_entry(head, struct mk_deflate_entry, _head);
+        if (entry->hash != hash || entry->encoding != encoding ||
+            entry->len != len || memcmp(entry->path, path, len) != 0) {
+            continue;
+        }
+
+        if (entry->inode == finfo->inode && entry->size == finfo->size &&
+            entry->mtime == finfo->last_modification) {
+            mk_list_del(&entry->_lru);
+            mk_list_add(&entry->_lru, &cache->lru);
+            cache->stats.hits++;
+            mk_stream_buffer_get(entry->variant);
+            return entry->variant;
+        }
+
+        /* The file changed */
+        mk_deflate_entry_free(cache, entry);
+        break;
+    }
+
+    /* CPU budget: bytes compressed per second by this worker */
+    if (mk_config->compression_budget > 0) {
+        if (cache->budget_time != log_current_utime) {
+            cache->budget_time = log_current_utime;
+            cache->budget_used = 0;
+        }
+        if (cache->budget_used + finfo->size > mk_config->compression_budget) {
+            cache->stats.skipped++;
+            return NULL;
+        }
+        cache->budget_used += finfo->size;
+    }
+
+    variant = mk_deflate_compress(cache, path, finfo, encoding);
+    if (!variant) {
+        return NULL;
+    }
+
+    /*
+     * Do not keep variants bigger than the cache or of files modified on
+     * the current second, they may still change without a new mtime.
+     */
+    if (variant->size > (unsigned long) mk_config->compression_cache ||
+        finfo->last_modification >= log_current_utime) {
+        return variant;
+    }
+
+    while (cache->stats.bytes + variant->size >
+           (unsigned long long) mk_config->compression_cache) {
+        entry = mk_list_entry_first(&cache->lru, struct mk_deflate_entry, _lru);
+        mk_deflate_entry_free(cache, entry);
+        cache->stats.evictions++;
+    }
+
+    entry = mk_mem_malloc(sizeof(struct mk_deflate_entry));
+    entry->encoding = encoding;
+    entry->len      = len;
+    entry->hash     = hash;
+    entry->path     = mk_mem_malloc(len + 1);
+    memcpy(entry->path, path, len);
+    entry->path[len] = '\0';
+    entry->inode    = finfo->inode;
+    entry->size     = finfo->size;
+    entry->mtime    = finfo->last_modification;
+    entry->variant  = variant;
+
+    mk_list_add(&entry->_head, bucket);
+    mk_list_add(&entry->_lru, &cache->lru);
+    cache->stats.bytes += variant->size;
+
+    mk_stream_buffer_get(variant);
+    return variant;
+#else
+    (void) path;
+    (void) len;
+    (void) finfo;
+    (void) encoding;
+
+    return NULL;
+#endif
+}
+
+/*
+ * Check a Content-Type header line ("Content-Type: text/html\r\n") against
+ * CompressionTypes, parameters of the type are ignored.
+ */
+int mk_deflate_type_check(mk_ptr_t *content_type)
+{
+    size_t len;
+    char *p;
+    char *end;
+    struct mk_list *head;
+    struct mk_string_line *entry;
+
+    if (!mk_config->compression_types || content_type->len == 0) {
+        return MK_FALSE;
+    }
+
+    end = content_type->data + content_type->len;
+    p = memchr(content_type->data, ':', content_type->len);
+    if (!p) {
+        return MK_FALSE;
+    }
+    for (p++; p < end && *p == ' '; p++);
+
+    mk_list_foreach(head, mk_config->compression_types) {
+        entry = mk_list_entry(head, struct mk_string_line, _head);
+        len = entry->len;
+        if ((size_t) (end - p) > len && strncasecmp(p, entry->val, len) == 0 &&
+            (p[len] == '\r' || p[len] == ';' || p[len] == ' ')) {
+            return MK_TRUE;
+        }
+    }
+
+    return MK_FALSE;
+}
+
+/*
+ * Deflater for the chunked body of a response, taken from the idle ones of
+ * the worker. It returns NULL if the body must be sent as is, the rules
+ * are the static content ones: the compression budget of the worker is
+ * spent or zlib failed.
+ */
+struct mk_deflate_channel *mk_deflate_channel_get(int encoding)
+{
+#ifdef HAVE_ZLIB
+    struct mk_deflate_cache *cache = mk_deflate_key;
+    struct mk_deflate_channel *dc;
+
+    if (!cache) {
+        return NULL;
+    }
+
+    if (mk_config->compression_budget > 0) {
+        if (cache->budget_time != log_current_utime) {
+            cache->budget_time = log_current_utime;
+            cache->budget_used = 0;
+        }
+        if (cache->budget_used >= mk_config->compression_budget) {
+            cache->stats.skipped++;
+            return NULL;
+        }
+    }
+
+    if (mk_list_is_empty(&cache->idle[encoding]) != 0) {
+        dc = mk_list_entry_first(&cache->idle[encoding],
+                                 struct mk_deflate_channel, _head);
+        mk_list_del(&dc->_head);
+        cache->idle_count[encoding]--;
+        deflateReset(dc->zs);
+    }
+    else {
+        dc = mk_mem_malloc_z(sizeof(struct mk_deflate_channel));
+        dc->zs = mk_deflate_stream_new(encoding);
+        if (!dc->zs) {
+            mk_mem_free(dc);
+            return NULL;
+        }
+        dc->buf = mk_mem_malloc(MK_DEFLATE_CHANNEL_BUF);
+        dc->encoding = encoding;
+    }
+
+    dc->flush    = MK_DEFLATE_NO_FLUSH;
+    dc->finished = MK_FALSE;
+    dc->len      = 0;
+
+    cache->stats.streamed++;
+    return dc;
+#else
+    (void) encoding;
+    return NULL;
+#endif
+}
+
+/* The body is over or its channel went away */
+void mk_deflate_channel_put(struct mk_deflate_channel *dc)
+{
+    struct mk_deflate_cache *cache = mk_deflate_key;
+
+    if (!cache || cache->idle_count[dc->encoding] >= MK_DEFLATE_CHANNEL_IDLE) {
+        mk_deflate_channel_free(dc);
+        return;
+    }
+
+    mk_list_add(&dc->_head, &cache->idle[dc->encoding]);
+    cache->idle_count[dc->encoding]++;
+}
+
+#ifdef HAVE_ZLIB
+/* Run the deflater into the free room of the output buffer */
+static int mk_deflate_channel_run(struct mk_deflate_channel *dc,
+                                  char *data, size_t len, int flush)
+{
+    int ret;
+    size_t in;
+    size_t out;
+    z_stream *zs = dc->zs;
+    struct timespec t0;
+    struct timespec t1;
+    struct mk_deflate_cache *cache = mk_deflate_key;
+
+    zs->next_in   = (Bytef *) data;
+    zs->avail_in  = len;
+    zs->next_out  = (Bytef *) dc->buf + dc->len;
+    zs->avail_out = MK_DEFLATE_CHANNEL_BUF - dc->len;
+    in  = zs->total_in;
+    out = zs->total_out;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t0);
+    ret = deflate(zs, flush);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t1);
+
+    dc->len += zs->total_out - out;
+    if (cache) {
+        cache->stats.bytes_in  += zs->total_in - in;
+        cache->stats.bytes_out += zs->total_out - out;
+        cache->stats.usec += ((t1.tv_sec - t0.tv_sec) * 1000000) +
+            ((t1.tv_nsec - t0.tv_nsec) / 1000);
+        cache->budget_used += zs->total_in - in;
+    }
+
+    /* Nothing left to flush is not an error */
+    if (ret == Z_BUF_ERROR) {
+        ret = Z_OK;
+    }
+    return ret;
+}
+#endif
+
+/*
+ * Compress data of the body, returns the bytes taken: less than 'len' once
+ * the output buffer is full, -1 on error.
+ */
+ssize_t mk_deflate_channel_input(struct mk_deflate_channel *dc,
+                                 char *data, size_t len)
+{
+#ifdef HAVE_ZLIB
+    z_stream *zs = dc->zs;
+
+    if (dc->len == MK_DEFLATE_CHANNEL_BUF) {
+        return 0;
+    }
+
+    if (mk_deflate_channel_run(dc, data, len, Z_NO_FLUSH) != Z_OK) {
+        return -1;
+    }
+
+    return len - zs->avail_in;
+#else
+    (void) dc;
+    (void) data;
+    (void) len;
+    return -1;
+#endif
+}
+
+/*
+ * Push out the data held by the deflater (MK_DEFLATE_SYNC) or end the
+ * compressed stream (MK_DEFLATE_FINISH). Returns 0 once it's all in the
+ * output buffer, 1 if it must be called again when the buffer was sent,
+ * -1 on error.
+ */
+int mk_deflate_channel_flush(struct mk_deflate_channel *dc, int flush)
+{
+#ifdef HAVE_ZLIB
+    int ret;
+
+    ret = mk_deflate_channel_run(dc, NULL, 0,
+                                 flush == MK_DEFLATE_FINISH ? Z_FINISH : Z_SYNC_FLUSH);
+    if (ret == Z_STREAM_END) {
+        dc->flush = MK_DEFLATE_NO_FLUSH;
+        dc->finished = MK_TRUE;
+        return 0;
+    }
+    else if (ret != Z_OK) {
+        return -1;
+    }
+
+    /* A full buffer may hold back some output */
+    if (dc->len == MK_DEFLATE_CHANNEL_BUF) {
+        dc->flush = flush;
+        return 1;
+    }
+
+    dc->flush = MK_DEFLATE_NO_FLUSH;
+    return 0;
+#else
+    (void) dc;
+    (void) flush;
+    return -1;
+#endif
+}
@@ -0,0 +1,375 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <monkey/monkey.h>
+#include <monkey/mk_fdt.h>
+#include <monkey/mk_http.h>
+#include <monkey/mk_config.h>
+#include <monkey/mk_memory.h>
+#include <monkey/mk_utils.h>
+#include <monkey/mk_scheduler.h>
+#include <monkey/mk_macros.h>
+
+static struct mk_fdt_shard mk_fdt_shards[MK_FDT_SHARDS];
+
+/* Descriptors and hash buckets available on every shard */
+static int mk_fdt_shard_limit;
+static int mk_fdt_shard_size;
+
+static inline struct mk_fdt_stats *mk_fdt_stats_get()
+{
+    struct sched_list_node *sched;
+
+    sched = mk_sched_get_thread_conf();
+    if (mk_unlikely(!sched)) {
+        return NULL;
+    }
+
+    return &sched->fdt_stats;
+}
+
+/* Release an entry, the caller must hold the shard lock */
+static void mk_fdt_entry_free(struct mk_fdt_entry *entry)
+{
+    /* Stale entries are neither on the table nor on the idle list */
+    if (entry->stale == MK_FALSE) {
+        mk_list_del(&entry->_head);
+        if (entry->readers == 0) {
+            mk_list_del(&entry->_lru);
+        }
+    }
+
+    entry->shard->count--;
+    close(entry->fd);
+    mk_mem_free(entry->path);
+    mk_mem_free(entry);
+}
+
+/*
+ * The file changed since the descriptor was opened: unlink the entry so
+ * nobody else gets it and release it once the current readers are done.
+ */
+static void mk_fdt_entry_invalidate(struct mk_fdt_entry *entry)
+{
+    if (entry->readers == 0) {
+        mk_fdt_entry_free(entry);
+        return;
+    }
+
+    mk_list_del(&entry->_head);
+    entry->stale = MK_TRUE;
+}
+
+void mk_fdt_init()
+{
+    int i;
+    int limit;
+    struct mk_fdt_shard *shard;
+
+    limit = mk_config->fdt_limit;
+    if (limit <= 0) {
+        limit = MK_FDT_LIMIT_DEFAULT;
+    }
+
+    mk_fdt_shard_limit = (limit + MK_FDT_SHARDS - 1) / MK_FDT_SHARDS;
+    mk_fdt_shard_size  = mk_fdt_shard_limit;
+
+    for (i = 0; i < MK_FDT_SHARDS; i++) {
+        shard = &mk_fdt_shards[i];
+        pthread_mutex_init(&shard->mutex, (pthread_mutexattr_t *) NULL);
+        shard->table = NULL;
+        shard->count = 0;
+        mk_list_init(&shard->lru);
+    }
+}
+
+void mk_fdt_exit()
+{
+    int i;
+    int j;
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_fdt_shard *shard;
+    struct mk_fdt_entry *entry;
+
+    for (i = 0; i < MK_FDT_SHARDS; i++) {
+        shard = &mk_fdt_shards[i];
+        if (!shard->table) {
+            continue;
+        }
+
+        for (j = 0; j < mk_fdt_shard_size; j++) {
+            mk_list_foreach_safe(head, tmp, &shard->table[j]) {
+                entry = mk_list_entry(head, struct mk_fdt_entry, _head);
+                mk_fdt_entry_free(entry);
+            }
+        }
+        mk_mem_free(shard->table);
+        shard->table = NULL;
+    }
+}
+
+static inline struct mk_fdt_entry *mk_fdt_lookup(struct mk_list *bucket,
+                                                 const char *path,
+                                                 unsigned long len,
+                                                 unsigned int hash)
+{
+    struct mk_list *head;
+    struct mk_fdt_entry *entry;
+
+    mk_list_foreach(head, bucket) {
+        entry = mk_list_entry(head, struct mk_fdt_entry, _head);
+        if (entry->hash == hash && entry->len == len &&
+            memcmp(entry->path, path, len) == 0) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+/* Check that the descriptor still belongs to the file the request stat'ed */
+static inline int mk_fdt_entry_valid(struct mk_fdt_entry *entry,
+                                     struct mk_http_request *sr)
+{
+    return (entry->inode == sr->file_info.inode &&
+            entry->size  == sr->file_info.size &&
+            entry->mtime == sr->file_info.last_modification);
+}
+
+/* Take a reference on a shared entry, the shard lock must be held */
+static inline int mk_fdt_entry_get(struct mk_fdt_entry *entry,
+                                   struct mk_http_request *sr)
+{
+    if (entry->readers == 0) {
+        mk_list_del(&entry->_lru);
+    }
+    entry->readers++;
+    sr->fdt_entry = entry;
+
+    return entry->fd;
+}
+
+/* Bucket of a path hash, the shard lock must be held */
+static inline struct mk_list *mk_fdt_bucket(struct mk_fdt_shard *shard,
+                                            unsigned int hash)
+{
+    int i;
+
+    if (mk_unlikely(!shard->table)) {
+        shard->table = mk_mem_malloc(sizeof(struct mk_list) * mk_fdt_shard_size);
+        for (i = 0; i < mk_fdt_shard_size; i++) {
+            mk_list_init(&shard->table[i]);
+        }
+    }
+
+    return &shard->table[(hash / MK_FDT_SHARDS) % mk_fdt_shard_size];
+}
+
+int mk_fdt_open(struct mk_http_request *sr)
+{
+    int fd;
+    unsigned int hash;
+    struct stat st;
+    struct mk_list *bucket;
+    struct mk_fdt_shard *shard;
+    struct mk_fdt_entry *entry;
+    struct mk_fdt_entry *victim;
+    struct mk_fdt_stats *stats;
+
+    if (mk_config->fdt == MK_FALSE) {
+        return open(sr->real_path.data, sr->file_info.flags_read_only);
+    }
+
+    stats = mk_fdt_stats_get();
+    hash  = mk_utils_gen_hash(sr->real_path.data, sr->real_path.len);
+    shard = &mk_fdt_shards[hash % MK_FDT_SHARDS];
+
+    pthread_mutex_lock(&shard->mutex);
+
+    bucket = mk_fdt_bucket(shard, hash);
+    entry = mk_fdt_lookup(bucket, sr->real_path.data, sr->real_path.len, hash);
+    if (entry) {
+        if (mk_fdt_entry_valid(entry, sr)) {
+            fd = mk_fdt_entry_get(entry, sr);
+            pthread_mutex_unlock(&shard->mutex);
+            if (stats) {
+                stats->hits++;
+            }
+            return fd;
+        }
+
+        if (stats) {
+            stats->invalidations++;
+        }
+        mk_fdt_entry_invalidate(entry);
+    }
+    pthread_mutex_unlock(&shard->mutex);
+
+    if (stats) {
+        stats->misses++;
+    }
+
+    fd = open(sr->real_path.data, sr->file_info.flags_read_only);
+    if (fd == -1) {
+        return -1;
+    }
+
+    /* Register the descriptor with the identity of what we really opened */
+    if (fstat(fd, &st) == -1) {
+        return fd;
+    }
+
+    pthread_mutex_lock(&shard->mutex);
+
+    /* Another worker may have registered the same file meanwhile */
+    entry = mk_fdt_lookup(bucket, sr->real_path.data, sr->real_path.len, hash);
+    if (entry && entry->inode == st.st_ino && entry->mtime == st.st_mtime &&
+        entry->size == st.st_size) {
+        close(fd);
+        fd = mk_fdt_entry_get(entry, sr);
+        pthread_mutex_unlock(&shard->mutex);
+        return fd;
+    }
+
+    if (entry) {
+        mk_fdt_entry_invalidate(entry);
+    }
+
+    /* Make room, only idle descriptors can be evicted */
+    if (shard->count >= mk_fdt_shard_limit) {
+        if (mk_list_is_empty(&shard->lru) == 0) {
+            /* Budget is in use by active readers, do not cache this one */
+            pthread_mutex_unlock(&shard->mutex);
+            return fd;
+        }
+
+        victim = mk_list_entry_first(&shard->lru, struct mk_fdt_entry, _lru);
+        mk_fdt_entry_free(victim);
+        if (stats) {
+            stats->evictions++;
+        }
+    }
+
+    /* The entry is born with its first reader, so it is not idle */
+    entry = mk_mem_malloc(sizeof(struct mk_fdt_entry));
+    entry->fd      = fd;
+    entry->readers = 1;
+    entry->stale   = MK_FALSE;
+    entry->len     = sr->real_path.len;
+    entry->hash    = hash;
+    entry->path    = mk_mem_malloc(entry->len + 1);
+    memcpy(entry->path, sr->real_path.data, entry->len);
+    entry->path[entry->len] = '\0';
+    entry->inode   = st.st_ino;
+    entry->size    = st.st_size;
+    entry->mtime   = st.st_mtime;
+    entry->shard   = shard;
+
+    mk_list_add(&entry->_head, bucket);
+    shard->count++;
+    sr->fdt_entry = entry;
+
+    pthread_mutex_unlock(&shard->mutex);
+    return fd;
+}
+
+/*
+ * Register a descriptor opened ahead of any request (prewarm), st is the
+ * fstat(2) of fd. The table takes the descriptor as an idle entry or closes
+ * it; nothing is evicted to make room for it.
+ */
+void mk_fdt_warm(const char *path, int len, int fd, struct stat *st)
+{
+    unsigned int hash;
+    struct mk_list *bucket;
+    struct mk_fdt_shard *shard;
+    struct mk_fdt_entry *entry;
+
+    if (mk_config->fdt == MK_FALSE) {
+        close(fd);
+        return;
+    }
+
+    hash  = mk_utils_gen_hash(path, len);
+    shard = &mk_fdt_shards[hash % MK_FDT_SHARDS];
+
+    pthread_mutex_lock(&shard->mutex);
+
+    bucket = mk_fdt_bucket(shard, hash);
+    if (shard->count >= mk_fdt_shard_limit ||
+        mk_fdt_lookup(bucket, path, len, hash)) {
+        pthread_mutex_unlock(&shard->mutex);
+        close(fd);
+        return;
+    }
+
+    entry = mk_mem_malloc(sizeof(struct mk_fdt_entry));
+    entry->fd      = fd;
+    entry->readers = 0;
+    entry->stale   = MK_FALSE;
+    entry->len     = len;
+    entry->hash    = hash;
+    entry->path    = mk_mem_malloc(len + 1);
+    memcpy(entry->path, path, len);
+    entry->path[len] = '\0';
+    entry->inode   = st->st_ino;
+    entry->size    = st->st_size;
+    entry->mtime   = st->st_mtime;
+    entry->shard   = shard;
+
+    mk_list_add(&entry->_head, bucket);
+    mk_list_add(&entry->_lru, &shard->lru);
+    shard->count++;
+
+    pthread_mutex_unlock(&shard->mutex);
+}
+
+int mk_fdt_close(struct mk_http_request *sr)
+{
+    struct mk_fdt_shard *shard;
+    struct mk_fdt_entry *entry = sr->fdt_entry;
+
+    if (!entry) {
+        return close(sr->file_stream.fd);
+    }
+
+    shard = entry->shard;
+    pthread_mutex_lock(&shard->mutex);
+
+    entry->readers--;
+    if (entry->readers == 0) {
+        if (entry->stale == MK_TRUE) {
+            mk_fdt_entry_free(entry);
+        }
+        else {
+            mk_list_add(&entry->_lru, &shard->lru);
+        }
+    }
+
+    pthread_mutex_unlock(&shard->mutex);
+    sr->fdt_entry = NULL;
+
+    return 0;
+}
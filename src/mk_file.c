@@ -67,6 +67,7 @@ int mk_file_get_info(const char *path, struct file_info *f_info, int mode)
     }
 
     f_info->size = target.st_size;
+    f_info->inode = target.st_ino;
     f_info->last_modification = target.st_mtime;
 
     if (S_ISDIR(target.st_mode)) {
@@ -33,6 +33,7 @@
 #include <monkey/mk_macros.h>
 #include <monkey/mk_vhost.h>
 #include <monkey/mk_tls.h>
+#include <monkey/mk_deflate.h>
 
 #define MK_HEADER_SHORT_DATE       "Date: "
 #define MK_HEADER_SHORT_LOCATION   "Location: "
@@ -43,8 +44,10 @@
 #define MK_HEADER_CONN_CLOSE       "Connection: Close" MK_CRLF
 #define MK_HEADER_CONTENT_LENGTH   "Content-Length: "
 #define MK_HEADER_CONTENT_ENCODING "Content-Encoding: "
+#define MK_HEADER_VARY             "Vary: "
 #define MK_HEADER_TE_CHUNKED       "Transfer-Encoding: Chunked" MK_CRLF
 #define MK_HEADER_LAST_MODIFIED    "Last-Modified: "
+#define MK_HEADER_ETAG             "ETag: "
 
 const mk_ptr_t mk_header_short_date = mk_ptr_init(MK_HEADER_SHORT_DATE);
 const mk_ptr_t mk_header_short_location = mk_ptr_init(MK_HEADER_SHORT_LOCATION);
@@ -55,9 +58,11 @@ const mk_ptr_t mk_header_conn_ka = mk_ptr_init(MK_HEADER_CONN_KA);
 const mk_ptr_t mk_header_conn_close = mk_ptr_init(MK_HEADER_CONN_CLOSE);
 const mk_ptr_t mk_header_content_length = mk_ptr_init(MK_HEADER_CONTENT_LENGTH);
 const mk_ptr_t mk_header_content_encoding = mk_ptr_init(MK_HEADER_CONTENT_ENCODING);
+const mk_ptr_t mk_header_vary = mk_ptr_init(MK_HEADER_VARY);
 const mk_ptr_t mk_header_accept_ranges = mk_ptr_init(MK_HEADER_ACCEPT_RANGES);
 const mk_ptr_t mk_header_te_chunked = mk_ptr_init(MK_HEADER_TE_CHUNKED);
 const mk_ptr_t mk_header_last_modified = mk_ptr_init(MK_HEADER_LAST_MODIFIED);
+const mk_ptr_t mk_header_etag = mk_ptr_init(MK_HEADER_ETAG);
 
 #define status_entry(num, str) {num, sizeof(str) - 1, str}
 
@@ -112,6 +117,7 @@ static const struct header_status_response status_response[] = {
     status_entry(MK_CLIENT_UNSUPPORTED_MEDIA, MK_RH_CLIENT_UNSUPPORTED_MEDIA),
     status_entry(MK_CLIENT_REQUESTED_RANGE_NOT_SATISF,
                  MK_RH_CLIENT_REQUESTED_RANGE_NOT_SATISF),
+    status_entry(MK_CLIENT_EXPECTATION_FAILED, MK_RH_CLIENT_EXPECTATION_FAILED),
 
     /* Server side errors */
     status_entry(MK_SERVER_INTERNAL_ERROR, MK_RH_SERVER_INTERNAL_ERROR),
@@ -129,6 +135,7 @@ static void mk_header_cb_finished(struct mk_stream *stream)
 {
     struct mk_iov *iov = stream->buffer;
     mk_iov_free_marked(iov);
+    stream->buffer = NULL;
 
 #if defined(__APPLE__)
         /*
@@ -158,6 +165,188 @@ static void cb_stream_iov_extended_free(struct mk_stream *stream)
     mk_iov_free_marked(iov);
 }
 
+/*
+ * Add a value composed on a thread cached buffer, with 'copy' set the value
+ * is copied as the cached buffer will be reused before the headers are
+ * sent.
+ */
+static inline void mk_header_iov_add_cached(struct mk_iov *iov, int copy,
+                                            char *data, int len)
+{
+    char *buf;
+
+    if (copy == MK_FALSE) {
+        mk_iov_add(iov, data, len, MK_FALSE);
+        return;
+    }
+
+    buf = mk_mem_malloc(len);
+    memcpy(buf, data, len);
+    mk_iov_add(iov, buf, len, MK_TRUE);
+}
+
+/* Content-Encoding and Vary headers */
+static inline void mk_header_encoding(struct response_headers *sh,
+                                      struct mk_iov *iov)
+{
+    if (sh->content_encoding.len > 0) {
+        mk_iov_add(iov, mk_header_content_encoding.data,
+                   mk_header_content_encoding.len,
+                   MK_FALSE);
+        mk_iov_add(iov, sh->content_encoding.data,
+                   sh->content_encoding.len,
+                   MK_FALSE);
+    }
+
+    if (sh->vary.len > 0) {
+        mk_iov_add(iov, mk_header_vary.data, mk_header_vary.len, MK_FALSE);
+        mk_iov_add(iov, sh->vary.data, sh->vary.len, MK_FALSE);
+    }
+}
+
+/* Connection and Keep-Alive headers */
+static inline void mk_header_connection(struct mk_http_session *cs,
+                                        struct mk_http_request *sr,
+                                        struct mk_iov *iov, int copy)
+{
+    if (sr->headers.connection != 0) {
+        return;
+    }
+
+    if (mk_http_keepalive_check(cs) == 0) {
+        if (sr->connection.len > 0) {
+            if (sr->protocol != MK_HTTP_PROTOCOL_11) {
+                /* Get cached mk_ptr_ts */
+                mk_ptr_t *ka_format = MK_TLS_GET(mk_tls_cache_header_ka);
+                mk_ptr_t *ka_header = MK_TLS_GET(mk_tls_cache_header_ka_max);
+
+                /* Compose header and add entries to iov */
+                mk_string_itop(mk_config->max_keep_alive_request - cs->counter_connections, ka_header);
+                mk_iov_add(iov, ka_format->data, ka_format->len,
+                           MK_FALSE);
+                mk_header_iov_add_cached(iov, copy,
+                                         ka_header->data, ka_header->len);
+                mk_iov_add(iov,
+                           mk_header_conn_ka.data,
+                           mk_header_conn_ka.len,
+                           MK_FALSE);
+            }
+        }
+    }
+    else {
+        mk_iov_add(iov,
+                   mk_header_conn_close.data,
+                   mk_header_conn_close.len,
+                   MK_FALSE);
+    }
+}
+
+/*
+ * Compose the entity tag of a file from its inode, size and modification
+ * time. A file modified within the current second may still change without
+ * a visible mtime update, on that case the tag is weak.
+ */
+int mk_header_etag_create(struct file_info *finfo, char *buf, int size)
+{
+    int len;
+
+    len = snprintf(buf, size, "%s\"%lx-%lx-%lx\"",
+                   finfo->last_modification >= log_current_utime ? "W/" : "",
+                   (unsigned long) finfo->inode,
+                   (unsigned long) finfo->size,
+                   (unsigned long) finfo->last_modification);
+    if (len <= 0 || len >= size) {
+        return -1;
+    }
+
+    return len;
+}
+
+/*
+ * Build the header block of a static file: every field that only depends
+ * on the file and its mime type. If body_size is greater than zero, room
+ * for the file content is reserved after the headers.
+ */
+struct mk_header_block *mk_header_block_create(struct file_info *finfo,
+                                               mk_ptr_t *content_type,
+                                               int body_size)
+{
+    int len;
+    char *p;
+    mk_ptr_t *lm;
+    int etag_len;
+    mk_ptr_t cl;
+    char cl_buf[MK_UTILS_INT2MKP_BUFFER_LEN];
+    char etag[MK_HEADER_ETAG_SIZE];
+    struct mk_header_block *block;
+
+    lm = MK_TLS_GET(mk_tls_cache_header_lm);
+    lm->len = mk_utils_utime2gmt(&lm->data, finfo->last_modification);
+    if (lm->len <= 0) {
+        return NULL;
+    }
+
+    etag_len = mk_header_etag_create(finfo, etag, sizeof(etag));
+    if (etag_len <= 0) {
+        return NULL;
+    }
+
+    cl.data = cl_buf;
+    mk_string_itop(finfo->size, &cl);
+
+    len = mk_header_last_modified.len + lm->len +
+        mk_header_etag.len + etag_len + mk_iov_crlf.len +
+        content_type->len +
+        mk_header_content_length.len + cl.len;
+    if (mk_config->resume == MK_TRUE) {
+        len += mk_header_accept_ranges.len;
+    }
+
+    block = mk_mem_malloc(sizeof(struct mk_header_block) + len + body_size);
+    block->refs = 1;
+    block->content_length = finfo->size;
+    block->data.data = (char *) (block + 1);
+    block->data.len  = len;
+    block->content_type = *content_type;
+    mk_ptr_reset(&block->body);
+    if (body_size > 0) {
+        block->body.data = block->data.data + len;
+        block->body.len  = body_size;
+    }
+
+    p = block->data.data;
+    memcpy(p, mk_header_last_modified.data, mk_header_last_modified.len);
+    p += mk_header_last_modified.len;
+    memcpy(p, lm->data, lm->len);
+    p += lm->len;
+    memcpy(p, mk_header_etag.data, mk_header_etag.len);
+    p += mk_header_etag.len;
+    memcpy(p, etag, etag_len);
+    block->etag.data = p;
+    block->etag.len  = etag_len;
+    p += etag_len;
+    memcpy(p, mk_iov_crlf.data, mk_iov_crlf.len);
+    p += mk_iov_crlf.len;
+    memcpy(p, content_type->data, content_type->len);
+    p += content_type->len;
+    memcpy(p, mk_header_content_length.data, mk_header_content_length.len);
+    p += mk_header_content_length.len;
+    memcpy(p, cl.data, cl.len);
+    p += cl.len;
+    if (mk_config->resume == MK_TRUE) {
+        memcpy(p, mk_header_accept_ranges.data, mk_header_accept_ranges.len);
+    }
+
+    return block;
+}
+
+void mk_header_block_release(struct mk_header_block *block)
+{
+    if (--block->refs == 0) {
+        mk_mem_free(block);
+    }
+}
+
 /* Send response headers */
 int mk_header_prepare(struct mk_http_session *cs,
                       struct mk_http_request *sr)
@@ -167,14 +356,64 @@ int mk_header_prepare(struct mk_http_session *cs,
     char *buffer = 0;
     mk_ptr_t response;
     struct response_headers *sh;
+    int owned = MK_FALSE;
+    int copy;
     struct mk_iov *iov;
+    struct mk_deflate_channel *deflate = NULL;
 
     sh = &sr->headers;
 
+    /*
+     * The thread cached iov is busy while a previous response is still
+     * queued on a channel, on that case use an iov owned by the request.
+     */
     iov = MK_TLS_GET(mk_tls_cache_iov_header);
+    if (iov->iov_idx > 0) {
+        if (!sh->iov) {
+            sh->iov = mk_iov_create(MK_HEADER_IOV, 0);
+        }
+        else {
+            mk_iov_free_marked(sh->iov);
+        }
+        iov = sh->iov;
+        owned = MK_TRUE;
+    }
+
+    /*
+     * Values built on the thread cached buffers are copied when the
+     * buffers are reused before these headers are sent: by the response of
+     * another channel, or by the next response of the same batch.
+     */
+    copy = (owned == MK_TRUE || cs->channel.status == MK_CHANNEL_BATCH);
+
+    /* Chunked body compressed on the fly, the coding headers are set */
+    if (sh->transfer_encoding == MK_HEADER_TE_TYPE_CHUNKED) {
+        deflate = mk_http_deflate_chunked(sr);
+    }
+
+    /*
+     * Static file, plain 200 response: the file dependent headers are
+     * already composed, only Date and Connection change per request.
+     */
+    if (sh->block && sh->status == MK_HTTP_OK &&
+        sh->content_length == sh->block->content_length &&
+        sh->transfer_encoding == -1 &&
+        !sh->location && !sh->_extra_rows && sh->cgi == SH_NOCGI) {
+        mk_iov_add(iov, status_response[0].response,
+                   status_response[0].length, MK_FALSE);
+        mk_iov_add(iov, headers_preset.data, headers_preset.len, MK_FALSE);
+        mk_iov_add(iov, sh->block->data.data, sh->block->data.len, MK_FALSE);
+        mk_header_encoding(sh, iov);
+        mk_header_connection(cs, sr, iov, copy);
+        mk_iov_add(iov, mk_iov_crlf.data, mk_iov_crlf.len, MK_FALSE);
+        goto stream;
+    }
 
-    /* HTTP Status Code */
-    if (sh->status == MK_CUSTOM_STATUS) {
+    /*
+     * HTTP Status Code, a plugin relaying a status line (CGI) sets it along
+     * with the numeric code.
+     */
+    if (sh->status == MK_CUSTOM_STATUS || sh->custom_status.len > 0) {
         response.data = sh->custom_status.data;
         response.len = sh->custom_status.len;
     }
@@ -213,42 +452,19 @@ int mk_header_prepare(struct mk_http_session *cs,
                    mk_header_last_modified.data,
                    mk_header_last_modified.len,
                    MK_FALSE);
-        mk_iov_add(iov,
-                   lm->data,
-                   lm->len,
-                   MK_FALSE);
+        mk_header_iov_add_cached(iov, copy, lm->data, lm->len);
     }
 
-    /* Connection */
-    if (sh->connection == 0) {
-        if (mk_http_keepalive_check(cs) == 0) {
-            if (sr->connection.len > 0) {
-                if (sr->protocol != MK_HTTP_PROTOCOL_11) {
-                    /* Get cached mk_ptr_ts */
-                    mk_ptr_t *ka_format = MK_TLS_GET(mk_tls_cache_header_ka);
-                    mk_ptr_t *ka_header = MK_TLS_GET(mk_tls_cache_header_ka_max);
-
-                    /* Compose header and add entries to iov */
-                    mk_string_itop(mk_config->max_keep_alive_request - cs->counter_connections, ka_header);
-                    mk_iov_add(iov, ka_format->data, ka_format->len,
-                               MK_FALSE);
-                    mk_iov_add(iov, ka_header->data, ka_header->len,
-                               MK_FALSE);
-                    mk_iov_add(iov,
-                               mk_header_conn_ka.data,
-                               mk_header_conn_ka.len,
-                               MK_FALSE);
-                }
-            }
-        }
-        else {
-            mk_iov_add(iov,
-                       mk_header_conn_close.data,
-                       mk_header_conn_close.len,
-                       MK_FALSE);
-        }
+    /* ETag */
+    if (sh->etag.data) {
+        mk_iov_add(iov, mk_header_etag.data, mk_header_etag.len, MK_FALSE);
+        mk_iov_add(iov, sh->etag.data, sh->etag.len, MK_FALSE);
+        mk_iov_add(iov, mk_iov_crlf.data, mk_iov_crlf.len, MK_FALSE);
     }
 
+    /* Connection */
+    mk_header_connection(cs, sr, iov, copy);
+
     /* Location */
     if (sh->location != NULL) {
         mk_iov_add(iov,
@@ -297,15 +513,8 @@ int mk_header_prepare(struct mk_http_session *cs,
         }
     }
 
-    /* Content-Encoding */
-    if (sh->content_encoding.len > 0) {
-        mk_iov_add(iov, mk_header_content_encoding.data,
-                   mk_header_content_encoding.len,
-                   MK_FALSE);
-        mk_iov_add(iov, sh->content_encoding.data,
-                   sh->content_encoding.len,
-                   MK_FALSE);
-    }
+    /* Content-Encoding and Vary */
+    mk_header_encoding(sh, iov);
 
     /* Content-Length */
     if (sh->content_length >= 0 && sh->transfer_encoding != 0) {
@@ -318,10 +527,7 @@ int mk_header_prepare(struct mk_http_session *cs,
                    mk_header_content_length.data,
                    mk_header_content_length.len,
                    MK_FALSE);
-        mk_iov_add(iov,
-                   cl->data,
-                   cl->len,
-                   MK_FALSE);
+        mk_header_iov_add_cached(iov, copy, cl->data, cl->len);
     }
 
     if ((sh->content_length != 0 && (sh->ranges[0] >= 0 || sh->ranges[1] >= 0)) &&
@@ -332,7 +538,7 @@ int mk_header_prepare(struct mk_http_session *cs,
         if (sh->ranges[0] >= 0 && sh->ranges[1] == -1) {
             mk_string_build(&buffer,
                             &len,
-                            "%s bytes %d-%ld/%ld\r\n",
+                            "%s bytes %ld-%ld/%ld\r\n",
                             RH_CONTENT_RANGE,
                             sh->ranges[0],
                             (sh->real_length - 1), sh->real_length);
@@ -343,7 +549,7 @@ int mk_header_prepare(struct mk_http_session *cs,
         if (sh->ranges[0] >= 0 && sh->ranges[1] >= 0) {
             mk_string_build(&buffer,
                             &len,
-                            "%s bytes %d-%d/%ld\r\n",
+                            "%s bytes %ld-%ld/%ld\r\n",
                             RH_CONTENT_RANGE,
                             sh->ranges[0], sh->ranges[1], sh->real_length);
 
@@ -376,6 +582,15 @@ int mk_header_prepare(struct mk_http_session *cs,
     /*
      * Configure the Stream to dispatch the headers
      */
+ stream:
+
+    /* A previous response may have left the channel chunked */
+    cs->channel.chunked = MK_FALSE;
+    cs->channel.encoding = MK_STREAM_ENC_NONE;
+    if (cs->channel.deflate) {
+        mk_deflate_channel_put(cs->channel.deflate);
+        cs->channel.deflate = NULL;
+    }
 
     /* Reset callbacks for headers stream */
     mk_stream_set(&sr->headers_stream,
@@ -393,6 +608,24 @@ int mk_header_prepare(struct mk_http_session *cs,
                       cb_stream_iov_extended_free, NULL, NULL);
     }
 
+    /* The body streams queued from now on are chunk encoded */
+    if (sh->transfer_encoding == MK_HEADER_TE_TYPE_CHUNKED &&
+        sr->method != MK_METHOD_HEAD &&
+        (sh->status < MK_REDIR_MULTIPLE || sh->status > MK_REDIR_USE_PROXY)) {
+        mk_channel_chunked_start(&cs->channel);
+        if (deflate) {
+            mk_channel_deflate_start(&cs->channel, deflate);
+        }
+    }
+    else if (deflate) {
+        mk_deflate_channel_put(deflate);
+    }
+
+    /* Whatever the handler queues as the body of a HEAD is not sent */
+    if (sr->method == MK_METHOD_HEAD) {
+        mk_channel_head_only(&cs->channel);
+    }
+
     sh->sent = MK_TRUE;
     return 0;
 }
@@ -418,7 +651,12 @@ void mk_header_response_reset(struct response_headers *header)
     header->cgi = SH_NOCGI;
     mk_ptr_reset(&header->content_type);
     mk_ptr_reset(&header->content_encoding);
+    mk_ptr_reset(&header->vary);
+    mk_ptr_reset(&header->custom_status);
     header->location = NULL;
     header->_extra_rows = NULL;
+    header->iov = NULL;
+    header->block = NULL;
+    mk_ptr_reset(&header->etag);
     header->allow_methods.len = 0;
 }
@@ -22,6 +22,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <limits.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -34,6 +35,9 @@
 #include <monkey/mk_http_status.h>
 #include <monkey/mk_clock.h>
 #include <monkey/mk_file.h>
+#include <monkey/mk_stat_cache.h>
+#include <monkey/mk_fdt.h>
+#include <monkey/mk_deflate.h>
 #include <monkey/mk_utils.h>
 #include <monkey/mk_config.h>
 #include <monkey/mk_string.h>
@@ -45,6 +49,7 @@
 #include <monkey/mk_vhost.h>
 #include <monkey/mk_server.h>
 #include <monkey/mk_plugin_stage.h>
+#include <monkey/mk_readahead.h>
 
 const mk_ptr_t mk_http_method_get_p = mk_ptr_init(MK_METHOD_GET_STR);
 const mk_ptr_t mk_http_method_post_p = mk_ptr_init(MK_METHOD_POST_STR);
@@ -68,21 +73,30 @@ void mk_http_request_init(struct mk_http_session *session,
     request->port = 0;
     request->status = MK_TRUE;
     request->uri.data = NULL;
+    request->query_string.data = NULL;
+    request->query_string.len = 0;
     request->method = MK_METHOD_UNKNOWN;
     request->protocol = MK_HTTP_PROTOCOL_UNKNOWN;
+    request->protocol_p.data = NULL;
     request->connection.len = -1;
     request->file_info.size = -1;
     request->file_stream.fd = 0;
     request->file_stream.bytes_total = -1;
     request->file_stream.bytes_offset = 0;
     request->file_stream.preserve = MK_FALSE;
-    request->vhost_fdt_enabled = MK_FALSE;
+    request->fdt_entry = NULL;
+    request->pack_record = NULL;
+    request->deflate_variant = NULL;
+    request->multirange = NULL;
     request->host.data = NULL;
     request->stage30_blocked = MK_FALSE;
     request->session = session;
     request->host_conf = mk_list_entry_first(host_list, struct host, _head);
     request->uri_processed.data = NULL;
     request->real_path.data = NULL;
+    request->data.data = NULL;
+    request->data.len = 0;
+    request->headers_stream.buffer = NULL;
     request->keep_alive = MK_TRUE;
     request->close_now = MK_TRUE;
 
@@ -109,37 +123,146 @@ static inline int mk_http_point_header(mk_ptr_t *h,
     return -1;
 }
 
+/*
+ * Decode and normalize the URI straight after the document root into
+ * the static path buffer, the result is used as the processed URI and
+ * the real path. Only paths that do not fit require a new buffer. If
+ * the URI cannot be served an error is sent and it returns -1.
+ */
+static int mk_http_request_path(struct mk_http_session *cs,
+                                struct mk_http_request *sr)
+{
+    int ret;
+    char *temp;
+    mk_ptr_t *docroot;
+
+    /* Already processed when handling an Expect header */
+    if (sr->uri_processed.data) {
+        return 0;
+    }
+
+    docroot = &sr->host_conf->documentroot;
+    if (docroot->len + sr->uri.len < MK_PATH_BASE) {
+        memcpy(sr->real_path_static, docroot->data, docroot->len);
+        temp = sr->real_path_static + docroot->len;
+    }
+    else {
+        temp = mk_mem_malloc(sr->uri.len + 1);
+        if (!temp) {
+            mk_http_error(MK_SERVER_INTERNAL_ERROR, cs, sr);
+            return -1;
+        }
+    }
+
+    ret = mk_utils_url_decode_path(sr->uri, temp);
+    if (ret < 0) {
+        if (temp != sr->real_path_static + docroot->len) {
+            mk_mem_free(temp);
+        }
+
+        if (ret == MK_UTILS_URL_TRAVERSAL) {
+            mk_http_error(MK_CLIENT_FORBIDDEN, cs, sr);
+        }
+        else {
+            mk_http_error(MK_CLIENT_BAD_REQUEST, cs, sr);
+        }
+        return -1;
+    }
+
+    sr->uri_processed.data = temp;
+    sr->uri_processed.len  = ret;
+
+    if (temp == sr->real_path_static + docroot->len) {
+        sr->real_path.data = sr->real_path_static;
+        sr->real_path.len  = docroot->len + ret;
+    }
+    else {
+        ret = mk_buffer_cat(&sr->real_path,
+                            docroot->data, docroot->len,
+                            sr->uri_processed.data, sr->uri_processed.len);
+        if (ret < 0) {
+            MK_TRACE("Error composing real path");
+            mk_http_error(MK_SERVER_INTERNAL_ERROR, cs, sr);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * While pipelined responses are queued the channel holds the TCP cork
+ * for all of them, single responses toggle it on their own.
+ */
+static inline void mk_http_cork_flag(struct mk_http_session *cs, int state)
+{
+    if (cs->channel.status == MK_CHANNEL_BATCH) {
+        return;
+    }
+
+    mk_server_cork_flag(cs->socket, state);
+}
+
+/*
+ * A stage 30 plugin may keep streaming the body from its stream callbacks
+ * after it returns, the request is over once the channel drains.
+ */
+static inline int mk_http_plugin_end(struct mk_http_session *cs)
+{
+    if (mk_list_is_empty(&cs->channel.streams) != 0) {
+        return MK_PLUGIN_RET_END;
+    }
+
+    return EXIT_NORMAL;
+}
+
+/*
+ * Socket buffers of the virtual host, set once per connection: keep-alive
+ * requests for the same host find them already in place.
+ */
+static inline void mk_http_sock_tune(struct mk_http_session *cs,
+                                     struct host *host)
+{
+    struct mk_config_sock *sock = &host->sock;
+
+    if (cs->sock_host == host) {
+        return;
+    }
+    cs->sock_host = host;
+
+    if (sock->send_lowat <= 0 && sock->send_buffer <= 0 &&
+        sock->recv_buffer <= 0) {
+        return;
+    }
+
+    if (sock->send_lowat > 0 &&
+        mk_socket_set_notsent_lowat(cs->socket, sock->send_lowat) == 0) {
+        cs->send_lowat = sock->send_lowat;
+    }
+    mk_socket_set_buffers(cs->socket, sock->send_buffer, sock->recv_buffer);
+
+    if (worker_sched_node) {
+        worker_sched_node->sock_stats.tuned++;
+    }
+}
+
 static int mk_http_request_prepare(struct mk_http_session *cs,
                                    struct mk_http_request *sr)
 {
+    int ret;
     int status = 0;
-    char *temp;
     struct mk_list *hosts = &mk_config->hosts;
     struct mk_list *alias;
     struct mk_http_header *header;
 
-    /*
-     * Process URI, if it contains ASCII encoded strings like '%20',
-     * it will return a new memory buffer with the decoded string, otherwise
-     * it returns NULL
-     */
-    temp = mk_utils_url_decode(sr->uri);
-    if (temp) {
-        sr->uri_processed.data = temp;
-        sr->uri_processed.len  = strlen(temp);
-    }
-    else {
-        sr->uri_processed.data = sr->uri.data;
-        sr->uri_processed.len  = sr->uri.len;
-    }
-
     /* Always assign the default vhost' */
+    mk_vhost_release(sr->host_conf);
     sr->host_conf = mk_list_entry_first(hosts, struct host, _head);
 
     sr->user_home = MK_FALSE;
 
     /* Valid request URI? */
-    if (sr->uri_processed.data[0] != '/') {
+    if (sr->uri.data[0] != '/') {
         mk_http_error(MK_CLIENT_BAD_REQUEST, cs, sr);
         return EXIT_NORMAL;
     }
@@ -153,11 +276,21 @@ static int mk_http_request_prepare(struct mk_http_session *cs,
     /* Header: Range */
     mk_http_point_header(&sr->range, &cs->parser, MK_HEADER_RANGE);
 
+    /* Header: Accept-Encoding */
+    mk_http_point_header(&sr->accept_encoding, &cs->parser,
+                         MK_HEADER_ACCEPT_ENCODING);
+
     /* Header: If-Modified-Since */
     mk_http_point_header(&sr->if_modified_since,
                          &cs->parser,
                          MK_HEADER_IF_MODIFIED_SINCE);
 
+    /* Headers: If-None-Match, If-Match and If-Range */
+    mk_http_point_header(&sr->if_none_match, &cs->parser,
+                         MK_HEADER_IF_NONE_MATCH);
+    mk_http_point_header(&sr->if_match, &cs->parser, MK_HEADER_IF_MATCH);
+    mk_http_point_header(&sr->if_range, &cs->parser, MK_HEADER_IF_RANGE);
+
     /* HTTP/1.1 needs Host header */
     if (!sr->host.data && sr->protocol == MK_HTTP_PROTOCOL_11) {
         mk_http_error(MK_CLIENT_BAD_REQUEST, cs, sr);
@@ -223,11 +356,17 @@ static int mk_http_request_prepare(struct mk_http_session *cs,
             sr->headers.location = NULL;
             mk_header_prepare(cs, sr);
             mk_channel_write(&cs->channel);
-            mk_server_cork_flag(cs->socket, TCP_CORK_OFF);
+            mk_http_cork_flag(cs, TCP_CORK_OFF);
             return 0;
         }
     }
 
+    mk_http_sock_tune(cs, sr->host_conf);
+
+    if (mk_http_request_path(cs, sr) != 0) {
+        return EXIT_NORMAL;
+    }
+
     /* Is requesting an user home directory ? */
     if (mk_config->user_dir &&
         sr->uri_processed.len > 2 &&
@@ -240,7 +379,6 @@ static int mk_http_request_prepare(struct mk_http_session *cs,
     }
 
     /* Plugins Stage 20 */
-    int ret;
     ret = mk_plugin_stage_run_20(cs, sr);
     if (ret == MK_PLUGIN_RET_CLOSE_CONX) {
         MK_TRACE("STAGE 20 requested close conexion");
@@ -296,6 +434,80 @@ static void mk_request_premature_close(int http_status, struct mk_http_session *
     mk_http_session_remove(cs->socket);
 }
 
+/*
+ * The request headers arrived with 'Expect: 100-continue' and the client
+ * is waiting before sending the body. Evaluate the conditions that would
+ * make us reject the request so the body is never read in such case,
+ * otherwise send the interim response. On rejection an error response has
+ * been sent and it returns -1.
+ */
+int mk_http_expect_continue(struct mk_http_session *cs,
+                            struct mk_http_request *sr)
+{
+    int ret;
+    int expect;
+    struct mk_http_parser *p = &cs->parser;
+
+    /* The expectation is evaluated only once per request */
+    expect = p->header_expect;
+    p->header_expect = MK_HTTP_PARSER_EXPECT_EMPTY;
+
+    if (expect == MK_HTTP_PARSER_EXPECT_UNKNOWN) {
+        mk_http_error(MK_CLIENT_EXPECTATION_FAILED, cs, sr);
+        return -1;
+    }
+
+    /* HTTP/1.0 clients do not know about interim responses */
+    if (sr->protocol != MK_HTTP_PROTOCOL_11) {
+        return 0;
+    }
+
+    /* Same rule applied by mk_http_init() once the body arrives */
+    if (sr->method != MK_METHOD_POST && sr->method != MK_METHOD_PUT) {
+        mk_http_error(MK_CLIENT_BAD_REQUEST, cs, sr);
+        return -1;
+    }
+
+    /* The whole request (headers + body) must fit in the buffer limit */
+    if (cs->body_length + p->header_content_length >
+        mk_config->max_request_size) {
+        mk_http_error(MK_CLIENT_REQUEST_ENTITY_TOO_LARGE, cs, sr);
+        return -1;
+    }
+
+    /* Let plugins such as auth reject the request before the body */
+    if (mk_list_is_empty(&mk_config->stage15_handler) != 0) {
+        if (sr->uri.data[0] != '/') {
+            mk_http_error(MK_CLIENT_BAD_REQUEST, cs, sr);
+            return -1;
+        }
+
+        mk_http_point_header(&sr->host, p, MK_HEADER_HOST);
+        if (sr->host.data) {
+            mk_vhost_get(sr->host, &sr->host_conf, &sr->host_alias);
+        }
+
+        if (mk_http_request_path(cs, sr) != 0) {
+            return -1;
+        }
+
+        ret = mk_plugin_stage_run_15(cs, sr);
+        if (ret == MK_PLUGIN_RET_END || ret == MK_PLUGIN_RET_CLOSE_CONX) {
+            return -1;
+        }
+    }
+
+    MK_TRACE("[FD %i] HTTP 100 Continue", cs->socket);
+    ret = mk_socket_send(cs->socket,
+                         MK_RH_INFO_CONTINUE MK_IOV_CRLF,
+                         sizeof(MK_RH_INFO_CONTINUE MK_IOV_CRLF) - 1);
+    if (ret != sizeof(MK_RH_INFO_CONTINUE MK_IOV_CRLF) - 1) {
+        return -1;
+    }
+
+    return 0;
+}
+
 int mk_http_handler_read(int socket, struct mk_http_session *cs)
 {
     int bytes;
@@ -392,17 +604,121 @@ int mk_http_handler_read(int socket, struct mk_http_session *cs)
     return bytes;
 }
 
+/*
+ * Parse the data available in the session buffer, once a request is complete
+ * the connection waits for the write event to dispatch it. If the request
+ * cannot be processed the session is removed and MK_HTTP_PARSER_ERROR is
+ * returned.
+ */
+int mk_http_handler_parse(int socket, struct mk_http_session *cs)
+{
+    int status;
+    struct mk_http_request *sr;
+    struct sched_list_node *sched;
+
+    sched = mk_sched_get_thread_conf();
+
+    if (mk_list_is_empty(&cs->request_list) == 0) {
+        /* Add the first entry */
+        sr = &cs->sr_fixed;
+        mk_list_add(&sr->_head, &cs->request_list);
+        mk_http_request_init(cs, sr);
+    }
+    else {
+        sr = mk_list_entry_first(&cs->request_list, struct mk_http_request, _head);
+    }
+
+    status = mk_http_parser(sr, &cs->parser, cs->body, cs->body_length);
+    if (status == MK_HTTP_PARSER_OK) {
+        MK_TRACE("[FD %i] HTTP_PARSER_OK", socket);
+        mk_http_status_completed(cs);
+        mk_event_add(sched->loop, socket, MK_EVENT_WRITE, NULL);
+    }
+    else if (status == MK_HTTP_PARSER_ERROR) {
+        if (mk_list_is_empty(&cs->channel.streams) != 0) {
+            mk_channel_write(&cs->channel);
+        }
+        mk_http_session_remove(socket);
+        MK_TRACE("[FD %i] HTTP_PARSER_ERROR", socket);
+    }
+    else {
+        MK_TRACE("[FD %i] HTTP_PARSER_PENDING", socket);
+
+        /* Headers are complete and the client waits to send the body */
+        if (cs->parser.header_expect != MK_HTTP_PARSER_EXPECT_EMPTY &&
+            cs->parser.level == REQ_LEVEL_BODY &&
+            cs->parser.body_received == 0) {
+            if (mk_http_expect_continue(cs, sr) != 0) {
+                if (mk_list_is_empty(&cs->channel.streams) != 0) {
+                    mk_channel_write(&cs->channel);
+                }
+                mk_http_session_remove(socket);
+                return MK_HTTP_PARSER_ERROR;
+            }
+        }
+    }
+
+    return status;
+}
+
+/*
+ * Parse the next pipelined request available in the session buffer. It returns
+ * the new request ready to be prepared or NULL if the remaining data does not
+ * hold a complete request.
+ */
+static struct mk_http_request *mk_http_request_pipeline_next(struct mk_http_session *cs)
+{
+    int ret;
+    struct mk_http_request *sr;
+
+    if (cs->body_offset >= cs->body_length) {
+        return NULL;
+    }
+
+    sr = mk_mem_malloc_z(sizeof(struct mk_http_request));
+    if (!sr) {
+        return NULL;
+    }
+    mk_http_request_init(cs, sr);
+    mk_list_add(&sr->_head, &cs->request_list);
+
+    mk_http_parser_init(&cs->parser);
+    ret = mk_http_parser(sr, &cs->parser,
+                         cs->body + cs->body_offset,
+                         cs->body_length - cs->body_offset);
+    if (ret == MK_HTTP_PARSER_OK) {
+        MK_TRACE("[FD %i] Pipeline next is %p", cs->socket, sr);
+        cs->body_offset += cs->parser.request_length;
+        cs->counter_connections++;
+        return sr;
+    }
+    else if (ret == MK_HTTP_PARSER_ERROR) {
+        /*
+         * Keep the request in the list, an error page may have been queued
+         * for it: the connection is closed once the channel is flushed.
+         */
+        sr->keep_alive = MK_FALSE;
+        sr->close_now = MK_TRUE;
+        return NULL;
+    }
+
+    /* Incomplete, it's parsed again once the queued responses are sent */
+    mk_list_del(&sr->_head);
+    mk_http_request_free(sr);
+    mk_mem_free(sr);
+
+    return NULL;
+}
+
 int mk_http_handler_write(int socket, struct mk_http_session *cs)
 {
     int ret;
     int final_status = 0;
     struct mk_http_request *sr_node;
-    struct mk_list *sr_list;
-    struct mk_list *sr_head;
     (void) socket;
 
     /* Check if our embedded channel have some data to stream out */
-    ret = mk_channel_write(&cs->channel);
+    ret = mk_channel_flush(&cs->channel);
     if (ret == MK_CHANNEL_ERROR) {
         return MK_CHANNEL_ERROR;
     }
@@ -412,40 +728,75 @@ int mk_http_handler_write(int socket, struct mk_http_session *cs)
     else if (ret == MK_CHANNEL_DONE) {
         return MK_CHANNEL_DONE;
     }
-    else if (ret == MK_CHANNEL_EMPTY) {
-        sr_list = &cs->request_list;
-        mk_list_foreach(sr_head, sr_list) {
-            sr_node = mk_list_entry_first(sr_list,
-                                          struct mk_http_request, _head);
-            final_status = mk_http_request_prepare(cs, sr_node);
-            /*
-             * If we got an error, we don't want to parse
-             * and send information for another pipelined request
-             */
-            if (final_status >= 0) {
-                return final_status;
+    else if (ret == MK_CHANNEL_BUSY) {
+        return MK_CHANNEL_BUSY;
+    }
+    else if (ret != MK_CHANNEL_EMPTY) {
+        return 0;
+    }
+
+    sr_node = mk_list_entry_first(&cs->request_list,
+                                  struct mk_http_request, _head);
+
+    /*
+     * Pipelined requests: if more data follows the current request, the
+     * responses of every complete request in the buffer are queued on the
+     * channel and flushed together once the last one has been prepared.
+     */
+    cs->body_offset = cs->parser.request_length;
+    if (cs->body_offset < cs->body_length) {
+        cs->pipelined = MK_TRUE;
+        cs->channel.status = MK_CHANNEL_BATCH;
+        mk_server_cork_flag(cs->socket, TCP_CORK_ON);
+    }
+
+    while (sr_node) {
+        final_status = mk_http_request_prepare(cs, sr_node);
+        if (final_status < 0) {
+            /* STAGE_40, request has ended */
+            mk_plugin_stage_run_40(cs, sr_node);
+            if (final_status == EXIT_ABORT || sr_node->close_now == MK_TRUE) {
+                final_status = -1;
             }
             else {
-                /* STAGE_40, request has ended */
-                mk_plugin_stage_run_40(cs, sr_node);
-                switch (final_status) {
-                case EXIT_NORMAL:
-                case EXIT_ERROR:
-                    if (sr_node->close_now == MK_TRUE) {
-                        return -1;
-                    }
-                    break;
-                case EXIT_ABORT:
-                    return -1;
-                }
+                final_status = 0;
             }
+            break;
         }
+
         /*
-         * If we are here, is because all pipelined request were
-         * processed successfully, let's return 0
+         * Only responses fully queued by the core are batched, a plugin
+         * that keeps working on the request must come last.
          */
+        if (cs->pipelined == MK_FALSE ||
+            (final_status != EXIT_NORMAL && final_status != MK_CHANNEL_FLUSH) ||
+            mk_http_keepalive_check(cs) != 0) {
+            break;
+        }
+
+        sr_node = mk_http_request_pipeline_next(cs);
     }
-    return 0;
+
+    if (cs->channel.status != MK_CHANNEL_BATCH) {
+        if (final_status == MK_PLUGIN_RET_END) {
+            return MK_CHANNEL_FLUSH;
+        }
+        return final_status;
+    }
+
+    /* Flush the queued responses */
+    cs->channel.status = MK_CHANNEL_ENABLED;
+    ret = mk_channel_flush(&cs->channel);
+    mk_server_cork_flag(cs->socket, TCP_CORK_OFF);
+
+    if (final_status < 0 || final_status == MK_PLUGIN_RET_CONTINUE) {
+        return final_status;
+    }
+    else if (ret == MK_CHANNEL_EMPTY) {
+        return MK_CHANNEL_DONE;
+    }
+
+    return ret;
 }
 
 /* Build error page */
@@ -522,111 +873,241 @@ mk_ptr_t mk_http_method_check_str(int method)
     return mk_http_method_null_p;
 }
 
-static int mk_http_range_set(struct mk_http_request *sr, size_t file_size)
+/* Parse a non negative decimal number, it returns the next position */
+static char *mk_http_range_number(char *p, char *end, off_t *num)
 {
-    struct response_headers *sh = &sr->headers;
-
-    sr->file_stream.bytes_total  = file_size;
-    sr->file_stream.bytes_offset = 0;
-
-    if (mk_config->resume == MK_TRUE && sr->range.data) {
-        /* yyy- */
-        if (sh->ranges[0] >= 0 && sh->ranges[1] == -1) {
-            sr->file_stream.bytes_offset = sh->ranges[0];
-            sr->file_stream.bytes_total = file_size - sr->file_stream.bytes_offset;
-        }
-
-        /* yyy-xxx */
-        if (sh->ranges[0] >= 0 && sh->ranges[1] >= 0) {
-            sr->file_stream.bytes_offset = sh->ranges[0];
-            sr->file_stream.bytes_total = labs(sh->ranges[1] - sh->ranges[0]) + 1;
-        }
-
-        /* -xxx */
-        if (sh->ranges[0] == -1 && sh->ranges[1] > 0) {
-            sr->file_stream.bytes_total = sh->ranges[1];
-            sr->file_stream.bytes_offset = file_size - sh->ranges[1];
-        }
+    long long n = 0;
+    char *start = p;
 
-        if ((size_t) sr->file_stream.bytes_offset >= file_size ||
-            sr->file_stream.bytes_total > file_size) {
-            return -1;
+    while (p < end && *p >= '0' && *p <= '9') {
+        if (n > (LLONG_MAX - 9) / 10) {
+            return NULL;
         }
+        n = (n * 10) + (*p - '0');
+        p++;
+    }
 
-        lseek(sr->file_stream.fd, sr->file_stream.bytes_offset, SEEK_SET);
+    if (p == start) {
+        return NULL;
     }
-    return 0;
+
+    *num = n;
+    return p;
 }
 
-static int mk_http_range_parse(struct mk_http_request *sr)
+/*
+ * Parse the Range header against the file size (RFC 7233). Satisfiable
+ * ranges are sorted and coalesced into 'start' and 'end' (inclusive). It
+ * returns the number of ranges, zero if none can be satisfied, -1 on a
+ * syntax error and -2 if the header must be ignored and the full content
+ * sent (limits against amplification).
+ */
+static int mk_http_range_parse(struct mk_http_request *sr, off_t size,
+                               off_t *start, off_t *end)
 {
-    int eq_pos, sep_pos, len;
-    char *buffer = 0;
-    struct response_headers *sh;
-
-    if (!sr->range.data)
+    int i;
+    int j;
+    int n = 0;
+    int specs = 0;
+    off_t s;
+    off_t e;
+    off_t first;
+    off_t last;
+    off_t requested = 0;
+    off_t coalesced = 0;
+    char *p;
+    char *end_p;
+    char *eq;
+
+    p = sr->range.data;
+    end_p = sr->range.data + sr->range.len;
+
+    eq = memchr(p, '=', sr->range.len);
+    if (!eq || eq - p != 5 || strncasecmp(p, "bytes", 5) != 0) {
         return -1;
+    }
 
-    if ((eq_pos = mk_string_char_search(sr->range.data, '=', sr->range.len)) < 0)
-        return -1;
+    p = eq + 1;
+    while (p < end_p) {
+        while (p < end_p && (*p == ' ' || *p == '\t')) {
+            p++;
+        }
+        if (p < end_p && *p == ',') {
+            p++;
+            continue;
+        }
+        if (p == end_p) {
+            break;
+        }
 
-    if (strncasecmp(sr->range.data, "Bytes", eq_pos) != 0)
-        return -1;
+        if (++specs > MK_HTTP_RANGES_MAX) {
+            return -2;
+        }
 
-    if ((sep_pos = mk_string_char_search(sr->range.data, '-', sr->range.len)) < 0)
-        return -1;
+        if (*p == '-') {
+            /* -suffix */
+            p = mk_http_range_number(p + 1, end_p, &last);
+            if (!p) {
+                return -1;
+            }
+            s = (last >= size) ? 0 : size - last;
+            e = size - 1;
+            if (last == 0 || size == 0) {
+                s = -1;
+            }
+        }
+        else {
+            /* first- or first-last */
+            p = mk_http_range_number(p, end_p, &first);
+            if (!p || p == end_p || *p != '-') {
+                return -1;
+            }
+            p++;
 
-    len = sr->range.len;
-    sh = &sr->headers;
+            last = size - 1;
+            if (p < end_p && *p >= '0' && *p <= '9') {
+                p = mk_http_range_number(p, end_p, &last);
+                if (!p || last < first) {
+                    return -1;
+                }
+            }
 
-    /* =-xxx */
-    if (eq_pos + 1 == sep_pos) {
-        sh->ranges[0] = -1;
-        sh->ranges[1] = (unsigned long) atol(sr->range.data + sep_pos + 1);
+            s = first;
+            e = (last >= size) ? size - 1 : last;
+            if (first >= size) {
+                s = -1;
+            }
+        }
 
-        if (sh->ranges[1] <= 0) {
+        while (p < end_p && (*p == ' ' || *p == '\t')) {
+            p++;
+        }
+        if (p < end_p && *p != ',') {
             return -1;
         }
 
-        sh->content_length = sh->ranges[1];
-        return 0;
-    }
+        /* Unsatisfiable range, skip it */
+        if (s < 0) {
+            continue;
+        }
 
-    /* =yyy-xxx */
-    if ((eq_pos + 1 != sep_pos) && (len > sep_pos + 1)) {
-        buffer = mk_string_copy_substr(sr->range.data, eq_pos + 1, sep_pos);
-        sh->ranges[0] = (unsigned long) atol(buffer);
-        mk_mem_free(buffer);
+        /* Keep the list sorted by the first byte */
+        for (i = n; i > 0 && start[i - 1] > s; i--) {
+            start[i] = start[i - 1];
+            end[i]   = end[i - 1];
+        }
+        start[i] = s;
+        end[i]   = e;
+        requested += (e - s) + 1;
+        n++;
+    }
 
-        buffer = mk_string_copy_substr(sr->range.data, sep_pos + 1, len);
-        sh->ranges[1] = (unsigned long) atol(buffer);
-        mk_mem_free(buffer);
+    if (specs == 0) {
+        return -1;
+    }
 
-        if (sh->ranges[1] < 0 || (sh->ranges[0] > sh->ranges[1])) {
-            return -1;
+    /* Coalesce overlapping ranges and the ones separated by a small gap */
+    for (i = 0, j = 1; j < n; j++) {
+        if (start[j] <= end[i] + MK_HTTP_RANGES_GAP) {
+            if (end[j] > end[i]) {
+                end[i] = end[j];
+            }
+            continue;
         }
+        i++;
+        start[i] = start[j];
+        end[i]   = end[j];
+    }
+    if (n > 0) {
+        n = i + 1;
+    }
 
-        sh->content_length = abs(sh->ranges[1] - sh->ranges[0]) + 1;
-        return 0;
+    for (i = 0; i < n; i++) {
+        coalesced += (end[i] - start[i]) + 1;
     }
-    /* =yyy- */
-    if ((eq_pos + 1 != sep_pos) && (len == sep_pos + 1)) {
-        buffer = mk_string_copy_substr(sr->range.data, eq_pos + 1, len);
-        sr->headers.ranges[0] = (unsigned long) atol(buffer);
-        mk_mem_free(buffer);
 
-        sh->content_length = (sh->content_length - sh->ranges[0]);
-        return 0;
+    if (requested - coalesced > size) {
+        return -2;
     }
 
-    return -1;
+    return n;
 }
 
-int mk_http_method_get(char *body)
+/*
+ * Compose the multipart/byteranges body: every part is a header (PTR
+ * stream) followed by its range of the file (FILE stream), the content
+ * itself is never copied.
+ */
+static int mk_http_multirange_create(struct mk_http_request *sr,
+                                     mk_ptr_t *type, off_t base,
+                                     int count, off_t *start, off_t *end)
 {
-    int int_method, pos = 0;
-    int max_len_method = 8;
-    mk_ptr_t method;
+    int i;
+    int len;
+    int size;
+    char *p;
+    char boundary[32];
+    long content_length = 0;
+    struct mk_http_multirange *mr;
+    struct mk_http_range_part *part;
+    static __thread unsigned int seq;
+
+    snprintf(boundary, sizeof(boundary), "%08lx%04x%08x",
+             (unsigned long) log_current_utime, seq++ & 0xffff,
+             (unsigned int) sr->file_info.inode);
+
+    /* Part headers, content type and closing boundary */
+    size = 128 + count * (type->len + 128);
+
+    mr = mk_mem_malloc(sizeof(struct mk_http_multirange) +
+                       sizeof(struct mk_http_range_part) * count + size);
+    mr->count = count;
+    p = (char *) &mr->parts[count];
+
+    len = snprintf(p, size,
+                   "Content-Type: multipart/byteranges; boundary=%s\r\n",
+                   boundary);
+    mr->content_type.data = p;
+    mr->content_type.len  = len;
+    p += len;
+    size -= len;
+
+    for (i = 0; i < count; i++) {
+        part = &mr->parts[i];
+        part->offset = base + start[i];
+        part->length = (end[i] - start[i]) + 1;
+
+        len = snprintf(p, size,
+                       "\r\n--%s\r\n%.*sContent-Range: bytes %lld-%lld/%lld\r\n\r\n",
+                       boundary,
+                       (int) type->len, type->data,
+                       (long long) start[i], (long long) end[i],
+                       (long long) sr->file_info.size);
+        part->header.data = p;
+        part->header.len  = len;
+        p += len;
+        size -= len;
+
+        content_length += part->header.len + part->length;
+    }
+
+    len = snprintf(p, size, "\r\n--%s--\r\n", boundary);
+    mr->tail.data = p;
+    mr->tail.len  = len;
+    content_length += len;
+
+    sr->multirange = mr;
+    sr->headers.content_type = mr->content_type;
+    sr->headers.content_length = content_length;
+
+    return 0;
+}
+
+int mk_http_method_get(char *body)
+{
+    int int_method, pos = 0;
+    int max_len_method = 8;
+    mk_ptr_t method;
 
     /* Max method length is 7 (GET/POST/HEAD/PUT/DELETE/OPTIONS) */
     pos = mk_string_char_search(body, ' ', max_len_method);
@@ -711,149 +1192,708 @@ static int mk_http_directory_redirect_check(struct mk_http_session *cs,
                         mk_config->transport, host, port_redirect, location);
     }
     else {
-        mk_string_build(&real_location, &len, "%s://%s%s\r\n",
-                        mk_config->transport, host, location);
+        mk_string_build(&real_location, &len, "%s://%s%s\r\n",
+                        mk_config->transport, host, location);
+    }
+
+    MK_TRACE("Redirecting to '%s'", real_location);
+
+    mk_mem_free(host);
+
+    mk_header_set_http_status(sr, MK_REDIR_MOVED);
+    sr->headers.content_length = 0;
+
+    mk_ptr_reset(&sr->headers.content_type);
+    sr->headers.location = real_location;
+    sr->headers.cgi = SH_NOCGI;
+    sr->headers.pconnections_left =
+        (mk_config->max_keep_alive_request - cs->counter_connections);
+
+
+    mk_header_prepare(cs, sr);
+    mk_channel_write(&cs->channel);
+    mk_http_cork_flag(cs, TCP_CORK_OFF);
+
+    /*
+     *  we do not free() real_location
+     *  as it's freed by iov
+     */
+    mk_mem_free(location);
+    sr->headers.location = NULL;
+    return -1;
+}
+
+/* Look for some  index.xxx in pathfile */
+mk_ptr_t mk_http_index_file(char *pathfile, char *file_aux,
+                            const unsigned int flen)
+{
+    unsigned long len;
+    mk_ptr_t f;
+    struct file_info finfo;
+    struct mk_string_line *entry;
+    struct mk_list *head;
+
+    mk_ptr_reset(&f);
+    if (!mk_config->index_files) return f;
+
+    mk_list_foreach(head, mk_config->index_files) {
+        entry = mk_list_entry(head, struct mk_string_line, _head);
+        len = snprintf(file_aux, flen, "%s%s", pathfile, entry->val);
+        if (mk_unlikely(len > flen)) {
+            len = flen - 1;
+            mk_warn("Path too long, truncated! '%s'", file_aux);
+        }
+
+        if (mk_stat_cache_get_info(file_aux, len, &finfo) == 0) {
+            f.data = file_aux;
+            f.len = len;
+            return f;
+        }
+    }
+
+    return f;
+}
+
+void mk_http_cb_file_finished(struct mk_stream *stream)
+{
+    (void) stream;
+
+    MK_TRACE("File finished");
+}
+
+#if defined (__linux__)
+void mk_http_cb_file_on_consume(struct mk_stream *stream, long bytes)
+{
+    (void) bytes;
+
+    /*
+     * This callback is invoked just once as we want to turn off
+     * the TCP Cork. We do this just overriding the callback for
+     * the file stream.
+     */
+    mk_server_cork_flag(stream->channel->fd, TCP_CORK_OFF);
+    stream->cb_bytes_consumed = NULL;
+}
+#endif
+
+/* Queue the parts of a multipart/byteranges response on the channel */
+static void mk_http_multirange_streams(struct mk_http_session *cs,
+                                       struct mk_http_request *sr)
+{
+    int i;
+    struct mk_http_range_part *part;
+    struct mk_http_multirange *mr = sr->multirange;
+
+    for (i = 0; i < mr->count; i++) {
+        part = &mr->parts[i];
+        mk_stream_set(&part->header_stream, MK_STREAM_PTR, &cs->channel,
+                      &part->header, -1, sr, NULL, NULL, NULL);
+
+        mk_stream_set(&part->file_stream, MK_STREAM_FILE, &cs->channel,
+                      NULL, part->length, sr, NULL, NULL, NULL);
+        part->file_stream.fd = sr->file_stream.fd;
+        part->file_stream.bytes_offset = part->offset;
+    }
+
+    mk_stream_set(&mr->tail_stream, MK_STREAM_PTR, &cs->channel,
+                  &mr->tail, -1, sr, mk_http_cb_file_finished, NULL, NULL);
+
+#if defined(__linux__)
+    if (cs->channel.status != MK_CHANNEL_BATCH) {
+        mr->parts[0].file_stream.cb_bytes_consumed = mk_http_cb_file_on_consume;
+    }
+#endif
+}
+
+/* Content codings of the precompressed siblings, in order of preference */
+static struct mk_http_encoding {
+    char *name;
+    int len;
+    char *ext;
+    char *header;
+} mk_http_encodings[] = {
+    { "br",   2, ".br", "br\r\n"   },
+    { "gzip", 4, ".gz", "gzip\r\n" },
+    { NULL,   0, NULL,  NULL       }
+};
+
+/*
+ * Check if a content coding is acceptable for the client: it must be listed
+ * on Accept-Encoding (or covered by '*') without a zero quality value.
+ */
+static int mk_http_accept_encoding(mk_ptr_t *header, char *name, int len)
+{
+    int tlen;
+    int zero;
+    int star = MK_FALSE;
+    char *p;
+    char *q;
+    char *end;
+    char *token;
+
+    p = header->data;
+    end = header->data + header->len;
+
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) {
+            p++;
+        }
+        if (p == end) {
+            break;
+        }
+
+        token = p;
+        while (p < end && *p != ',' && *p != ';' && *p != ' ' && *p != '\t') {
+            p++;
+        }
+        tlen = p - token;
+
+        /* Parameters, only the quality value matters */
+        zero = MK_FALSE;
+        while (p < end && *p != ',') {
+            if ((*p == 'q' || *p == 'Q') && p + 1 < end && p[1] == '=') {
+                q = p + 2;
+                zero = (q < end && *q == '0');
+                for (q++; zero && q < end && *q != ',' && *q != ';' &&
+                         *q != ' '; q++) {
+                    if (*q != '.' && *q != '0') {
+                        zero = MK_FALSE;
+                    }
+                }
+            }
+            p++;
+        }
+
+        if (tlen == len && strncasecmp(token, name, len) == 0) {
+            return !zero;
+        }
+        else if (tlen == 1 && *token == '*') {
+            star = !zero;
+        }
+    }
+
+    return star;
+}
+
+/*
+ * Static file: if the client accepts a content coding and a compressed
+ * sibling (file.br, file.gz) exists and is not older than the file, serve
+ * the sibling instead. Any sibling makes the response depend on the
+ * Accept-Encoding header, even when the identity file is sent. Lookups go
+ * through the stat cache, so negative results are cached as well.
+ */
+static int mk_http_precompressed(struct mk_http_request *sr)
+{
+    int len;
+    int probed = MK_FALSE;
+    char path[MK_MAX_PATH];
+    struct file_info finfo;
+    struct mk_http_encoding *enc;
+
+    if (sr->real_path.len + 4 > MK_MAX_PATH) {
+        return -1;
+    }
+
+    for (enc = mk_http_encodings; enc->name; enc++) {
+        memcpy(path, sr->real_path.data, sr->real_path.len);
+        memcpy(path + sr->real_path.len, enc->ext, 4);
+        len = sr->real_path.len + 3;
+        probed = MK_TRUE;
+
+        if (mk_stat_cache_get_info(path, len, &finfo) != 0 ||
+            finfo.is_file == MK_FALSE || finfo.read_access == MK_FALSE ||
+            finfo.last_modification < sr->file_info.last_modification ||
+            (finfo.is_link == MK_TRUE && mk_config->symlink == MK_FALSE)) {
+            continue;
+        }
+
+        mk_ptr_set(&sr->headers.vary, "Accept-Encoding\r\n");
+
+        if (!sr->accept_encoding.data ||
+            mk_http_accept_encoding(&sr->accept_encoding,
+                                    enc->name, enc->len) == MK_FALSE) {
+            continue;
+        }
+
+        if (sr->real_path.data != sr->real_path_static) {
+            mk_ptr_free(&sr->real_path);
+        }
+        if (len < MK_PATH_BASE) {
+            memcpy(sr->real_path_static, path, len + 1);
+            sr->real_path.data = sr->real_path_static;
+        }
+        else {
+            sr->real_path.data = mk_string_dup(path);
+        }
+        sr->real_path.len = len;
+
+        memcpy(&sr->file_info, &finfo, sizeof(struct file_info));
+        mk_ptr_set(&sr->headers.content_encoding, enc->header);
+        return 0;
+    }
+
+    /* Point the stat cache back to the original file */
+    if (probed == MK_TRUE) {
+        mk_stat_cache_get_info(sr->real_path.data, sr->real_path.len, &finfo);
+    }
+
+    return -1;
+}
+
+/* On-the-fly content codings, in order of preference */
+static struct mk_http_encoding mk_http_deflate_encodings[] = {
+    { "gzip",    4, "-gz", "gzip\r\n"    },
+    { "deflate", 7, "-zz", "deflate\r\n" },
+    { NULL,      0, NULL,  NULL          }
+};
+
+/*
+ * Static file that can be compressed on the fly: get the compressed variant
+ * for the first coding accepted by the client. The entity tag is extended
+ * with the coding so it differs from the identity one.
+ */
+static int mk_http_deflate(struct mk_http_request *sr)
+{
+    int i;
+    int len;
+    char *etag;
+    struct mk_stream_buffer *variant;
+    struct mk_http_encoding *enc;
+
+    for (i = 0; mk_http_deflate_encodings[i].name; i++) {
+        if (mk_http_accept_encoding(&sr->accept_encoding,
+                                    mk_http_deflate_encodings[i].name,
+                                    mk_http_deflate_encodings[i].len) == MK_TRUE) {
+            break;
+        }
+    }
+
+    enc = &mk_http_deflate_encodings[i];
+    if (!enc->name || !sr->headers.etag.data ||
+        sr->headers.etag.len + 3 >= MK_HEADER_ETAG_SIZE) {
+        return -1;
+    }
+
+    variant = mk_deflate_variant_get(sr->real_path.data, sr->real_path.len,
+                                     &sr->file_info, i);
+    if (!variant) {
+        return -1;
+    }
+
+    /* The entity tag may point to the header block, copy it first */
+    len = sr->headers.etag.len - 1;
+    etag = sr->headers.etag_buf;
+    memmove(etag, sr->headers.etag.data, len);
+    memcpy(etag + len, enc->ext, 3);
+    etag[len + 3] = '"';
+    sr->headers.etag.data = etag;
+    sr->headers.etag.len  = len + 4;
+
+    /* The header block describes the identity content */
+    if (sr->headers.block) {
+        mk_header_block_release(sr->headers.block);
+        sr->headers.block = NULL;
+    }
+
+    sr->deflate_variant = variant;
+    sr->headers.content_length = variant->size;
+    mk_ptr_set(&sr->headers.content_encoding, enc->header);
+
+    return 0;
+}
+
+/*
+ * Chunked body of a dynamic response (dirlisting and the like): it's
+ * compressed on its channel if its type is listed on CompressionTypes and
+ * the client accepts a coding, it sets the coding headers and returns the
+ * deflater to hand to the channel once the headers are queued. HEAD gets
+ * the headers a GET would.
+ */
+struct mk_deflate_channel *mk_http_deflate_chunked(struct mk_http_request *sr)
+{
+    int i;
+    struct mk_deflate_channel *dc = NULL;
+
+    if (mk_config->compression == MK_FALSE ||
+        sr->headers.status != MK_HTTP_OK ||
+        sr->headers.content_encoding.len > 0 ||
+        (sr->method != MK_METHOD_GET && sr->method != MK_METHOD_HEAD) ||
+        mk_deflate_type_check(&sr->headers.content_type) == MK_FALSE) {
+        return NULL;
+    }
+
+    mk_ptr_set(&sr->headers.vary, "Accept-Encoding\r\n");
+    if (!sr->accept_encoding.data) {
+        return NULL;
+    }
+
+    for (i = 0; mk_http_deflate_encodings[i].name; i++) {
+        if (mk_http_accept_encoding(&sr->accept_encoding,
+                                    mk_http_deflate_encodings[i].name,
+                                    mk_http_deflate_encodings[i].len) == MK_TRUE) {
+            break;
+        }
+    }
+
+    if (!mk_http_deflate_encodings[i].name) {
+        return NULL;
+    }
+
+    if (sr->method == MK_METHOD_GET) {
+        dc = mk_deflate_channel_get(i);
+        if (!dc) {
+            return NULL;
+        }
+    }
+
+    mk_ptr_set(&sr->headers.content_encoding,
+               mk_http_deflate_encodings[i].header);
+    return dc;
+}
+
+/*
+ * Look up an entity tag on the list of a conditional header, '*' matches
+ * any tag. The strong comparison never matches weak tags, the weak one
+ * ignores the W/ prefix on both sides.
+ */
+static int mk_http_etag_match(mk_ptr_t *header, mk_ptr_t *etag, int strong)
+{
+    int len;
+    char *p;
+    char *end;
+    char *tag;
+    mk_ptr_t self = *etag;
+
+    if (etag->len > 2 && etag->data[0] == 'W' && etag->data[1] == '/') {
+        if (strong == MK_TRUE) {
+            return MK_FALSE;
+        }
+        self.data += 2;
+        self.len  -= 2;
+    }
+
+    p = header->data;
+    end = header->data + header->len;
+
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) {
+            p++;
+        }
+        if (p == end) {
+            break;
+        }
+
+        if (*p == '*') {
+            return MK_TRUE;
+        }
+
+        tag = p;
+        if (end - p > 2 && p[0] == 'W' && p[1] == '/') {
+            if (strong == MK_TRUE) {
+                tag = NULL;
+            }
+            else {
+                tag = p + 2;
+            }
+            p += 2;
+        }
+
+        /* Quoted opaque tag */
+        if (p < end && *p == '"') {
+            p++;
+            while (p < end && *p != '"') {
+                p++;
+            }
+            if (p < end) {
+                p++;
+            }
+        }
+        else {
+            while (p < end && *p != ',') {
+                p++;
+            }
+        }
+
+        if (tag) {
+            len = p - tag;
+            if (len == (int) self.len && memcmp(tag, self.data, len) == 0) {
+                return MK_TRUE;
+            }
+        }
+    }
+
+    return MK_FALSE;
+}
+
+/*
+ * Evaluate the conditional headers of a static file request (RFC 7232),
+ * it returns the status to answer with or zero to serve the request. A
+ * failed If-Range condition drops the Range header so the full file is sent.
+ */
+static int mk_http_conditional(struct mk_http_request *sr)
+{
+    time_t date;
+    mk_ptr_t *etag = &sr->headers.etag;
+    int safe = (sr->method == MK_METHOD_GET || sr->method == MK_METHOD_HEAD);
+
+    if (sr->if_match.data) {
+        if (!etag->data ||
+            mk_http_etag_match(&sr->if_match, etag, MK_TRUE) == MK_FALSE) {
+            return MK_CLIENT_PRECOND_FAILED;
+        }
+    }
+
+    if (sr->if_none_match.data) {
+        if (etag->data &&
+            mk_http_etag_match(&sr->if_none_match, etag, MK_FALSE) == MK_TRUE) {
+            return safe ? MK_NOT_MODIFIED : MK_CLIENT_PRECOND_FAILED;
+        }
+    }
+    else if (sr->if_modified_since.data && safe) {
+        date = mk_utils_gmt2utime(sr->if_modified_since.data,
+                                  sr->if_modified_since.len);
+        if (date > 0 && sr->file_info.last_modification <= date) {
+            return MK_NOT_MODIFIED;
+        }
+    }
+
+    if (sr->if_range.data && sr->range.data) {
+        if (sr->if_range.data[0] == '"' ||
+            (sr->if_range.len > 2 && sr->if_range.data[0] == 'W' &&
+             sr->if_range.data[1] == '/')) {
+            if (!etag->data ||
+                mk_http_etag_match(&sr->if_range, etag, MK_TRUE) == MK_FALSE) {
+                mk_ptr_reset(&sr->range);
+            }
+        }
+        else {
+            date = mk_utils_gmt2utime(sr->if_range.data, sr->if_range.len);
+            if (date != sr->file_info.last_modification) {
+                mk_ptr_reset(&sr->range);
+            }
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Send the static content of a request: the file stream is ready to send
+ * the whole object, which starts at 'base' on the descriptor.
+ */
+static int mk_http_file_send(struct mk_http_session *cs,
+                             struct mk_http_request *sr,
+                             mk_ptr_t *type, off_t base)
+{
+    int ret;
+    off_t range_start[MK_HTTP_RANGES_MAX];
+    off_t range_end[MK_HTTP_RANGES_MAX];
+
+    /* Process methods */
+    if (sr->method == MK_METHOD_GET || sr->method == MK_METHOD_HEAD) {
+        sr->headers.content_type = *type;
+
+        /* HTTP Ranges */
+        if (sr->range.data != NULL && mk_config->resume == MK_TRUE) {
+            ret = mk_http_range_parse(sr, sr->file_info.size,
+                                      range_start, range_end);
+            if (ret == -1) {
+                return mk_http_error(MK_CLIENT_BAD_REQUEST, cs, sr);
+            }
+            else if (ret == 0) {
+                sr->headers.content_length = -1;
+                return mk_http_error(MK_CLIENT_REQUESTED_RANGE_NOT_SATISF, cs, sr);
+            }
+            else if (ret == 1) {
+                mk_header_set_http_status(sr, MK_HTTP_PARTIAL);
+                sr->headers.ranges[0] = range_start[0];
+                sr->headers.ranges[1] = range_end[0];
+                sr->headers.content_length = (range_end[0] - range_start[0]) + 1;
+                sr->file_stream.bytes_offset = base + range_start[0];
+                sr->file_stream.bytes_total  = sr->headers.content_length;
+            }
+            else if (ret > 1) {
+                mk_header_set_http_status(sr, MK_HTTP_PARTIAL);
+                mk_http_multirange_create(sr, type, base, ret,
+                                          range_start, range_end);
+            }
+        }
+    }
+    else {
+        /* without content-type */
+        mk_ptr_reset(&sr->headers.content_type);
+    }
+
+    /* Send headers */
+    mk_header_prepare(cs, sr);
+    if (mk_unlikely(sr->headers.content_length == 0)) {
+        return 0;
+    }
+
+    /* Multiple ranges: every part is queued with its own streams */
+    if (sr->multirange) {
+        if (sr->method == MK_METHOD_GET) {
+            mk_http_multirange_streams(cs, sr);
+            mk_http_cork_flag(cs, TCP_CORK_ON);
+        }
+        return mk_channel_write(&cs->channel);
+    }
+
+    /* Send file content */
+    if (sr->method == MK_METHOD_GET || sr->method == MK_METHOD_POST) {
+        /* Note: bytes and offsets are set after the Range check */
+        sr->file_stream.type = MK_STREAM_FILE;
+        mk_channel_append_stream(&cs->channel, &sr->file_stream);
+    }
+
+    /*
+     * Enable TCP Cork for the remote socket. It will be disabled
+     * later by the file stream on the channel after send the first
+     * file bytes.
+     */
+#if defined(__linux__)
+    if (cs->channel.status == MK_CHANNEL_BATCH) {
+        sr->file_stream.cb_bytes_consumed = NULL;
+    }
+    else {
+        sr->file_stream.cb_bytes_consumed = mk_http_cb_file_on_consume;
     }
-
-    MK_TRACE("Redirecting to '%s'", real_location);
-
-    mk_mem_free(host);
-
-    mk_header_set_http_status(sr, MK_REDIR_MOVED);
-    sr->headers.content_length = 0;
-
-    mk_ptr_reset(&sr->headers.content_type);
-    sr->headers.location = real_location;
-    sr->headers.cgi = SH_NOCGI;
-    sr->headers.pconnections_left =
-        (mk_config->max_keep_alive_request - cs->counter_connections);
-
-
-    mk_header_prepare(cs, sr);
-    mk_channel_write(&cs->channel);
-    mk_server_cork_flag(cs->socket, TCP_CORK_OFF);
+#endif
+    sr->file_stream.cb_finished       = mk_http_cb_file_finished;
 
     /*
-     *  we do not free() real_location
-     *  as it's freed by iov
+     * Enable CORK/NO_PUSH
+     * -------------------
+     * If it was compiled for Linux, it will turn the Cork off after
+     * send the first round of bytes from the target static file.
+     *
+     * For OSX, it sets TCP_NOPUSH off after send all HTTP headers. Refer
+     * to mk_header.c for more details.
      */
-    mk_mem_free(location);
-    sr->headers.location = NULL;
-    return -1;
+    mk_http_cork_flag(cs, TCP_CORK_ON);
+
+    /* Start sending data to the channel */
+    return mk_channel_write(&cs->channel);
 }
 
-/* Look for some  index.xxx in pathfile */
-mk_ptr_t mk_http_index_file(char *pathfile, char *file_aux,
-                            const unsigned int flen)
+/* Asset of the virtual host pack for a request path, index files included */
+static struct mk_pack_record *mk_http_pack_lookup(struct mk_pack *pack,
+                                                  mk_ptr_t *uri)
 {
-    unsigned long len;
-    mk_ptr_t f;
-    struct mk_string_line *entry;
+    int len;
+    char path[MK_MAX_PATH];
     struct mk_list *head;
+    struct mk_string_line *entry;
+    struct mk_pack_record *record;
 
-    mk_ptr_reset(&f);
-    if (!mk_config->index_files) return f;
+    record = mk_pack_lookup(pack, uri->data, uri->len);
+    if (record || !mk_config->index_files ||
+        uri->len == 0 || uri->data[uri->len - 1] != '/') {
+        return record;
+    }
 
     mk_list_foreach(head, mk_config->index_files) {
         entry = mk_list_entry(head, struct mk_string_line, _head);
-        len = snprintf(file_aux, flen, "%s%s", pathfile, entry->val);
-        if (mk_unlikely(len > flen)) {
-            len = flen - 1;
-            mk_warn("Path too long, truncated! '%s'", file_aux);
+        len = snprintf(path, sizeof(path), "%.*s%s",
+                       (int) uri->len, uri->data, entry->val);
+        if (len >= (int) sizeof(path)) {
+            continue;
         }
 
-        if (access(file_aux, F_OK) == 0) {
-            f.data = file_aux;
-            f.len = len;
-            return f;
+        record = mk_pack_lookup(pack, path, len);
+        if (record) {
+            return record;
         }
     }
 
-    return f;
+    return NULL;
 }
 
-void mk_http_cb_file_finished(struct mk_stream *stream)
+/*
+ * Serve an asset of the virtual host pack: the metadata, headers and entity
+ * tag come from the pack index and the content is sent from the descriptor
+ * of the pack, no file is looked up nor opened.
+ */
+static int mk_http_pack_send(struct mk_http_session *cs,
+                             struct mk_http_request *sr,
+                             struct mk_pack *pack,
+                             struct mk_pack_record *record)
 {
-    (void) stream;
+    int ret;
+    mk_ptr_t type;
 
-    MK_TRACE("File finished");
-}
+    sr->headers.pconnections_left = (int)
+        (mk_config->max_keep_alive_request - cs->counter_connections);
+    mk_header_set_http_status(sr, MK_HTTP_OK);
+    sr->headers.location = NULL;
 
-#if defined (__linux__)
-void mk_http_cb_file_on_consume(struct mk_stream *stream, long bytes)
-{
-    (void) bytes;
+    sr->headers.last_modified  = record->mtime;
+    sr->headers.content_length = record->size;
+    sr->headers.real_length    = record->size;
+    sr->headers.etag.data = pack->strings + record->etag;
+    sr->headers.etag.len  = record->etag_len;
 
-    /*
-     * This callback is invoked just once as we want to turn off
-     * the TCP Cork. We do this just overriding the callback for
-     * the file stream.
-     */
-    mk_server_cork_flag(stream->channel->fd, TCP_CORK_OFF);
-    stream->cb_bytes_consumed = NULL;
+    type.data = pack->strings + record->type;
+    type.len  = record->type_len;
+
+    ret = mk_http_conditional(sr);
+    if (ret == MK_NOT_MODIFIED) {
+        mk_header_set_http_status(sr, MK_NOT_MODIFIED);
+        sr->headers.content_length = -1;
+        mk_header_prepare(cs, sr);
+        mk_channel_write(&cs->channel);
+        return EXIT_NORMAL;
+    }
+    else if (ret == MK_CLIENT_PRECOND_FAILED) {
+        return mk_http_error(MK_CLIENT_PRECOND_FAILED, cs, sr);
+    }
+
+    /* The descriptor belongs to the pack, it's not closed with the request */
+    sr->pack_record = record;
+    sr->file_stream.channel = &cs->channel;
+    sr->file_stream.fd = pack->fd;
+    sr->file_stream.bytes_offset = record->offset;
+    sr->file_stream.bytes_total  = record->size;
+
+    return mk_http_file_send(cs, sr, &type, record->offset);
 }
-#endif
 
 int mk_http_init(struct mk_http_session *cs, struct mk_http_request *sr)
 {
     int ret;
     struct mimetype *mime;
+    struct mk_pack_record *record;
 
     MK_TRACE("[FD %i] HTTP Protocol Init, session %p", cs->socket, sr);
 
-    /* Request to root path of the virtualhost in question */
-    if (sr->uri_processed.len == 1 && sr->uri_processed.data[0] == '/') {
-        sr->real_path.data = sr->host_conf->documentroot.data;
-        sr->real_path.len = sr->host_conf->documentroot.len;
-    }
-
-    /* Compose real path */
-    if (sr->user_home == MK_FALSE) {
-        int len;
-
-        len = sr->host_conf->documentroot.len + sr->uri_processed.len;
-        if (len < MK_PATH_BASE) {
-            memcpy(sr->real_path_static,
-                   sr->host_conf->documentroot.data,
-                   sr->host_conf->documentroot.len);
-            memcpy(sr->real_path_static + sr->host_conf->documentroot.len,
-                   sr->uri_processed.data,
-                   sr->uri_processed.len);
-            sr->real_path_static[len] = '\0';
-            sr->real_path.data = sr->real_path_static;
-            sr->real_path.len = len;
-        }
-        else {
-            ret = mk_buffer_cat(&sr->real_path,
-                                sr->host_conf->documentroot.data,
-                                sr->host_conf->documentroot.len,
-                                sr->uri_processed.data,
-                                sr->uri_processed.len);
-
-            if (ret < 0) {
-                MK_TRACE("Error composing real path");
-                return EXIT_ERROR;
-            }
-        }
-    }
-
-    /* Check backward directory request */
-    if (memmem(sr->uri_processed.data, sr->uri_processed.len,
-               MK_HTTP_DIRECTORY_BACKWARD,
-               sizeof(MK_HTTP_DIRECTORY_BACKWARD) - 1)) {
-        return mk_http_error(MK_CLIENT_FORBIDDEN, cs, sr);
-    }
-
     if (sr->_content_length.data &&
         (sr->method != MK_METHOD_POST &&
          sr->method != MK_METHOD_PUT)) {
         return mk_http_error(MK_CLIENT_BAD_REQUEST, cs, sr);
     }
 
-
-    if (mk_file_get_info(sr->real_path.data,
-                         &sr->file_info,
-                         MK_FILE_READ) != 0) {
+    /*
+     * Assets of the virtual host pack: the pack index replaces the look up
+     * of the file, the handlers of stage 30 still see the request.
+     */
+    record = NULL;
+    if (sr->host_conf->pack && sr->user_home == MK_FALSE &&
+        (sr->method == MK_METHOD_GET || sr->method == MK_METHOD_HEAD)) {
+        record = mk_http_pack_lookup(sr->host_conf->pack, &sr->uri_processed);
+    }
+
+    if (record) {
+        memset(&sr->file_info, 0, sizeof(struct file_info));
+        sr->file_info.size = record->size;
+        sr->file_info.inode = record->offset;
+        sr->file_info.last_modification = record->mtime;
+        sr->file_info.exists = MK_TRUE;
+        sr->file_info.is_file = MK_TRUE;
+        sr->file_info.read_access = MK_TRUE;
+    }
+    else if (mk_stat_cache_get_info(sr->real_path.data,
+                                    sr->real_path.len,
+                                    &sr->file_info) != 0) {
         /* if the requested resource doesn't exist,
          * check if some plugin would like to handle it
          */
@@ -871,7 +1911,7 @@ int mk_http_init(struct mk_http_session *cs, struct mk_http_request *sr)
             return MK_PLUGIN_RET_CONTINUE;
         }
         else if (ret == MK_PLUGIN_RET_END) {
-            return EXIT_NORMAL;
+            return mk_http_plugin_end(cs);
         }
 
         if (sr->file_info.exists == MK_FALSE) {
@@ -915,7 +1955,8 @@ int mk_http_init(struct mk_http_session *cs, struct mk_http_request *sr)
                 sr->real_path.data = mk_string_dup(index_file.data);
             }
 
-            mk_file_get_info(sr->real_path.data, &sr->file_info, MK_FILE_READ);
+            mk_stat_cache_get_info(sr->real_path.data, sr->real_path.len,
+                                   &sr->file_info);
         }
     }
 
@@ -949,7 +1990,7 @@ int mk_http_init(struct mk_http_session *cs, struct mk_http_request *sr)
                 return mk_http_error(MK_CLIENT_FORBIDDEN, cs, sr);
             }
         case MK_PLUGIN_RET_END:
-            return EXIT_NORMAL;
+            return mk_http_plugin_end(cs);
         }
     }
 
@@ -963,6 +2004,10 @@ int mk_http_init(struct mk_http_session *cs, struct mk_http_request *sr)
         return mk_http_error(MK_SERVER_NOT_IMPLEMENTED, cs, sr);
     }
 
+    if (record) {
+        return mk_http_pack_send(cs, sr, sr->host_conf->pack, record);
+    }
+
     /* counter connections */
     sr->headers.pconnections_left = (int)
         (mk_config->max_keep_alive_request - cs->counter_connections);
@@ -1010,106 +2055,111 @@ int mk_http_init(struct mk_http_session *cs, struct mk_http_request *sr)
         return mk_http_error(MK_CLIENT_NOT_FOUND, cs, sr);
     }
 
-    sr->headers.last_modified = sr->file_info.last_modification;
-
-    if (sr->if_modified_since.data && sr->method == MK_METHOD_GET) {
-        time_t date_client;       /* Date sent by client */
-        time_t date_file_server;  /* Date server file */
-
-        date_client = mk_utils_gmt2utime(sr->if_modified_since.data);
-        date_file_server = sr->file_info.last_modification;
-
-        if (date_file_server <= date_client &&
-            date_client > 0) {
-            mk_header_set_http_status(sr, MK_NOT_MODIFIED);
-            mk_header_prepare(cs, sr);
-            mk_channel_write(&cs->channel);
-            return EXIT_NORMAL;
-        }
+    /* Compressed sibling of the file, the mime type is the original one */
+    if (mk_config->precompressed == MK_TRUE &&
+        (sr->method == MK_METHOD_GET || sr->method == MK_METHOD_HEAD)) {
+        mk_http_precompressed(sr);
     }
 
+    sr->headers.last_modified = sr->file_info.last_modification;
+
     /* Object size for log and response headers */
     sr->headers.content_length = sr->file_info.size;
     sr->headers.real_length = sr->file_info.size;
 
-    /* Open file */
-    sr->file_stream.channel = &cs->channel;
+    /*
+     * Static response: reuse the cached header block of the file, it also
+     * carries the entity tag used to evaluate the conditional headers.
+     */
+    if (sr->method == MK_METHOD_GET || sr->method == MK_METHOD_HEAD) {
+        sr->headers.block = mk_stat_cache_header_block(sr->real_path.data,
+                                                       sr->real_path.len,
+                                                       &mime->header_type);
+    }
 
-    if (mk_likely(sr->file_info.size > 0)) {
-        sr->file_stream.fd = mk_vhost_open(sr);
-        if (sr->file_stream.fd == -1) {
-            MK_TRACE("open() failed");
-            return mk_http_error(MK_CLIENT_FORBIDDEN, cs, sr);
+    if (sr->headers.block) {
+        sr->headers.etag = sr->headers.block->etag;
+    }
+    else {
+        ret = mk_header_etag_create(&sr->file_info, sr->headers.etag_buf,
+                                    sizeof(sr->headers.etag_buf));
+        if (ret > 0) {
+            sr->headers.etag.data = sr->headers.etag_buf;
+            sr->headers.etag.len  = ret;
         }
-        sr->file_stream.bytes_offset = 0;
-        sr->file_stream.bytes_total  = sr->file_info.size;
     }
 
-    /* Process methods */
-    if (sr->method == MK_METHOD_GET || sr->method == MK_METHOD_HEAD) {
-        sr->headers.content_type = mime->header_type;
-
-        /* HTTP Ranges */
-        if (sr->range.data != NULL && mk_config->resume == MK_TRUE) {
-            if (mk_http_range_parse(sr) < 0) {
-                sr->headers.ranges[0] = -1;
-                sr->headers.ranges[1] = -1;
-                return mk_http_error(MK_CLIENT_BAD_REQUEST, cs, sr);
-            }
-            if (sr->headers.ranges[0] >= 0 || sr->headers.ranges[1] >= 0) {
-                mk_header_set_http_status(sr, MK_HTTP_PARTIAL);
-            }
-
-            /* Calc bytes to send & offset */
-            if (mk_http_range_set(sr, sr->file_info.size) != 0) {
-                sr->headers.content_length = -1;
-                sr->headers.ranges[0] = -1;
-                sr->headers.ranges[1] = -1;
-                return mk_http_error(MK_CLIENT_REQUESTED_RANGE_NOT_SATISF, cs, sr);
-            }
+    /*
+     * On-the-fly compression of static content. The response of a
+     * compressible file depends on Accept-Encoding whatever it is sent as,
+     * shared caches must not hand the identity copy to a gzip client.
+     */
+    if (mk_config->compression == MK_TRUE && mime->compress == MK_TRUE &&
+        (sr->method == MK_METHOD_GET || sr->method == MK_METHOD_HEAD) &&
+        sr->file_info.size >= mk_config->compression_min_size &&
+        sr->file_info.size <= mk_config->compression_max_size) {
+        mk_ptr_set(&sr->headers.vary, "Accept-Encoding\r\n");
+
+        if (sr->accept_encoding.data && sr->headers.content_encoding.len == 0 &&
+            !(sr->range.data != NULL && mk_config->resume == MK_TRUE)) {
+            mk_http_deflate(sr);
         }
     }
-    else {
-        /* without content-type */
-        mk_ptr_reset(&sr->headers.content_type);
+
+    /* Conditional request: a 304 is answered from the file metadata only */
+    ret = mk_http_conditional(sr);
+    if (ret == MK_NOT_MODIFIED) {
+        mk_header_set_http_status(sr, MK_NOT_MODIFIED);
+        sr->headers.content_length = -1;
+        mk_header_prepare(cs, sr);
+        mk_channel_write(&cs->channel);
+        return EXIT_NORMAL;
+    }
+    else if (ret == MK_CLIENT_PRECOND_FAILED) {
+        return mk_http_error(MK_CLIENT_PRECOND_FAILED, cs, sr);
     }
 
-    /* Send headers */
-    mk_header_prepare(cs, sr);
-    if (mk_unlikely(sr->headers.content_length == 0)) {
-        return 0;
+    /* Compressed content is sent from memory */
+    if (sr->deflate_variant) {
+        sr->headers.content_type = mime->header_type;
+        mk_header_prepare(cs, sr);
+        if (sr->method == MK_METHOD_GET) {
+            mk_stream_set(&sr->page_stream, MK_STREAM_BUFFER, &cs->channel,
+                          sr->deflate_variant, -1, NULL,
+                          NULL, NULL, NULL);
+        }
+        return mk_channel_write(&cs->channel);
     }
 
-    /* Send file content */
-    if (sr->method == MK_METHOD_GET || sr->method == MK_METHOD_POST) {
-        /* Note: bytes and offsets are set after the Range check */
-        sr->file_stream.type = MK_STREAM_FILE;
-        mk_channel_append_stream(&cs->channel, &sr->file_stream);
+    /* Small files carry their content on the block, the file is not opened */
+    if (sr->headers.block && sr->headers.block->body.data &&
+        !(sr->range.data != NULL && mk_config->resume == MK_TRUE)) {
+        sr->headers.content_type = mime->header_type;
+        mk_header_prepare(cs, sr);
+
+        /* Gathered with the headers, it still goes out in a single write */
+        if (sr->method == MK_METHOD_GET) {
+            mk_stream_set(&sr->page_stream, MK_STREAM_PTR, &cs->channel,
+                          &sr->headers.block->body, -1, NULL,
+                          NULL, NULL, NULL);
+        }
+        return mk_channel_write(&cs->channel);
     }
 
-    /*
-     * Enable TCP Cork for the remote socket. It will be disabled
-     * later by the file stream on the channel after send the first
-     * file bytes.
-     */
-#if defined(__linux__)
-    sr->file_stream.cb_bytes_consumed = mk_http_cb_file_on_consume;
-#endif
-    sr->file_stream.cb_finished       = mk_http_cb_file_finished;
+    /* Open file */
+    sr->file_stream.channel = &cs->channel;
 
-    /*
-     * Enable CORK/NO_PUSH
-     * -------------------
-     * If it was compiled for Linux, it will turn the Cork off after
-     * send the first round of bytes from the target static file.
-     *
-     * For OSX, it sets TCP_NOPUSH off after send all HTTP headers. Refer
-     * to mk_header.c for more details.
-     */
-    mk_server_cork_flag(cs->socket, TCP_CORK_ON);
+    if (mk_likely(sr->file_info.size > 0)) {
+        sr->file_stream.fd = mk_fdt_open(sr);
+        if (sr->file_stream.fd == -1) {
+            MK_TRACE("open() failed");
+            return mk_http_error(MK_CLIENT_FORBIDDEN, cs, sr);
+        }
+        sr->file_stream.bytes_offset = 0;
+        sr->file_stream.bytes_total  = sr->file_info.size;
+    }
 
-    /* Start sending data to the channel */
-    return mk_channel_write(&cs->channel);
+    return mk_http_file_send(cs, sr, &mime->header_type, 0);
 }
 
 /*
@@ -1156,11 +2206,47 @@ int mk_http_keepalive_check(struct mk_http_session *cs)
     return 0;
 }
 
+/*
+ * Adaptive send watermark: a connection that took at least twice its
+ * watermark in a single write event drains its socket fast, it gets a
+ * bigger one (up to SendLowatMax) so it's refilled less often.
+ */
+void mk_http_sock_adapt(struct mk_http_session *cs, unsigned long long bytes)
+{
+    long lowat;
+
+    if (mk_config->send_lowat_max <= 0) {
+        return;
+    }
+
+    if (cs->send_lowat < 0) {
+        cs->send_lowat = mk_socket_get_notsent_lowat(cs->socket);
+    }
+
+    /* No watermark set, the kernel keeps the whole send buffer */
+    if (cs->send_lowat == 0 || cs->send_lowat >= mk_config->send_lowat_max ||
+        bytes < (unsigned long long) cs->send_lowat * 2) {
+        return;
+    }
+
+    lowat = (long) cs->send_lowat * 2;
+    if (lowat > mk_config->send_lowat_max) {
+        lowat = mk_config->send_lowat_max;
+    }
+
+    if (mk_socket_set_notsent_lowat(cs->socket, lowat) == 0) {
+        cs->send_lowat = lowat;
+        if (worker_sched_node) {
+            worker_sched_node->sock_stats.raised++;
+        }
+    }
+}
+
 int mk_http_request_end(int socket)
 {
     int ka;
+    int ret;
     struct mk_http_session *cs;
-    struct mk_http_request *sr;
     struct sched_list_node *sched;
 
     sched = mk_sched_get_thread_conf();
@@ -1175,25 +2261,6 @@ int mk_http_request_end(int socket)
         return -1;
     }
 
-    /* Check if we have some enqueued pipeline requests */
-    if (cs->pipelined == MK_TRUE) {
-        sr =  mk_list_entry_first(&cs->request_list, struct mk_http_request, _head);
-        MK_TRACE("[FD %i] Pipeline finishing %p", socket, sr);
-
-        /* Remove node and release resources */
-        mk_list_del(&sr->_head);
-        mk_http_request_free(sr);
-
-        if (mk_list_is_empty(&cs->request_list) != 0) {
-#ifdef TRACE
-            sr = mk_list_entry_first(&cs->request_list, struct mk_http_request, _head);
-            MK_TRACE("[FD %i] Pipeline next is %p", socket, sr);
-#endif
-            return 0;
-        }
-    }
-
-
     /*
      * We need to ask to http_keepalive if this
      * connection can continue working or we must
@@ -1208,6 +2275,18 @@ int mk_http_request_end(int socket)
     }
     else {
         mk_http_request_ka_next(cs);
+
+        /* A pipelined request may be waiting in the buffer already */
+        if (cs->body_length > 0) {
+            ret = mk_http_handler_parse(socket, cs);
+            if (ret == MK_HTTP_PARSER_ERROR) {
+                return -1;
+            }
+            else if (ret == MK_HTTP_PARSER_OK) {
+                return 0;
+            }
+        }
+
         mk_event_add(sched->loop, socket, MK_EVENT_READ, NULL);
         return 0;
     }
@@ -1312,6 +2391,12 @@ int mk_http_error(int http_status, struct mk_http_session *cs,
         mk_ptr_free(&message);
         break;
 
+    case MK_CLIENT_PRECOND_FAILED:
+        page = mk_http_error_page("Precondition Failed",
+                                  &sr->uri,
+                                  mk_config->server_signature);
+        break;
+
     case MK_CLIENT_METHOD_NOT_ALLOWED:
         page = mk_http_error_page("Method Not Allowed",
                                   &sr->uri,
@@ -1350,6 +2435,7 @@ int mk_http_error(int http_status, struct mk_http_session *cs,
     sr->headers.cgi = SH_NOCGI;
     sr->headers.pconnections_left = 0;
     sr->headers.last_modified = -1;
+    mk_ptr_reset(&sr->headers.etag);
 
     if (!page) {
         mk_ptr_reset(&sr->headers.content_type);
@@ -1372,7 +2458,7 @@ int mk_http_error(int http_status, struct mk_http_session *cs,
     }
 
     /* Turn off TCP_CORK */
-    mk_server_cork_flag(cs->socket, TCP_CORK_OFF);
+    mk_http_cork_flag(cs, TCP_CORK_OFF);
     mk_channel_write(&cs->channel);
 
     return EXIT_NORMAL;
@@ -1389,6 +2475,8 @@ void mk_http_session_remove(int socket)
     cs_node = mk_http_session_get(socket);
     if (cs_node) {
         rb_erase(&cs_node->_rb_head, cs_list);
+        mk_readahead_cancel(&cs_node->channel);
+        mk_channel_clean(&cs_node->channel);
         if (cs_node->body != cs_node->body_fixed) {
             mk_mem_free(cs_node->body);
         }
@@ -1444,12 +2532,22 @@ struct mk_http_session *mk_http_session_create(int socket,
     cs->counter_connections = 0;
     cs->socket = socket;
     cs->status = MK_REQUEST_STATUS_INCOMPLETE;
+    cs->send_lowat = -1;
+    cs->sock_host = NULL;
     mk_list_add(&cs->request_incomplete, cs_incomplete);
 
     /* Stream channel */
-    cs->channel.type = MK_CHANNEL_SOCKET;
-    cs->channel.fd   = socket;
+    cs->channel.type   = MK_CHANNEL_SOCKET;
+    cs->channel.fd     = socket;
+    cs->channel.status = MK_CHANNEL_ENABLED;
+    cs->channel.job    = NULL;
+    cs->channel.pipe   = NULL;
+    cs->channel.relay_wait = -1;
+    cs->channel.chunked = MK_FALSE;
+    cs->channel.zerocopy = MK_CHANNEL_ZEROCOPY_UNKNOWN;
+    cs->channel.zerocopy_id = 0;
     mk_list_init(&cs->channel.streams);
+    mk_list_init(&cs->channel.zerocopy_pins);
 
     /* creation time in unix time */
     cs->init_time = sc->arrive_time;
@@ -1467,6 +2565,7 @@ struct mk_http_session *mk_http_session_create(int socket,
 
     /* Current data length */
     cs->body_length = 0;
+    cs->body_offset = 0;
 
     /* Init session request list */
     mk_list_init(&cs->request_list);
@@ -1517,24 +2616,57 @@ struct mk_http_session *mk_http_session_create(int socket,
 
 void mk_http_request_free(struct mk_http_request *sr)
 {
-    if (sr->vhost_fdt_enabled == MK_TRUE) {
-        mk_vhost_close(sr);
+    /* A dynamic virtual host is held while the request uses it */
+    mk_vhost_release(sr->host_conf);
+    sr->host_conf = NULL;
+
+    if (sr->fdt_entry) {
+        mk_fdt_close(sr);
     }
-    else if(sr->file_stream.fd > 0) {
+    else if (sr->file_stream.fd > 0 && !sr->pack_record) {
         close(sr->file_stream.fd);
     }
 
+    if (sr->headers.block) {
+        mk_header_block_release(sr->headers.block);
+        sr->headers.block = NULL;
+    }
+
+    if (sr->deflate_variant) {
+        mk_stream_buffer_release(sr->deflate_variant);
+        sr->deflate_variant = NULL;
+    }
+
+    if (sr->multirange) {
+        mk_mem_free(sr->multirange);
+        sr->multirange = NULL;
+    }
+
     if (sr->headers.location) {
         mk_mem_free(sr->headers.location);
     }
 
-    if (sr->uri_processed.data != sr->uri.data) {
+    /* The processed URI is kept in the static path unless it did not fit */
+    if (sr->uri_processed.data &&
+        (sr->uri_processed.data < sr->real_path_static ||
+         sr->uri_processed.data >= sr->real_path_static + MK_PATH_BASE)) {
         mk_ptr_free(&sr->uri_processed);
     }
 
     if (sr->real_path.data != sr->real_path_static) {
         mk_ptr_free(&sr->real_path);
     }
+
+    /* Response headers that were not completely sent */
+    if (sr->headers_stream.buffer) {
+        mk_iov_free_marked(sr->headers_stream.buffer);
+        sr->headers_stream.buffer = NULL;
+    }
+
+    if (sr->headers.iov) {
+        mk_iov_free(sr->headers.iov);
+        sr->headers.iov = NULL;
+    }
 }
 
 void mk_http_request_free_list(struct mk_http_session *cs)
@@ -1558,7 +2690,21 @@ void mk_http_request_free_list(struct mk_http_session *cs)
 
 void mk_http_request_ka_next(struct mk_http_session *cs)
 {
-    cs->body_length = 0;
+    /*
+     * Pipelined data not consumed yet is moved to the beginning of the
+     * buffer, so the next request is parsed from there.
+     */
+    if (cs->body_offset > 0 && cs->body_offset < cs->body_length) {
+        cs->body_length -= cs->body_offset;
+        memmove(cs->body, cs->body + cs->body_offset, cs->body_length);
+        cs->body[cs->body_length] = '\0';
+    }
+    else {
+        cs->body_length = 0;
+    }
+
+    cs->body_offset = 0;
+    cs->pipelined = MK_FALSE;
     cs->counter_connections++;
 
     /* Update data for scheduler */
@@ -65,8 +65,12 @@ struct row_entry mk_headers_table[] = {
     { 14, "content-length"      },
     { 13, "content-range"       },
     { 12, "content-type"        },
+    {  6, "expect"              },
     {  4, "host"                },
+    {  8, "if-match"            },
     { 17, "if-modified-since"   },
+    { 13, "if-none-match"       },
+    {  8, "if-range"            },
     { 13, "last-modified"       },
     { 19, "last-modified-since" },
     {  5, "range"               },
@@ -268,6 +272,17 @@ static inline int header_lookup(struct mk_http_parser *p, char *buffer)
                     p->header_connection = MK_HTTP_PARSER_CONN_UNKNOWN;
                 }
             }
+            else if (i == MK_HEADER_EXPECT) {
+                /* Only the 100-continue expectation is supported */
+                if (header->val.len == sizeof(MK_EXPECT_CONTINUE) - 1 &&
+                    header_cmp(MK_EXPECT_CONTINUE,
+                               header->val.data, header->val.len) == 0) {
+                    p->header_expect = MK_HTTP_PARSER_EXPECT_CONTINUE;
+                }
+                else {
+                    p->header_expect = MK_HTTP_PARSER_EXPECT_UNKNOWN;
+                }
+            }
             return 0;
         }
     }
@@ -327,6 +342,33 @@ static inline int mk_http_parser_ok(struct mk_http_request *req,
     return MK_HTTP_PARSER_OK;
 }
 
+/*
+ * The body starts right after the empty line that ends the headers (p->start),
+ * its size is given by Content-Length: any byte beyond it belongs to the next
+ * pipelined request.
+ */
+static inline int mk_http_parser_body(struct mk_http_request *req,
+                                      struct mk_http_parser *p,
+                                      char *buffer, int len)
+{
+    if (p->header_content_length > 0) {
+        p->body_received = len - p->start;
+        if (p->body_received < p->header_content_length) {
+            return MK_HTTP_PARSER_PENDING;
+        }
+
+        p->body_received  = p->header_content_length;
+        p->request_length = p->start + p->header_content_length;
+        req->data.data = buffer + p->start;
+        req->data.len  = p->header_content_length;
+    }
+    else {
+        p->request_length = p->start;
+    }
+
+    return mk_http_parser_ok(req, p);
+}
+
 /*
  * Parse the protocol and point relevant fields, don't take logic decisions
  * based on this, just parse to locate things.
@@ -483,6 +525,7 @@ int mk_http_parser(struct mk_http_request *req, struct mk_http_parser *p,
                 break;
             case MK_ST_BLOCK_END:
                 if (buffer[i] == '\n') {
+                    p->request_length = i + 1;
                     return mk_http_parser_ok(req, p);
                 }
                 else {
@@ -536,11 +579,15 @@ int mk_http_parser(struct mk_http_request *req, struct mk_http_parser *p,
                         p->header_min = MK_HEADER_CACHE_CONTROL;
                         p->header_max = MK_HEADER_CONTENT_TYPE;
                         break;
+                    case 'e':
+                        header_scope_eq(p, MK_HEADER_EXPECT);
+                        break;
                     case 'h':
                         header_scope_eq(p, MK_HEADER_HOST);
                         break;
                     case 'i':
-                        header_scope_eq(p, MK_HEADER_IF_MODIFIED_SINCE);
+                        p->header_min = MK_HEADER_IF_MATCH;
+                        p->header_max = MK_HEADER_IF_RANGE;
                         break;
                     case 'l':
                         p->header_min = MK_HEADER_LAST_MODIFIED;
@@ -584,6 +631,9 @@ int mk_http_parser(struct mk_http_request *req, struct mk_http_parser *p,
             /* Parsing the header value */
             else if (p->status == MK_ST_HEADER_VALUE) {
                 /* Trim left, set starts only when found something != ' ' */
+                if (buffer[i] == ' ') {
+                    continue;
+                }
                 p->status = MK_ST_HEADER_VAL_STARTS;
                 p->start = p->header_val = i;
                 continue;
@@ -656,17 +706,7 @@ int mk_http_parser(struct mk_http_request *req, struct mk_http_parser *p,
              * - A Pipeline Request
              * - A Body content (POST/PUT methods)
              */
-            if (p->header_content_length > 0) {
-                p->body_received += (len - i);
-
-                if (p->body_received == p->header_content_length) {
-                    return mk_http_parser_ok(req, p);
-                }
-                else {
-                    return MK_HTTP_PARSER_PENDING;
-                }
-            }
-            return mk_http_parser_ok(req, p);
+            return mk_http_parser_body(req, p, buffer, len);
         }
     }
 
@@ -695,25 +735,7 @@ int mk_http_parser(struct mk_http_request *req, struct mk_http_parser *p,
         }
     }
     else if (p->level == REQ_LEVEL_BODY) {
-        if (p->header_content_length > 0) {
-            p->body_received += (len - i);
-            if (p->header_content_length == p->body_received) {
-                return mk_http_parser_ok(req, p);
-            }
-            else {
-                return MK_HTTP_PARSER_PENDING;
-            }
-        }
-        if (p->header_content_length > 0 &&
-            p->body_received <= p->header_content_length) {
-            return MK_HTTP_PARSER_PENDING;
-        }
-        else if (p->chars == 0) {
-            return mk_http_parser_ok(req, p);
-        }
-        else {
-        }
-
+        return mk_http_parser_body(req, p, buffer, len);
     }
 
     return MK_HTTP_PARSER_PENDING;
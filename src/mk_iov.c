@@ -21,6 +21,7 @@
 #include <fcntl.h>
 
 #include <sys/uio.h>
+#include <sys/socket.h>
 #include <sys/mman.h>
 #include <errno.h>
 #include <stdio.h>
@@ -115,6 +116,29 @@ ssize_t mk_iov_send(int fd, struct mk_iov *mk_io)
     return n;
 }
 
+/* Same as mk_iov_send() but more data follows, the kernel holds a partial frame */
+ssize_t mk_iov_send_more(int fd, struct mk_iov *mk_io)
+{
+#if defined(MSG_MORE)
+    ssize_t n;
+    struct msghdr msg;
+
+    memset(&msg, '\0', sizeof(msg));
+    msg.msg_iov    = mk_io->io;
+    msg.msg_iovlen = mk_io->iov_idx;
+
+    n = sendmsg(fd, &msg, MSG_MORE);
+    if (mk_unlikely(n < 0)) {
+        MK_TRACE( "[FD %i] sendmsg() '%s'", fd, strerror(errno));
+        return -1;
+    }
+
+    return n;
+#else
+    return mk_iov_send(fd, mk_io);
+#endif
+}
+
 void mk_iov_free(struct mk_iov *mk_io)
 {
     mk_iov_free_marked(mk_io);
@@ -118,6 +118,11 @@ int mk_kernel_features()
         flags |= MK_KERNEL_TCP_FASTOPEN;
     }
 
+    /* MSG_ZEROCOPY for TCP */
+    if (mk_kernel_runver >= MK_KERNEL_VERSION(4, 14, 0)) {
+        flags |= MK_KERNEL_MSG_ZEROCOPY;
+    }
+
     mk_config->kernel_features = flags;
     return flags;
 }
@@ -142,7 +147,13 @@ int mk_kernel_features_print(char *buffer, size_t size)
     }
 
     if (mk_config->kernel_features & MK_KERNEL_TCP_AUTOCORKING) {
-        snprintf(buffer + offset, size - offset, "%s", "TCP_AUTOCORKING ");
+        offset += snprintf(buffer + offset, size - offset, "%s", "TCP_AUTOCORKING ");
+        features++;
+    }
+
+    if ((mk_config->kernel_features & MK_KERNEL_MSG_ZEROCOPY) &&
+        mk_config->zerocopy > 0) {
+        snprintf(buffer + offset, size - offset, "%s", "MSG_ZEROCOPY ");
         features++;
     }
 
@@ -0,0 +1,277 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <unistd.h>
+#include <setjmp.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <monkey/monkey.h>
+#include <monkey/mk_mmap.h>
+#include <monkey/mk_config.h>
+#include <monkey/mk_memory.h>
+#include <monkey/mk_scheduler.h>
+#include <monkey/mk_macros.h>
+
+static pthread_mutex_t mk_mmap_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct mk_list mk_mmap_table[MK_MMAP_BUCKETS];
+static struct mk_list mk_mmap_lru;
+static long mk_mmap_bytes;     /* size of the mappings alive */
+
+/* Recovery point of the thread copying from a mapping, see mk_mmap_read() */
+static __thread sigjmp_buf *mk_mmap_jmp;
+
+static inline struct mk_mmap_stats *mk_mmap_stats_get()
+{
+    struct sched_list_node *sched;
+
+    sched = mk_sched_get_thread_conf();
+    if (mk_unlikely(!sched)) {
+        return NULL;
+    }
+
+    return &sched->mmap_stats;
+}
+
+/* Release an entry, the caller must hold the lock */
+static void mk_mmap_entry_free(struct mk_mmap_entry *entry)
+{
+    /* Stale entries are neither on the table nor on the idle list */
+    if (entry->stale == MK_FALSE) {
+        mk_list_del(&entry->_head);
+        if (entry->refs == 0) {
+            mk_list_del(&entry->_lru);
+        }
+    }
+
+    munmap(entry->addr, entry->size);
+    mk_mmap_bytes -= entry->size;
+    mk_mem_free(entry);
+}
+
+void mk_mmap_init()
+{
+    int i;
+
+    for (i = 0; i < MK_MMAP_BUCKETS; i++) {
+        mk_list_init(&mk_mmap_table[i]);
+    }
+    mk_list_init(&mk_mmap_lru);
+    mk_mmap_bytes = 0;
+}
+
+void mk_mmap_exit()
+{
+    int i;
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_mmap_entry *entry;
+
+    for (i = 0; i < MK_MMAP_BUCKETS; i++) {
+        mk_list_foreach_safe(head, tmp, &mk_mmap_table[i]) {
+            entry = mk_list_entry(head, struct mk_mmap_entry, _head);
+            mk_mmap_entry_free(entry);
+        }
+    }
+}
+
+/*
+ * Return a mapping of the whole file behind a descriptor, the caller must
+ * release it. NULL means the file is not cached (cache disabled, file
+ * empty or bigger than the budget) and it must be read as usual.
+ */
+struct mk_mmap_entry *mk_mmap_get(int fd)
+{
+    void *addr;
+    struct stat st;
+    struct mk_list *head;
+    struct mk_list *bucket;
+    struct mk_mmap_entry *entry;
+    struct mk_mmap_entry *victim;
+    struct mk_mmap_stats *stats;
+
+    if (mk_config->mmap_cache <= 0) {
+        return NULL;
+    }
+
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0 ||
+        st.st_size > mk_config->mmap_cache) {
+        return NULL;
+    }
+
+    stats  = mk_mmap_stats_get();
+    bucket = &mk_mmap_table[(st.st_ino ^ st.st_dev) % MK_MMAP_BUCKETS];
+
+    pthread_mutex_lock(&mk_mmap_mutex);
+    mk_list_foreach(head, bucket) {
+        entry = mk_list_entry(head, struct mk_mmap_entry, _head);
+        if (entry->inode != st.st_ino || entry->dev != st.st_dev) {
+            continue;
+        }
+
+        if (entry->size == st.st_size && entry->mtime == st.st_mtime) {
+            if (entry->refs++ == 0) {
+                mk_list_del(&entry->_lru);
+            }
+            pthread_mutex_unlock(&mk_mmap_mutex);
+            if (stats) {
+                stats->hits++;
+            }
+            return entry;
+        }
+
+        /* The file changed, the current readers keep the old mapping */
+        if (stats) {
+            stats->invalidations++;
+        }
+        if (entry->refs == 0) {
+            mk_mmap_entry_free(entry);
+        }
+        else {
+            mk_list_del(&entry->_head);
+            entry->stale = MK_TRUE;
+        }
+        break;
+    }
+
+    /* Make room, only idle mappings can be released */
+    while (mk_mmap_bytes + st.st_size > mk_config->mmap_cache) {
+        if (mk_list_is_empty(&mk_mmap_lru) == 0) {
+            pthread_mutex_unlock(&mk_mmap_mutex);
+            return NULL;
+        }
+
+        victim = mk_list_entry_first(&mk_mmap_lru, struct mk_mmap_entry, _lru);
+        mk_mmap_entry_free(victim);
+        if (stats) {
+            stats->evictions++;
+        }
+    }
+
+    /*
+     * Map it holding the lock, so two workers missing the same file do not
+     * map it twice; it's just the cost of the mmap(2) call, pages are read
+     * on demand.
+     */
+    addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        pthread_mutex_unlock(&mk_mmap_mutex);
+        return NULL;
+    }
+
+    /* Consumers read files front to back */
+    madvise(addr, st.st_size, MADV_SEQUENTIAL);
+
+    entry = mk_mem_malloc(sizeof(struct mk_mmap_entry));
+    entry->refs  = 1;
+    entry->stale = MK_FALSE;
+    entry->dev   = st.st_dev;
+    entry->inode = st.st_ino;
+    entry->size  = st.st_size;
+    entry->mtime = st.st_mtime;
+    entry->addr  = addr;
+
+    mk_list_add(&entry->_head, bucket);
+    mk_mmap_bytes += st.st_size;
+    pthread_mutex_unlock(&mk_mmap_mutex);
+
+    if (stats) {
+        stats->misses++;
+    }
+    return entry;
+}
+
+void mk_mmap_release(struct mk_mmap_entry *entry)
+{
+    pthread_mutex_lock(&mk_mmap_mutex);
+
+    entry->refs--;
+    if (entry->refs == 0) {
+        if (entry->stale == MK_TRUE) {
+            mk_mmap_entry_free(entry);
+        }
+        else {
+            mk_list_add(&entry->_lru, &mk_mmap_lru);
+        }
+    }
+
+    pthread_mutex_unlock(&mk_mmap_mutex);
+}
+
+/*
+ * Run 'func' over up to 'len' bytes at 'offset' of a mapping, it gets the
+ * mapped memory itself. A page that went away because the file was
+ * truncated behind us raises SIGBUS on access, the signal handler jumps
+ * back here through mk_mmap_fault() and the mapping is dropped from the
+ * cache: it returns -1 and whatever 'func' was doing is abandoned half
+ * way, the caller must discard its state and fail the transfer.
+ */
+int mk_mmap_read(struct mk_mmap_entry *entry, off_t offset, size_t len,
+                 void (*func) (void *, const char *, size_t), void *data)
+{
+    sigjmp_buf jmp;
+    struct mk_mmap_stats *stats;
+
+    if (offset >= entry->size) {
+        return 0;
+    }
+    if (len > (size_t) (entry->size - offset)) {
+        len = entry->size - offset;
+    }
+
+    /* The handler runs with SA_NODEFER, no need to save the signal mask */
+    if (sigsetjmp(jmp, 0) != 0) {
+        mk_mmap_jmp = NULL;
+
+        pthread_mutex_lock(&mk_mmap_mutex);
+        if (entry->stale == MK_FALSE) {
+            mk_list_del(&entry->_head);
+            entry->stale = MK_TRUE;
+        }
+        pthread_mutex_unlock(&mk_mmap_mutex);
+
+        stats = mk_mmap_stats_get();
+        if (stats) {
+            stats->invalidations++;
+        }
+
+        MK_TRACE("[mmap] inode %lu truncated while mapped",
+                 (unsigned long) entry->inode);
+        errno = EIO;
+        return -1;
+    }
+
+    mk_mmap_jmp = &jmp;
+    func(data, (char *) entry->addr + offset, len);
+    mk_mmap_jmp = NULL;
+
+    return 0;
+}
+
+/*
+ * Called from the SIGBUS handler: if the faulting thread is inside
+ * mk_mmap_read() it resumes there, otherwise it returns and the signal
+ * is handled as a crash.
+ */
+void mk_mmap_fault()
+{
+    if (mk_mmap_jmp) {
+        siglongjmp(*mk_mmap_jmp, 1);
+    }
+}
@@ -0,0 +1,169 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <monkey/monkey.h>
+#include <monkey/mk_pack.h>
+#include <monkey/mk_memory.h>
+#include <monkey/mk_string.h>
+#include <monkey/mk_utils.h>
+#include <monkey/mk_macros.h>
+
+static int mk_pack_read(int fd, void *buf, size_t size, off_t offset)
+{
+    ssize_t n;
+    size_t total = 0;
+
+    while (total < size) {
+        n = pread(fd, (char *) buf + total, size - total, offset + total);
+        if (n <= 0) {
+            return -1;
+        }
+        total += n;
+    }
+
+    return 0;
+}
+
+/* Every record must point inside the pack and the strings area */
+static int mk_pack_validate(struct mk_pack_header *h,
+                            struct mk_pack_record *r, off_t size)
+{
+    if (r->offset > (uint64_t) size || r->size > (uint64_t) size - r->offset ||
+        r->path_len == 0 || r->type_len == 0 || r->etag_len == 0 ||
+        r->path > h->strings_size || r->path_len > h->strings_size - r->path ||
+        r->type > h->strings_size || r->type_len > h->strings_size - r->type ||
+        r->etag > h->strings_size || r->etag_len > h->strings_size - r->etag) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static void mk_pack_index(struct mk_pack *pack)
+{
+    uint32_t i;
+    uint32_t slot;
+    struct mk_pack_record *r;
+
+    /* Power of two, at least twice the number of records */
+    pack->size = 16;
+    while (pack->size < pack->count * 2) {
+        pack->size <<= 1;
+    }
+    pack->table = mk_mem_malloc_z(sizeof(uint32_t) * pack->size);
+
+    for (i = 0; i < pack->count; i++) {
+        r = &pack->records[i];
+        slot = mk_utils_gen_hash(pack->strings + r->path, r->path_len);
+        slot &= (pack->size - 1);
+        while (pack->table[slot] != 0) {
+            slot = (slot + 1) & (pack->size - 1);
+        }
+        pack->table[slot] = i + 1;
+    }
+}
+
+struct mk_pack *mk_pack_open(const char *path)
+{
+    int fd;
+    uint32_t i;
+    struct stat st;
+    struct mk_pack *pack;
+    struct mk_pack_header h;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        mk_err("Pack: cannot open %s", path);
+        return NULL;
+    }
+
+    if (fstat(fd, &st) == -1 ||
+        mk_pack_read(fd, &h, sizeof(h), 0) != 0 ||
+        memcmp(h.magic, MK_PACK_MAGIC, sizeof(h.magic)) != 0 ||
+        h.version != MK_PACK_VERSION ||
+        h.records > (uint64_t) st.st_size ||
+        (uint64_t) h.count * sizeof(struct mk_pack_record) >
+        (uint64_t) st.st_size - h.records ||
+        h.strings > (uint64_t) st.st_size ||
+        h.strings_size > (uint64_t) st.st_size - h.strings) {
+        mk_err("Pack: %s is not a valid pack file", path);
+        close(fd);
+        return NULL;
+    }
+
+    pack = mk_mem_malloc_z(sizeof(struct mk_pack));
+    pack->fd      = fd;
+    pack->path    = mk_string_dup(path);
+    pack->count   = h.count;
+    pack->records = mk_mem_malloc(sizeof(struct mk_pack_record) * h.count + 1);
+    pack->strings = mk_mem_malloc(h.strings_size + 1);
+
+    if (mk_pack_read(fd, pack->records,
+                     sizeof(struct mk_pack_record) * h.count, h.records) != 0 ||
+        mk_pack_read(fd, pack->strings, h.strings_size, h.strings) != 0) {
+        mk_err("Pack: cannot read %s", path);
+        mk_pack_close(pack);
+        return NULL;
+    }
+
+    for (i = 0; i < pack->count; i++) {
+        if (mk_pack_validate(&h, &pack->records[i], st.st_size) != 0) {
+            mk_err("Pack: %s has an invalid record", path);
+            mk_pack_close(pack);
+            return NULL;
+        }
+    }
+
+    mk_pack_index(pack);
+    return pack;
+}
+
+void mk_pack_close(struct mk_pack *pack)
+{
+    close(pack->fd);
+    mk_mem_free(pack->path);
+    mk_mem_free(pack->records);
+    mk_mem_free(pack->strings);
+    mk_mem_free(pack->table);
+    mk_mem_free(pack);
+}
+
+struct mk_pack_record *mk_pack_lookup(struct mk_pack *pack,
+                                      const char *path, int len)
+{
+    uint32_t slot;
+    struct mk_pack_record *r;
+
+    slot = mk_utils_gen_hash(path, len) & (pack->size - 1);
+    while (pack->table[slot] != 0) {
+        r = &pack->records[pack->table[slot] - 1];
+        if (r->path_len == (uint32_t) len &&
+            memcmp(pack->strings + r->path, path, len) == 0) {
+            return r;
+        }
+        slot = (slot + 1) & (pack->size - 1);
+    }
+
+    return NULL;
+}
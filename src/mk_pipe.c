@@ -0,0 +1,119 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <monkey/monkey.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <monkey/mk_pipe.h>
+#include <monkey/mk_memory.h>
+#include <monkey/mk_scheduler.h>
+#include <monkey/mk_macros.h>
+
+/* Idle pipes of the worker, allocated on first use */
+static __thread struct mk_list *mk_pipe_pool;
+static __thread int mk_pipe_idle;
+
+static void mk_pipe_free(struct mk_pipe *pipe)
+{
+    close(pipe->fd[0]);
+    close(pipe->fd[1]);
+    mk_mem_free(pipe);
+}
+
+/* Get an empty pipe, from the pool if there is one */
+struct mk_pipe *mk_pipe_get()
+{
+    struct mk_pipe *pipe;
+
+    if (mk_pipe_pool && mk_pipe_idle > 0) {
+        pipe = mk_list_entry_first(mk_pipe_pool, struct mk_pipe, _head);
+        mk_list_del(&pipe->_head);
+        mk_pipe_idle--;
+
+        if (worker_sched_node) {
+            worker_sched_node->pipe_stats.reused++;
+        }
+        return pipe;
+    }
+
+#if defined (__linux__)
+    pipe = mk_mem_malloc(sizeof(struct mk_pipe));
+    if (!pipe) {
+        return NULL;
+    }
+
+    if (pipe2(pipe->fd, O_NONBLOCK | O_CLOEXEC) != 0) {
+        mk_libc_error("pipe2");
+        mk_mem_free(pipe);
+        return NULL;
+    }
+    pipe->bytes = 0;
+#else
+    /* Data is only spliced on Linux */
+    return NULL;
+#endif
+
+    if (worker_sched_node) {
+        worker_sched_node->pipe_stats.created++;
+    }
+    return pipe;
+}
+
+/*
+ * Give a pipe back: an empty one goes to the pool while there is room, a
+ * pipe still holding data (its relay was dropped) is closed.
+ */
+void mk_pipe_put(struct mk_pipe *pipe)
+{
+    if (pipe->bytes > 0 || mk_pipe_idle >= MK_PIPE_POOL_SIZE) {
+        mk_pipe_free(pipe);
+        return;
+    }
+
+    if (!mk_pipe_pool) {
+        mk_pipe_pool = mk_mem_malloc(sizeof(struct mk_list));
+        mk_list_init(mk_pipe_pool);
+    }
+
+    mk_list_add(&pipe->_head, mk_pipe_pool);
+    mk_pipe_idle++;
+}
+
+void mk_pipe_worker_exit()
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_pipe *pipe;
+
+    if (!mk_pipe_pool) {
+        return;
+    }
+
+    mk_list_foreach_safe(head, tmp, mk_pipe_pool) {
+        pipe = mk_list_entry(head, struct mk_pipe, _head);
+        mk_list_del(&pipe->_head);
+        mk_pipe_free(pipe);
+    }
+
+    mk_mem_free(mk_pipe_pool);
+    mk_pipe_pool = NULL;
+    mk_pipe_idle = 0;
+}
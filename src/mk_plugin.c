@@ -165,6 +165,11 @@ struct mk_plugin *mk_plugin_load(int type, const char *shortname,
             mk_config->transport_layer_plugin = plugin;
             mk_config->network = plugin->network;
 
+            /* Streams are flagged with MSG_MORE, corking is not needed */
+            if (plugin->network->write_more && plugin->network->writev_more) {
+                mk_config->manual_tcp_cork = MK_FALSE;
+            }
+
             /* Ask the transport layer if it's using any buffer size */
             mk_config->transport_buffer_size = plugin->network->buffer_size();
             if (mk_config->transport_buffer_size <= 0) {
@@ -182,6 +187,12 @@ struct mk_plugin *mk_plugin_load(int type, const char *shortname,
             st->plugin  = plugin;
             mk_list_add(&st->_head, &mk_config->stage10_handler);
         }
+        if (stage->stage15) {
+            st = mk_mem_malloc(sizeof(struct mk_plugin_stage));
+            st->stage15 = stage->stage15;
+            st->plugin  = plugin;
+            mk_list_add(&st->_head, &mk_config->stage15_handler);
+        }
         if (stage->stage20) {
             st = mk_mem_malloc(sizeof(struct mk_plugin_stage));
             st->stage20 = stage->stage20;
@@ -269,6 +280,9 @@ void mk_plugin_api_init()
     /* File Callbacks */
     api->file_to_buffer = mk_file_to_buffer;
     api->file_get_info = mk_file_get_info;
+    api->file_mmap_get = mk_mmap_get;
+    api->file_mmap_release = mk_mmap_release;
+    api->file_mmap_read = mk_mmap_read;
 
     /* HTTP Callbacks */
     api->header_prepare = mk_header_prepare;
@@ -281,7 +295,11 @@ void mk_plugin_api_init()
     api->channel_new   = mk_channel_new;
     api->channel_write = mk_channel_write;
     api->channel_append_stream = mk_channel_append_stream;
+    api->channel_chunked_end = mk_channel_chunked_end;
     api->stream_set = mk_stream_set;
+    api->stream_buffer_new = mk_stream_buffer_new;
+    api->stream_buffer_get = mk_stream_buffer_get;
+    api->stream_buffer_release = mk_stream_buffer_release;
 
     /* IOV callbacks */
     api->iov_create  = mk_iov_create;
@@ -291,6 +309,7 @@ void mk_plugin_api_init()
     api->iov_add =  mk_iov_add;
     api->iov_set_entry =  mk_iov_set_entry;
     api->iov_send =  mk_iov_send;
+    api->iov_send_more = mk_iov_send_more;
     api->iov_print =  mk_iov_print;
 
     /* events mechanism */
@@ -0,0 +1,245 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include <monkey/monkey.h>
+#include <monkey/mk_prewarm.h>
+#include <monkey/mk_config.h>
+#include <monkey/mk_vhost.h>
+#include <monkey/mk_fdt.h>
+#include <monkey/mk_memory.h>
+#include <monkey/mk_utils.h>
+#include <monkey/mk_macros.h>
+
+#define MK_PREWARM_CHUNK  65536
+
+static pthread_t mk_prewarm_tid;
+static int mk_prewarm_running = MK_FALSE;
+
+/* Read the whole file, so it's in the page cache once we return */
+static long mk_prewarm_read(int fd, off_t size, char *buf)
+{
+    ssize_t n;
+    off_t offset = 0;
+
+#ifdef POSIX_FADV_WILLNEED
+    posix_fadvise(fd, 0, size, POSIX_FADV_WILLNEED);
+#endif
+
+    while (offset < size) {
+        n = pread(fd, buf, MK_PREWARM_CHUNK, offset);
+        if (n <= 0) {
+            break;
+        }
+        offset += n;
+    }
+
+    return offset;
+}
+
+/* Returns -1 once the budget of the virtual host is consumed */
+static int mk_prewarm_file(struct mk_prewarm *pw, const char *path, char *buf)
+{
+    int fd;
+    struct stat st;
+
+    fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd == -1) {
+        pw->failed++;
+        return 0;
+    }
+
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return 0;
+    }
+
+    if (mk_config->prewarm_budget > 0 &&
+        pw->bytes + st.st_size > (unsigned long long) mk_config->prewarm_budget) {
+        close(fd);
+        return -1;
+    }
+
+    pw->bytes += mk_prewarm_read(fd, st.st_size, buf);
+    pw->files++;
+
+    /* The FDT owns the descriptor from now on */
+    mk_fdt_warm(path, strlen(path), fd, &st);
+    return 0;
+}
+
+static int mk_prewarm_path(struct mk_prewarm *pw, const char *path, char *buf)
+{
+    int ret = 0;
+    char child[MK_MAX_PATH];
+    DIR *dir;
+    struct stat st;
+    struct dirent *ent;
+
+    /* Linked directories are not followed, they could loop */
+    if (lstat(path, &st) == -1) {
+        pw->failed++;
+        return 0;
+    }
+
+    if (!S_ISDIR(st.st_mode)) {
+        return mk_prewarm_file(pw, path, buf);
+    }
+
+    dir = opendir(path);
+    if (!dir) {
+        pw->failed++;
+        return 0;
+    }
+
+    while (ret == 0 && (ent = readdir(dir))) {
+        if (ent->d_name[0] == '.') {
+            continue;
+        }
+
+        if (snprintf(child, sizeof(child), "%s/%s",
+                     path, ent->d_name) >= (int) sizeof(child)) {
+            continue;
+        }
+        ret = mk_prewarm_path(pw, child, buf);
+    }
+
+    closedir(dir);
+    return ret;
+}
+
+/* One path or glob(3) pattern per line, relative to the DocumentRoot */
+static void mk_prewarm_manifest(struct host *host, char *buf)
+{
+    int ret = 0;
+    size_t i;
+    size_t len;
+    char line[MK_MAX_PATH];
+    char pattern[MK_MAX_PATH];
+    FILE *f;
+    glob_t matches;
+    struct mk_prewarm *pw = host->prewarm;
+
+    f = fopen(pw->source, "r");
+    if (!f) {
+        mk_warn("Prewarm: cannot open %s", pw->source);
+        return;
+    }
+
+    while (ret == 0 && fgets(line, sizeof(line), f)) {
+        len = strlen(line);
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r' ||
+                           line[len - 1] == ' ' || line[len - 1] == '\t')) {
+            line[--len] = '\0';
+        }
+        if (len == 0 || line[0] == '#') {
+            continue;
+        }
+
+        snprintf(pattern, sizeof(pattern), "%s%s%s",
+                 host->documentroot.data, line[0] == '/' ? "" : "/", line);
+        if (glob(pattern, 0, NULL, &matches) != 0) {
+            pw->failed++;
+            continue;
+        }
+
+        for (i = 0; ret == 0 && i < matches.gl_pathc; i++) {
+            ret = mk_prewarm_path(pw, matches.gl_pathv[i], buf);
+        }
+        globfree(&matches);
+    }
+
+    fclose(f);
+}
+
+static void mk_prewarm_thread(void *data)
+{
+    char *buf;
+    struct stat st;
+    struct timespec start;
+    struct timespec end;
+    struct mk_list *head;
+    struct host *host;
+    struct mk_prewarm *pw;
+
+    (void) data;
+    mk_utils_worker_rename("monkey: prewarm");
+    buf = mk_mem_malloc(MK_PREWARM_CHUNK);
+
+    mk_list_foreach(head, &mk_config->hosts) {
+        host = mk_list_entry(head, struct host, _head);
+        pw = host->prewarm;
+        if (!pw) {
+            continue;
+        }
+
+        pw->state = MK_PREWARM_RUNNING;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        if (stat(pw->source, &st) == 0 && S_ISDIR(st.st_mode)) {
+            mk_prewarm_path(pw, pw->source, buf);
+        }
+        else {
+            mk_prewarm_manifest(host, buf);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        pw->usec = ((end.tv_sec - start.tv_sec) * 1000000) +
+            ((end.tv_nsec - start.tv_nsec) / 1000);
+        pw->state = MK_PREWARM_DONE;
+
+        mk_info("Prewarm: %s, %lu files (%llu KB) in %lu ms, %lu failed",
+                pw->source, pw->files, pw->bytes / 1024,
+                pw->usec / 1000, pw->failed);
+    }
+
+    mk_mem_free(buf);
+}
+
+/* Start warming the caches of every virtual host with a Prewarm list */
+void mk_prewarm_init()
+{
+    struct mk_list *head;
+    struct host *host;
+
+    mk_list_foreach(head, &mk_config->hosts) {
+        host = mk_list_entry(head, struct host, _head);
+        if (host->prewarm) {
+            mk_prewarm_tid = mk_utils_worker_spawn(mk_prewarm_thread, NULL);
+            mk_prewarm_running = MK_TRUE;
+            return;
+        }
+    }
+}
+
+void mk_prewarm_wait()
+{
+    if (mk_prewarm_running == MK_TRUE) {
+        pthread_join(mk_prewarm_tid, NULL);
+        mk_prewarm_running = MK_FALSE;
+    }
+}
@@ -0,0 +1,386 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <monkey/monkey.h>
+
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+
+#include <monkey/mk_readahead.h>
+#include <monkey/mk_config.h>
+#include <monkey/mk_memory.h>
+#include <monkey/mk_utils.h>
+#include <monkey/mk_macros.h>
+
+/* Pending jobs, shared by the threads of the pool */
+static pthread_mutex_t mk_readahead_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t mk_readahead_cond = PTHREAD_COND_INITIALIZER;
+static struct mk_list mk_readahead_jobs;
+
+static __thread struct mk_readahead_worker *mk_readahead_key;
+
+/* Read the window of a job: once it returns the data is in the page cache */
+static void mk_readahead_fetch(struct mk_readahead_job *job, char *buf,
+                               size_t size)
+{
+    ssize_t n;
+    size_t total = 0;
+
+#if defined(POSIX_FADV_WILLNEED)
+    /* Submit the whole window at once, the reads below just wait for it */
+    posix_fadvise(job->fd, job->offset, job->length, POSIX_FADV_WILLNEED);
+#endif
+
+    while (total < job->length) {
+        n = pread(job->fd, buf, size, job->offset + total);
+        if (n <= 0) {
+            break;
+        }
+        total += n;
+    }
+}
+
+static void mk_readahead_worker_free(struct mk_readahead_worker *worker)
+{
+    close(worker->ch_r);
+    pthread_mutex_destroy(&worker->lock);
+    mk_mem_free(worker);
+}
+
+static void mk_readahead_thread(void *data)
+{
+    int last;
+    char *buf;
+    uint64_t val = 1;
+    struct mk_readahead_job *job;
+    struct mk_readahead_worker *worker;
+    (void) data;
+
+    mk_utils_worker_rename("monkey: readahead");
+    buf = mk_mem_malloc(MK_READAHEAD_CHUNK);
+
+    while (1) {
+        pthread_mutex_lock(&mk_readahead_mutex);
+        while (mk_list_is_empty(&mk_readahead_jobs) == 0) {
+            pthread_cond_wait(&mk_readahead_cond, &mk_readahead_mutex);
+        }
+        job = mk_list_entry_first(&mk_readahead_jobs,
+                                  struct mk_readahead_job, _head);
+        mk_list_del(&job->_head);
+        pthread_mutex_unlock(&mk_readahead_mutex);
+
+        mk_readahead_fetch(job, buf, MK_READAHEAD_CHUNK);
+
+        /* Hand it back to the worker, unless it's gone */
+        worker = job->worker;
+        pthread_mutex_lock(&worker->lock);
+        if (worker->exiting == MK_FALSE) {
+            mk_list_add(&job->_head, &worker->done);
+            pthread_mutex_unlock(&worker->lock);
+
+            if (write(worker->ch_w, &val, sizeof(val)) <= 0) {
+                mk_libc_error("write");
+            }
+            continue;
+        }
+
+        last = (--worker->pending == 0);
+        pthread_mutex_unlock(&worker->lock);
+
+        close(job->fd);
+        mk_mem_free(job);
+        if (last) {
+            mk_readahead_worker_free(worker);
+        }
+    }
+}
+
+/* Start the readahead pool */
+void mk_readahead_init()
+{
+    int i;
+
+    if (mk_config->readahead_threads <= 0) {
+        return;
+    }
+
+    mk_list_init(&mk_readahead_jobs);
+    for (i = 0; i < mk_config->readahead_threads; i++) {
+        mk_utils_worker_spawn(mk_readahead_thread, NULL);
+    }
+}
+
+struct mk_readahead_worker *mk_readahead_worker_init(mk_event_loop_t *loop)
+{
+    int ret;
+    struct mk_readahead_worker *worker;
+
+    if (mk_config->readahead_threads <= 0) {
+        return NULL;
+    }
+
+    worker = mk_mem_malloc_z(sizeof(struct mk_readahead_worker));
+    ret = mk_event_channel_create(loop, &worker->ch_r, &worker->ch_w);
+    if (ret < 0) {
+        mk_warn("Readahead: could not create the worker channel, disabled");
+        mk_mem_free(worker);
+        return NULL;
+    }
+
+    worker->probe = MK_TRUE;
+    worker->loop  = loop;
+    pthread_mutex_init(&worker->lock, NULL);
+    mk_list_init(&worker->done);
+
+    mk_readahead_key = worker;
+    return worker;
+}
+
+void mk_readahead_worker_exit()
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_readahead_job *job;
+    struct mk_readahead_worker *worker = mk_readahead_key;
+
+    if (!worker) {
+        return;
+    }
+
+    mk_readahead_key = NULL;
+
+    pthread_mutex_lock(&worker->lock);
+    mk_list_foreach_safe(head, tmp, &worker->done) {
+        job = mk_list_entry(head, struct mk_readahead_job, _head);
+        mk_list_del(&job->_head);
+        close(job->fd);
+        mk_mem_free(job);
+        worker->pending--;
+    }
+
+    /* Jobs still running on the pool release the worker when they finish */
+    if (worker->pending > 0) {
+        worker->exiting = MK_TRUE;
+        pthread_mutex_unlock(&worker->lock);
+        return;
+    }
+    pthread_mutex_unlock(&worker->lock);
+
+    mk_readahead_worker_free(worker);
+}
+
+/* Check that every page of a file region is in the page cache */
+static int mk_readahead_resident(struct mk_readahead_worker *worker,
+                                 int fd, off_t offset, size_t length)
+{
+#if defined(RWF_NOWAIT)
+    /*
+     * A read that must not block fails with EAGAIN if the page is not
+     * cached; the first and last pages of the window are checked.
+     */
+    int i;
+    char c;
+    ssize_t ret;
+    off_t pos[2] = {offset, offset + length - 1};
+    struct iovec iov = {&c, 1};
+
+    for (i = 0; i < 2; i++) {
+        ret = preadv2(fd, &iov, 1, pos[i], RWF_NOWAIT);
+        if (ret == -1 && errno == EAGAIN) {
+            return MK_FALSE;
+        }
+        else if (ret == -1) {
+            /* Not supported by the kernel or the filesystem */
+            worker->probe = MK_FALSE;
+            return MK_TRUE;
+        }
+    }
+
+    return MK_TRUE;
+#else
+    int ret = MK_TRUE;
+    long page;
+    size_t i;
+    size_t pages;
+    off_t start;
+    void *map;
+    char *vec;
+
+    page   = sysconf(_SC_PAGESIZE);
+    start  = offset & ~((off_t) page - 1);
+    length += offset - start;
+    pages  = (length + page - 1) / page;
+
+    map = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, start);
+    if (map == MAP_FAILED) {
+        worker->probe = MK_FALSE;
+        return MK_TRUE;
+    }
+
+    vec = mk_mem_malloc(pages);
+    if (mincore(map, length, (void *) vec) == 0) {
+        for (i = 0; i < pages; i++) {
+            if (!(vec[i] & 1)) {
+                ret = MK_FALSE;
+                break;
+            }
+        }
+    }
+    else {
+        worker->probe = MK_FALSE;
+    }
+
+    mk_mem_free(vec);
+    munmap(map, length);
+
+    return ret;
+#endif
+}
+
+/*
+ * Called before sending a file stream. If the next window of the file is
+ * not cached it's queued on the readahead pool and it returns zero: the
+ * caller must put the connection to sleep, it's woken up for write once
+ * the data is in memory. Otherwise the stream can be sent right away.
+ */
+int mk_readahead_park(struct mk_channel *channel, struct mk_stream *stream)
+{
+    size_t length;
+    struct mk_readahead_job *job;
+    struct mk_readahead_worker *worker = mk_readahead_key;
+
+    /* Still waiting for a previous window */
+    if (channel->job) {
+        return 0;
+    }
+
+    if (!worker || worker->probe == MK_FALSE ||
+        stream->bytes_offset < stream->resident) {
+        return -1;
+    }
+
+    length = stream->bytes_total;
+    if (length > (size_t) mk_config->readahead_window) {
+        length = mk_config->readahead_window;
+    }
+
+    worker->stats.probes++;
+    if (mk_readahead_resident(worker, stream->fd,
+                              stream->bytes_offset, length) == MK_TRUE) {
+        stream->resident = stream->bytes_offset + length;
+        return -1;
+    }
+
+    job = mk_mem_malloc(sizeof(struct mk_readahead_job));
+    job->fd = dup(stream->fd);
+    if (job->fd == -1) {
+        mk_mem_free(job);
+        return -1;
+    }
+
+    job->offset  = stream->bytes_offset;
+    job->length  = length;
+    job->channel = channel;
+    job->stream  = stream;
+    job->worker  = worker;
+    clock_gettime(CLOCK_MONOTONIC, &job->start);
+
+    channel->job = job;
+    worker->stats.parked++;
+
+    pthread_mutex_lock(&worker->lock);
+    worker->pending++;
+    pthread_mutex_unlock(&worker->lock);
+
+    pthread_mutex_lock(&mk_readahead_mutex);
+    mk_list_add(&job->_head, &mk_readahead_jobs);
+    pthread_cond_signal(&mk_readahead_cond);
+    pthread_mutex_unlock(&mk_readahead_mutex);
+
+    MK_TRACE("[FD %i] Readahead, parked on offset %lu",
+             channel->fd, job->offset);
+    return 0;
+}
+
+/* The connection of a parked channel is closed, forget about it */
+void mk_readahead_cancel(struct mk_channel *channel)
+{
+    if (channel->job) {
+        channel->job->channel = NULL;
+        channel->job = NULL;
+    }
+}
+
+/* Resume the connections whose data has been read by the pool */
+int mk_readahead_events()
+{
+    int n = 0;
+    uint64_t val;
+    struct mk_list done;
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct timespec now;
+    struct mk_readahead_job *job;
+    struct mk_readahead_worker *worker = mk_readahead_key;
+
+    if (read(worker->ch_r, &val, sizeof(val)) <= 0) {
+        mk_libc_error("read");
+    }
+
+    mk_list_init(&done);
+    pthread_mutex_lock(&worker->lock);
+    mk_list_foreach_safe(head, tmp, &worker->done) {
+        mk_list_del(head);
+        mk_list_add(head, &done);
+        worker->pending--;
+    }
+    pthread_mutex_unlock(&worker->lock);
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    mk_list_foreach_safe(head, tmp, &done) {
+        job = mk_list_entry(head, struct mk_readahead_job, _head);
+        mk_list_del(&job->_head);
+
+        if (job->channel) {
+            job->channel->job = NULL;
+            job->stream->resident = job->offset + job->length;
+            mk_event_add(worker->loop, job->channel->fd, MK_EVENT_WRITE, NULL);
+
+            worker->stats.resumed++;
+            worker->stats.bytes += job->length;
+            worker->stats.usec += ((now.tv_sec - job->start.tv_sec) * 1000000) +
+                ((now.tv_nsec - job->start.tv_nsec) / 1000);
+            n++;
+        }
+        else {
+            worker->stats.cancelled++;
+        }
+
+        close(job->fd);
+        mk_mem_free(job);
+    }
+
+    return n;
+}
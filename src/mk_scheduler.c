@@ -163,7 +163,12 @@ void mk_sched_worker_free()
 
     /* External */
     mk_plugin_exit_worker();
-    mk_vhost_fdt_worker_exit();
+    mk_stat_cache_worker_exit();
+    mk_deflate_worker_exit();
+    mk_readahead_worker_exit();
+    mk_pipe_worker_exit();
+    mk_channel_worker_exit();
+    mk_vhost_worker_exit();
     mk_cache_worker_exit();
 
     /* Scheduler stuff */
@@ -399,6 +404,15 @@ void *mk_sched_launch_worker_loop(void *thread_conf)
         exit(EXIT_FAILURE);
     }
 
+    /* Stat cache, it registers its inotify channel on the worker loop */
+    sched->stat_cache = mk_stat_cache_worker_init(sched->loop);
+
+    /* Compressed variants of static files */
+    sched->deflate_cache = mk_deflate_worker_init();
+
+    /* Connections waiting for cold files are resumed through this channel */
+    sched->readahead = mk_readahead_worker_init(sched->loop);
+
     /*
      * ULONG_MAX BUG test only
      * =======================
@@ -649,6 +663,9 @@ int mk_sched_check_timeouts(struct sched_list_node *sched)
         }
     }
 
+    /* Zero copy sends of closed connections */
+    mk_channel_orphans_check();
+
     return 0;
 }
 
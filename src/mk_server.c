@@ -140,6 +140,38 @@ void mk_server_listen_free(struct mk_server_listen *server_listen)
     server_listen->count = 0;
 }
 
+/*
+ * Socket buffers are set on the listening socket: connections accepted
+ * from it inherit them, so they cost no syscall per accept.
+ */
+static int mk_server_sock_tune(int server_fd, struct mk_config_listener *listen)
+{
+    int ret = 0;
+    long lowat = mk_config->sock.send_lowat;
+    long sndbuf = mk_config->sock.send_buffer;
+    long rcvbuf = mk_config->sock.recv_buffer;
+
+    if (listen->sock.send_lowat > 0) {
+        lowat = listen->sock.send_lowat;
+    }
+    if (listen->sock.send_buffer > 0) {
+        sndbuf = listen->sock.send_buffer;
+    }
+    if (listen->sock.recv_buffer > 0) {
+        rcvbuf = listen->sock.recv_buffer;
+    }
+
+    if (lowat > 0 && mk_socket_set_notsent_lowat(server_fd, lowat) != 0) {
+        ret = -1;
+    }
+
+    if (mk_socket_set_buffers(server_fd, sndbuf, rcvbuf) != 0) {
+        ret = -1;
+    }
+
+    return ret;
+}
+
 int mk_server_listen_init(struct mk_server_config *config,
                           struct mk_server_listen *server_listen)
 {
@@ -180,6 +212,10 @@ int mk_server_listen_init(struct mk_server_config *config,
                 mk_warn("[server] Could not set TCP_DEFER_ACCEPT");
 #endif
             }
+            if (mk_server_sock_tune(server_fd, listen) != 0) {
+                mk_warn("[server] Could not tune socket buffers of %s:%s",
+                        listen->address, listen->port);
+            }
             listen_list[i].listen = listen;
             listen_list[i].server_fd = server_fd;
         }
@@ -352,6 +388,23 @@ void mk_server_worker_loop(struct mk_server_listen *listen)
     while (1) {
         mk_event_wait(evl);
         mk_event_foreach(evl, fd, mask) {
+            /* The relay source of a sleeping channel is ready */
+            if (mk_channel_relay_resume(fd) == MK_TRUE) {
+                continue;
+            }
+
+            /*
+             * Zero copy completions are queued on the socket error queue,
+             * they flag the connection with an error that is not one.
+             */
+            if ((mask & MK_EVENT_ERROR) && mk_config->zerocopy > 0 &&
+                mk_conn_zerocopy(fd) > 0) {
+                mask &= ~MK_EVENT_ERROR;
+                if (mask == 0) {
+                    continue;
+                }
+            }
+
             if (mask & MK_EVENT_READ) {
                 /* Check if we have a worker signal */
                 if (mk_unlikely(fd == sched->signal_channel_r)) {
@@ -381,6 +434,14 @@ void mk_server_worker_loop(struct mk_server_listen *listen)
                     }
                     continue;
                 }
+                else if (sched->stat_cache && fd == sched->stat_cache->fd) {
+                    mk_stat_cache_events();
+                    continue;
+                }
+                else if (sched->readahead && fd == sched->readahead->ch_r) {
+                    mk_readahead_events();
+                    continue;
+                }
                 else if (listen && mk_server_listen_check(listen, fd)) {
                     /*
                      * A new connection have been accepted..or failed, despite
@@ -22,6 +22,7 @@
 #include <monkey/mk_clock.h>
 #include <monkey/mk_plugin.h>
 #include <monkey/mk_macros.h>
+#include <monkey/mk_mmap.h>
 #include <monkey/monkey.h>
 
 #include <signal.h>
@@ -81,6 +82,9 @@ static void mk_signal_handler(int signo, siginfo_t *si, void *context UNUSED_PAR
         mk_signal_exit();
         break;
     case SIGBUS:
+        /* A mapped file was truncated, resumes if it was a guarded copy */
+        mk_mmap_fault();
+        /* fall through */
     case SIGSEGV:
 #ifdef DEBUG
         mk_utils_stacktrace();
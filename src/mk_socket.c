@@ -33,6 +33,10 @@
 #include <time.h>
 #include <netinet/tcp.h>
 
+#if defined (__linux__)
+#include <linux/errqueue.h>
+#endif
+
 static void mk_socket_safe_event_write(int socket)
 {
     struct sched_list_node *sched;
@@ -116,6 +120,117 @@ int mk_socket_set_tcp_reuseport(int sockfd)
     return setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
 }
 
+/* Set the kernel buffers of a socket, zero values are left untouched */
+int mk_socket_set_buffers(int sockfd, int sndbuf, int rcvbuf)
+{
+    int ret = 0;
+
+    if (sndbuf > 0 &&
+        setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf)) != 0) {
+        ret = -1;
+    }
+
+    if (rcvbuf > 0 &&
+        setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) != 0) {
+        ret = -1;
+    }
+
+    return ret;
+}
+
+/*
+ * Limit of unsent bytes queued in the socket: the socket is reported
+ * writable only once the queue drains below it, so a slow client does not
+ * keep a whole send buffer of data allocated in the kernel.
+ */
+int mk_socket_set_notsent_lowat(int sockfd, int bytes)
+{
+    return setsockopt(sockfd, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+                      &bytes, sizeof(bytes));
+}
+
+/* Returns the current limit, zero if unknown or not set */
+int mk_socket_get_notsent_lowat(int sockfd)
+{
+    int bytes = 0;
+    socklen_t len = sizeof(bytes);
+
+    if (getsockopt(sockfd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &bytes, &len) != 0 ||
+        bytes < 0) {
+        return 0;
+    }
+
+    return bytes;
+}
+
+int mk_socket_set_zerocopy(int sockfd)
+{
+#if defined (__linux__)
+    int on = 1;
+
+    return setsockopt(sockfd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on));
+#else
+    (void) sockfd;
+    return -1;
+#endif
+}
+
+/*
+ * Read a zero copy completion from the socket error queue: the sends with
+ * ids from 'lo' to 'hi' are done, 'copied' tells if the kernel had to copy
+ * their data anyway. Returns 1 if a completion was read, 0 if the queue is
+ * empty or -1 on error.
+ */
+int mk_socket_zerocopy_read(int sockfd, uint32_t *lo, uint32_t *hi,
+                            int *copied)
+{
+#if defined (__linux__)
+    char control[128];
+    struct msghdr msg;
+    struct cmsghdr *cm;
+    struct sock_extended_err *serr;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control    = control;
+    msg.msg_controllen = sizeof(control);
+
+    if (recvmsg(sockfd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+        if (errno == EAGAIN) {
+            return 0;
+        }
+        return -1;
+    }
+
+    for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+        if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+              (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))) {
+            continue;
+        }
+
+        serr = (struct sock_extended_err *) CMSG_DATA(cm);
+        if (serr->ee_errno != 0 ||
+            serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+            continue;
+        }
+
+        *lo = serr->ee_info;
+        *hi = serr->ee_data;
+        *copied = (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) != 0;
+        return 1;
+    }
+
+    /* Something else was queued, there is no completion in it */
+    errno = EIO;
+    return -1;
+#else
+    (void) sockfd;
+    (void) lo;
+    (void) hi;
+    (void) copied;
+    return 0;
+#endif
+}
+
 int mk_socket_close(int socket)
 {
     return mk_config->network->close(socket);
@@ -195,6 +310,57 @@ int mk_socket_send(int socket_fd, const void *buf, size_t count)
     return bytes;
 }
 
+/*
+ * Write a chunk that is not the end of the response: transports that can
+ * flag it with MSG_MORE do it, the others write it as usual.
+ */
+int mk_socket_sendv_more(int socket_fd, struct mk_iov *mk_io)
+{
+    int bytes;
+
+    if (!mk_config->network->writev_more) {
+        return mk_socket_sendv(socket_fd, mk_io);
+    }
+
+    bytes = mk_config->network->writev_more(socket_fd, mk_io);
+    if (mk_config->safe_event_write == MK_TRUE) {
+        mk_socket_safe_event_write(socket_fd);
+    }
+    return bytes;
+}
+
+/*
+ * Write a buffer the kernel references instead of copying it (MSG_ZEROCOPY),
+ * it must not change until the send is reported complete on the socket
+ * error queue. Only transports providing write_zerocopy get here.
+ */
+int mk_socket_send_zerocopy(int socket_fd, const void *buf, size_t count)
+{
+    int bytes;
+
+    bytes = mk_config->network->write_zerocopy(socket_fd, buf, count);
+    if (mk_config->safe_event_write == MK_TRUE) {
+        mk_socket_safe_event_write(socket_fd);
+    }
+    return bytes;
+}
+
+/*
+ * Move data buffered in a pipe to the socket (splice), 'more' tells the
+ * transport the response goes on. Only transports providing write_pipe
+ * get here.
+ */
+int mk_socket_send_pipe(int socket_fd, int pipe_fd, size_t count, int more)
+{
+    int bytes;
+
+    bytes = mk_config->network->write_pipe(socket_fd, pipe_fd, count, more);
+    if (mk_config->safe_event_write == MK_TRUE) {
+        mk_socket_safe_event_write(socket_fd);
+    }
+    return bytes;
+}
+
 int mk_socket_read(int socket_fd, void *buf, int count)
 {
     return mk_config->network->read(socket_fd, (void *)buf, count);
@@ -0,0 +1,494 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <monkey/monkey.h>
+#include <monkey/mk_stat_cache.h>
+#include <monkey/mk_config.h>
+#include <monkey/mk_memory.h>
+#include <monkey/mk_utils.h>
+#include <monkey/mk_clock.h>
+#include <monkey/mk_macros.h>
+#include <monkey/mk_header.h>
+
+#if defined(__linux__)
+#include <sys/inotify.h>
+
+#define MK_STAT_CACHE_WATCH_MASK (IN_ATTRIB | IN_CREATE | IN_DELETE |       \
+                                  IN_DELETE_SELF | IN_MODIFY |              \
+                                  IN_MOVE_SELF | IN_MOVED_FROM |            \
+                                  IN_MOVED_TO)
+#endif
+
+static __thread struct mk_stat_cache *mk_stat_cache_key;
+
+static void mk_stat_cache_watch_free(struct mk_stat_cache *cache,
+                                     struct mk_stat_cache_watch *watch)
+{
+#if defined(__linux__)
+    if (watch->wd >= 0) {
+        inotify_rm_watch(cache->fd, watch->wd);
+    }
+#endif
+    mk_list_del(&watch->_head);
+    mk_mem_free(watch->path);
+    mk_mem_free(watch);
+}
+
+/* Release the header block (and the file content) held by an entry */
+static void mk_stat_cache_block_drop(struct mk_stat_cache *cache,
+                                     struct mk_stat_cache_entry *entry)
+{
+    if (entry->block->body.data) {
+        cache->stats.mem_bytes -= entry->block->body.len;
+    }
+    mk_header_block_release(entry->block);
+    entry->block = NULL;
+}
+
+static void mk_stat_cache_entry_free(struct mk_stat_cache *cache,
+                                     struct mk_stat_cache_entry *entry)
+{
+    mk_list_del(&entry->_head);
+    mk_list_del(&entry->_lru);
+    if (entry->watch) {
+        mk_list_del(&entry->_watch);
+    }
+    if (entry->block) {
+        mk_stat_cache_block_drop(cache, entry);
+    }
+    if (cache->last == entry) {
+        cache->last = NULL;
+    }
+
+    mk_mem_free(entry->path);
+    mk_mem_free(entry);
+    cache->count--;
+}
+
+/*
+ * Lookup or register the watch for the directory that contains 'path',
+ * a path ending with a slash is a directory itself and is watched as is.
+ */
+static struct mk_stat_cache_watch *mk_stat_cache_watch_get(struct mk_stat_cache *cache,
+                                                           const char *path,
+                                                           int len)
+{
+    int wd;
+    unsigned int hash;
+    struct mk_list *head;
+    struct mk_stat_cache_watch *watch;
+
+    if (cache->fd == -1) {
+        return NULL;
+    }
+
+    while (len > 1 && path[len - 1] != '/') {
+        len--;
+    }
+    if (len > 1) {
+        len--;
+    }
+
+    hash = mk_utils_gen_hash(path, len);
+    mk_list_foreach(head, &cache->watches) {
+        watch = mk_list_entry(head, struct mk_stat_cache_watch, _head);
+        if (watch->hash == hash && watch->len == len &&
+            memcmp(watch->path, path, len) == 0) {
+            return watch;
+        }
+    }
+
+    watch = mk_mem_malloc(sizeof(struct mk_stat_cache_watch));
+    watch->path = mk_mem_malloc(len + 1);
+    memcpy(watch->path, path, len);
+    watch->path[len] = '\0';
+    watch->len = len;
+    watch->hash = hash;
+    watch->wd = -1;
+
+#if defined(__linux__)
+    wd = inotify_add_watch(cache->fd, watch->path, MK_STAT_CACHE_WATCH_MASK);
+#else
+    wd = -1;
+#endif
+    if (wd == -1) {
+        /* Entries under this path will rely on the TTL only */
+        mk_mem_free(watch->path);
+        mk_mem_free(watch);
+        return NULL;
+    }
+
+    watch->wd = wd;
+    mk_list_init(&watch->entries);
+    mk_list_add(&watch->_head, &cache->watches);
+
+    return watch;
+}
+
+struct mk_stat_cache *mk_stat_cache_worker_init(mk_event_loop_t *loop)
+{
+    int i;
+    struct mk_stat_cache *cache;
+
+    if (mk_config->stat_cache <= 0) {
+        return NULL;
+    }
+
+    cache = mk_mem_malloc_z(sizeof(struct mk_stat_cache));
+    cache->size = mk_config->stat_cache;
+    cache->table = mk_mem_malloc(sizeof(struct mk_list) * cache->size);
+    for (i = 0; i < cache->size; i++) {
+        mk_list_init(&cache->table[i]);
+    }
+    mk_list_init(&cache->lru);
+    mk_list_init(&cache->watches);
+
+    cache->fd = -1;
+#if defined(__linux__)
+    cache->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (cache->fd == -1) {
+        mk_libc_error("inotify_init1");
+    }
+    else if (mk_event_add(loop, cache->fd, MK_EVENT_READ, NULL) != 0) {
+        close(cache->fd);
+        cache->fd = -1;
+    }
+#else
+    (void) loop;
+#endif
+
+    mk_stat_cache_key = cache;
+    return cache;
+}
+
+void mk_stat_cache_worker_exit()
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_stat_cache *cache = mk_stat_cache_key;
+    struct mk_stat_cache_entry *entry;
+    struct mk_stat_cache_watch *watch;
+
+    if (!cache) {
+        return;
+    }
+
+    mk_list_foreach_safe(head, tmp, &cache->lru) {
+        entry = mk_list_entry(head, struct mk_stat_cache_entry, _lru);
+        mk_stat_cache_entry_free(cache, entry);
+    }
+
+    mk_list_foreach_safe(head, tmp, &cache->watches) {
+        watch = mk_list_entry(head, struct mk_stat_cache_watch, _head);
+        mk_stat_cache_watch_free(cache, watch);
+    }
+
+    if (cache->fd != -1) {
+        close(cache->fd);
+    }
+
+    mk_mem_free(cache->table);
+    mk_mem_free(cache);
+    mk_stat_cache_key = NULL;
+}
+
+/*
+ * Same semantics than mk_file_get_info(path, f_info, MK_FILE_READ) but
+ * served from the worker cache when possible. Failed lookups are cached
+ * too, so repeated requests for missing resources do not hit the disk.
+ */
+int mk_stat_cache_get_info(const char *path, int len, struct file_info *f_info)
+{
+    int ret;
+    unsigned int hash;
+    struct mk_list *head;
+    struct mk_list *bucket;
+    struct mk_stat_cache *cache = mk_stat_cache_key;
+    struct mk_stat_cache_entry *entry;
+    struct mk_stat_cache_watch *watch;
+
+    if (!cache) {
+        return mk_file_get_info(path, f_info, MK_FILE_READ);
+    }
+
+    hash = mk_utils_gen_hash(path, len);
+    bucket = &cache->table[hash % cache->size];
+
+    mk_list_foreach(head, bucket) {
+        entry = mk_list_entry(head, struct mk_stat_cache_entry, _head);
+        if (entry->hash != hash || entry->len != len ||
+            memcmp(entry->path, path, len) != 0) {
+            continue;
+        }
+
+        if (entry->expire <= log_current_utime) {
+            cache->stats.expired++;
+            mk_stat_cache_entry_free(cache, entry);
+            break;
+        }
+
+        /* Hit: move the entry to the most recent position */
+        mk_list_del(&entry->_lru);
+        mk_list_add(&entry->_lru, &cache->lru);
+
+        cache->stats.hits++;
+        cache->stats.syscalls_saved += entry->syscalls;
+        cache->last = entry;
+        memcpy(f_info, &entry->info, sizeof(struct file_info));
+        return entry->ret;
+    }
+
+    cache->stats.misses++;
+    ret = mk_file_get_info(path, f_info, MK_FILE_READ);
+
+    /* Make room for the new entry */
+    if (cache->count >= cache->size) {
+        entry = mk_list_entry_first(&cache->lru, struct mk_stat_cache_entry,
+                                    _lru);
+        watch = entry->watch;
+        mk_stat_cache_entry_free(cache, entry);
+        if (watch && mk_list_is_empty(&watch->entries) == 0) {
+            mk_stat_cache_watch_free(cache, watch);
+        }
+        cache->stats.evictions++;
+    }
+
+    entry = mk_mem_malloc(sizeof(struct mk_stat_cache_entry));
+    entry->path = mk_mem_malloc(len + 1);
+    memcpy(entry->path, path, len);
+    entry->path[len] = '\0';
+    entry->len = len;
+    entry->hash = hash;
+    entry->ret = ret;
+    entry->syscalls = (ret == 0 && f_info->is_link == MK_TRUE) ? 2 : 1;
+    entry->expire = log_current_utime + mk_config->stat_cache_ttl;
+    entry->block = NULL;
+    memcpy(&entry->info, f_info, sizeof(struct file_info));
+
+    entry->watch = mk_stat_cache_watch_get(cache, path, len);
+    if (entry->watch) {
+        mk_list_add(&entry->_watch, &entry->watch->entries);
+    }
+    mk_list_add(&entry->_head, bucket);
+    mk_list_add(&entry->_lru, &cache->lru);
+    cache->count++;
+    cache->last = entry;
+
+    return ret;
+}
+
+/* Make room for 'size' bytes of file content, least recently used first */
+static int mk_stat_cache_mem_reserve(struct mk_stat_cache *cache,
+                                     struct mk_stat_cache_entry *skip,
+                                     long size)
+{
+    struct mk_list *head;
+    struct mk_stat_cache_entry *entry;
+
+    if (size > mk_config->small_file_memory) {
+        return -1;
+    }
+
+    mk_list_foreach(head, &cache->lru) {
+        if (cache->stats.mem_bytes + size <= (unsigned long long) mk_config->small_file_memory) {
+            break;
+        }
+
+        entry = mk_list_entry(head, struct mk_stat_cache_entry, _lru);
+        if (entry == skip || !entry->block || !entry->block->body.data) {
+            continue;
+        }
+
+        mk_stat_cache_block_drop(cache, entry);
+        cache->stats.mem_evictions++;
+    }
+
+    if (cache->stats.mem_bytes + size > (unsigned long long) mk_config->small_file_memory) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Load the content of a small file, it must still match the cached info */
+static int mk_stat_cache_body_read(struct mk_stat_cache_entry *entry)
+{
+    int fd;
+    ssize_t n;
+    size_t total = 0;
+    struct stat st;
+    mk_ptr_t *body = &entry->block->body;
+
+    fd = open(entry->path, entry->info.flags_read_only);
+    if (fd == -1) {
+        return -1;
+    }
+
+    if (fstat(fd, &st) == -1 || st.st_ino != entry->info.inode ||
+        st.st_size != entry->info.size ||
+        st.st_mtime != entry->info.last_modification) {
+        close(fd);
+        return -1;
+    }
+
+    while (total < body->len) {
+        n = read(fd, body->data + total, body->len - total);
+        if (n <= 0) {
+            close(fd);
+            return -1;
+        }
+        total += n;
+    }
+
+    close(fd);
+    return 0;
+}
+
+/*
+ * Return a reference to the response header block of the file resolved by
+ * the last lookup, the caller must release it. It returns NULL if the path
+ * is not cached. Small files get their content loaded on the block.
+ */
+struct mk_header_block *mk_stat_cache_header_block(const char *path, int len,
+                                                   mk_ptr_t *content_type)
+{
+    int body_size;
+    struct mk_stat_cache *cache = mk_stat_cache_key;
+    struct mk_stat_cache_entry *entry;
+
+    if (!cache || !cache->last) {
+        return NULL;
+    }
+
+    entry = cache->last;
+    if (entry->ret != 0 || entry->len != len ||
+        memcmp(entry->path, path, len) != 0) {
+        return NULL;
+    }
+
+    /*
+     * A compressed sibling is served with the mime type of the original
+     * file, the block of a different mime type is not shared.
+     */
+    if (entry->block && entry->block->content_type.data != content_type->data) {
+        return mk_header_block_create(&entry->info, content_type, 0);
+    }
+
+    if (entry->block) {
+        if (entry->block->body.data) {
+            cache->stats.mem_hits++;
+        }
+        entry->block->refs++;
+        return entry->block;
+    }
+
+    /*
+     * A file modified within the current second only gets a weak ETag,
+     * build a block for this response but do not keep it.
+     */
+    if (entry->info.last_modification >= log_current_utime) {
+        return mk_header_block_create(&entry->info, content_type, 0);
+    }
+
+    body_size = 0;
+    if (entry->info.size > 0 && entry->info.size <= mk_config->small_file_size &&
+        mk_stat_cache_mem_reserve(cache, entry, entry->info.size) == 0) {
+        body_size = entry->info.size;
+    }
+
+    entry->block = mk_header_block_create(&entry->info, content_type,
+                                          body_size);
+    if (!entry->block) {
+        return NULL;
+    }
+
+    if (body_size > 0) {
+        if (mk_stat_cache_body_read(entry) == 0) {
+            cache->stats.mem_loads++;
+            cache->stats.mem_bytes += body_size;
+        }
+        else {
+            mk_ptr_reset(&entry->block->body);
+        }
+    }
+
+    entry->block->refs++;
+    return entry->block;
+}
+
+/* Consume the inotify events and drop the entries of changed directories */
+int mk_stat_cache_events()
+{
+#if defined(__linux__)
+    int ret;
+    char *p;
+    char buf[MK_STAT_CACHE_EVENTS_SIZE]
+        __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct inotify_event *ev;
+    struct mk_stat_cache *cache = mk_stat_cache_key;
+    struct mk_stat_cache_entry *entry;
+    struct mk_stat_cache_watch *watch;
+
+    if (!cache || cache->fd == -1) {
+        return -1;
+    }
+
+    while ((ret = read(cache->fd, buf, sizeof(buf))) > 0) {
+        for (p = buf; p < buf + ret; p += sizeof(struct inotify_event) + ev->len) {
+            ev = (struct inotify_event *) p;
+
+            watch = NULL;
+            mk_list_foreach(head, &cache->watches) {
+                watch = mk_list_entry(head, struct mk_stat_cache_watch, _head);
+                if (watch->wd == ev->wd) {
+                    break;
+                }
+                watch = NULL;
+            }
+
+            if (!watch) {
+                continue;
+            }
+
+            MK_TRACE("[stat cache] event 0x%x on %s", ev->mask, watch->path);
+
+            mk_list_foreach_safe(head, tmp, &watch->entries) {
+                entry = mk_list_entry(head, struct mk_stat_cache_entry, _watch);
+                mk_stat_cache_entry_free(cache, entry);
+                cache->stats.invalidations++;
+            }
+
+            /* The kernel already released the watch */
+            if (ev->mask & IN_IGNORED) {
+                watch->wd = -1;
+                mk_stat_cache_watch_free(cache, watch);
+            }
+        }
+    }
+#endif
+
+    return 0;
+}
@@ -18,10 +18,91 @@
  */
 
 #include <monkey/monkey.h>
+
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
 #include <monkey/mk_socket.h>
 #include <monkey/mk_list.h>
 #include <monkey/mk_memory.h>
 #include <monkey/mk_stream.h>
+#include <monkey/mk_readahead.h>
+#include <monkey/mk_config.h>
+#include <monkey/mk_scheduler.h>
+#include <monkey/mk_plugin.h>
+#include <monkey/mk_pipe.h>
+#include <monkey/mk_event.h>
+#include <monkey/mk_deflate.h>
+
+/* Max memory segments written at once by a channel */
+#if defined(IOV_MAX)
+#define MK_CHANNEL_IOV_MAX  IOV_MAX
+#else
+#define MK_CHANNEL_IOV_MAX  1024
+#endif
+
+/* Bytes relayed at once from a MK_STREAM_SOCKET source */
+#define MK_CHANNEL_RELAY_SIZE  65536
+
+static __thread char *mk_channel_relay;
+
+/* A shared buffer pinned by a MSG_ZEROCOPY send until the kernel is done */
+struct mk_channel_pin {
+    uint32_t id;
+    struct mk_stream_buffer *buffer;
+    struct mk_list _head;
+};
+
+/*
+ * The pins of a closed channel whose completions did not arrive yet, the
+ * socket is kept open through a duplicate of its descriptor to read them.
+ */
+struct mk_channel_orphan {
+    int fd;
+    struct mk_list pins;
+    struct mk_list _head;
+};
+
+static __thread struct mk_list *mk_channel_orphans;
+
+/* Create a shared buffer, the caller owns the first reference */
+struct mk_stream_buffer *mk_stream_buffer_new(char *data, size_t size,
+                                              void *priv,
+                                              void (*cb_release) (struct mk_stream_buffer *))
+{
+    struct mk_stream_buffer *buffer;
+
+    buffer = mk_mem_malloc(sizeof(struct mk_stream_buffer));
+    if (!buffer) {
+        return NULL;
+    }
+
+    buffer->refs       = 1;
+    buffer->data       = data;
+    buffer->size       = size;
+    buffer->priv       = priv;
+    buffer->cb_release = cb_release;
+
+    return buffer;
+}
+
+/* Drop a reference, the last one releases the buffer */
+void mk_stream_buffer_release(struct mk_stream_buffer *buffer)
+{
+    if (__sync_sub_and_fetch(&buffer->refs, 1) > 0) {
+        return;
+    }
+
+    if (buffer->cb_release) {
+        buffer->cb_release(buffer);
+    }
+    mk_mem_free(buffer);
+}
 
 /* Create a new stream instance */
 struct mk_stream *mk_stream_new(int type, struct mk_channel *channel,
@@ -50,16 +131,27 @@ struct mk_channel *mk_channel_new(int type, int fd)
     struct mk_channel *channel;
 
     channel = mk_mem_malloc(sizeof(struct mk_channel));
-    channel->type = type;
-    channel->fd   = fd;
+    channel->type   = type;
+    channel->fd     = fd;
+    channel->status = MK_CHANNEL_ENABLED;
+    channel->job    = NULL;
+    channel->pipe   = NULL;
+    channel->relay_wait = -1;
+    channel->chunked = MK_FALSE;
+    channel->encoding = MK_STREAM_ENC_NONE;
+    channel->deflate = NULL;
+    channel->zerocopy = MK_CHANNEL_ZEROCOPY_UNKNOWN;
+    channel->zerocopy_id = 0;
 
     mk_list_init(&channel->streams);
+    mk_list_init(&channel->zerocopy_pins);
 
     return channel;
 }
 
 static inline size_t channel_write_stream_file(struct mk_channel *channel,
-                                               struct mk_stream *stream)
+                                               struct mk_stream *stream,
+                                               size_t count)
 {
     long int bytes = 0;
 
@@ -70,20 +162,871 @@ static inline size_t channel_write_stream_file(struct mk_channel *channel,
     bytes = mk_socket_send_file(channel->fd,
                                 stream->fd,
                                 &stream->bytes_offset,
-                                stream->bytes_total
-                                );
+                                count);
     MK_TRACE("[CH=%d] [FD=%i] WRITE STREAM FILE: %lu bytes",
              channel->fd, stream->fd, bytes);
 
     return bytes;
 }
 
+/*
+ * Bytes of a stream to write now: a single write never goes beyond the
+ * WriteBudget, so a fast client does not keep the worker busy while the
+ * rest of the connections ready on the same loop iteration wait. Being
+ * still writable, the connection is reported again on the next round
+ * after them.
+ */
+static inline size_t mk_channel_budget(struct mk_stream *stream)
+{
+    if (mk_config->write_budget > 0 &&
+        stream->bytes_total > (size_t) mk_config->write_budget) {
+        return mk_config->write_budget;
+    }
+
+    return stream->bytes_total;
+}
+
+/*
+ * The relay source has nothing to read: the channel sleeps and the source
+ * is watched on the worker loop instead, tagged with the channel so
+ * mk_channel_relay_resume() knows who to wake up. The source belongs to
+ * the channel while the stream is queued, its owner must not watch it.
+ */
+static inline int mk_channel_relay_park(struct mk_channel *channel,
+                                        struct mk_stream *stream)
+{
+    if (!worker_sched_node ||
+        mk_event_add(worker_sched_node->loop, stream->fd,
+                     MK_EVENT_READ | MK_EVENT_RELAY, channel) != 0) {
+        return -1;
+    }
+
+    channel->relay_wait = stream->fd;
+    return 0;
+}
+
+/* Nothing is read from the source, see why */
+static inline ssize_t mk_channel_relay_empty(struct mk_channel *channel,
+                                             struct mk_stream *stream,
+                                             ssize_t bytes)
+{
+    if (bytes == 0) {
+        /* The end of a relay of unknown size */
+        if (stream->until_eof == MK_TRUE) {
+            stream->bytes_total = 0;
+            return 0;
+        }
+
+        /* The source went away before giving us the expected bytes */
+        errno = EPIPE;
+        return -1;
+    }
+
+    if (errno == EAGAIN && mk_channel_relay_park(channel, stream) == 0) {
+        return 0;
+    }
+
+    return -1;
+}
+
+/*
+ * Start the next chunk of a relay of unknown size on a chunked channel: it
+ * carries what the source has to read right now, and that data is taken
+ * from it as usual once it's written. Returns the chunk size, or what
+ * mk_channel_relay_empty() says when there is nothing to read.
+ */
+static inline ssize_t mk_channel_relay_chunk(struct mk_channel *channel,
+                                             struct mk_stream *stream)
+{
+    int avail = 0;
+    char c;
+    ssize_t bytes;
+
+    bytes = recv(stream->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    if (bytes <= 0) {
+        return mk_channel_relay_empty(channel, stream, bytes);
+    }
+
+    if (ioctl(stream->fd, FIONREAD, &avail) != 0 || avail < 1) {
+        avail = 1;
+    }
+    if (avail > MK_CHANNEL_RELAY_SIZE) {
+        avail = MK_CHANNEL_RELAY_SIZE;
+    }
+
+    stream->bytes_total = avail;
+    mk_stream_chunk_compose(stream);
+
+    return avail;
+}
+
+#if defined (__linux__)
+/*
+ * Relay a socket stream with splice(2): data moves from the source into
+ * the channel pipe and from there to the client, nothing is copied to
+ * user space. What the client does not take stays in the pipe for the
+ * next write, the pipe goes back to the pool once it's empty.
+ */
+static inline ssize_t channel_write_stream_splice(struct mk_channel *channel,
+                                                  struct mk_stream *stream,
+                                                  size_t count)
+{
+    int more;
+    ssize_t bytes;
+    struct mk_pipe *pipe = channel->pipe;
+
+    if (pipe->bytes < count) {
+        bytes = splice(stream->fd, NULL, pipe->fd[1], NULL,
+                       count - pipe->bytes,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (bytes > 0) {
+            pipe->bytes += bytes;
+        }
+        else if (pipe->bytes == 0) {
+            bytes = mk_channel_relay_empty(channel, stream, bytes);
+            mk_pipe_put(pipe);
+            channel->pipe = NULL;
+            return bytes;
+        }
+    }
+
+    if (count > pipe->bytes) {
+        count = pipe->bytes;
+    }
+
+    /* More data follows: the rest of the stream or the streams behind it */
+    more = (stream->bytes_total > count || stream->chunk_tail > 0 ||
+            stream->_head.next != &channel->streams);
+
+    bytes = mk_socket_send_pipe(channel->fd, pipe->fd[0], count, more);
+    if (bytes > 0) {
+        pipe->bytes -= bytes;
+        if (worker_sched_node) {
+            worker_sched_node->pipe_stats.bytes += bytes;
+        }
+    }
+
+    if (pipe->bytes == 0) {
+        mk_pipe_put(pipe);
+        channel->pipe = NULL;
+    }
+
+    MK_TRACE("[CH=%d] [FD=%i] WRITE STREAM SPLICE: %li bytes",
+             channel->fd, stream->fd, bytes);
+
+    return bytes;
+}
+#endif
+
+/*
+ * Relay data from a socket stream. Transports that can send from a pipe
+ * get it spliced, the others get it peeked first: only what the channel
+ * accepted is taken from the source, so a short write does not lose
+ * anything. Either way, while the source has nothing to read the channel
+ * sleeps until it does (returns 0 with relay_wait set).
+ */
+static inline ssize_t channel_write_stream_socket(struct mk_channel *channel,
+                                                  struct mk_stream *stream,
+                                                  size_t count)
+{
+    ssize_t bytes;
+
+#if defined (__linux__)
+    if (mk_config->network->write_pipe) {
+        if (!channel->pipe) {
+            channel->pipe = mk_pipe_get();
+        }
+        if (channel->pipe) {
+            return channel_write_stream_splice(channel, stream, count);
+        }
+    }
+#endif
+
+    if (!mk_channel_relay) {
+        mk_channel_relay = mk_mem_malloc(MK_CHANNEL_RELAY_SIZE);
+    }
+
+    if (count > MK_CHANNEL_RELAY_SIZE) {
+        count = MK_CHANNEL_RELAY_SIZE;
+    }
+
+    bytes = recv(stream->fd, mk_channel_relay, count, MSG_PEEK | MSG_DONTWAIT);
+    if (bytes <= 0) {
+        return mk_channel_relay_empty(channel, stream, bytes);
+    }
+
+    bytes = mk_socket_send(channel->fd, mk_channel_relay, bytes);
+    if (bytes > 0) {
+        recv(stream->fd, mk_channel_relay, bytes, MSG_DONTWAIT);
+    }
+
+    MK_TRACE("[CH=%d] [FD=%i] WRITE STREAM SOCKET: %li bytes",
+             channel->fd, stream->fd, bytes);
+
+    return bytes;
+}
+
+/* Framing bytes due before or after the data of a stream */
+static inline int mk_stream_chunk_pending(struct mk_stream *stream)
+{
+    return (stream->chunk_head > 0 ||
+            (stream->bytes_total == 0 && stream->chunk_tail > 0));
+}
+
+/* Bytes of a stream still to go out, framing included */
+static inline size_t mk_stream_wire_len(struct mk_stream *stream)
+{
+    return stream->chunk_head + stream->bytes_total + stream->chunk_tail;
+}
+
+/* Size line or CRLF of a chunk wrapping a FILE or SOCKET stream */
+static inline ssize_t channel_write_stream_frame(struct mk_channel *channel,
+                                                 struct mk_stream *stream)
+{
+    if (stream->chunk_head > 0) {
+        return mk_socket_send(channel->fd,
+                              stream->chunk +
+                              (stream->chunk_len - stream->chunk_head),
+                              stream->chunk_head);
+    }
+
+    return mk_socket_send(channel->fd,
+                          mk_iov_crlf.data +
+                          (mk_iov_crlf.len - stream->chunk_tail),
+                          stream->chunk_tail);
+}
+
+/*
+ * Account bytes written from a stream, release it once it's consumed. For
+ * a chunked stream they cover its size line, data and CRLF in that order.
+ */
+static inline void mk_channel_consumed(struct mk_stream *stream, size_t bytes)
+{
+    int preserve;
+    size_t len;
+
+    len = bytes;
+    if (len > (size_t) stream->chunk_head) {
+        len = stream->chunk_head;
+    }
+    stream->chunk_head -= len;
+    bytes -= len;
+
+    len = bytes;
+    if (len > stream->bytes_total) {
+        len = stream->bytes_total;
+    }
+    bytes -= len;
+
+    /* FILE streams are moved forward by sendfile(2) */
+    if (stream->type == MK_STREAM_IOV) {
+        mk_iov_consume(stream->buffer, len);
+    }
+    else if (stream->type != MK_STREAM_FILE) {
+        stream->bytes_offset += len;
+    }
+
+    if (len > 0) {
+        mk_stream_bytes_consumed(stream, len);
+
+        /* notification callback, optional */
+        if (stream->cb_bytes_consumed) {
+            stream->cb_bytes_consumed(stream, len);
+        }
+
+        /*
+         * A buffer stream holds its reference while it has data pending,
+         * the chunk CRLF that may still follow does not need it.
+         */
+        if (stream->type == MK_STREAM_BUFFER && stream->bytes_total == 0) {
+            mk_stream_buffer_release(stream->buffer);
+        }
+    }
+
+    if (stream->bytes_total == 0) {
+        stream->chunk_tail -= bytes;
+    }
+
+    /* A chunk of a relay of unknown size is over, the next one follows */
+    if (stream->chunk_relay == MK_TRUE && stream->chunk_len > 0 &&
+        mk_stream_wire_len(stream) == 0) {
+        stream->chunk_len   = 0;
+        stream->bytes_total = MK_STREAM_SIZE_EOF;
+        return;
+    }
+
+    if (mk_stream_wire_len(stream) == 0) {
+        MK_TRACE("Stream done, unlinking");
+
+        /*
+         * The callback may release the stream or queue it again, it's not
+         * touched after it unless the callback dropped the preserve flag.
+         */
+        preserve = stream->preserve;
+        if (preserve == MK_FALSE) {
+            mk_stream_unlink(stream);
+        }
+
+        if (stream->cb_finished) {
+            stream->cb_finished(stream);
+        }
+
+        if (preserve == MK_TRUE && stream->preserve == MK_FALSE) {
+            mk_stream_unlink(stream);
+        }
+    }
+}
+
+/* A stream that must go through the deflater before anything is written */
+static inline int mk_channel_deflate_pending(struct mk_channel *channel,
+                                             struct mk_stream *stream)
+{
+    if (!channel->deflate) {
+        return MK_FALSE;
+    }
+
+    /* The compressed body ends before the last chunk */
+    if (stream->encoding == MK_STREAM_ENC_DEFLATE ||
+        (stream == &channel->chunk_end &&
+         channel->deflate->finished == MK_FALSE)) {
+        return MK_TRUE;
+    }
+
+    return MK_FALSE;
+}
+
+/*
+ * Data of a stream of a compressed body. Memory is used in place, FILE data
+ * is read with pread(2) and SOCKET data is peeked from the source, they're
+ * taken once the deflater consumed them. Returns the bytes available, 0 if
+ * the stream is empty, -1 on error or if the source has nothing to read.
+ */
+static inline ssize_t mk_channel_deflate_data(struct mk_stream *stream,
+                                              char **data)
+{
+    int i;
+    size_t len = stream->bytes_total;
+    ssize_t bytes;
+    mk_ptr_t *ptr;
+    struct mk_iov *iov;
+    struct mk_stream_buffer *shared;
+
+    if (stream->type == MK_STREAM_IOV) {
+        iov = stream->buffer;
+        for (i = 0; i < iov->iov_idx; i++) {
+            if (iov->io[i].iov_len > 0) {
+                *data = iov->io[i].iov_base;
+                return iov->io[i].iov_len;
+            }
+        }
+        return 0;
+    }
+    else if (stream->type == MK_STREAM_PTR) {
+        ptr = stream->buffer;
+        *data = ptr->data + stream->bytes_offset;
+        return len;
+    }
+    else if (stream->type == MK_STREAM_BUFFER) {
+        shared = stream->buffer;
+        *data = shared->data + stream->bytes_offset;
+        return len;
+    }
+    else if (stream->type == MK_STREAM_RAW) {
+        *data = (char *) stream->buffer + stream->bytes_offset;
+        return len;
+    }
+
+    if (len == 0) {
+        return 0;
+    }
+
+    if (!mk_channel_relay) {
+        mk_channel_relay = mk_mem_malloc(MK_CHANNEL_RELAY_SIZE);
+    }
+    if (len > MK_CHANNEL_RELAY_SIZE) {
+        len = MK_CHANNEL_RELAY_SIZE;
+    }
+    *data = mk_channel_relay;
+
+    if (stream->type == MK_STREAM_FILE) {
+        bytes = pread(stream->fd, mk_channel_relay, len, stream->bytes_offset);
+    }
+    else {
+        bytes = recv(stream->fd, mk_channel_relay, len,
+                     MSG_PEEK | MSG_DONTWAIT);
+    }
+
+    /* The source ended before giving us the expected bytes */
+    if (bytes == 0) {
+        errno = EPIPE;
+        return -1;
+    }
+
+    return bytes;
+}
+
+static inline void mk_channel_deflate_queue(struct mk_channel *channel);
+
+/* The output of a round was sent */
+static void mk_channel_deflate_sent(struct mk_stream *stream)
+{
+    struct mk_channel *channel = stream->data;
+    struct mk_deflate_channel *dc = channel->deflate;
+
+    dc->len = 0;
+
+    /* The rest of a flush cut short by the full buffer goes first */
+    if (dc->flush != MK_DEFLATE_NO_FLUSH &&
+        mk_deflate_channel_flush(dc, dc->flush) >= 0 && dc->len > 0) {
+        mk_channel_deflate_queue(channel);
+        return;
+    }
+
+    /* The compressed body is over, only the last chunk is left */
+    if (dc->finished == MK_TRUE) {
+        channel->deflate = NULL;
+        mk_deflate_channel_put(dc);
+    }
+}
+
+/* A failed write of compressed data is reported to the body streams */
+static void mk_channel_deflate_exception(struct mk_stream *stream, int err)
+{
+    struct mk_channel *channel = stream->data;
+    struct mk_stream *next;
+
+    if (stream->_head.next == &channel->streams) {
+        return;
+    }
+
+    next = mk_list_entry(stream->_head.next, struct mk_stream, _head);
+    if (next->cb_exception) {
+        next->cb_exception(next, err);
+    }
+}
+
+/* Queue the output of a round in front of the streams it was made of */
+static inline void mk_channel_deflate_queue(struct mk_channel *channel)
+{
+    struct mk_deflate_channel *dc = channel->deflate;
+    struct mk_stream *out = &dc->out;
+
+    out->type         = MK_STREAM_RAW;
+    out->channel      = channel;
+    out->buffer       = dc->buf;
+    out->data         = channel;
+    out->bytes_total  = dc->len;
+    out->bytes_offset = 0;
+    out->resident     = 0;
+    out->preserve     = MK_FALSE;
+    out->encoding     = MK_STREAM_ENC_NONE;
+    out->cb_finished       = mk_channel_deflate_sent;
+    out->cb_bytes_consumed = NULL;
+    out->cb_exception      = mk_channel_deflate_exception;
+
+    mk_stream_chunk_compose(out);
+    __mk_list_add(&out->_head, &channel->streams, channel->streams.next);
+}
+
+/*
+ * Compressed chunked body: the streams at the head of the channel are fed
+ * to the deflater and consumed, their callbacks run as usual and may queue
+ * more. A round ends when the output buffer is full, the streams run out
+ * or the last chunk is reached, then what was produced is flushed and
+ * queued as one chunk. If a relay source has nothing to read and there is
+ * nothing to flush, the channel sleeps on it.
+ */
+static int mk_channel_deflate(struct mk_channel *channel)
+{
+    int fed = MK_FALSE;
+    int flush = MK_DEFLATE_SYNC;
+    char *data;
+    ssize_t len;
+    ssize_t bytes;
+    struct mk_stream *stream = NULL;
+    struct mk_deflate_channel *dc = channel->deflate;
+
+    /* A flush cut short by a full buffer goes on first */
+    if (dc->flush != MK_DEFLATE_NO_FLUSH) {
+        flush = dc->flush;
+        fed = MK_TRUE;
+        goto flush;
+    }
+
+    while (mk_list_is_empty(&channel->streams) != 0 &&
+           dc->len < MK_DEFLATE_CHANNEL_BUF) {
+        stream = mk_list_entry_first(&channel->streams, struct mk_stream, _head);
+        if (stream->encoding != MK_STREAM_ENC_DEFLATE) {
+            if (stream == &channel->chunk_end) {
+                flush = MK_DEFLATE_FINISH;
+            }
+            break;
+        }
+
+        len = mk_channel_deflate_data(stream, &data);
+        if (len < 0) {
+            if (errno != EAGAIN) {
+                goto error;
+            }
+            if (fed == MK_TRUE) {
+                break;
+            }
+            if (mk_channel_relay_park(channel, stream) != 0) {
+                goto error;
+            }
+            MK_TRACE("[CH %i] CHANNEL_BUSY (deflate relay)", channel->fd);
+            return MK_CHANNEL_BUSY;
+        }
+        else if (len == 0) {
+            mk_channel_consumed(stream, stream->bytes_total);
+            continue;
+        }
+
+        bytes = mk_deflate_channel_input(dc, data, len);
+        if (bytes < 0) {
+            errno = EIO;
+            goto error;
+        }
+        fed = MK_TRUE;
+
+        if (stream->type == MK_STREAM_SOCKET) {
+            recv(stream->fd, mk_channel_relay, bytes, MSG_DONTWAIT);
+        }
+        else if (stream->type == MK_STREAM_FILE) {
+            stream->bytes_offset += bytes;
+        }
+        mk_channel_consumed(stream, bytes);
+    }
+
+    /* A full buffer is sent as is if more data follows */
+    if (dc->len == MK_DEFLATE_CHANNEL_BUF &&
+        mk_list_is_empty(&channel->streams) != 0) {
+        flush = MK_DEFLATE_NO_FLUSH;
+    }
+
+ flush:
+    if (flush == MK_DEFLATE_FINISH ||
+        (flush == MK_DEFLATE_SYNC && fed == MK_TRUE)) {
+        if (mk_deflate_channel_flush(dc, flush) < 0) {
+            errno = EIO;
+            goto error;
+        }
+    }
+
+    if (dc->len > 0) {
+        mk_channel_deflate_queue(channel);
+    }
+
+    if (mk_list_is_empty(&channel->streams) == 0) {
+        MK_TRACE("[CH %i] CHANNEL_DONE", channel->fd);
+        return MK_CHANNEL_DONE;
+    }
+
+    return MK_CHANNEL_FLUSH;
+
+ error:
+    if (stream && stream->cb_exception) {
+        stream->cb_exception(stream, errno);
+    }
+    return MK_CHANNEL_ERROR;
+}
+
+/* Large shared buffers are not copied into the socket, see ZeroCopy */
+static inline int mk_stream_zerocopy(struct mk_channel *channel,
+                                     struct mk_stream *stream)
+{
+    if (mk_config->zerocopy > 0 &&
+        stream->type == MK_STREAM_BUFFER &&
+        stream->bytes_total >= (size_t) mk_config->zerocopy &&
+        channel->zerocopy != MK_CHANNEL_ZEROCOPY_OFF &&
+        mk_config->network->write_zerocopy) {
+        return MK_TRUE;
+    }
+
+    return MK_FALSE;
+}
+
+/*
+ * Send data of a shared buffer with MSG_ZEROCOPY, every send takes a
+ * reference on the buffer that is dropped once the kernel reports it
+ * complete, see mk_channel_zerocopy_done().
+ */
+static inline ssize_t channel_write_stream_zerocopy(struct mk_channel *channel,
+                                                    struct mk_stream *stream,
+                                                    size_t count)
+{
+    ssize_t bytes;
+    char *data;
+    struct mk_channel_pin *pin;
+    struct mk_stream_buffer *shared;
+
+    shared = stream->buffer;
+    data = shared->data + stream->bytes_offset;
+
+    if (channel->zerocopy == MK_CHANNEL_ZEROCOPY_UNKNOWN) {
+        if (mk_socket_set_zerocopy(channel->fd) != 0) {
+            channel->zerocopy = MK_CHANNEL_ZEROCOPY_OFF;
+            return mk_socket_send(channel->fd, data, count);
+        }
+        channel->zerocopy = MK_CHANNEL_ZEROCOPY_ON;
+    }
+
+    pin = mk_mem_malloc(sizeof(struct mk_channel_pin));
+    if (!pin) {
+        return mk_socket_send(channel->fd, data, count);
+    }
+
+    bytes = mk_socket_send_zerocopy(channel->fd, data, count);
+    if (bytes <= 0) {
+        mk_mem_free(pin);
+
+        /* No room left to track the pages (optmem_max), copy them */
+        if (bytes < 0 && errno == ENOBUFS) {
+            return mk_socket_send(channel->fd, data, count);
+        }
+        return bytes;
+    }
+
+    mk_stream_buffer_get(shared);
+    pin->id     = channel->zerocopy_id++;
+    pin->buffer = shared;
+    mk_list_add(&pin->_head, &channel->zerocopy_pins);
+
+    if (worker_sched_node) {
+        worker_sched_node->channel_stats.zerocopy += bytes;
+    }
+
+    return bytes;
+}
+
+static inline int mk_stream_in_memory(struct mk_stream *stream)
+{
+    if (stream->type == MK_STREAM_RAW || stream->type == MK_STREAM_IOV ||
+        stream->type == MK_STREAM_PTR || stream->type == MK_STREAM_BUFFER) {
+        return MK_TRUE;
+    }
+
+    return MK_FALSE;
+}
+
+static inline void mk_channel_stats_add(ssize_t bytes, int budget_hit)
+{
+    struct mk_channel_stats *stats;
+
+    if (!worker_sched_node) {
+        return;
+    }
+
+    stats = &worker_sched_node->channel_stats;
+    stats->writes++;
+    stats->bytes += bytes;
+    if (budget_hit == MK_TRUE) {
+        stats->budget_hits++;
+    }
+}
+
+/*
+ * Write the memory streams (RAW, IOV, PTR and BUFFER) found in a row at the head
+ * of the channel with a single writev(2): headers, small bodies, multipart
+ * boundaries and the rows pushed by plugins leave in one call instead of
+ * one per stream. A FILE stream ends the batch, it's written on its own
+ * through sendfile(2). If there are more streams behind the batch the data
+ * is flagged with MSG_MORE, so the kernel waits for them before sending a
+ * short frame.
+ */
+static int mk_channel_write_memory(struct mk_channel *channel)
+{
+    int i;
+    int j;
+    int n = 0;
+    int count = 0;
+    int more = MK_FALSE;
+    int budget_hit = MK_FALSE;
+    ssize_t bytes;
+    size_t len;
+    size_t total = 0;
+    size_t wire = 0;
+    size_t budget = SIZE_MAX;
+    size_t lengths[MK_CHANNEL_IOV_MAX];
+    mk_ptr_t *ptr;
+    struct mk_iov *iov;
+    struct mk_iov batch;
+    struct mk_stream_buffer *shared;
+    struct iovec io[MK_CHANNEL_IOV_MAX];
+    struct mk_list *head;
+    struct mk_stream *stream;
+    struct mk_stream *streams[MK_CHANNEL_IOV_MAX];
+
+    if (mk_config->write_budget > 0) {
+        budget = mk_config->write_budget;
+    }
+
+    mk_list_foreach(head, &channel->streams) {
+        stream = mk_list_entry(head, struct mk_stream, _head);
+        if (mk_stream_in_memory(stream) == MK_FALSE ||
+            stream->encoding == MK_STREAM_ENC_DISCARD ||
+            mk_channel_deflate_pending(channel, stream) == MK_TRUE ||
+            n == MK_CHANNEL_IOV_MAX || total == budget) {
+            more = MK_TRUE;
+            break;
+        }
+
+        streams[count] = stream;
+        lengths[count] = 0;
+        count++;
+
+        /* Chunk size line */
+        if (stream->chunk_head > 0) {
+            io[n].iov_base = stream->chunk +
+                (stream->chunk_len - stream->chunk_head);
+            io[n].iov_len  = stream->chunk_head;
+            lengths[count - 1] += stream->chunk_head;
+            n++;
+        }
+
+        /* Zero copy data is sent on its own, only the size line goes now */
+        if (mk_stream_zerocopy(channel, stream) == MK_TRUE) {
+            if (lengths[count - 1] == 0) {
+                count--;
+            }
+            else {
+                wire += lengths[count - 1];
+            }
+            more = MK_TRUE;
+            break;
+        }
+
+        if (stream->type == MK_STREAM_IOV) {
+            iov = stream->buffer;
+            for (i = 0; i < iov->iov_idx && n < MK_CHANNEL_IOV_MAX; i++) {
+                len = iov->io[i].iov_len;
+                if (len == 0) {
+                    continue;
+                }
+                if (len > budget - total) {
+                    len = budget - total;
+                }
+                io[n].iov_base = iov->io[i].iov_base;
+                io[n].iov_len  = len;
+                lengths[count - 1] += len;
+                total += len;
+                n++;
+                if (total == budget) {
+                    break;
+                }
+            }
+        }
+        else if (stream->bytes_total > 0 && n < MK_CHANNEL_IOV_MAX) {
+            len = stream->bytes_total;
+            if (len > budget - total) {
+                len = budget - total;
+            }
+
+            if (stream->type == MK_STREAM_PTR) {
+                ptr = stream->buffer;
+                io[n].iov_base = ptr->data + stream->bytes_offset;
+            }
+            else if (stream->type == MK_STREAM_BUFFER) {
+                shared = stream->buffer;
+                io[n].iov_base = shared->data + stream->bytes_offset;
+            }
+            else {
+                io[n].iov_base = (char *) stream->buffer + stream->bytes_offset;
+            }
+            io[n].iov_len = len;
+            lengths[count - 1] += len;
+            total += len;
+            n++;
+        }
+
+        /* Chunk CRLF, once all the data is in */
+        if (stream->chunk_tail > 0 && n < MK_CHANNEL_IOV_MAX &&
+            lengths[count - 1] == stream->chunk_head + stream->bytes_total) {
+            io[n].iov_base = (char *) mk_iov_crlf.data +
+                (mk_iov_crlf.len - stream->chunk_tail);
+            io[n].iov_len  = stream->chunk_tail;
+            lengths[count - 1] += stream->chunk_tail;
+            n++;
+        }
+        wire += lengths[count - 1];
+
+        /* The stream does not fit completely, the rest goes later */
+        if (lengths[count - 1] < mk_stream_wire_len(stream)) {
+            more = MK_TRUE;
+            if (total == budget) {
+                budget_hit = MK_TRUE;
+            }
+            break;
+        }
+    }
+
+    MK_TRACE("[CH %i] MEMORY STREAMS %i, %i entries, %lu bytes",
+             channel->fd, count, n, wire);
+
+    bytes = 0;
+    if (n > 0) {
+        batch.io        = io;
+        batch.iov_idx   = n;
+        batch.total_len = wire;
+
+        if (more == MK_TRUE) {
+            bytes = mk_socket_sendv_more(channel->fd, &batch);
+        }
+        else {
+            bytes = mk_socket_sendv(channel->fd, &batch);
+        }
+
+        if (bytes < 0 && errno == EAGAIN) {
+            MK_TRACE("[CH %i] CHANNEL_FLUSH (EAGAIN)", channel->fd);
+            return MK_CHANNEL_FLUSH;
+        }
+        else if (bytes <= 0) {
+            stream = streams[0];
+            if (stream->cb_exception) {
+                stream->cb_exception(stream, errno);
+            }
+            return MK_CHANNEL_ERROR;
+        }
+
+        mk_channel_stats_add(bytes, budget_hit == MK_TRUE &&
+                             (size_t) bytes == wire);
+    }
+
+    /* Distribute what was written across the streams, in order */
+    for (j = 0; j < count; j++) {
+        len = lengths[j];
+        if ((size_t) bytes < len) {
+            len = bytes;
+        }
+
+        /* Empty streams are done as soon as the ones before them */
+        if (len == 0 && mk_stream_wire_len(streams[j]) > 0) {
+            break;
+        }
+
+        bytes -= len;
+        mk_channel_consumed(streams[j], len);
+
+        if (lengths[j] > len) {
+            break;
+        }
+    }
+
+    if (mk_list_is_empty(&channel->streams) == 0) {
+        MK_TRACE("[CH %i] CHANNEL_DONE", channel->fd);
+        return MK_CHANNEL_DONE;
+    }
+
+    MK_TRACE("[CH %i] CHANNEL_FLUSH", channel->fd);
+    return MK_CHANNEL_FLUSH;
+}
+
 int mk_channel_write(struct mk_channel *channel)
 {
+    int ret;
     //size_t bytes = -1;
     ssize_t bytes = -1;//it should be signed,since "if (bytes <= 0)" below
-    struct mk_iov *iov;
-    mk_ptr_t *ptr;
+    size_t count = 0;
     struct mk_stream *stream;
 
     if (mk_list_is_empty(&channel->streams) == 0) {
@@ -91,59 +1034,124 @@ int mk_channel_write(struct mk_channel *channel)
         return MK_CHANNEL_EMPTY;
     }
 
+    /* The owner is still queueing streams, they will be flushed together */
+    if (channel->status == MK_CHANNEL_BATCH) {
+        return MK_CHANNEL_FLUSH;
+    }
+
     /* Get the input source */
     stream = mk_list_entry_first(&channel->streams, struct mk_stream, _head);
 
+    /* Body of a HEAD response, it's consumed without being sent */
+    while (stream->encoding == MK_STREAM_ENC_DISCARD) {
+        mk_channel_consumed(stream, mk_stream_wire_len(stream));
+        if (mk_list_is_empty(&channel->streams) == 0) {
+            MK_TRACE("[CH %i] CHANNEL_DONE", channel->fd);
+            return MK_CHANNEL_DONE;
+        }
+        stream = mk_list_entry_first(&channel->streams, struct mk_stream, _head);
+    }
+
+    /* Compressed body, what goes out is the output of the deflater */
+    if (mk_channel_deflate_pending(channel, stream) == MK_TRUE) {
+        ret = mk_channel_deflate(channel);
+        if (ret != MK_CHANNEL_FLUSH) {
+            return ret;
+        }
+        stream = mk_list_entry_first(&channel->streams, struct mk_stream, _head);
+    }
+
     /*
      * Based on the Stream type we consume on that way, not all inputs
      * requires to read from buffer, e.g: Static File, Pipes.
      */
     if (channel->type == MK_CHANNEL_SOCKET) {
-        if (stream->type == MK_STREAM_FILE) {
-            bytes = channel_write_stream_file(channel, stream);
+        if (stream->chunk_head == 0 &&
+            mk_stream_zerocopy(channel, stream) == MK_TRUE) {
+            count = mk_channel_budget(stream);
+            bytes = channel_write_stream_zerocopy(channel, stream, count);
         }
-        else if (stream->type == MK_STREAM_IOV) {
-            MK_TRACE("[CH %i] STREAM_IOV, wrote %lu bytes",
-                     channel->fd, stream->bytes_total);
-
-            iov   = stream->buffer;
-            bytes = mk_socket_sendv(channel->fd, iov);
-
-            if (bytes > 0) {
-                /* Perform the adjustment on mk_iov */
-                mk_iov_consume(iov, bytes);
-            }
+        else if (mk_stream_in_memory(stream) == MK_TRUE) {
+            return mk_channel_write_memory(channel);
         }
-        else if (stream->type == MK_STREAM_PTR) {
-            MK_TRACE("[CH %i] STREAM_PTR, bytes=%lu",
-                     channel->fd, stream->bytes_total);
-
-            ptr = stream->buffer;
-            bytes = mk_socket_send(channel->fd, ptr->data, ptr->len);
-            if (bytes > 0) {
-                /* FIXME OFFSET */
+        else if (mk_stream_chunk_pending(stream)) {
+            bytes = channel_write_stream_frame(channel, stream);
+        }
+        else if (stream->type == MK_STREAM_FILE) {
+            /* Do not block the worker reading a file that is not cached */
+            if (mk_readahead_park(channel, stream) == 0) {
+                MK_TRACE("[CH %i] CHANNEL_BUSY", channel->fd);
+                return MK_CHANNEL_BUSY;
             }
+            count = mk_channel_budget(stream);
+            bytes = channel_write_stream_file(channel, stream, count);
         }
-
-        if (bytes > 0) {
-            mk_stream_bytes_consumed(stream, bytes);
-
-            /* notification callback, optional */
-            if (stream->cb_bytes_consumed) {
-                stream->cb_bytes_consumed(stream, bytes);
+        else if (stream->type == MK_STREAM_SOCKET) {
+            if (channel->relay_wait == -1 && stream->chunk_relay == MK_TRUE &&
+                stream->chunk_len == 0) {
+                /* A new chunk, its size line goes out right away */
+                bytes = mk_channel_relay_chunk(channel, stream);
+                if (bytes > 0) {
+                    bytes = channel_write_stream_frame(channel, stream);
+                }
+            }
+            else if (channel->relay_wait == -1) {
+                count = mk_channel_budget(stream);
+                bytes = channel_write_stream_socket(channel, stream, count);
             }
 
-            if (stream->bytes_total == 0) {
-                MK_TRACE("Stream done, unlinking");
+            /* Sleep until the source has data */
+            if (channel->relay_wait != -1) {
+                MK_TRACE("[CH %i] CHANNEL_BUSY (relay)", channel->fd);
+                return MK_CHANNEL_BUSY;
+            }
 
-                if (stream->cb_finished) {
-                    stream->cb_finished(stream);
+            /* The source was closed, the relay is over */
+            if (bytes == 0 && stream->bytes_total == 0) {
+                mk_channel_consumed(stream, 0);
+                if (mk_list_is_empty(&channel->streams) == 0) {
+                    MK_TRACE("[CH %i] CHANNEL_DONE", channel->fd);
+                    return MK_CHANNEL_DONE;
                 }
+                return MK_CHANNEL_FLUSH;
+            }
+        }
+        else if (stream->type == MK_STREAM_WAIT) {
+            /*
+             * The owner reads the source once it's readable and queues what
+             * it makes of it behind the stream, until then the channel
+             * sleeps on the source.
+             */
+            ret = MK_CHANNEL_BUSY;
+            if (channel->relay_wait == -1) {
+                ret = stream->cb_ready(stream);
+            }
 
-                if (stream->preserve == MK_FALSE) {
-                    mk_stream_unlink(stream);
+            if (ret == MK_CHANNEL_DONE) {
+                mk_channel_consumed(stream, 0);
+                if (mk_list_is_empty(&channel->streams) == 0) {
+                    MK_TRACE("[CH %i] CHANNEL_DONE", channel->fd);
+                    return MK_CHANNEL_DONE;
                 }
+                return MK_CHANNEL_FLUSH;
+            }
+            else if (ret == MK_CHANNEL_BUSY &&
+                     (channel->relay_wait != -1 ||
+                      mk_channel_relay_park(channel, stream) == 0)) {
+                MK_TRACE("[CH %i] CHANNEL_BUSY (wait)", channel->fd);
+                return MK_CHANNEL_BUSY;
+            }
+
+            if (stream->cb_exception) {
+                stream->cb_exception(stream, errno);
             }
+            return MK_CHANNEL_ERROR;
+        }
+
+        if (bytes > 0) {
+            mk_channel_stats_add(bytes, count < stream->bytes_total &&
+                                 (size_t) bytes == count);
+            mk_channel_consumed(stream, bytes);
 
             if (mk_list_is_empty(&channel->streams) == 0) {
                 MK_TRACE("[CH %i] CHANNEL_DONE", channel->fd);
@@ -153,6 +1161,10 @@ int mk_channel_write(struct mk_channel *channel)
             MK_TRACE("[CH %i] CHANNEL_FLUSH", channel->fd);
             return MK_CHANNEL_FLUSH;
         }
+        else if (bytes < 0 && errno == EAGAIN) {
+            MK_TRACE("[CH %i] CHANNEL_FLUSH (EAGAIN)", channel->fd);
+            return MK_CHANNEL_FLUSH;
+        }
         else if (bytes <= 0) {
             if (stream->cb_exception) {
                 stream->cb_exception(stream, errno);
@@ -163,3 +1175,329 @@ int mk_channel_write(struct mk_channel *channel)
 
     return MK_CHANNEL_UNKNOWN;
 }
+
+/*
+ * Write streams in a row while each one is consumed completely: a partial
+ * write means the socket buffer is full and the rest must wait for the next
+ * writable event.
+ */
+int mk_channel_flush(struct mk_channel *channel)
+{
+    int ret;
+    struct mk_stream *stream;
+
+    do {
+        if (mk_list_is_empty(&channel->streams) == 0) {
+            return MK_CHANNEL_EMPTY;
+        }
+
+        stream = mk_list_entry_first(&channel->streams, struct mk_stream, _head);
+        ret = mk_channel_write(channel);
+    } while (ret == MK_CHANNEL_FLUSH &&
+             channel->status != MK_CHANNEL_BATCH &&
+             mk_list_is_empty(&channel->streams) != 0 &&
+             stream != mk_list_entry_first(&channel->streams,
+                                           struct mk_stream, _head));
+
+    return ret;
+}
+
+/* Streams queued from now on are sent with chunked transfer encoding */
+void mk_channel_chunked_start(struct mk_channel *channel)
+{
+    channel->chunked = MK_TRUE;
+}
+
+/* The body is over, queue the last chunk */
+void mk_channel_chunked_end(struct mk_channel *channel)
+{
+    static const mk_ptr_t last = mk_ptr_init("0\r\n\r\n");
+
+    if (channel->chunked == MK_FALSE) {
+        return;
+    }
+
+    /* The last chunk is not part of a compressed body, it ends it */
+    channel->chunked = MK_FALSE;
+    channel->encoding = MK_STREAM_ENC_NONE;
+    mk_stream_set(&channel->chunk_end, MK_STREAM_PTR, channel,
+                  (void *) &last, -1, NULL, NULL, NULL, NULL);
+}
+
+/* The body streams queued from now on are compressed by 'deflate' */
+void mk_channel_deflate_start(struct mk_channel *channel,
+                              struct mk_deflate_channel *deflate)
+{
+    channel->deflate  = deflate;
+    channel->encoding = MK_STREAM_ENC_DEFLATE;
+}
+
+/*
+ * The response has no body (HEAD): the streams queued from now on are
+ * consumed without being sent, so their owners go on as usual.
+ */
+void mk_channel_head_only(struct mk_channel *channel)
+{
+    channel->encoding = MK_STREAM_ENC_DISCARD;
+}
+
+/*
+ * Called by the worker loop for every event: if 'fd' is the relay source a
+ * channel sleeps on, it's not watched anymore and the channel is woken up
+ * to write. A source that failed or hung up wakes it up as well, the
+ * write reports it.
+ */
+int mk_channel_relay_resume(int fd)
+{
+    struct mk_channel *channel;
+    struct mk_event_fd_state *state;
+
+    /* Only sources parked by mk_channel_relay_park() carry a channel */
+    state = mk_event_get_state(fd);
+    if (!(state->mask & MK_EVENT_RELAY) || !state->data) {
+        return MK_FALSE;
+    }
+    channel = state->data;
+
+    mk_event_del(worker_sched_node->loop, fd);
+    channel->relay_wait = -1;
+    mk_event_add(worker_sched_node->loop, channel->fd, MK_EVENT_WRITE, NULL);
+
+    return MK_TRUE;
+}
+
+/* Release a buffer pinned by a zero copy send */
+static inline void mk_channel_pin_release(struct mk_channel_pin *pin)
+{
+    mk_list_del(&pin->_head);
+    mk_stream_buffer_release(pin->buffer);
+    mk_mem_free(pin);
+}
+
+/*
+ * Read the zero copy completions queued on the error queue of a socket and
+ * release the pins of the sends they cover, 'copied' is set if the kernel
+ * reported it had to copy the data anyway. Returns the number of
+ * completions read or -1 on error.
+ */
+static int mk_channel_pins_done(int fd, struct mk_list *pins, int *copied)
+{
+    int ret;
+    int count = 0;
+    int copy;
+    uint32_t lo;
+    uint32_t hi;
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_channel_pin *pin;
+
+    while ((ret = mk_socket_zerocopy_read(fd, &lo, &hi, &copy)) > 0) {
+        count++;
+
+        mk_list_foreach_safe(head, tmp, pins) {
+            pin = mk_list_entry(head, struct mk_channel_pin, _head);
+
+            /* ids wrap around */
+            if ((int32_t) (pin->id - lo) >= 0 && (int32_t) (hi - pin->id) >= 0) {
+                mk_channel_pin_release(pin);
+            }
+        }
+
+        if (copy) {
+            *copied = MK_TRUE;
+        }
+    }
+
+    if (ret < 0) {
+        return -1;
+    }
+
+    return count;
+}
+
+/*
+ * Read the zero copy completions of a channel. If the kernel reports it
+ * had to copy the data anyway (loopback, a device without scatter-gather)
+ * the channel stops using zero copy, it only adds the completion overhead.
+ * Returns the number of completions read or -1 on error.
+ */
+int mk_channel_zerocopy_done(struct mk_channel *channel)
+{
+    int ret;
+    int copied = MK_FALSE;
+
+    ret = mk_channel_pins_done(channel->fd, &channel->zerocopy_pins, &copied);
+    if (copied) {
+        channel->zerocopy = MK_CHANNEL_ZEROCOPY_OFF;
+        if (worker_sched_node) {
+            worker_sched_node->channel_stats.zerocopy_copied++;
+        }
+    }
+
+    return ret;
+}
+
+/*
+ * The pages of a zero copy send are read by the device until its
+ * completion is reported, the buffers pinned by a channel that goes away
+ * can't be released before. The socket is duplicated so it survives the
+ * close of the connection and the pins are kept on the worker orphans
+ * list until mk_channel_orphans_check() reads their completions.
+ */
+static void mk_channel_orphan(struct mk_channel *channel)
+{
+    int fd;
+    int timeout;
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_channel_pin *pin;
+    struct mk_channel_orphan *orphan;
+
+    fd = dup(channel->fd);
+    if (fd == -1) {
+        /*
+         * Better to leak the buffers than to let the allocator hand out
+         * pages the device is still reading.
+         */
+        mk_libc_error("dup");
+        mk_list_init(&channel->zerocopy_pins);
+        return;
+    }
+
+    /*
+     * The connection ends as usual for the client, and a peer that stops
+     * acknowledging data does not hold the pins longer than a request.
+     */
+    shutdown(fd, SHUT_WR);
+#ifdef TCP_USER_TIMEOUT
+    timeout = mk_config->timeout * 1000;
+    setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &timeout, sizeof(timeout));
+#else
+    (void) timeout;
+#endif
+
+    if (!mk_channel_orphans) {
+        mk_channel_orphans = mk_mem_malloc(sizeof(struct mk_list));
+        mk_list_init(mk_channel_orphans);
+    }
+
+    orphan = mk_mem_malloc(sizeof(struct mk_channel_orphan));
+    orphan->fd = fd;
+    mk_list_init(&orphan->pins);
+    mk_list_foreach_safe(head, tmp, &channel->zerocopy_pins) {
+        pin = mk_list_entry(head, struct mk_channel_pin, _head);
+        mk_list_del(&pin->_head);
+        mk_list_add(&pin->_head, &orphan->pins);
+    }
+    mk_list_add(&orphan->_head, mk_channel_orphans);
+}
+
+/*
+ * Collect the completions of the orphaned pins of the worker, the socket
+ * is closed once all of them are released. Called from the scheduler
+ * timer and when a channel is cleaned.
+ */
+void mk_channel_orphans_check()
+{
+    int copied;
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_channel_orphan *orphan;
+
+    if (!mk_channel_orphans) {
+        return;
+    }
+
+    mk_list_foreach_safe(head, tmp, mk_channel_orphans) {
+        orphan = mk_list_entry(head, struct mk_channel_orphan, _head);
+        mk_channel_pins_done(orphan->fd, &orphan->pins, &copied);
+
+        if (mk_list_is_empty(&orphan->pins) == 0) {
+            close(orphan->fd);
+            mk_list_del(&orphan->_head);
+            mk_mem_free(orphan);
+        }
+    }
+}
+
+/* The worker exits, nothing is sent anymore */
+void mk_channel_worker_exit()
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_list *p_tmp;
+    struct mk_list *p_head;
+    struct mk_channel_pin *pin;
+    struct mk_channel_orphan *orphan;
+
+    if (!mk_channel_orphans) {
+        return;
+    }
+
+    mk_list_foreach_safe(head, tmp, mk_channel_orphans) {
+        orphan = mk_list_entry(head, struct mk_channel_orphan, _head);
+        close(orphan->fd);
+        mk_list_foreach_safe(p_head, p_tmp, &orphan->pins) {
+            pin = mk_list_entry(p_head, struct mk_channel_pin, _head);
+            mk_channel_pin_release(pin);
+        }
+        mk_list_del(&orphan->_head);
+        mk_mem_free(orphan);
+    }
+
+    mk_mem_free(mk_channel_orphans);
+    mk_channel_orphans = NULL;
+}
+
+/*
+ * Unlink the streams left on a channel that goes away, the shared buffers
+ * they still reference are released.
+ */
+void mk_channel_clean(struct mk_channel *channel)
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_stream *stream;
+    struct mk_event_fd_state *state;
+
+    mk_list_foreach_safe(head, tmp, &channel->streams) {
+        stream = mk_list_entry(head, struct mk_stream, _head);
+        mk_stream_unlink(stream);
+
+        if (stream->type == MK_STREAM_BUFFER && stream->bytes_total > 0) {
+            mk_stream_buffer_release(stream->buffer);
+        }
+    }
+    channel->chunked = MK_FALSE;
+    channel->encoding = MK_STREAM_ENC_NONE;
+
+    if (channel->deflate) {
+        mk_deflate_channel_put(channel->deflate);
+        channel->deflate = NULL;
+    }
+
+    /* A relay in progress is dropped, with the data left in its pipe */
+    if (channel->relay_wait != -1) {
+        if (worker_sched_node) {
+            mk_event_del(worker_sched_node->loop, channel->relay_wait);
+        }
+        state = mk_event_get_state(channel->relay_wait);
+        state->mask &= ~MK_EVENT_RELAY;
+        state->data  = NULL;
+        channel->relay_wait = -1;
+    }
+    if (channel->pipe) {
+        mk_pipe_put(channel->pipe);
+        channel->pipe = NULL;
+    }
+
+    /* Sends still in flight keep their buffers after the channel is gone */
+    if (mk_list_is_empty(&channel->zerocopy_pins) != 0) {
+        mk_channel_zerocopy_done(channel);
+        if (mk_list_is_empty(&channel->zerocopy_pins) != 0) {
+            mk_channel_orphan(channel);
+        }
+    }
+
+    mk_channel_orphans_check();
+}
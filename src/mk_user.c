@@ -66,6 +66,11 @@ int mk_user_init(struct mk_http_session *cs, struct mk_http_request *sr)
         return -1;
     }
 
+    /* Discard the real path composed under the document root */
+    if (sr->real_path.data != sr->real_path_static) {
+        mk_ptr_free(&sr->real_path);
+    }
+
     if (sr->uri_processed.len > (unsigned int) (offset+limit)) {
         user_uri = mk_mem_malloc(sr->uri_processed.len);
         if (!user_uri) {
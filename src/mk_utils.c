@@ -183,19 +183,130 @@ int mk_utils_utime2gmt(char **data, time_t date)
     return size;
 }
 
-time_t mk_utils_gmt2utime(char *date)
+/* Last date parsed by this thread, clients repeat the same validator */
+static __thread char mk_date_last[32];
+static __thread int mk_date_last_len;
+static __thread time_t mk_date_last_time;
+
+static inline int mk_utils_date_num(const char *p, int digits)
 {
-    time_t new_unix_time;
+    int i;
+    int n = 0;
+
+    for (i = 0; i < digits; i++) {
+        if (p[i] < '0' || p[i] > '9') {
+            return -1;
+        }
+        n = (n * 10) + (p[i] - '0');
+    }
+    return n;
+}
+
+/* Days since 1970-01-01 of a civil date, proleptic Gregorian calendar */
+static inline long mk_utils_date_days(int y, int m, int d)
+{
+    long era;
+    unsigned long yoe;
+    unsigned long doy;
+    unsigned long doe;
+
+    y -= (m <= 2);
+    era = (y >= 0 ? y : y - 399) / 400;
+    yoe = (unsigned long) (y - era * 400);
+    doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+
+    return era * 146097 + (long) doe - 719468;
+}
+
+/*
+ * Parse the fixed length IMF-fixdate format by position:
+ *
+ *     Sun, 06 Nov 1994 08:49:37 GMT
+ */
+static time_t mk_utils_gmt2utime_fixed(const char *date)
+{
+    int i;
+    int mon = -1;
+    int day, year, hour, min, sec;
+
+    if (date[3] != ',' || date[4] != ' ' || date[7] != ' ' ||
+        date[11] != ' ' || date[16] != ' ' || date[19] != ':' ||
+        date[22] != ':' || memcmp(date + 25, " GMT", 4) != 0) {
+        return -1;
+    }
+
+    for (i = 0; i < 12; i++) {
+        if (memcmp(date + 8, mk_date_ym[i], 3) == 0) {
+            mon = i;
+            break;
+        }
+    }
+
+    day  = mk_utils_date_num(date + 5, 2);
+    year = mk_utils_date_num(date + 12, 4);
+    hour = mk_utils_date_num(date + 17, 2);
+    min  = mk_utils_date_num(date + 20, 2);
+    sec  = mk_utils_date_num(date + 23, 2);
+
+    if (mon < 0 || day < 1 || day > 31 || year < 1970 || hour < 0 ||
+        hour > 23 || min < 0 || min > 59 || sec < 0 || sec > 60) {
+        return -1;
+    }
+
+    return (mk_utils_date_days(year, mon + 1, day) * 86400) +
+        (hour * 3600) + (min * 60) + sec;
+}
+
+/*
+ * Convert an HTTP date to unix time. The IMF-fixdate format is parsed by
+ * hand, the obsolete RFC 850 and asctime() formats fall back to strptime().
+ */
+time_t mk_utils_gmt2utime(const char *date, int len)
+{
+    int i;
+    time_t t = -1;
+    char buf[64];
     struct tm t_data;
-    memset(&t_data, 0, sizeof(struct tm));
+    static const char *formats[] = {
+        "%a, %d %b %Y %H:%M:%S GMT",
+        "%A, %d-%b-%y %H:%M:%S GMT",
+        "%a %b %e %H:%M:%S %Y",
+        NULL
+    };
 
-    if (!strptime(date, GMT_DATEFORMAT, (struct tm *) &t_data)) {
+    if (len <= 0 || len >= (int) sizeof(buf)) {
         return -1;
     }
 
-    new_unix_time = timegm((struct tm *) &t_data);
+    if (len == mk_date_last_len && memcmp(date, mk_date_last, len) == 0) {
+        return mk_date_last_time;
+    }
+
+    if (len == 29) {
+        t = mk_utils_gmt2utime_fixed(date);
+    }
+
+    if (t == -1) {
+        memcpy(buf, date, len);
+        buf[len] = '\0';
+
+        for (i = 0; formats[i]; i++) {
+            memset(&t_data, 0, sizeof(struct tm));
+            if (strptime(buf, formats[i], &t_data)) {
+                t = timegm(&t_data);
+                break;
+            }
+        }
+    }
+
+    if (t != -1 && len < (int) sizeof(mk_date_last)) {
+        memcpy(mk_date_last, date, len);
+        mk_date_last_len  = len;
+        mk_date_last_time = t;
+    }
 
-    return (new_unix_time);
+    return t;
 }
 
 int mk_buffer_cat(mk_ptr_t *p, char *buf1, int len1, char *buf2, int len2)
@@ -251,54 +362,112 @@ int mk_utils_hex2int(char *hex, int len)
     return res;
 }
 
-/* If the URI contains hexa format characters it will return
- * convert the Hexa values to ASCII character
- */
-char *mk_utils_url_decode(mk_ptr_t uri)
+static inline int mk_utils_hex_value(int c)
 {
-    int tmp, hex_result;
-    unsigned int i;
-    int buf_idx = 0;
-    char *buf;
-    char hex[3];
-
-    if ((tmp = mk_string_char_search(uri.data, '%', uri.len)) < 0) {
-        return NULL;
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    else if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    else if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
     }
 
-    i = tmp;
+    return -1;
+}
 
-    buf = mk_mem_malloc_z(uri.len + 1);
-    if (i > 0) {
-        memcpy(buf, uri.data, i);
-        buf_idx = i;
+/*
+ * Decode and normalize a request URI path in a single pass. The '%XX'
+ * sequences are decoded, consecutive slashes are collapsed and the '.'
+ * and '..' segments are resolved while writing the result into 'out',
+ * which must have room for at least uri.len + 1 bytes (the output is
+ * never longer than the input).
+ *
+ * An encoded NUL or slash, a raw NUL or a malformed hex sequence makes
+ * the URI invalid. A '..' segment that tries to go above the root is
+ * reported as a traversal attempt. On success it returns the length of
+ * the NULL terminated path stored in 'out'.
+ */
+int mk_utils_url_decode_path(mk_ptr_t uri, char *out)
+{
+    int c;
+    int hi;
+    int lo;
+    int len;
+    int seg;
+    int o = 0;
+    unsigned int i = 1;
+
+    if (uri.len == 0 || uri.data[0] != '/') {
+        return MK_UTILS_URL_INVALID;
     }
 
-    while (i < uri.len) {
-        if (uri.data[i] == '%' && i + 2 < uri.len) {
-            memcpy(hex, uri.data + i + 1, 2);
-            hex[2] = '\0';
+    out[o++] = '/';
+    seg = o;
+
+    while (1) {
+        if (i < uri.len) {
+            c = (unsigned char) uri.data[i++];
+            if (c == '%') {
+                if (uri.len - i < 2) {
+                    return MK_UTILS_URL_INVALID;
+                }
+
+                hi = mk_utils_hex_value(uri.data[i]);
+                lo = mk_utils_hex_value(uri.data[i + 1]);
+                if (hi < 0 || lo < 0) {
+                    return MK_UTILS_URL_INVALID;
+                }
+                i += 2;
+
+                /* Encoded slashes are not allowed to split segments */
+                c = (hi << 4) | lo;
+                if (c == '/' || c == '\0') {
+                    return MK_UTILS_URL_INVALID;
+                }
+            }
+            else if (c == '\0') {
+                return MK_UTILS_URL_INVALID;
+            }
 
-            hex_result = mk_utils_hex2int(hex, 2);
+            if (c != '/') {
+                out[o++] = c;
+                continue;
+            }
+        }
+        else {
+            c = -1;
+        }
 
-            if (hex_result != -1) {
-                buf[buf_idx] = hex_result;
+        /* A segment has finished, check what it contains */
+        len = o - seg;
+        if (len == 1 && out[seg] == '.') {
+            o = seg;
+        }
+        else if (len == 2 && out[seg] == '.' && out[seg + 1] == '.') {
+            if (seg == 1) {
+                return MK_UTILS_URL_TRAVERSAL;
             }
-            else {
-                mk_mem_free(buf);
-                return NULL;
+
+            /* Drop the parent segment */
+            o = seg - 1;
+            while (out[o - 1] != '/') {
+                o--;
             }
-            i += 2;
         }
-        else {
-            buf[buf_idx] = uri.data[i];
+        else if (len > 0 && c == '/') {
+            out[o++] = '/';
         }
-        i++;
-        buf_idx++;
+
+        if (c == -1) {
+            break;
+        }
+        seg = o;
     }
-    buf[buf_idx] = '\0';
 
-    return buf;
+    out[o] = '\0';
+    return o;
 }
 
 /*robust get environment variable that also checks __secure_getenv() */
@@ -28,261 +28,15 @@
 #include <monkey/mk_memory.h>
 #include <monkey/mk_info.h>
 #include <monkey/mk_file.h>
+#include <monkey/mk_clock.h>
+#include <monkey/mk_scheduler.h>
 
 #include <sys/stat.h>
+#include <limits.h>
+#include <ctype.h>
 #include <dirent.h>
 #include <fcntl.h>
 
-/* Initialize Virtual Host FDT mutex */
-pthread_mutex_t mk_vhost_fdt_mutex = PTHREAD_MUTEX_INITIALIZER;
-
-static __thread struct mk_list *mk_vhost_fdt_key;
-
-/*
- * This function is triggered upon thread creation (inside the thread
- * context), here we configure per-thread data.
- */
-int mk_vhost_fdt_worker_init()
-{
-    int i;
-    int j;
-    struct host *h;
-    struct mk_list *list;
-    struct mk_list *head;
-    struct vhost_fdt_host *fdt;
-    struct vhost_fdt_hash_table *ht;
-    struct vhost_fdt_hash_chain *hc;
-
-    if (mk_config->fdt == MK_FALSE) {
-        return -1;
-    }
-
-    /*
-     * We are under a thread context and the main configuration is
-     * already in place. Now for every existent virtual host we are
-     * going to create the File Descriptor Table (FDT) which aims to
-     * hold references of 'open and shared' file descriptors under
-     * the Virtual Host context.
-     */
-
-    /*
-     * Under an initialization context we need to protect this critical
-     * section
-     */
-    pthread_mutex_lock(&mk_vhost_fdt_mutex);
-
-    /*
-     * Initialize the thread FDT/Hosts list and create an entry per
-     * existent virtual host
-     */
-    list = mk_mem_malloc_z(sizeof(struct mk_list));
-    mk_list_init(list);
-
-    mk_list_foreach(head, &mk_config->hosts) {
-        h = mk_list_entry(head, struct host, _head);
-
-        fdt = mk_mem_malloc(sizeof(struct vhost_fdt_host));
-        fdt->host = h;
-
-        /* Initialize hash table */
-        for (i = 0; i < VHOST_FDT_HASHTABLE_SIZE; i++) {
-            ht = &fdt->hash_table[i];
-            ht->av_slots = VHOST_FDT_HASHTABLE_CHAINS;
-
-            /* for each chain under the hash table, set the fd */
-            for (j = 0; j < VHOST_FDT_HASHTABLE_CHAINS; j++) {
-                hc = &ht->chain[j];
-                hc->fd      = -1;
-                hc->hash    =  0;
-                hc->readers =  0;
-            }
-        }
-        mk_list_add(&fdt->_head, list);
-    }
-
-    mk_vhost_fdt_key = list;
-    pthread_mutex_unlock(&mk_vhost_fdt_mutex);
-
-    return 0;
-}
-
-int mk_vhost_fdt_worker_exit()
-{
-    struct mk_list *head;
-    struct mk_list *tmp;
-    struct vhost_fdt_host *fdt;
-
-    if (mk_config->fdt == MK_FALSE) {
-        return -1;
-    }
-
-    mk_list_foreach_safe(head, tmp, mk_vhost_fdt_key) {
-        fdt = mk_list_entry(head, struct vhost_fdt_host, _head);
-        mk_list_del(&fdt->_head);
-        mk_mem_free(fdt);
-    }
-
-    mk_mem_free(mk_vhost_fdt_key);
-    return 0;
-}
-
-
-static inline
-struct vhost_fdt_hash_table *mk_vhost_fdt_table_lookup(int id, struct host *host)
-{
-    struct mk_list *head;
-    struct mk_list *vhost_list;
-    struct vhost_fdt_host *fdt_host;
-    struct vhost_fdt_hash_table *ht = NULL;
-
-    vhost_list = mk_vhost_fdt_key;
-    mk_list_foreach(head, vhost_list) {
-        fdt_host = mk_list_entry(head, struct vhost_fdt_host, _head);
-        if (fdt_host->host == host) {
-            ht = &fdt_host->hash_table[id];
-            return ht;
-        }
-    }
-
-    return ht;
-}
-
-static inline
-struct vhost_fdt_hash_chain
-*mk_vhost_fdt_chain_lookup(unsigned int hash, struct vhost_fdt_hash_table *ht)
-{
-    int i;
-    struct vhost_fdt_hash_chain *hc = NULL;
-
-    for (i = 0; i < VHOST_FDT_HASHTABLE_CHAINS; i++) {
-        hc = &ht->chain[i];
-        if (hc->hash == hash) {
-            return hc;
-        }
-    }
-
-    return NULL;
-}
-
-
-static inline int mk_vhost_fdt_open(int id, unsigned int hash,
-                                    struct mk_http_request *sr)
-{
-    int i;
-    int fd;
-    struct vhost_fdt_hash_table *ht = NULL;
-    struct vhost_fdt_hash_chain *hc;
-
-    if (mk_config->fdt == MK_FALSE) {
-        return open(sr->real_path.data, sr->file_info.flags_read_only);
-    }
-
-    ht = mk_vhost_fdt_table_lookup(id, sr->host_conf);
-    if (mk_unlikely(!ht)) {
-        return open(sr->real_path.data, sr->file_info.flags_read_only);
-    }
-
-    /* We got the hash table, now look around the chains array */
-    hc = mk_vhost_fdt_chain_lookup(hash, ht);
-    if (hc) {
-        /* Increment the readers and return the shared FD */
-        hc->readers++;
-        sr->vhost_fdt_enabled = MK_TRUE;
-        return hc->fd;
-    }
-
-    /*
-     * Get here means that no entry exists in the hash table for the
-     * requested file descriptor and hash, we must try to open the file
-     * and register the entry in the table.
-     */
-    fd = open(sr->real_path.data, sr->file_info.flags_read_only);
-    if (fd == -1) {
-        return -1;
-    }
-
-    /* If chains are full, just return the new FD, bad luck... */
-    if (ht->av_slots <= 0) {
-        return fd;
-    }
-
-    /* Register the new entry in an available slot */
-    for (i = 0; i < VHOST_FDT_HASHTABLE_CHAINS; i++) {
-        hc = &ht->chain[i];
-        if (hc->fd == -1) {
-            hc->fd   = fd;
-            hc->hash = hash;
-            hc->readers++;
-            ht->av_slots--;
-
-            sr->vhost_fdt_id      = id;
-            sr->vhost_fdt_hash    = hash;
-            sr->vhost_fdt_enabled = MK_TRUE;
-
-            return fd;
-        }
-    }
-
-    return -1;
-}
-
-static inline int mk_vhost_fdt_close(struct mk_http_request *sr)
-{
-    int id;
-    unsigned int hash;
-    struct vhost_fdt_hash_table *ht = NULL;
-    struct vhost_fdt_hash_chain *hc;
-
-    if (mk_config->fdt == MK_FALSE) {
-        return close(sr->file_stream.fd);
-    }
-
-    id   = sr->vhost_fdt_id;
-    hash = sr->vhost_fdt_hash;
-
-    ht = mk_vhost_fdt_table_lookup(id, sr->host_conf);
-    if (mk_unlikely(!ht)) {
-        return close(sr->file_stream.fd);
-    }
-
-    /* We got the hash table, now look around the chains array */
-    hc = mk_vhost_fdt_chain_lookup(hash, ht);
-    if (hc) {
-        /* Increment the readers and check if we should close */
-        hc->readers--;
-        if (hc->readers == 0) {
-            hc->fd   = -1;
-            hc->hash = 0;
-            ht->av_slots++;
-            return close(sr->file_stream.fd);
-        }
-        else {
-            return 0;
-        }
-    }
-    return close(sr->file_stream.fd);
-}
-
-
-int mk_vhost_open(struct mk_http_request *sr)
-{
-    int id;
-    int off;
-    unsigned int hash;
-
-    off = sr->host_conf->documentroot.len;
-    hash = mk_utils_gen_hash(sr->real_path.data + off,
-                             sr->real_path.len - off);
-    id   = (hash % VHOST_FDT_HASHTABLE_SIZE);
-
-    return mk_vhost_fdt_open(id, hash, sr);
-}
-
-int mk_vhost_close(struct mk_http_request *sr)
-{
-    return mk_vhost_fdt_close(sr);
-}
-
 /*
  * Open a virtual host configuration file and return a structure with
  * definitions.
@@ -397,6 +151,40 @@ struct host *mk_vhost_read(char *path)
         mk_mem_free(tmp);
     }
 
+    /* Asset pack */
+    tmp = mk_config_section_getval(section_host, "Pack", MK_CONFIG_VAL_STR);
+    if (tmp) {
+        host->pack = mk_pack_open(tmp);
+        mk_mem_free(tmp);
+    }
+
+    /* Prewarm list */
+    tmp = mk_config_section_getval(section_host, "Prewarm", MK_CONFIG_VAL_STR);
+    if (tmp) {
+        host->prewarm = mk_mem_malloc_z(sizeof(struct mk_prewarm));
+        host->prewarm->source = tmp;
+    }
+
+    /* Socket tuning */
+    mk_config_sock_read(section_host, &host->sock);
+
+    /* Mass hosting */
+    tmp = mk_config_section_getval(section_host, "VirtualDocumentRoot",
+                                   MK_CONFIG_VAL_STR);
+    if (tmp && tmp[0] != '/') {
+        mk_warn("VirtualDocumentRoot in %s must be an absolute path", path);
+        mk_mem_free(tmp);
+    }
+    else if (tmp) {
+        host->docroot_pattern = tmp;
+        host->docroot_cache = (size_t) mk_config_section_getval(section_host,
+                                                                "VirtualHostCache",
+                                                                MK_CONFIG_VAL_NUM);
+        if (host->docroot_cache <= 0) {
+            host->docroot_cache = MK_VHOST_CACHE_SIZE;
+        }
+    }
+
     /* Error Pages */
     section_ep = mk_config_section_get(cnf, "ERROR_PAGES");
     if (section_ep) {
@@ -449,6 +237,7 @@ void mk_vhost_set_single(char *path)
     /* Prepare the unique alias */
     halias = mk_mem_malloc_z(sizeof(struct host_alias));
     halias->name = mk_string_dup("127.0.0.1");
+    halias->len  = strlen(halias->name);
     mk_list_add(&halias->_head, &host->server_names);
 
     host->documentroot.data = mk_string_dup(path);
@@ -539,23 +328,706 @@ void mk_vhost_init(char *path)
 }
 
 
+/*
+ * Copy a host name in lowercase, without the port and the trailing dot. It
+ * returns the new length or -1 if the name does not fit in 'buf'.
+ */
+static int mk_vhost_name_normalize(const char *name, int len, char *buf)
+{
+    int i;
+
+    /* Port, the digits must follow a single colon (not '::1') */
+    for (i = len - 1; i > 0 && isdigit((unsigned char) name[i]); i--);
+    if (i > 0 && i < len - 1 && name[i] == ':' && name[i - 1] != ':') {
+        len = i;
+    }
+
+    if (len > 0 && name[len - 1] == '.') {
+        len--;
+    }
+
+    if (len <= 0 || len >= MK_HOSTNAME_LEN) {
+        return -1;
+    }
+
+    for (i = 0; i < len; i++) {
+        buf[i] = tolower((unsigned char) name[i]);
+    }
+    buf[len] = '\0';
+
+    return len;
+}
+
+static struct mk_vhost_label *mk_vhost_label_new(const char *name, int len)
+{
+    struct mk_vhost_label *label;
+
+    label = mk_mem_malloc_z(sizeof(struct mk_vhost_label));
+    label->name = mk_string_copy_substr(name, 0, len);
+    label->len  = len;
+
+    return label;
+}
+
+static void mk_vhost_label_free(struct mk_vhost_label *label)
+{
+    unsigned int i;
+
+    for (i = 0; i < label->count; i++) {
+        mk_vhost_label_free(label->children[i]);
+    }
+
+    mk_mem_free(label->children);
+    mk_mem_free(label->name);
+    mk_mem_free(label);
+}
+
+/*
+ * Binary search of a sub label. It returns its position, or the position
+ * where it must be inserted when 'found' is MK_FALSE.
+ */
+static unsigned int mk_vhost_label_search(struct mk_vhost_label *parent,
+                                          const char *name, unsigned int len,
+                                          int *found)
+{
+    int ret;
+    unsigned int lo = 0;
+    unsigned int hi = parent->count;
+    unsigned int mid;
+    struct mk_vhost_label *label;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        label = parent->children[mid];
+
+        if (label->len != len) {
+            ret = (label->len < len) ? -1 : 1;
+        }
+        else {
+            ret = memcmp(label->name, name, len);
+        }
+
+        if (ret == 0) {
+            *found = MK_TRUE;
+            return mid;
+        }
+        else if (ret < 0) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+
+    *found = MK_FALSE;
+    return lo;
+}
+
+/* Register the suffix of a '*.example.com' name, labels from the right */
+static void mk_vhost_wildcard_add(struct mk_vhost_index *index,
+                                  const char *name, int len,
+                                  struct host *host, struct host_alias *alias)
+{
+    int end = len;
+    int start;
+    int found;
+    unsigned int pos;
+    struct mk_vhost_label *node = index->labels;
+    struct mk_vhost_label *child;
+
+    while (end > 0) {
+        for (start = end; start > 0 && name[start - 1] != '.'; start--);
+
+        pos = mk_vhost_label_search(node, name + start, end - start, &found);
+        if (found == MK_FALSE) {
+            if (node->count == node->size) {
+                node->size = node->size ? node->size * 2 : 4;
+                node->children = mk_mem_realloc(node->children,
+                                                node->size * sizeof(child));
+            }
+            memmove(node->children + pos + 1, node->children + pos,
+                    (node->count - pos) * sizeof(child));
+
+            child = mk_vhost_label_new(name + start, end - start);
+            node->children[pos] = child;
+            node->count++;
+        }
+
+        node = node->children[pos];
+        end = start - 1;
+    }
+
+    /* Like the plain names, the first host declaring it wins */
+    if (node == index->labels || node->host) {
+        return;
+    }
+
+    node->host  = host;
+    node->alias = alias;
+    index->wildcards++;
+}
+
+/* Longest wildcard suffix matching a normalized host name */
+static struct mk_vhost_label *mk_vhost_wildcard_get(struct mk_vhost_label *node,
+                                                    const char *name, int len)
+{
+    int end = len;
+    int start;
+    int found;
+    unsigned int pos;
+    struct mk_vhost_label *match = NULL;
+
+    while (end > 0) {
+        for (start = end; start > 0 && name[start - 1] != '.'; start--);
+
+        pos = mk_vhost_label_search(node, name + start, end - start, &found);
+        if (found == MK_FALSE) {
+            break;
+        }
+        node = node->children[pos];
+
+        /* The '*' must stand for at least one more label */
+        if (start == 0) {
+            break;
+        }
+
+        if (node->host) {
+            match = node;
+        }
+        end = start - 1;
+    }
+
+    return match;
+}
+
+static void mk_vhost_name_add(struct mk_vhost_index *index,
+                              const char *name, int len,
+                              struct host *host, struct host_alias *alias)
+{
+    unsigned int hash;
+    struct mk_vhost_name **bucket;
+    struct mk_vhost_name *entry;
+
+    hash = mk_utils_gen_hash(name, len);
+    bucket = &index->table[hash & (index->size - 1)];
+
+    /* A name declared twice belongs to the first host, as in the list */
+    for (entry = *bucket; entry; entry = entry->next) {
+        if (entry->hash == hash && entry->len == (unsigned int) len &&
+            memcmp(entry->name, name, len) == 0) {
+            return;
+        }
+    }
+
+    entry = mk_mem_malloc(sizeof(struct mk_vhost_name));
+    entry->hash  = hash;
+    entry->len   = len;
+    entry->name  = mk_string_copy_substr(name, 0, len);
+    entry->host  = host;
+    entry->alias = alias;
+    entry->next  = *bucket;
+    *bucket = entry;
+
+    index->names++;
+}
+
+/* Build the lookup index of the names of a hosts list */
+struct mk_vhost_index *mk_vhost_index_create(struct mk_list *hosts)
+{
+    int len;
+    unsigned int total = 0;
+    char buf[MK_HOSTNAME_LEN];
+    struct host *host;
+    struct host_alias *alias;
+    struct mk_list *head_host;
+    struct mk_list *head_alias;
+    struct mk_vhost_index *index;
+
+    mk_list_foreach(head_host, hosts) {
+        host = mk_list_entry(head_host, struct host, _head);
+        total += mk_list_size(&host->server_names);
+    }
+
+    index = mk_mem_malloc_z(sizeof(struct mk_vhost_index));
+
+    /* Keep the load factor under 0.5 */
+    index->size = 64;
+    while (index->size < total * 2) {
+        index->size <<= 1;
+    }
+    index->table  = mk_mem_malloc_z(index->size * sizeof(struct mk_vhost_name *));
+    index->labels = mk_vhost_label_new("", 0);
+
+    mk_list_foreach(head_host, hosts) {
+        host = mk_list_entry(head_host, struct host, _head);
+        if (host->docroot_pattern && !index->dynamic) {
+            index->dynamic = host;
+        }
+
+        mk_list_foreach(head_alias, &host->server_names) {
+            alias = mk_list_entry(head_alias, struct host_alias, _head);
+
+            len = mk_vhost_name_normalize(alias->name, alias->len, buf);
+            if (len < 0) {
+                continue;
+            }
+
+            if (len > 2 && buf[0] == '*' && buf[1] == '.') {
+                mk_vhost_wildcard_add(index, buf + 2, len - 2, host, alias);
+            }
+            else {
+                mk_vhost_name_add(index, buf, len, host, alias);
+            }
+        }
+    }
+
+    MK_TRACE("[vhost] index: %u names, %u wildcards, %u buckets",
+             index->names, index->wildcards, index->size);
+
+    return index;
+}
+
+/*
+ * Publish a new index, requests are matched against it from now on. The
+ * previous one is returned: a worker may still be reading it, the caller
+ * can only release it once the running requests are past their lookup.
+ */
+struct mk_vhost_index *mk_vhost_index_swap(struct mk_vhost_index *index)
+{
+    return __atomic_exchange_n(&mk_config->vhost_index, index,
+                               __ATOMIC_ACQ_REL);
+}
+
+void mk_vhost_index_free(struct mk_vhost_index *index)
+{
+    unsigned int i;
+    struct mk_vhost_name *entry;
+    struct mk_vhost_name *next;
+
+    if (!index) {
+        return;
+    }
+
+    for (i = 0; i < index->size; i++) {
+        for (entry = index->table[i]; entry; entry = next) {
+            next = entry->next;
+            mk_mem_free(entry->name);
+            mk_mem_free(entry);
+        }
+    }
+
+    mk_vhost_label_free(index->labels);
+    mk_mem_free(index->table);
+    mk_mem_free(index);
+}
+
+/* Per worker cache of the dynamic hosts, allocated on first use */
+static __thread struct mk_vhost_cache *mk_vhost_cache;
+
+/* Only names made of [a-z0-9-] labels are used to build a path */
+static int mk_vhost_name_is_safe(const char *name, int len)
+{
+    int i;
+
+    if (name[0] == '.' || name[0] == '-') {
+        return MK_FALSE;
+    }
+
+    for (i = 0; i < len; i++) {
+        if (name[i] == '.') {
+            if (name[i - 1] == '.') {
+                return MK_FALSE;
+            }
+        }
+        else if (!isalnum((unsigned char) name[i]) && name[i] != '-') {
+            return MK_FALSE;
+        }
+    }
+
+    return MK_TRUE;
+}
+
+/*
+ * Label 'n' of a name: the first one is 1, negative values count from the
+ * right (-1 is the last one). It returns the label length or -1.
+ */
+static int mk_vhost_name_label(const char *name, int len, int n,
+                               const char **label)
+{
+    int i;
+    int start = 0;
+    int labels = 1;
+
+    for (i = 0; i < len; i++) {
+        if (name[i] == '.') {
+            labels++;
+        }
+    }
+
+    if (n < 0) {
+        n = labels + n + 1;
+    }
+    if (n < 1 || n > labels) {
+        return -1;
+    }
+
+    for (i = 0; i <= len; i++) {
+        if (i < len && name[i] != '.') {
+            continue;
+        }
+        if (--n == 0) {
+            *label = name + start;
+            return i - start;
+        }
+        start = i + 1;
+    }
+
+    return -1;
+}
+
+/*
+ * Expand a VirtualDocumentRoot pattern: %0 is the whole name, %N the label
+ * N and %-N the label N from the right, a missing label becomes '_'.
+ */
+static int mk_vhost_docroot_build(const char *pattern,
+                                  const char *name, int len,
+                                  char *buf, int size)
+{
+    int n;
+    int neg;
+    int plen;
+    int out = 0;
+    const char *p = pattern;
+    const char *part;
+
+    while (*p) {
+        if (*p != '%' || p[1] == '%') {
+            if (out + 1 >= size) {
+                return -1;
+            }
+            buf[out++] = *p;
+            p += (*p == '%') ? 2 : 1;
+            continue;
+        }
+
+        p++;
+        neg = (*p == '-');
+        if (neg) {
+            p++;
+        }
+        if (!isdigit((unsigned char) *p)) {
+            return -1;
+        }
+        n = *p++ - '0';
+
+        if (n == 0) {
+            part = name;
+            plen = len;
+        }
+        else {
+            plen = mk_vhost_name_label(name, len, neg ? -n : n, &part);
+            if (plen <= 0) {
+                part = "_";
+                plen = 1;
+            }
+        }
+
+        if (out + plen >= size) {
+            return -1;
+        }
+        memcpy(buf + out, part, plen);
+        out += plen;
+    }
+    buf[out] = '\0';
+
+    return out;
+}
+
+/* Host entry for a name, with the error pages of the template */
+static struct host *mk_vhost_dynamic_create(struct host *template,
+                                            const char *name, int len,
+                                            const char *root, int root_len)
+{
+    unsigned long size;
+    struct host *host;
+    struct host_alias *alias;
+    struct error_page *ep;
+    struct error_page *new_ep;
+    struct mk_list *head;
+
+    host = mk_mem_malloc_z(sizeof(struct host));
+    mk_list_init(&host->error_pages);
+    mk_list_init(&host->server_names);
+
+    alias = mk_mem_malloc_z(sizeof(struct host_alias));
+    alias->name = mk_string_copy_substr(name, 0, len);
+    alias->len  = len;
+    mk_list_add(&alias->_head, &host->server_names);
+
+    host->documentroot.data = mk_string_copy_substr(root, 0, root_len);
+    host->documentroot.len  = root_len;
+
+    /* Shared with the template, never released through this entry */
+    host->header_redirect = template->header_redirect;
+    host->sock = template->sock;
+
+    mk_list_foreach(head, &template->error_pages) {
+        ep = mk_list_entry(head, struct error_page, _head);
+
+        new_ep = mk_mem_malloc_z(sizeof(struct error_page));
+        new_ep->status = ep->status;
+        new_ep->file   = mk_string_dup(ep->file);
+        mk_string_build(&new_ep->real_path, &size, "%s/%s",
+                        host->documentroot.data, new_ep->file);
+        mk_list_add(&new_ep->_head, &host->error_pages);
+    }
+
+    host->origin = template;
+
+    /* Reference of the cache entry */
+    host->refs = 1;
+
+    return host;
+}
+
+static void mk_vhost_dynamic_free(struct host *host)
+{
+    struct host_alias *alias;
+    struct error_page *ep;
+    struct mk_list *head;
+    struct mk_list *tmp;
+
+    mk_list_foreach_safe(head, tmp, &host->server_names) {
+        alias = mk_list_entry(head, struct host_alias, _head);
+        mk_list_del(&alias->_head);
+        mk_mem_free(alias->name);
+        mk_mem_free(alias);
+    }
+
+    mk_list_foreach_safe(head, tmp, &host->error_pages) {
+        ep = mk_list_entry(head, struct error_page, _head);
+        mk_list_del(&ep->_head);
+        mk_mem_free(ep->file);
+        mk_mem_free(ep->real_path);
+        mk_mem_free(ep);
+    }
+
+    mk_ptr_free(&host->documentroot);
+    mk_mem_free(host);
+}
+
+/*
+ * Drop a reference on a dynamic host: the requests mapped to it hold one
+ * and its cache entry another, a host evicted from the cache is released
+ * when its last request ends. Configured hosts are not counted.
+ */
+void mk_vhost_release(struct host *host)
+{
+    if (!host || !host->origin) {
+        return;
+    }
+
+    if (--host->refs == 0) {
+        mk_vhost_dynamic_free(host);
+    }
+}
+
+static void mk_vhost_entry_free(struct mk_vhost_cache *cache,
+                                struct mk_vhost_entry *entry)
+{
+    mk_list_del(&entry->_head);
+    mk_list_del(&entry->_lru);
+
+    mk_vhost_release(entry->host);
+    mk_mem_free(entry);
+    cache->entries--;
+}
+
+static struct mk_vhost_cache *mk_vhost_cache_get()
+{
+    int i;
+    struct mk_vhost_cache *cache;
+
+    if (mk_vhost_cache) {
+        return mk_vhost_cache;
+    }
+
+    cache = mk_mem_malloc_z(sizeof(struct mk_vhost_cache));
+    for (i = 0; i < MK_VHOST_CACHE_BUCKETS; i++) {
+        mk_list_init(&cache->table[i]);
+    }
+    mk_list_init(&cache->lru);
+
+    mk_vhost_cache = cache;
+    return cache;
+}
+
+/* Resolve a name through the VirtualDocumentRoot of the template host */
+static struct host *mk_vhost_dynamic_get(struct host *template,
+                                         const char *name, int len)
+{
+    int root_len;
+    unsigned int hash;
+    char root[PATH_MAX];
+    struct stat st;
+    struct host *host = NULL;
+    struct mk_list *head;
+    struct mk_list *bucket;
+    struct mk_vhost_entry *entry;
+    struct mk_vhost_cache *cache;
+    struct mk_vhost_stats *stats;
+    struct mk_vhost_stats unused;
+
+    /* Counters of the worker, a plugin thread has none */
+    stats = worker_sched_node ? &worker_sched_node->vhost_stats : &unused;
+
+    cache = mk_vhost_cache_get();
+    hash = mk_utils_gen_hash(name, len);
+    bucket = &cache->table[hash % MK_VHOST_CACHE_BUCKETS];
+
+    mk_list_foreach(head, bucket) {
+        entry = mk_list_entry(head, struct mk_vhost_entry, _head);
+        if (entry->hash != hash || entry->len != (unsigned int) len ||
+            memcmp(entry->name, name, len) != 0) {
+            continue;
+        }
+
+        /* Resolved by a previous configuration, or an expired negative */
+        if (entry->origin != template ||
+            (!entry->host && entry->expire <= log_current_utime)) {
+            mk_vhost_entry_free(cache, entry);
+            break;
+        }
+
+        mk_list_del(&entry->_lru);
+        mk_list_add(&entry->_lru, &cache->lru);
+
+        if (!entry->host) {
+            stats->negative++;
+            return NULL;
+        }
+
+        stats->hits++;
+        return entry->host;
+    }
+
+    stats->misses++;
+
+    if (mk_vhost_name_is_safe(name, len) == MK_FALSE) {
+        stats->negative++;
+        return NULL;
+    }
+
+    root_len = mk_vhost_docroot_build(template->docroot_pattern, name, len,
+                                      root, sizeof(root));
+    if (root_len > 0 && stat(root, &st) == 0 && S_ISDIR(st.st_mode)) {
+        host = mk_vhost_dynamic_create(template, name, len, root, root_len);
+    }
+
+    /* Make room for the new entry */
+    if (cache->entries >= template->docroot_cache) {
+        entry = mk_list_entry_first(&cache->lru, struct mk_vhost_entry, _lru);
+        mk_vhost_entry_free(cache, entry);
+        stats->evictions++;
+    }
+
+    entry = mk_mem_malloc(sizeof(struct mk_vhost_entry));
+    entry->hash   = hash;
+    entry->len    = len;
+    memcpy(entry->name, name, len);
+    entry->origin = template;
+    entry->host   = host;
+    entry->expire = log_current_utime + MK_VHOST_NEGATIVE_TTL;
+
+    mk_list_add(&entry->_head, bucket);
+    mk_list_add(&entry->_lru, &cache->lru);
+    cache->entries++;
+
+    if (!host) {
+        stats->negative++;
+    }
+    return host;
+}
+
+void mk_vhost_worker_exit()
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_vhost_entry *entry;
+    struct mk_vhost_cache *cache = mk_vhost_cache;
+
+    if (!cache) {
+        return;
+    }
+
+    mk_list_foreach_safe(head, tmp, &cache->lru) {
+        entry = mk_list_entry(head, struct mk_vhost_entry, _lru);
+        mk_vhost_entry_free(cache, entry);
+    }
+
+    mk_mem_free(cache);
+    mk_vhost_cache = NULL;
+}
+
+/* Map a request to a host, a dynamic one is referenced while it's used */
+static inline void mk_vhost_set(struct host **vhost, struct host_alias **alias,
+                                struct host *host, struct host_alias *host_alias)
+{
+    if (host->origin) {
+        host->refs++;
+    }
+    mk_vhost_release(*vhost);
+
+    *vhost = host;
+    *alias = host_alias;
+}
+
 /* Lookup a registered virtual host based on the given 'host' input */
 int mk_vhost_get(mk_ptr_t host, struct host **vhost, struct host_alias **alias)
 {
-    struct host *entry_host;
-    struct host_alias *entry_alias;
-    struct mk_list *head_vhost, *head_alias;
-
-    mk_list_foreach(head_vhost, &mk_config->hosts) {
-        entry_host = mk_list_entry(head_vhost, struct host, _head);
-        mk_list_foreach(head_alias, &entry_host->server_names) {
-            entry_alias = mk_list_entry(head_alias, struct host_alias, _head);
-            if (entry_alias->len == host.len &&
-                strncmp(entry_alias->name, host.data, host.len) == 0) {
-                *vhost = entry_host;
-                *alias = entry_alias;
-                return 0;
-            }
+    int len;
+    unsigned int hash;
+    char buf[MK_HOSTNAME_LEN];
+    struct host *dynamic;
+    struct mk_vhost_name *entry;
+    struct mk_vhost_label *label;
+    struct mk_vhost_index *index;
+
+    index = __atomic_load_n(&mk_config->vhost_index, __ATOMIC_ACQUIRE);
+    if (!index) {
+        return -1;
+    }
+
+    len = mk_vhost_name_normalize(host.data, host.len, buf);
+    if (len < 0) {
+        return -1;
+    }
+
+    hash = mk_utils_gen_hash(buf, len);
+    for (entry = index->table[hash & (index->size - 1)]; entry;
+         entry = entry->next) {
+        if (entry->hash == hash && entry->len == (unsigned int) len &&
+            memcmp(entry->name, buf, len) == 0) {
+            mk_vhost_set(vhost, alias, entry->host, entry->alias);
+            return 0;
+        }
+    }
+
+    if (index->wildcards > 0) {
+        label = mk_vhost_wildcard_get(index->labels, buf, len);
+        if (label) {
+            mk_vhost_set(vhost, alias, label->host, label->alias);
+            return 0;
+        }
+    }
+
+    if (index->dynamic) {
+        dynamic = mk_vhost_dynamic_get(index->dynamic, buf, len);
+        if (dynamic) {
+            mk_vhost_set(vhost, alias, dynamic,
+                         mk_list_entry_first(&dynamic->server_names,
+                                             struct host_alias, _head));
+            return 0;
         }
     }
 
@@ -572,6 +1044,8 @@ void mk_vhost_free_all()
     struct mk_list *head_error;
     struct mk_list *tmp1, *tmp2;
 
+    mk_vhost_index_free(mk_vhost_index_swap(NULL));
+
     mk_list_foreach_safe(head_host, tmp1, &mk_config->hosts) {
         host = mk_list_entry(head_host, struct host, _head);
         mk_list_del(&host->_head);
@@ -597,6 +1071,19 @@ void mk_vhost_free_all()
 
         mk_ptr_free(&host->documentroot);
 
+        if (host->pack) {
+            mk_pack_close(host->pack);
+        }
+
+        if (host->prewarm) {
+            mk_mem_free(host->prewarm->source);
+            mk_mem_free(host->prewarm);
+        }
+
+        if (host->docroot_pattern) {
+            mk_mem_free(host->docroot_pattern);
+        }
+
         /* Free source configuration */
         if (host->config) mk_config_free(host->config);
         mk_mem_free(host);
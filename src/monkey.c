@@ -36,6 +36,11 @@
 #include <monkey/mk_utils.h>
 #include <monkey/mk_config.h>
 #include <monkey/mk_scheduler.h>
+#include <monkey/mk_fdt.h>
+#include <monkey/mk_mmap.h>
+#include <monkey/mk_deflate.h>
+#include <monkey/mk_readahead.h>
+#include <monkey/mk_prewarm.h>
 #include <monkey/mk_tls.h>
 
 #include <getopt.h>
@@ -330,6 +335,9 @@ int main(int argc, char **argv)
     /* Core and Scheduler setup */
     mk_config_start_configure();
     mk_sched_init();
+    mk_fdt_init();
+    mk_mmap_init();
+    mk_deflate_init();
 
 
     if (balancing_mode == MK_TRUE) {
@@ -351,6 +359,15 @@ int main(int argc, char **argv)
     /* Register PID of Monkey */
     mk_utils_register_pid();
 
+    /* Readahead pool for files not in the page cache */
+    mk_readahead_init();
+
+    /* Warm up the caches with the Prewarm lists */
+    mk_prewarm_init();
+    if (mk_config->prewarm_wait == MK_TRUE) {
+        mk_prewarm_wait();
+    }
+
     /* Workers: logger and clock */
     mk_clock_tid = mk_utils_worker_spawn((void *) mk_clock_worker_init, NULL);
 
@@ -0,0 +1,324 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/*
+ * mkpack: build an asset pack from a directory tree, see mk_pack.h.
+ *
+ *   mkpack [-m monkey.mime] [-t default/type] <directory> <output.pack>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <monkey/mk_pack.h>
+
+#define MKPACK_BUF_SIZE    65536
+
+struct mkpack_mime {
+    char *ext;
+    char *type;
+};
+
+struct mkpack_file {
+    char *path;                 /* request path, starts with '/' */
+    char *source;               /* path on disk */
+    off_t size;
+    time_t mtime;
+};
+
+static struct mkpack_mime *mimes;
+static int mimes_count;
+
+static struct mkpack_file *files;
+static int files_count;
+static int files_size;
+
+static char *strings;
+static size_t strings_len;
+static size_t strings_size;
+
+static void *xrealloc(void *ptr, size_t size)
+{
+    ptr = realloc(ptr, size);
+    if (!ptr) {
+        perror("realloc");
+        exit(EXIT_FAILURE);
+    }
+    return ptr;
+}
+
+/* Load the extensions of a Monkey mime types file */
+static void mkpack_mime_load(const char *path)
+{
+    char line[1024];
+    char ext[256];
+    char type[512];
+    FILE *f;
+
+    f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "mkpack: cannot open %s: %s\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, " %255s %511s", ext, type) != 2 ||
+            ext[0] == '#' || ext[0] == '[') {
+            continue;
+        }
+
+        mimes = xrealloc(mimes, sizeof(struct mkpack_mime) * (mimes_count + 1));
+        mimes[mimes_count].ext  = strdup(ext);
+        mimes[mimes_count].type = strdup(type);
+        mimes_count++;
+    }
+
+    fclose(f);
+}
+
+static const char *mkpack_mime_find(const char *path, const char *def)
+{
+    int i;
+    const char *ext;
+
+    ext = strrchr(path, '.');
+    if (!ext || strchr(ext, '/')) {
+        return def;
+    }
+    ext++;
+
+    for (i = 0; i < mimes_count; i++) {
+        if (strcasecmp(mimes[i].ext, ext) == 0) {
+            return mimes[i].type;
+        }
+    }
+
+    return def;
+}
+
+/* Append to the strings area, returns the offset */
+static uint32_t mkpack_string_add(const char *str, size_t len)
+{
+    uint32_t offset = strings_len;
+
+    if (strings_len + len > strings_size) {
+        strings_size = (strings_len + len) * 2;
+        strings = xrealloc(strings, strings_size);
+    }
+
+    memcpy(strings + strings_len, str, len);
+    strings_len += len;
+
+    return offset;
+}
+
+static void mkpack_scan(const char *root, const char *rel)
+{
+    char source[4096];
+    char path[4096];
+    DIR *dir;
+    struct stat st;
+    struct dirent *ent;
+
+    snprintf(source, sizeof(source), "%s%s", root, rel);
+    dir = opendir(source);
+    if (!dir) {
+        fprintf(stderr, "mkpack: cannot open %s: %s\n", source, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    while ((ent = readdir(dir))) {
+        if (ent->d_name[0] == '.') {
+            continue;
+        }
+
+        snprintf(path, sizeof(path), "%s/%s", rel, ent->d_name);
+        snprintf(source, sizeof(source), "%s%s", root, path);
+        if (stat(source, &st) == -1) {
+            continue;
+        }
+
+        if (S_ISDIR(st.st_mode)) {
+            mkpack_scan(root, path);
+            continue;
+        }
+        else if (!S_ISREG(st.st_mode)) {
+            continue;
+        }
+
+        if (files_count == files_size) {
+            files_size = files_size ? files_size * 2 : 256;
+            files = xrealloc(files, sizeof(struct mkpack_file) * files_size);
+        }
+
+        files[files_count].path   = strdup(path);
+        files[files_count].source = strdup(source);
+        files[files_count].size   = st.st_size;
+        files[files_count].mtime  = st.st_mtime;
+        files_count++;
+    }
+
+    closedir(dir);
+}
+
+static int mkpack_file_cmp(const void *a, const void *b)
+{
+    return strcmp(((struct mkpack_file *) a)->path,
+                  ((struct mkpack_file *) b)->path);
+}
+
+/* Copy a file into the pack, returns the FNV-1a hash of its content */
+static uint64_t mkpack_copy(FILE *out, struct mkpack_file *file)
+{
+    size_t i;
+    size_t n;
+    off_t total = 0;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    unsigned char buf[MKPACK_BUF_SIZE];
+    FILE *in;
+
+    in = fopen(file->source, "rb");
+    if (!in) {
+        fprintf(stderr, "mkpack: cannot open %s: %s\n",
+                file->source, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+        for (i = 0; i < n; i++) {
+            hash = (hash ^ buf[i]) * 0x100000001b3ULL;
+        }
+        if (fwrite(buf, 1, n, out) != n) {
+            perror("fwrite");
+            exit(EXIT_FAILURE);
+        }
+        total += n;
+    }
+    fclose(in);
+
+    if (total != file->size) {
+        fprintf(stderr, "mkpack: %s changed while packing it\n", file->source);
+        exit(EXIT_FAILURE);
+    }
+
+    return hash;
+}
+
+static void usage()
+{
+    fprintf(stderr,
+            "usage: mkpack [-m monkey.mime] [-t default/type] "
+            "<directory> <output.pack>\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+    int i;
+    int opt;
+    int len;
+    char row[1024];
+    const char *type;
+    const char *def_type = "text/plain";
+    uint64_t hash;
+    FILE *out;
+    struct mk_pack_header header;
+    struct mk_pack_record *records;
+
+    while ((opt = getopt(argc, argv, "m:t:")) != -1) {
+        switch (opt) {
+        case 'm':
+            mkpack_mime_load(optarg);
+            break;
+        case 't':
+            def_type = optarg;
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if (argc - optind != 2) {
+        usage();
+    }
+
+    mkpack_scan(argv[optind], "");
+    qsort(files, files_count, sizeof(struct mkpack_file), mkpack_file_cmp);
+
+    out = fopen(argv[optind + 1], "wb");
+    if (!out) {
+        fprintf(stderr, "mkpack: cannot create %s: %s\n",
+                argv[optind + 1], strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    /* The header is written once the offsets are known */
+    memset(&header, '\0', sizeof(header));
+    fwrite(&header, sizeof(header), 1, out);
+
+    records = calloc(files_count ? files_count : 1, sizeof(struct mk_pack_record));
+    for (i = 0; i < files_count; i++) {
+        records[i].offset = ftello(out);
+        records[i].size   = files[i].size;
+        records[i].mtime  = files[i].mtime;
+
+        hash = mkpack_copy(out, &files[i]);
+
+        records[i].path_len = strlen(files[i].path);
+        records[i].path = mkpack_string_add(files[i].path, records[i].path_len);
+
+        type = mkpack_mime_find(files[i].path, def_type);
+        len = snprintf(row, sizeof(row), "Content-Type: %s\r\n", type);
+        records[i].type_len = len;
+        records[i].type = mkpack_string_add(row, len);
+
+        len = snprintf(row, sizeof(row), "\"%016llx-%llx\"",
+                       (unsigned long long) hash,
+                       (unsigned long long) files[i].size);
+        records[i].etag_len = len;
+        records[i].etag = mkpack_string_add(row, len);
+    }
+
+    memcpy(header.magic, MK_PACK_MAGIC, sizeof(header.magic));
+    header.version = MK_PACK_VERSION;
+    header.count   = files_count;
+    header.records = ftello(out);
+    fwrite(records, sizeof(struct mk_pack_record), files_count, out);
+    header.strings = ftello(out);
+    header.strings_size = strings_len;
+    fwrite(strings, 1, strings_len, out);
+
+    if (fseeko(out, 0, SEEK_SET) != 0 ||
+        fwrite(&header, sizeof(header), 1, out) != 1 ||
+        fclose(out) != 0) {
+        fprintf(stderr, "mkpack: cannot write %s\n", argv[optind + 1]);
+        exit(EXIT_FAILURE);
+    }
+
+    printf("%i files packed into %s\n", files_count, argv[optind + 1]);
+    return 0;
+}